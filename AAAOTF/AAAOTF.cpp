@@ -37,6 +37,13 @@ const char* g_Channel_7 = "7";
 const char* g_Channel_8 = "8";			
 const char* g_DelayBetweenChannels = "Delay between channels (ms)";
 const char* g_Frequency = "Frequency (MHz)";
+const char* g_SwitchMode = "Line switching";
+const char* g_SwitchPerChannel = "One command per line";
+const char* g_SwitchBatched = "Changed lines in one write";
+const char* g_SwitchLatency = "Last switch latency (ms)";
+const char* g_Trigger = "Trigger";
+const char* g_Blanking = "External blanking during sequence";
+const char* g_Async = "Asynchronous serial commands";
 
 using namespace std;
 
@@ -92,6 +99,134 @@ int ClearPort(MM::Device& device, MM::Core& core, std::string port)
 } 
 
 
+///////////////////////////////////////////////////////////////////////////////
+// AOTFCommandQueue
+///////////////////////////////////////////////////////////////////////////////
+MMThreadLock AOTFCommandQueue::registryLock_;
+std::map<std::string, AOTFCommandQueue*> AOTFCommandQueue::registry_;
+
+AOTFCommandQueue::AOTFCommandQueue(const std::string& port) :
+   port_(port),
+   users_(0),
+   stop_(false),
+   inFlight_(0)
+{
+}
+
+AOTFCommandQueue* AOTFCommandQueue::Acquire(const std::string& port)
+{
+   MMThreadGuard g(registryLock_);
+   AOTFCommandQueue* queue = registry_[port];
+   if (queue == 0) {
+      queue = new AOTFCommandQueue(port);
+      registry_[port] = queue;
+      queue->activate();
+   }
+   queue->users_++;
+   return queue;
+}
+
+void AOTFCommandQueue::Release(AOTFCommandQueue* queue)
+{
+   MMThreadGuard g(registryLock_);
+   if (--queue->users_ > 0)
+      return;
+   registry_.erase(queue->port_);
+   {
+      std::lock_guard<std::mutex> q(queue->lock_);
+      queue->stop_ = true;
+   }
+   queue->work_.notify_one();
+   queue->wait();
+   delete queue;
+}
+
+int AOTFCommandQueue::Enqueue(AOTFCommandSink* sink, const std::string& key, const std::string& command)
+{
+   std::unique_lock<std::mutex> g(lock_);
+   int ret = DEVICE_OK;
+   std::map<AOTFCommandSink*, int>::iterator err = errors_.find(sink);
+   if (err != errors_.end()) {
+      ret = err->second;
+      errors_.erase(err);
+   }
+   if (!key.empty()) {
+      // the stale one goes, the new one queues behind everything sent since
+      for (std::deque<Entry>::iterator it = pending_.begin(); it != pending_.end(); ++it) {
+         if (it->sink == sink && it->key == key) {
+            pending_.erase(it);
+            break;
+         }
+      }
+   }
+   Entry entry;
+   entry.sink = sink;
+   entry.key = key;
+   entry.command = command;
+   pending_.push_back(entry);
+   g.unlock();
+   work_.notify_one();
+   return ret;
+}
+
+bool AOTFCommandQueue::Pending(AOTFCommandSink* sink)
+{
+   std::lock_guard<std::mutex> g(lock_);
+   return PendingLocked(sink);
+}
+
+bool AOTFCommandQueue::PendingLocked(AOTFCommandSink* sink) const
+{
+   if (inFlight_ == sink)
+      return true;
+   for (std::deque<Entry>::const_iterator it = pending_.begin(); it != pending_.end(); ++it) {
+      if (it->sink == sink)
+         return true;
+   }
+   return false;
+}
+
+int AOTFCommandQueue::Drain(AOTFCommandSink* sink)
+{
+   std::unique_lock<std::mutex> g(lock_);
+   while (PendingLocked(sink))
+      sent_.wait(g);
+   int ret = DEVICE_OK;
+   std::map<AOTFCommandSink*, int>::iterator err = errors_.find(sink);
+   if (err != errors_.end()) {
+      ret = err->second;
+      errors_.erase(err);
+   }
+   return ret;
+}
+
+int AOTFCommandQueue::svc()
+{
+   while (true) {
+      Entry entry;
+      {
+         std::unique_lock<std::mutex> g(lock_);
+         while (pending_.empty() && !stop_)
+            work_.wait(g);
+         if (pending_.empty())
+            break;
+         entry = pending_.front();
+         pending_.pop_front();
+         inFlight_ = entry.sink;
+      }
+      int ret = entry.sink->SendQueuedCommand(entry.command);
+      {
+         std::lock_guard<std::mutex> g(lock_);
+         inFlight_ = 0;
+         if (ret != DEVICE_OK)
+            errors_[entry.sink] = ret;
+      }
+      sent_.notify_all();
+   }
+   return 0;
+}
+
+
 
 AOTF::AOTF() :
    port_("Undefined"),
@@ -100,7 +235,13 @@ AOTF::AOTF() :
    activeChannel_(g_Channel_1),
    intensity_(100),
    maxintensity_(1900),
-   frequency_(115.32) // Default frequency
+   frequency_(115.32), // Default frequency
+   intensitySequenceRunning_(false),
+   channelSequenceRunning_(false),
+   sequenceIndex_(0),
+   blankingDuringSequence_(false),
+   queue_(0),
+   asyncCommands_(true)
 
    /*,*/
    /*version_("Undefined")*/
@@ -143,6 +284,8 @@ int AOTF::Initialize()
 
 	if (initialized_)
       return DEVICE_OK;
+
+   queue_ = AOTFCommandQueue::Acquire(port_);
       
    // set property list
    // -----------------
@@ -207,9 +350,31 @@ int AOTF::Initialize()
    if (ret != DEVICE_OK)                                                     
       return ret;
 
+   // Advances loaded intensity/channel sequences, set to "+" by the camera
+   pAct = new CPropertyAction(this, &AOTF::OnTrigger);
+   ret = CreateProperty(g_Trigger, "-", MM::String, false, pAct);
+   if (ret != DEVICE_OK)
+      return ret;
+   AddAllowedValue(g_Trigger, "-");
+   AddAllowedValue(g_Trigger, "+");
+
+   pAct = new CPropertyAction(this, &AOTF::OnBlanking);
+   ret = CreateProperty(g_Blanking, "No", MM::String, false, pAct);
+   if (ret != DEVICE_OK)
+      return ret;
+   AddAllowedValue(g_Blanking, "No");
+   AddAllowedValue(g_Blanking, "Yes");
 
-   //switch AOTF to internal mode
-   SendSerialCommand(port_.c_str(), "I0", "\r");
+   pAct = new CPropertyAction(this, &AOTF::OnAsync);
+   ret = CreateProperty(g_Async, "Yes", MM::String, false, pAct);
+   if (ret != DEVICE_OK)
+      return ret;
+   AddAllowedValue(g_Async, "No");
+   AddAllowedValue(g_Async, "Yes");
+
+
+   //switch AOTF to internal mode, synchronously so a missing controller fails here
+   ret = SendCommandNow("I0");
    if (ret != DEVICE_OK)                                                     
       return ret;
 
@@ -226,7 +391,7 @@ int AOTF::Initialize()
 		command<< "L" << i << "O0\r";
 	}
 
-	ret = SendSerialCommand(port_.c_str(), command.str().c_str(), "\r");
+	ret = SendCommandNow(command.str());
 	if (ret!=DEVICE_OK)
 	   return ret;
 
@@ -277,7 +442,9 @@ int AOTF::SetShutterPosition(bool state)
    else
 	   command<< "L" << test << "O1";
 
-   int ret = SendSerialCommand(port_.c_str(), command.str().c_str(), "\r");
+   ostringstream key;
+   key << "L" << test << "O";
+   int ret = QueueCommand(key.str(), command.str());
    if (ret!=DEVICE_OK)
 	   return ret;
 
@@ -306,7 +473,9 @@ int AOTF::SetIntensity(double intensity)
 
    //out << command.str().c_str() << "\n";
 
-   int ret = SendSerialCommand(port_.c_str(), command.str().c_str(), "\r");
+   ostringstream key;
+   key << "L" << test << "D";
+   int ret = QueueCommand(key.str(), command.str());
    if (ret!=DEVICE_OK)
 	   return ret;
 
@@ -320,6 +489,13 @@ int AOTF::SetIntensity(double intensity)
 
 int AOTF::Shutdown()                                                
 {                                                                            
+   if (queue_)
+   {
+      // let the last commands (e.g. a shutter close) reach the controller
+      queue_->Drain(this);
+      AOTFCommandQueue::Release(queue_);
+      queue_ = 0;
+   }
    if (initialized_)                                                         
    {                                                                         
       initialized_ = false;                                                  
@@ -327,10 +503,57 @@ int AOTF::Shutdown()
    return DEVICE_OK;                                                         
 }                                                                            
 
-// Never busy because all commands block
+// Busy until everything we queued has been written
 bool AOTF::Busy()
 {
-   return false;
+   return queue_ != 0 && queue_->Pending(this);
+}
+
+/**
+ * Sends now or, with asynchronous commands, leaves it to the port's worker.
+ * Commands with a key are coalesced while they wait.
+ */
+int AOTF::QueueCommand(const std::string& key, const std::string& command)
+{
+   if (queue_ && asyncCommands_)
+      return queue_->Enqueue(this, key, command);
+   return SendSerialCommand(port_.c_str(), command.c_str(), "\r");
+}
+
+int AOTF::SendQueuedCommand(const std::string& command)
+{
+   return SendSerialCommand(port_.c_str(), command.c_str(), "\r");
+}
+
+/**
+ * Writes straight away, behind whatever this device still has queued, and
+ * returns the controller's answer - for initialization and for writes that
+ * have to be on the lines when the call returns.
+ */
+int AOTF::SendCommandNow(const std::string& command)
+{
+   int queued = queue_ ? queue_->Drain(this) : DEVICE_OK;
+   int ret = SendSerialCommand(port_.c_str(), command.c_str(), "\r");
+   return (ret != DEVICE_OK) ? ret : queued;
+}
+
+int AOTF::OnAsync(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(asyncCommands_ ? "Yes" : "No");
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      std::string async;
+      pProp->Get(async);
+      bool newAsync = (async == "Yes");
+      // whatever is still queued has to go out before direct writes overtake it
+      if (!newAsync && queue_)
+         queue_->Drain(this);
+      asyncCommands_ = newAsync;
+   }
+   return DEVICE_OK;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -392,6 +615,32 @@ int AOTF::OnIntensity(MM::PropertyBase* pProp, MM::ActionType eAct)
       pProp->Get(pos);
       return SetIntensity(pos);
    }
+   else if (eAct == MM::IsSequenceable)
+   {
+      pProp->SetSequenceable(AOTF_MAX_SEQUENCE);
+   }
+   else if (eAct == MM::AfterLoadSequence)
+   {
+      // convert to the controller's dB values once, stepping only sends them
+      std::vector<std::string> sequence = pProp->GetSequence();
+      intensitySequence_.clear();
+      intensityPercent_.clear();
+      for (size_t i = 0; i < sequence.size(); i++) {
+         double percent = atof(sequence[i].c_str());
+         ostringstream value;
+         value << percent*maxintensity_/10000;
+         intensitySequence_.push_back(value.str());
+         intensityPercent_.push_back(percent);
+      }
+   }
+   else if (eAct == MM::StartSequence)
+   {
+      return SetSequenceRunning(intensitySequenceRunning_, true);
+   }
+   else if (eAct == MM::StopSequence)
+   {
+      return SetSequenceRunning(intensitySequenceRunning_, false);
+   }
    return DEVICE_OK;
 }
 
@@ -430,6 +679,22 @@ int AOTF::OnChannel(MM::PropertyBase* pProp, MM::ActionType eAct)
       }
       // It might be a good idea to close the shutter at this point...
    }
+   else if (eAct == MM::IsSequenceable)
+   {
+      pProp->SetSequenceable(AOTF_MAX_SEQUENCE);
+   }
+   else if (eAct == MM::AfterLoadSequence)
+   {
+      channelSequence_ = pProp->GetSequence();
+   }
+   else if (eAct == MM::StartSequence)
+   {
+      return SetSequenceRunning(channelSequenceRunning_, true);
+   }
+   else if (eAct == MM::StopSequence)
+   {
+      return SetSequenceRunning(channelSequenceRunning_, false);
+   }
    return DEVICE_OK;
 }
 
@@ -449,7 +714,9 @@ int AOTF::OnFrequency(MM::PropertyBase* pProp, MM::ActionType eAct)
         int channel = atoi(activeChannel_.c_str());
         command << "L" << channel << "F" << tmpFrequency;
 
-        int ret = SendSerialCommand(port_.c_str(), command.str().c_str(), "\r");
+        ostringstream key;
+        key << "L" << channel << "F";
+        int ret = QueueCommand(key.str(), command.str());
         if (ret != DEVICE_OK)
             return ret;
 
@@ -458,6 +725,91 @@ int AOTF::OnFrequency(MM::PropertyBase* pProp, MM::ActionType eAct)
     return DEVICE_OK;
 }
 
+/**
+ * Starts or stops one of the sequences. The first to start rewinds the shared
+ * step and, if asked for, hands the lines to the external blanking input; the
+ * last to stop takes them back.
+ */
+int AOTF::SetSequenceRunning(bool& running, bool start)
+{
+   bool wasRunning = intensitySequenceRunning_ || channelSequenceRunning_;
+   running = start;
+   bool isRunning = intensitySequenceRunning_ || channelSequenceRunning_;
+   if (isRunning && !wasRunning) {
+      sequenceIndex_ = 0;
+      if (blankingDuringSequence_)
+         return QueueCommand("", "I1");
+   }
+   else if (!isRunning && wasRunning && blankingDuringSequence_) {
+      return QueueCommand("", "I0");
+   }
+   return DEVICE_OK;
+}
+
+/**
+ * Applies the next entry of every running sequence in a single write. It is
+ * written synchronously: the trigger contract is that the lines have switched
+ * when SetProperty("Trigger", "+") returns.
+ */
+int AOTF::StepSequence()
+{
+   ostringstream command;
+   std::string channel = activeChannel_;
+
+   if (channelSequenceRunning_ && !channelSequence_.empty()) {
+      channel = channelSequence_[sequenceIndex_ % channelSequence_.size()];
+      if (channel != activeChannel_ && state_ == 1)
+         command << "L" << activeChannel_ << "O0\rL" << channel << "O1";
+   }
+   if (intensitySequenceRunning_ && !intensitySequence_.empty()) {
+      if (command.tellp() > 0)
+         command << "\r";
+      command << "L" << channel << "D" << intensitySequence_[sequenceIndex_ % intensitySequence_.size()];
+   }
+   if (command.tellp() > 0) {
+      int ret = SendCommandNow(command.str());
+      if (ret != DEVICE_OK)
+         return ret;
+   }
+
+   activeChannel_ = channel;
+   if (intensitySequenceRunning_ && !intensityPercent_.empty())
+      intensity_ = intensityPercent_[sequenceIndex_ % intensityPercent_.size()];
+   sequenceIndex_++;
+   return DEVICE_OK;
+}
+
+int AOTF::OnTrigger(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set("-");
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      std::string trigger;
+      pProp->Get(trigger);
+      if (trigger == "+" && (intensitySequenceRunning_ || channelSequenceRunning_))
+         return StepSequence();
+   }
+   return DEVICE_OK;
+}
+
+int AOTF::OnBlanking(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(blankingDuringSequence_ ? "Yes" : "No");
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      std::string blanking;
+      pProp->Get(blanking);
+      blankingDuringSequence_ = (blanking == "Yes");
+   }
+   return DEVICE_OK;
+}
+
 
 /// Here we define the multiline shutter device to operate multiple lines simultaneously
 
@@ -469,7 +821,15 @@ multiAOTF::multiAOTF() :
    //intensity_(1900)
    /*,*/
    /*version_("Undefined")*/
-   delayBetweenChannels_(0)
+   delayBetweenChannels_(0),
+   batchSwitching_(true),
+   lineStates_(-1),
+   switchLatencyMs_(0),
+   channelSequenceRunning_(false),
+   sequenceIndex_(0),
+   blankingDuringSequence_(false),
+   queue_(0),
+   asyncCommands_(true)
 {
    InitializeDefaultErrorMessages();
                                                                              
@@ -501,12 +861,11 @@ void multiAOTF::GetName(char* Name) const
 
 int multiAOTF::Initialize()
 {
-	ostringstream command;
-	int i;
-
 
 	if (initialized_)
       return DEVICE_OK;
+
+   queue_ = AOTFCommandQueue::Acquire(port_);
       
    // set property list
    // -----------------
@@ -530,6 +889,19 @@ int multiAOTF::Initialize()
    if (ret != DEVICE_OK)
       return ret;
 
+   // How SetShutterPosition talks to the controller
+   pAct = new CPropertyAction(this, &multiAOTF::OnSwitchMode);
+   ret = CreateProperty(g_SwitchMode, g_SwitchBatched, MM::String, false, pAct);
+   if (ret != DEVICE_OK)
+      return ret;
+   AddAllowedValue(g_SwitchMode, g_SwitchPerChannel);
+   AddAllowedValue(g_SwitchMode, g_SwitchBatched);
+
+   pAct = new CPropertyAction(this, &multiAOTF::OnSwitchLatency);
+   ret = CreateProperty(g_SwitchLatency, "0", MM::Float, true, pAct);
+   if (ret != DEVICE_OK)
+      return ret;
+
    // Intensity
    //--------------------
    //pAct = new CPropertyAction(this, &AOTF::OnIntensity);
@@ -548,30 +920,45 @@ int multiAOTF::Initialize()
    if (ret != DEVICE_OK)                                                     
       return ret;
 
+   // Advances a loaded channel sequence, set to "+" by the camera
+   pAct = new CPropertyAction(this, &multiAOTF::OnTrigger);
+   ret = CreateProperty(g_Trigger, "-", MM::String, false, pAct);
+   if (ret != DEVICE_OK)
+      return ret;
+   AddAllowedValue(g_Trigger, "-");
+   AddAllowedValue(g_Trigger, "+");
+
+   pAct = new CPropertyAction(this, &multiAOTF::OnBlanking);
+   ret = CreateProperty(g_Blanking, "No", MM::String, false, pAct);
+   if (ret != DEVICE_OK)
+      return ret;
+   AddAllowedValue(g_Blanking, "No");
+   AddAllowedValue(g_Blanking, "Yes");
+
+   pAct = new CPropertyAction(this, &multiAOTF::OnAsync);
+   ret = CreateProperty(g_Async, "Yes", MM::String, false, pAct);
+   if (ret != DEVICE_OK)
+      return ret;
+   AddAllowedValue(g_Async, "No");
+   AddAllowedValue(g_Async, "Yes");
+
 
-   //switch AOTF to internal mode
-   SendSerialCommand(port_.c_str(), "I0", "\r");
+   //switch AOTF to internal mode, synchronously so a missing controller fails here
+   ret = SendCommandNow("I0");
    if (ret != DEVICE_OK)                                                     
       return ret;
 
-   // switch all channels off on startup instead of querying which one is open
-   SetProperty(MM::g_Keyword_State , "0");
+   // switch all channels off on startup instead of querying which one is open;
+   // lineStates_ is still unknown, so this switches all 8 lines off in one
+   // synchronous write
+   ret = SetProperty(MM::g_Keyword_State , "0");
+   if (ret != DEVICE_OK)
+      return ret;
 
    ret = UpdateStatus();                                                 
    if (ret != DEVICE_OK)                                                     
       return ret;
 
-   for (i = 1; i <= 8; i++) {
-      // Use fixed large delay here, since user has not had a chance to set
-      // delayBetweenChannels_.
-      CDeviceUtils::SleepMs(50);
-      command.str("");
-      command << "L" << i << "O0";
-      ret = SendSerialCommand(port_.c_str(), command.str().c_str(), "\r");
-      if (ret != DEVICE_OK)
-         return ret;
-   }
-
    initialized_ = true;
 
    return DEVICE_OK;                                                         
@@ -608,31 +995,72 @@ int multiAOTF::GetOpen(bool& open)
  */
 int multiAOTF::SetShutterPosition(bool state)                              
 {                                                                            
-	ostringstream command;
+   MM::MMTime start = GetCurrentMMTime();
+   int ret = SendLineStates(state ? (activeMultiChannels_ & 0xFF) : 0);
+   if (ret != DEVICE_OK)
+      return ret;
+   switchLatencyMs_ = (GetCurrentMMTime() - start).getMsec();
+
+   state_ = state ? 1 : 0;
+   return DEVICE_OK;
+
+}
 
-   int i;
+/**
+ * Brings the 8 lines to lineStates (bit i-1 = line i on). Batched, only the
+ * lines that differ from the cached state are sent, as one write of
+ * concatenated L<i>O<x> commands - the form Initialize has always used.
+ * A delay between channels needs separate writes, so it forces the old path.
+ * Always synchronous: the cache and the switch latency have to reflect
+ * what the controller actually accepted.
+ */
+int multiAOTF::SendLineStates(int lineStates)
+{
+   ostringstream command;
    int ret;
 
-   for (i = 1; i <= 8; i++) {
+   if (batchSwitching_ && delayBetweenChannels_ <= 0.0)
+   {
+      for (int i = 1; i <= 8; i++) {
+         int channelBit = 1 << (i - 1);
+         if (lineStates_ >= 0 && (lineStates_ & channelBit) == (lineStates & channelBit))
+            continue;
+         if (command.tellp() > 0)
+            command << "\r";
+         command << "L" << i << ((lineStates & channelBit) ? "O1" : "O0");
+      }
+      if (command.tellp() == 0)
+         return DEVICE_OK;
+
+      ret = SendCommandNow(command.str());
+      if (ret != DEVICE_OK) {
+         lineStates_ = -1;
+         return ret;
+      }
+      lineStates_ = lineStates;
+      return DEVICE_OK;
+   }
+
+   for (int i = 1; i <= 8; i++) {
       command.str("");
       command << "L" << i;
       int channelBit = 1 << (i - 1);
-      if (state && (activeMultiChannels_ & channelBit))
+      if (lineStates & channelBit)
          command << "O1";
       else
          command << "O0";
 
-      ret = SendSerialCommand(port_.c_str(), command.str().c_str(), "\r");
-      if (ret != DEVICE_OK)
+      ret = SendCommandNow(command.str());
+      if (ret != DEVICE_OK) {
+         lineStates_ = -1;
          return ret;
+      }
 
       if (delayBetweenChannels_ > 0.0)
          CDeviceUtils::SleepMs((long)ceil(delayBetweenChannels_));
    }
-
-   state_ = state ? 1 : 0;
+   lineStates_ = lineStates;
    return DEVICE_OK;
-
 }
 
 
@@ -641,6 +1069,13 @@ int multiAOTF::SetShutterPosition(bool state)
 
 int multiAOTF::Shutdown()                                                
 {                                                                            
+   if (queue_)
+   {
+      // let the last commands (e.g. a shutter close) reach the controller
+      queue_->Drain(this);
+      AOTFCommandQueue::Release(queue_);
+      queue_ = 0;
+   }
    if (initialized_)                                                         
    {                                                                         
       initialized_ = false;                                                  
@@ -648,10 +1083,57 @@ int multiAOTF::Shutdown()
    return DEVICE_OK;                                                         
 }                                                                            
 
-// Never busy because all commands block
+// Busy until everything we queued has been written
 bool multiAOTF::Busy()
 {
-   return false;
+   return queue_ != 0 && queue_->Pending(this);
+}
+
+/**
+ * Sends now or, with asynchronous commands, leaves it to the port's worker.
+ * Commands with a key are coalesced while they wait.
+ */
+int multiAOTF::QueueCommand(const std::string& key, const std::string& command)
+{
+   if (queue_ && asyncCommands_)
+      return queue_->Enqueue(this, key, command);
+   return SendSerialCommand(port_.c_str(), command.c_str(), "\r");
+}
+
+int multiAOTF::SendQueuedCommand(const std::string& command)
+{
+   return SendSerialCommand(port_.c_str(), command.c_str(), "\r");
+}
+
+/**
+ * Writes straight away, behind whatever this device still has queued, and
+ * returns the controller's answer - for initialization and for writes that
+ * have to be on the lines when the call returns.
+ */
+int multiAOTF::SendCommandNow(const std::string& command)
+{
+   int queued = queue_ ? queue_->Drain(this) : DEVICE_OK;
+   int ret = SendSerialCommand(port_.c_str(), command.c_str(), "\r");
+   return (ret != DEVICE_OK) ? ret : queued;
+}
+
+int multiAOTF::OnAsync(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(asyncCommands_ ? "Yes" : "No");
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      std::string async;
+      pProp->Get(async);
+      bool newAsync = (async == "Yes");
+      // whatever is still queued has to go out before direct writes overtake it
+      if (!newAsync && queue_)
+         queue_->Drain(this);
+      asyncCommands_ = newAsync;
+   }
+   return DEVICE_OK;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -718,6 +1200,30 @@ int multiAOTF::OnChannel(MM::PropertyBase* pProp, MM::ActionType eAct)
       }
       // It might be a good idea to close the shutter at this point...
    }
+   else if (eAct == MM::IsSequenceable)
+   {
+      pProp->SetSequenceable(AOTF_MAX_SEQUENCE);
+   }
+   else if (eAct == MM::AfterLoadSequence)
+   {
+      std::vector<std::string> sequence = pProp->GetSequence();
+      channelSequence_.clear();
+      for (size_t i = 0; i < sequence.size(); i++)
+         channelSequence_.push_back(atoi(sequence[i].c_str()) & 0xFF);
+   }
+   else if (eAct == MM::StartSequence)
+   {
+      sequenceIndex_ = 0;
+      channelSequenceRunning_ = true;
+      if (blankingDuringSequence_)
+         return QueueCommand("", "I1");
+   }
+   else if (eAct == MM::StopSequence)
+   {
+      channelSequenceRunning_ = false;
+      if (blankingDuringSequence_)
+         return QueueCommand("", "I0");
+   }
    return DEVICE_OK;
 }
 
@@ -733,3 +1239,51 @@ int multiAOTF::OnDelayBetweenChannels(MM::PropertyBase* pProp, MM::ActionType eA
    }
    return DEVICE_OK;
 }
+
+int multiAOTF::OnSwitchMode(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+      pProp->Set(batchSwitching_ ? g_SwitchBatched : g_SwitchPerChannel);
+   else if (eAct == MM::AfterSet) {
+      std::string mode;
+      pProp->Get(mode);
+      batchSwitching_ = (mode == g_SwitchBatched);
+   }
+   return DEVICE_OK;
+}
+
+int multiAOTF::OnSwitchLatency(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+      pProp->Set(switchLatencyMs_);
+   return DEVICE_OK;
+}
+
+int multiAOTF::OnTrigger(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+      pProp->Set("-");
+   else if (eAct == MM::AfterSet) {
+      std::string trigger;
+      pProp->Get(trigger);
+      if (trigger == "+" && channelSequenceRunning_ && !channelSequence_.empty()) {
+         // only the lines that change go out, in one write when batching
+         activeMultiChannels_ = channelSequence_[sequenceIndex_++ % channelSequence_.size()];
+         if (state_ == 1)
+            return SetShutterPosition(true);
+      }
+   }
+   return DEVICE_OK;
+}
+
+int multiAOTF::OnBlanking(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+      pProp->Set(blankingDuringSequence_ ? "Yes" : "No");
+   else if (eAct == MM::AfterSet) {
+      std::string blanking;
+      pProp->Get(blanking);
+      blankingDuringSequence_ = (blanking == "Yes");
+   }
+   return DEVICE_OK;
+}
@@ -13,8 +13,13 @@
 
 #include "MMDevice.h"
 #include "DeviceBase.h"
+#include "DeviceThreads.h"
 #include <string>
 #include <map>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
 
 //////////////////////////////////////////////////////////////////////////////
 // Error codes
@@ -37,9 +42,69 @@
 #define ERR_AOTF_OFFSET 10200
 #define ERR_INTENSILIGHTSHUTTER_OFFSET 10300
 
+// longest intensity/channel list we accept for property sequencing
+#define AOTF_MAX_SEQUENCE 1024
 
+//////////////////////////////////////////////////////////////////////////////
+// Asynchronous serial commands
+//
+// One queue and worker thread per serial port, shared by every device on it.
+// A command queued with a key replaces a still pending one with the same key
+// from the same device, so only the last of several intensity sets is sent.
+// The replacement goes to the back of the queue, never ahead of commands
+// queued after the one it replaces.
 
-class AOTF : public CShutterBase<AOTF>
+class AOTFCommandSink
+{
+public:
+   virtual ~AOTFCommandSink() {}
+   // called on the worker thread
+   virtual int SendQueuedCommand(const std::string& command) = 0;
+};
+
+class AOTFCommandQueue : public MMDeviceThreadBase
+{
+public:
+   static AOTFCommandQueue* Acquire(const std::string& port);
+   static void Release(AOTFCommandQueue* queue);
+
+   // returns the error of an earlier failed command from this sink, if any
+   int Enqueue(AOTFCommandSink* sink, const std::string& key, const std::string& command);
+   bool Pending(AOTFCommandSink* sink);
+   // waits until nothing of this sink is queued or sending, returns (and clears) its error
+   int Drain(AOTFCommandSink* sink);
+
+   int svc();
+
+private:
+   AOTFCommandQueue(const std::string& port);
+
+   struct Entry
+   {
+      AOTFCommandSink* sink;
+      std::string key;
+      std::string command;
+   };
+
+   bool PendingLocked(AOTFCommandSink* sink) const;
+
+   std::string port_;
+   int users_;
+   bool stop_;
+   std::mutex lock_;
+   std::condition_variable work_; // Enqueue and Release wake the worker
+   std::condition_variable sent_; // the worker finished a command, Drain rechecks
+   std::deque<Entry> pending_;
+   AOTFCommandSink* inFlight_;
+   std::map<AOTFCommandSink*, int> errors_;
+
+   static MMThreadLock registryLock_;
+   static std::map<std::string, AOTFCommandQueue*> registry_;
+};
+
+
+
+class AOTF : public CShutterBase<AOTF>, public AOTFCommandSink
 {
 public:
    AOTF();
@@ -71,12 +136,21 @@ public:
    int OnFrequency(MM::PropertyBase* pProp, MM::ActionType eAct);
    //ADDED END
    //int OnVersion(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnTrigger(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnBlanking(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnAsync(MM::PropertyBase* pProp, MM::ActionType eAct);
+
+   int SendQueuedCommand(const std::string& command);
 
 private:
 
+   int QueueCommand(const std::string& key, const std::string& command);
+   int SendCommandNow(const std::string& command);
    int SetIntensity(double intensity);
 	
    int SetShutterPosition(bool state);
+   int StepSequence();
+   int SetSequenceRunning(bool& running, bool start);
    //int GetVersion();
 
    // MMCore name of serial port
@@ -94,9 +168,21 @@ private:
    //Added start
    double frequency_; // New member variable to store frequency
    //added end
+
+   // Property sequences, stepped by "Trigger" (e.g. from the camera every frame)
+   std::vector<std::string> intensitySequence_;  // dB value strings, converted on load
+   std::vector<double> intensityPercent_;
+   std::vector<std::string> channelSequence_;
+   bool intensitySequenceRunning_;
+   bool channelSequenceRunning_;
+   size_t sequenceIndex_;
+   // switch to external modulation while a sequence runs
+   bool blankingDuringSequence_;
+   AOTFCommandQueue* queue_;
+   bool asyncCommands_;
 };
 
-class multiAOTF : public CShutterBase<multiAOTF>
+class multiAOTF : public CShutterBase<multiAOTF>, public AOTFCommandSink
 {
 public:
    multiAOTF();
@@ -125,12 +211,22 @@ public:
    //int OnIntensity(MM::PropertyBase* pProp, MM::ActionType eAct);
    //int OnVersion(MM::PropertyBase* pProp, MM::ActionType eAct);
    int OnDelayBetweenChannels(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnSwitchMode(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnSwitchLatency(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnTrigger(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnBlanking(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnAsync(MM::PropertyBase* pProp, MM::ActionType eAct);
+
+   int SendQueuedCommand(const std::string& command);
 
 private:
 
+   int QueueCommand(const std::string& key, const std::string& command);
+   int SendCommandNow(const std::string& command);
    //int SetIntensity(int intensity);
 	
    int SetShutterPosition(bool state);
+   int SendLineStates(int lineStates);
    //int GetVersion();
 
    // MMCore name of serial port
@@ -144,6 +240,20 @@ private:
    int activeMultiChannels_;
    // milliseconds to wait between the per-channel on/off commands
    double delayBetweenChannels_;
+   // send only the changed lines, concatenated into one write
+   bool batchSwitching_;
+   // bit i-1 set when line i is on as far as we know, -1 when unknown
+   int lineStates_;
+   // time the last open/close took to send, in ms
+   double switchLatencyMs_;
+
+   // Channel word sequence, stepped by "Trigger"
+   std::vector<int> channelSequence_;
+   bool channelSequenceRunning_;
+   size_t sequenceIndex_;
+   bool blankingDuringSequence_;
+   AOTFCommandQueue* queue_;
+   bool asyncCommands_;
 };
 
 #endif //_AOTF_H_
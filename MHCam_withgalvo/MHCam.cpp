@@ -38,6 +38,9 @@
 #include "WriteCompactTiffRGB.h"
 #include <iostream>
 #include <direct.h>
+#include <malloc.h>
+#include <intrin.h>
+#include <immintrin.h>
 
 #pragma comment(lib, "ws2_32.lib") // Link with Ws2_32.lib for sockets
 
@@ -55,14 +58,38 @@ const char* g_PROP_EXAMPLE_NAME = "Hub EXAMPLE STRING PROPERTY FROM CAM";
 // constants for naming pixel types (allowed values of the "PixelType" property)
 const char* g_PixelType_8bit = "8bit";
 const char* g_PixelType_16bit = "16bit";
+const char* g_PixelType_32bit = "32bit";
 
 // constants for naming camera modes
 const char* g_MH_Test = "MH Test Pattern";
 const char* g_MH_Histo = "MH Histogram";
 const char* g_MH_Image = "MH Image";
+const char* g_MH_Flim = "MH FLIM";
+const char* g_MH_Phasor = "MH Phasor";
+const char* g_MH_DeviceHisto = "MH Histogram (on device)";
+
+//The opened MultiHarp outlives the camera object: Shutdown() leaves it open, so a cfg
+//reload in the same session picks it up again instead of reopening and re-initializing it
+static struct MultiHarpSession
+{
+    int index;        //Device index, -1 if none is open
+    char serial[9];
+    int mode;         //Measurement mode it was last initialized in
+    bool configValid; //applied is what the device has
+    MultiHarpConfig applied;
+
+    void Reset()
+    {
+        index = -1;
+        serial[0] = 0;
+        mode = -1;
+        configValid = false;
+        applied = MultiHarpConfig();
+    }
+} g_MultiHarp = { -1, "", -1, false, MultiHarpConfig() };
 
 //enum { MODE_ARTIFICIAL_WAVES, MODE_NOISE, MODE_COLOR_TEST, MODE_MH_TEST };
-enum { MODE_MH_TEST, MODE_MH_HISTO, MODE_MH_IMAGE};
+enum { MODE_MH_TEST, MODE_MH_HISTO, MODE_MH_IMAGE, MODE_MH_FLIM, MODE_MH_PHASOR, MODE_MH_DEVICE_HISTO};
 
 ///////////////////////////////////////////////////////////////////////////////
 // Exported MMDevice API
@@ -104,6 +131,82 @@ MODULE_API void DeleteDevice(MM::Device* pDevice)
     delete pDevice;
 }
 
+///////////////////////////////////////////////////////////////////////////////
+// T3 record scanning kernels
+///////////////////////////////////////////////////////////////////////////////
+
+/**
+* True if both the CPU and the OS (saved YMM state) support AVX2.
+*/
+static bool CpuHasAVX2()
+{
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7)
+        return false;
+    __cpuid(info, 1);
+    bool osxsave = (info[2] & (1 << 27)) != 0;
+    bool avx = (info[2] & (1 << 28)) != 0;
+    if (!osxsave || !avx)
+        return false;
+    if ((_xgetbv(0) & 0x6) != 0x6)
+        return false;
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+}
+
+static inline int LowestSetBit(unsigned int mask)
+{
+    unsigned long idx;
+    _BitScanForward(&idx, mask);
+    return (int)idx;
+}
+
+/**
+* Index of the first special (marker/overflow) record in [start, n), or n if there is none.
+*/
+static int FindNextMarkerScalar(const unsigned int* records, int start, int n)
+{
+    for (int i = start; i < n; i++) {
+        if (records[i] & 0x80000000) {
+            return i;
+        }
+    }
+    return n;
+}
+
+/**
+* AVX2 version of FindNextMarkerScalar. The special flag is bit 31, i.e. the sign bit,
+* so movemask pulls it out of 8 records at once; 32 records are tested per iteration.
+*/
+static int FindNextMarkerAVX2(const unsigned int* records, int start, int n)
+{
+    int i = start;
+    for (; i + 32 <= n; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i*)(records + i));
+        __m256i b = _mm256_loadu_si256((const __m256i*)(records + i + 8));
+        __m256i c = _mm256_loadu_si256((const __m256i*)(records + i + 16));
+        __m256i d = _mm256_loadu_si256((const __m256i*)(records + i + 24));
+        __m256i any = _mm256_or_si256(_mm256_or_si256(a, b), _mm256_or_si256(c, d));
+        if (_mm256_movemask_ps(_mm256_castsi256_ps(any)) == 0) {
+            continue;
+        }
+        unsigned int mask = (unsigned int)_mm256_movemask_ps(_mm256_castsi256_ps(a))
+            | ((unsigned int)_mm256_movemask_ps(_mm256_castsi256_ps(b)) << 8)
+            | ((unsigned int)_mm256_movemask_ps(_mm256_castsi256_ps(c)) << 16)
+            | ((unsigned int)_mm256_movemask_ps(_mm256_castsi256_ps(d)) << 24);
+        return i + LowestSetBit(mask);
+    }
+    for (; i + 8 <= n; i += 8) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(records + i));
+        int mask = _mm256_movemask_ps(_mm256_castsi256_ps(v));
+        if (mask) {
+            return i + LowestSetBit((unsigned int)mask);
+        }
+    }
+    return FindNextMarkerScalar(records, i, n);
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 // MH_camera implementation
 // ~~~~~~~~~~~~~~~~~~~~~~~~~~
@@ -120,6 +223,8 @@ MODULE_API void DeleteDevice(MM::Device* pDevice)
 */
 MH_camera::MH_camera() :
     CCameraBase<MH_camera>(),
+    scanPixelSizeUm_(nominalPixelSizeUm_),
+    scanMagnification_(1.0),
     exposureMaximum_(MAX_INTEG_MS),
     dPhase_(0),
     initialized_(false),
@@ -128,6 +233,7 @@ MH_camera::MH_camera() :
     bitDepth_(16),
     roiX_(0),
     roiY_(0),
+    roiGeneration_(0),
     sequenceStartTime_(0),
     isSequenceable_(false),
     sequenceMaxLength_(100),
@@ -153,6 +259,41 @@ MH_camera::MH_camera() :
     supportsMultiROI_(false),
     multiROIFillValue_(0),
     nComponents_(1),
+    tttrRolloverMB_(0),
+    tttrSource_(TTTR_SOURCE_MULTIHARP),
+    synthPhotonRate_(1e6),
+    synthSyncMHz_(40.0),
+    acqPixels_(0),
+    previewMode_(PREVIEW_OFF),
+    previewLines_(16),
+    previewIntervalMs_(100.0),
+    liveSequence_(false),
+    previewing_(false),
+    previewLineCount_(0),
+    previewTicks_(0),
+    stopFrameService_(false),
+    triggerSteps_(0),
+    stopAcq_(false),
+    stopOnFrameEnd_(false),
+    snapFramesDone_(0),
+    fifoNearFullReads_(0),
+    fifoOverruns_(0),
+    fifoReadResult_(DEVICE_OK),
+    ringFullStalls_(0),
+    adaptivePolling_(true),
+    pollState_(POLL_SPIN),
+    statRecordsRead_(0),
+    statPhotonsBinned_(0),
+    statDroppedFlyback_(0),
+    statDroppedNoFrame_(0),
+    statDecodeTicks_(0),
+    statDecodeRecords_(0),
+    statDiskBytes_(0),
+    statFifoReadHighWater_(0),
+    statReaderCpu_(0),
+    statStartTicks_(0),
+    statStopTicks_(0),
+    perfFrequency_(1),
     mode_(MODE_MH_TEST),
     imgManpl_(0),
     pcf_(1.0),
@@ -169,21 +310,66 @@ MH_camera::MH_camera() :
     MeasDesc_GlobalResolution_(12618),//From an old .ptu file
     last_line_start_(0),
     last_line_end_(100000000000000000),
+    line_pixel_scale_(0),
+    line_end_clock_seen_(false),
+    flyback_fraction_(0.1),
+    line_map_mode_(LINE_MAP_LINEAR),
     current_line_(-99),
     n_line_repeats_(1),
     n_frame_repeats_(1),
+    geometryVersion_(0),
     n_frame_tracker_(0),
     nBeams(1),
     overflow_counter_(0),
     saving_(false),
-    frame_active_(false)
+    frame_active_(false),
+    continuousSequence_(false),
+    streaming_(false),
+    frame_completed_(false),
+    stream_frames_summed_(0),
+    stream_images_left_(0),
+    stream_ret_(DEVICE_OK),
+    useAVX2_(CpuHasAVX2()),
+    saturateCounts_(true),
+    decayCube_(0),
+    decayCubeSize_(0),
+    flimBins_(FLIM_DEFAULT_BINS),
+    flimBinShift_(0),
+    flimBinWidthPs_(0.0),
+    nGates_(0),
+    gateGeneration_(0),
+    gateShift_(0),
+    beamCorrection_(false),
+    beamCorrGeneration_(0),
+    beamCorrActive_(false),
+    binPhotons_(&MH_camera::BinPhotonsNone),
+    binLifetimes_(&MH_camera::BinPhotonsNone),
+    binThreads_(1),
+    binPending_(0),
+    binDone_(NULL),
+    binQuit_(false),
+    rateProbeRunning_(false),
+    probedSyncRate_(0)
 {
     memset(testProperty_, 0, sizeof(testProperty_));
+    memset(beamLUT_, 0, sizeof(beamLUT_));
+    memset(binOwner_, -1, sizeof(binOwner_));
+    memset(&accumulatorKey_, 0, sizeof(accumulatorKey_));
+    for (int gate = 0; gate < MAX_GATES; gate++)
+        gateWindows_[gate] = GATE_DEFAULT_WINDOW;
+    line_map_.assign(LINE_MAP_SIZE + 1, 0);
+    LARGE_INTEGER freq;
+    if (QueryPerformanceFrequency(&freq) && freq.QuadPart > 0)
+        perfFrequency_ = freq.QuadPart;
 
     // call the base class method to set-up default error codes/messages
     InitializeDefaultErrorMessages();
     readoutStartTime_ = GetCurrentMMTime();
     thd_ = new MySequenceThread(this);
+    fifoReader_ = new FifoReaderThread(this);
+    tttrWriter_ = new TTTRWriterThread(this);
+    frameService_ = new FrameServiceThread(this);
+    rateProbe_ = new RateProbeThread(this);
 
     // parent ID display
     CreateHubIDProperty();
@@ -191,6 +377,17 @@ MH_camera::MH_camera() :
     CreateFloatProperty("MaximumExposureMs", exposureMaximum_, false,
         new CPropertyAction(this, &MH_camera::OnMaxExposure),
         true);
+
+    //Where the T3 records come from; the offline sources need no MultiHarp attached
+    CreateStringProperty(g_PropName_TTTR_Source, g_TTTR_Source_MultiHarp, false,
+        new CPropertyAction(this, &MH_camera::OnTTTRSource), true);
+    AddAllowedValue(g_PropName_TTTR_Source, g_TTTR_Source_MultiHarp);
+    AddAllowedValue(g_PropName_TTTR_Source, g_TTTR_Source_Replay);
+    AddAllowedValue(g_PropName_TTTR_Source, g_TTTR_Source_Synthetic);
+
+    //Opening only this MultiHarp skips probing every other USB index
+    CreateStringProperty(g_PropName_MH_Serial, mhSerial_.c_str(), false,
+        new CPropertyAction(this, &MH_camera::OnMultiHarpSerial), true);
 }
 
 /**
@@ -203,7 +400,17 @@ MH_camera::MH_camera() :
 MH_camera::~MH_camera()
 {
     StopSequenceAcquisition();
+    WaitForRateProbe();
+    delete rateProbe_;
     delete thd_;
+    delete fifoReader_;
+    delete tttrWriter_;
+    delete frameService_;
+    StopBinWorkers();
+    fifoRing_.Free();
+    tttrFile_.Free();
+    framePool_.Free();
+    FreeDecayCube();
 }
 
 /**
@@ -244,7 +451,12 @@ int MH_camera::Initialize()
     for (int i = 0; i < MAX_N_CHANNELS; i++) {
         live_rates[i] = 0;
     }
-        
+
+    SetErrorText(ERR_MH_MODE, "Could not switch the MultiHarp measurement mode");
+    SetErrorText(ERR_MH_HISTOGRAM, "MultiHarp histogram measurement failed");
+    SetErrorText(ERR_REPLAY_SOURCE, "Could not use the TTTR replay source");
+    SetErrorText(ERR_MH_FIFO, "Reading the MultiHarp FIFO failed, the measurement was stopped");
+
 
     // set property list
     // -----------------
@@ -284,6 +496,7 @@ int MH_camera::Initialize()
     vector<string> pixelTypeValues;
     pixelTypeValues.push_back(g_PixelType_8bit);
     pixelTypeValues.push_back(g_PixelType_16bit);
+    pixelTypeValues.push_back(g_PixelType_32bit);
 
     nRet = SetAllowedValues(MM::g_Keyword_PixelType, pixelTypeValues);
     if (nRet != DEVICE_OK)
@@ -297,6 +510,7 @@ int MH_camera::Initialize()
     vector<string> bitDepths;
     bitDepths.push_back("8");
     bitDepths.push_back("16");
+    bitDepths.push_back("32");
     nRet = SetAllowedValues("BitDepth", bitDepths);
     if (nRet != DEVICE_OK)
         return nRet;
@@ -362,10 +576,10 @@ int MH_camera::Initialize()
     // Number of pixels the scanner needs to do
     pAct = new CPropertyAction(this, &MH_camera::Onn_scanPixels_X);
     CreateIntegerProperty(g_N_Scan_Px_X, 120, false, pAct);
-    SetPropertyLimits(g_N_Scan_Px_X, 1, 1024);
+    SetPropertyLimits(g_N_Scan_Px_X, 1, MAX_SCAN_PIXELS);
     pAct = new CPropertyAction(this, &MH_camera::Onn_scanPixels_Y);
     CreateIntegerProperty(g_N_Scan_Px_Y, 80, false, pAct);
-    SetPropertyLimits(g_N_Scan_Px_Y, 1, 1024);
+    SetPropertyLimits(g_N_Scan_Px_Y, 1, MAX_SCAN_PIXELS);
     
     //Number of beams in the array
     pAct = new CPropertyAction(this, &MH_camera::Onn_beams_X);
@@ -435,6 +649,9 @@ int MH_camera::Initialize()
     AddAllowedValue(propName.c_str(), g_MH_Test);
     AddAllowedValue(propName.c_str(), g_MH_Histo);
     AddAllowedValue(propName.c_str(), g_MH_Image);
+    AddAllowedValue(propName.c_str(), g_MH_Flim);
+    AddAllowedValue(propName.c_str(), g_MH_Phasor);
+    AddAllowedValue(propName.c_str(), g_MH_DeviceHisto);
 
     // Photon Conversion Factor for Noise type camera
     pAct = new CPropertyAction(this, &MH_camera::OnPCF);
@@ -496,6 +713,142 @@ int MH_camera::Initialize()
     AddAllowedValue(g_PropName_Saving, "True");
     AddAllowedValue(g_PropName_Saving, "False");
 
+    nRet = CreateStringProperty(g_PropName_Count_Overflow, "Saturate", false, new CPropertyAction(this, &MH_camera::OnCountOverflow));
+    if (DEVICE_OK != nRet) {
+        return nRet;
+    }
+    AddAllowedValue(g_PropName_Count_Overflow, "Saturate");
+    AddAllowedValue(g_PropName_Count_Overflow, "Wrap");
+
+    //How time into a line maps onto pixels: linear galvo or sinusoidal (resonant) scanner
+    nRet = CreateStringProperty(g_PropName_Line_Map, "Linear", false, new CPropertyAction(this, &MH_camera::OnLineMap));
+    if (DEVICE_OK != nRet) {
+        return nRet;
+    }
+    AddAllowedValue(g_PropName_Line_Map, "Linear");
+    AddAllowedValue(g_PropName_Line_Map, "Sinusoidal");
+
+    //Only used when the scanner sends no line-end clock: active part of each line-start to line-start period
+    nRet = CreateFloatProperty(g_PropName_Flyback, flyback_fraction_, false, new CPropertyAction(this, &MH_camera::OnFlybackFraction));
+    if (DEVICE_OK != nRet) {
+        return nRet;
+    }
+    SetPropertyLimits(g_PropName_Flyback, 0.0, 0.9);
+
+    //Threads the photons are binned on, beams are split between them; 1 bins on the decoding thread
+    nRet = CreateIntegerProperty(g_PropName_Bin_Threads, binThreads_, false, new CPropertyAction(this, &MH_camera::OnBinThreads));
+    if (DEVICE_OK != nRet) {
+        return nRet;
+    }
+    SetPropertyLimits(g_PropName_Bin_Threads, 1, MAX_BIN_THREADS);
+
+    //Decay histogram length in FLIM mode, spread over one sync period
+    nRet = CreateIntegerProperty(g_PropName_Flim_Bins, flimBins_, false, new CPropertyAction(this, &MH_camera::OnFlimBins));
+    if (DEVICE_OK != nRet) {
+        return nRet;
+    }
+    AddAllowedValue(g_PropName_Flim_Bins, "16");
+    AddAllowedValue(g_PropName_Flim_Bins, "32");
+    AddAllowedValue(g_PropName_Flim_Bins, "64");
+    AddAllowedValue(g_PropName_Flim_Bins, "128");
+    AddAllowedValue(g_PropName_Flim_Bins, "256");
+
+    //Time gated intensity: every gate adds an image channel with only the photons inside its TCSPC window(s)
+    nRet = CreateIntegerProperty(g_PropName_Gates, nGates_, false, new CPropertyAction(this, &MH_camera::OnGates));
+    if (DEVICE_OK != nRet) {
+        return nRet;
+    }
+    SetPropertyLimits(g_PropName_Gates, 0, MAX_GATES);
+    for (int gate = 0; gate < MAX_GATES; gate++) {
+        char gateName[MM::MaxStrLength];
+        sprintf(gateName, g_PropName_Gate_Window, gate + 1);
+        nRet = CreateStringProperty(gateName, gateWindows_[gate].c_str(), false, new CPropertyActionEx(this, &MH_camera::OnGateWindow, gate));
+        if (DEVICE_OK != nRet) {
+            return nRet;
+        }
+    }
+
+    //Beam correction: dark offsets, crosstalk unmixing and flat-field gains per beam, applied once per finished frame
+    nRet = CreateStringProperty(g_PropName_Beam_Correction, "Off", false, new CPropertyActionEx(this, &MH_camera::OnBeamCorrection, 0));
+    if (DEVICE_OK != nRet) {
+        return nRet;
+    }
+    AddAllowedValue(g_PropName_Beam_Correction, "Off");
+    AddAllowedValue(g_PropName_Beam_Correction, "On");
+    CreateStringProperty(g_PropName_Beam_Gains, beamGains_.c_str(), false, new CPropertyActionEx(this, &MH_camera::OnBeamCorrection, 1));
+    CreateStringProperty(g_PropName_Beam_Offsets, beamOffsets_.c_str(), false, new CPropertyActionEx(this, &MH_camera::OnBeamCorrection, 2));
+    CreateStringProperty(g_PropName_Beam_Crosstalk, beamCrosstalk_.c_str(), false, new CPropertyActionEx(this, &MH_camera::OnBeamCorrection, 3));
+    CreateStringProperty(g_PropName_Beam_FlatField, beamFlatField_.c_str(), false, new CPropertyActionEx(this, &MH_camera::OnBeamCorrection, 4));
+
+    //Sequences either re-arm the MultiHarp for every frame or run one measurement cut up on frame clocks
+    nRet = CreateStringProperty(g_PropName_Sequence_Mode, g_Sequence_Frame_By_Frame, false, new CPropertyAction(this, &MH_camera::OnSequenceMode));
+    if (DEVICE_OK != nRet) {
+        return nRet;
+    }
+    AddAllowedValue(g_PropName_Sequence_Mode, g_Sequence_Frame_By_Frame);
+    AddAllowedValue(g_PropName_Sequence_Mode, g_Sequence_Continuous);
+
+    //Split long TTTR recordings into several .ptu files
+    nRet = CreateIntegerProperty(g_PropName_TTTR_Rollover, tttrRolloverMB_, false, new CPropertyAction(this, &MH_camera::OnTTTRRollover));
+    if (DEVICE_OK != nRet) {
+        return nRet;
+    }
+    SetPropertyLimits(g_PropName_TTTR_Rollover, 0, 65536);
+
+    //Offline sources, MHCamBench drives the decode/binning path from them
+    CreateStringProperty(g_PropName_Replay_File, replayPath_.c_str(), false, new CPropertyAction(this, &MH_camera::OnReplayFile));
+    CreateFloatProperty(g_PropName_Synth_Rate, synthPhotonRate_, false, new CPropertyActionEx(this, &MH_camera::OnSyntheticParam, 0));
+    SetPropertyLimits(g_PropName_Synth_Rate, 0, 1e9);
+    CreateFloatProperty(g_PropName_Synth_Sync, synthSyncMHz_, false, new CPropertyActionEx(this, &MH_camera::OnSyntheticParam, 1));
+    SetPropertyLimits(g_PropName_Synth_Sync, 1, 100);
+
+    //Read-only FIFO pipeline counters, refreshed whenever they are read
+    CPropertyActionEx* pStatAct = new CPropertyActionEx(this, &MH_camera::OnPipelineStat, 0);
+    CreateIntegerProperty(g_PropName_Ring_Occupancy, 0, true, pStatAct);
+    pStatAct = new CPropertyActionEx(this, &MH_camera::OnPipelineStat, 1);
+    CreateIntegerProperty(g_PropName_Ring_HighWater, 0, true, pStatAct);
+    pStatAct = new CPropertyActionEx(this, &MH_camera::OnPipelineStat, 2);
+    CreateIntegerProperty(g_PropName_Ring_Stalls, 0, true, pStatAct);
+    pStatAct = new CPropertyActionEx(this, &MH_camera::OnPipelineStat, 3);
+    CreateIntegerProperty(g_PropName_FIFO_NearFull, 0, true, pStatAct);
+    pStatAct = new CPropertyActionEx(this, &MH_camera::OnPipelineStat, 14);
+    CreateIntegerProperty(g_PropName_FIFO_Overruns, 0, true, pStatAct);
+    pStatAct = new CPropertyActionEx(this, &MH_camera::OnPipelineStat, 4);
+    CreateIntegerProperty(g_PropName_Frame_Stalls, 0, true, pStatAct);
+    pStatAct = new CPropertyActionEx(this, &MH_camera::OnPipelineStat, 5);
+    CreateFloatProperty(g_PropName_Stat_RecordRate, 0, true, pStatAct);
+    pStatAct = new CPropertyActionEx(this, &MH_camera::OnPipelineStat, 6);
+    CreateFloatProperty(g_PropName_Stat_Binned, 0, true, pStatAct);
+    pStatAct = new CPropertyActionEx(this, &MH_camera::OnPipelineStat, 7);
+    CreateFloatProperty(g_PropName_Stat_Flyback, 0, true, pStatAct);
+    pStatAct = new CPropertyActionEx(this, &MH_camera::OnPipelineStat, 8);
+    CreateFloatProperty(g_PropName_Stat_NoFrame, 0, true, pStatAct);
+    pStatAct = new CPropertyActionEx(this, &MH_camera::OnPipelineStat, 9);
+    CreateIntegerProperty(g_PropName_Stat_FifoHighWater, 0, true, pStatAct);
+    pStatAct = new CPropertyActionEx(this, &MH_camera::OnPipelineStat, 10);
+    CreateFloatProperty(g_PropName_Stat_DecodeNs, 0, true, pStatAct);
+    pStatAct = new CPropertyActionEx(this, &MH_camera::OnPipelineStat, 11);
+    CreateFloatProperty(g_PropName_Stat_DiskRate, 0, true, pStatAct);
+    pStatAct = new CPropertyActionEx(this, &MH_camera::OnPipelineStat, 12);
+    CreateStringProperty(g_PropName_Stat_PollState, g_Poll_State_Names[POLL_SPIN], true, pStatAct);
+    pStatAct = new CPropertyActionEx(this, &MH_camera::OnPipelineStat, 13);
+    CreateFloatProperty(g_PropName_Stat_ReaderCpu, 0, true, pStatAct);
+
+    //Adaptive polling backs off between FIFO reads at low count rates instead of spinning a core
+    CreateStringProperty(g_PropName_FIFO_Polling, g_FIFO_Polling_Adaptive, false, new CPropertyAction(this, &MH_camera::OnFifoPolling));
+    AddAllowedValue(g_PropName_FIFO_Polling, g_FIFO_Polling_Adaptive);
+    AddAllowedValue(g_PropName_FIFO_Polling, g_FIFO_Polling_Spin);
+
+    //Live mode only: partial frames while a long exposure is still integrating
+    CreateStringProperty(g_PropName_Preview, g_Preview_Off, false, new CPropertyActionEx(this, &MH_camera::OnPreview, 0));
+    AddAllowedValue(g_PropName_Preview, g_Preview_Off);
+    AddAllowedValue(g_PropName_Preview, g_Preview_Lines);
+    AddAllowedValue(g_PropName_Preview, g_Preview_Interval);
+    CreateIntegerProperty(g_PropName_Preview_Lines, previewLines_, false, new CPropertyActionEx(this, &MH_camera::OnPreview, 1));
+    SetPropertyLimits(g_PropName_Preview_Lines, 1, 1024);
+    CreateFloatProperty(g_PropName_Preview_Interval, previewIntervalMs_, false, new CPropertyActionEx(this, &MH_camera::OnPreview, 2));
+    SetPropertyLimits(g_PropName_Preview_Interval, 10.0, 10000.0);
+
     LogMessage("Did add allowed statuses", false);
 
 /////UPDATE STATUS WAS HERE
@@ -508,6 +861,10 @@ int MH_camera::Initialize()
 
     LogMessage("Image buffer resized", false);
 
+    //From here on the scan geometry comes from the hub, if there is one
+    if (pHub)
+        pHub->RegisterCamera(this);
+
 #ifdef TESTRESOURCELOCKING
     TestResourceLocking(true);
     LogMessage("TestResourceLocking OK", true);
@@ -529,55 +886,41 @@ int MH_camera::Initialize()
         return DEVICE_INVALID_PROPERTY_VALUE;
     }
     
-    //Try to initialise the first MultiHarp we can find
-    for (int i = 0; i < MAXDEVNUM; i++)
+    if (tttrSource_ != TTTR_SOURCE_MULTIHARP)
     {
-        retcode = MH_OpenDevice(i, HW_Serial);
-        if (retcode == 0) //Grab any device we can open
-        {
-            if (HW_Serial[0] != '\0') {//If the HW_Serial 'string' isn't an empty one
-                LogMessage("HWSerial not empty");
-                std::string sernum = convertToString(HW_Serial, true);
-                msgstr = "MultiHarp #" + sernum + " opened ok!";
-                LogMessage(msgstr, false);
-            }
-            dev[found] = i; //keep index to devices we want to use
-            found++;
-        }
-        else
-        {
-            if (retcode == MH_ERROR_DEVICE_OPEN_FAIL)
-            {
-                msgstr = "No MultiHarp at index " + to_string(i);
-                LogMessage(msgstr, false);
-            }
-            else
-            {
-                msgstr = "MultiHarp OpenDevice error message: " + MH_GetErrorString(Errorstring, retcode);
-                LogMessage(msgstr, false);
-            }
-        }
-    }
-    if (found > 0) {
-        msgstr = "Total no. of MultiHarps found: " + to_string(found) + " - using first one detected: " + to_string(dev[0]);
-    }
-    else {
-        msgstr = "No MultiHarp found!";
+        //Replay/synthetic records: no hardware to open, just a plausible T3 time base
+        LogMessage("Offline TTTR source, not opening a MultiHarp");
+        NumChannels = MAX_N_CHANNELS;
+        Resolution = 5.0;
+        Syncrate = (int)(SyncDivider * synthSyncMHz_ * 1e6);
+        MeasDesc_GlobalResolution_ = (uint64_t)(1e6 / synthSyncMHz_ + 0.5);
+        goto offline_source;
+    }
+
+    bool reused;
+    bool fromSession; //Handle came from g_MultiHarp rather than a fresh MH_OpenDevice
+open_device:
+    if (OpenMultiHarp(reused) != DEVICE_OK)
         return DEVICE_NOT_CONNECTED;
-    }
-    LogMessage(msgstr, false);
+    fromSession = reused;
 
-    //Try initialisation
-    retcode = MH_Initialize(dev[0], Mode, 0);
+    //Try initialisation, unless the MultiHarp is still set up from the last Initialize()
+    retcode = (reused && g_MultiHarp.mode == Mode) ? 0 : MH_Initialize(dev[0], Mode, 0);
     if (retcode < 0)
     {
         MH_GetErrorString(Errorstring, retcode);
         msgstr = to_string(printf("MultiHarp: MH_Initialize error %d (%s). Aborted.", retcode, Errorstring));
         LogMessage(msgstr);
-        goto fail;
+        goto device_fail;
+    }
+    else if (reused && g_MultiHarp.mode == Mode) {
+        LogMessage("MultiHarp already initialised, only changed settings are applied");
     }
     else {
         LogMessage("MultiHarp initialise call went ok");
+        g_MultiHarp.mode = Mode;
+        g_MultiHarp.configValid = false;
+        reused = false;
     }
 
     retcode = MH_GetHardwareInfo(dev[0], HW_Model, HW_Partno, HW_Version);
@@ -586,7 +929,7 @@ int MH_camera::Initialize()
         MH_GetErrorString(Errorstring, retcode);
         msgstr = to_string(printf("MH_GetHardwareInfo error %d (%s). Aborted.", retcode, Errorstring));
         LogMessage(msgstr);
-        goto fail;
+        goto device_fail;
     }
     else
     {
@@ -606,7 +949,7 @@ int MH_camera::Initialize()
         sprintf(dummy, "MH_GetNumOfInputChannels error %d (%s). Aborted.", retcode, Errorstring);
         msgstr = dummy;
         LogMessage(msgstr);
-        goto fail;
+        goto device_fail;
     }
     else
     {
@@ -616,8 +959,231 @@ int MH_camera::Initialize()
         msgstr = dummy;
         LogMessage(msgstr);
     }
-    ///////////////////////////////////////////////////////////////////////////////////////////////
-    retcode = MH_SetSyncDiv(dev[0], SyncDivider);
+    if (ApplyMultiHarpSettings(Mode) != DEVICE_OK)
+        goto device_fail;
+
+    char gummy[100];
+    sprintf(gummy, "EARLY OUTPUT");
+    msgstr = gummy;
+    LogMessage(msgstr);
+
+    retcode = MH_GetResolution(dev[0], &Resolution);
+    if (retcode < 0)
+    {
+        MH_GetErrorString(Errorstring, retcode);
+        char dummy[100];
+        sprintf(dummy, "MH_GetResolution error %d (%s). Aborted.", retcode, Errorstring);
+        msgstr = dummy;
+        LogMessage(msgstr);
+        goto device_fail;
+    }
+    else {
+        char dummy[100];
+        sprintf(dummy, "MH_GetResolution gave %1.0lfps", retcode);
+        msgstr = dummy;
+        LogMessage(msgstr);
+
+    }
+
+    //The rates need 150 ms after MH_Initialize to settle; check them in the background
+    probedSyncRate_ = 0;
+    rateProbe_->Start(!reused);
+    rateProbeRunning_ = true;
+    //Next step in example tttrmode.c is to start upon pressing return, so switch to generating MM UI stuff instead...
+
+offline_source:
+    //Set default stored values for offsets and other per-channel bits (all to zero?)
+    for (int i = 0; i < NumChannels; i++) {
+        offsets.push_back(hardcoded_init_offsets[i]);
+    }
+
+    //FIFO blocks are big (TTREADMAX records each) so grab them once here rather than per acquisition
+    if (!fifoRing_.Allocate(N_TTTR_BLOCKS)) {
+        LogMessage("Could not allocate the FIFO read blocks");
+        return DEVICE_OUT_OF_MEMORY;
+    }
+    if (!tttrFile_.Allocate()) {
+        LogMessage("Could not allocate the TTTR file write buffers");
+        return DEVICE_OUT_OF_MEMORY;
+    }
+
+////////////////////////////////////////////////////////
+
+    // synchronize all properties
+    // --------------------------
+    nRet = UpdateStatus();
+    if (nRet != DEVICE_OK)
+        return nRet;
+
+    LogMessage("UpdateStatus ok", false);
+
+    // initialize image buffer
+    GenerateEmptyImage(img_);
+    return DEVICE_OK;
+
+    device_fail:
+    if (fromSession)
+    {
+        //The kept handle went stale (e.g. USB replug); drop it and go through a fresh open once
+        LogMessage("Kept MultiHarp handle failed, closing it and opening the device again");
+        MH_CloseDevice(g_MultiHarp.index);
+        g_MultiHarp.Reset();
+        goto open_device;
+    }
+    LogMessage("MultiHarp initialisation failure! Shutting down in MultiHarp device adapter...");
+    Shutdown();
+    return DEVICE_CAN_NOT_SET_PROPERTY;
+}
+
+/**
+* Opens the MultiHarp: the one still open from an earlier Initialize() if it
+* matches the serial property, otherwise the first index that opens (and has
+* that serial, if one is set). Stops at the first match rather than opening
+* every index, and remembers the serial in the property.
+*/
+int MH_camera::OpenMultiHarp(bool& reused)
+{
+    reused = false;
+    if (g_MultiHarp.index >= 0)
+    {
+        if (mhSerial_.empty() || mhSerial_.compare(g_MultiHarp.serial) == 0)
+        {
+            dev[0] = g_MultiHarp.index;
+            found = 1;
+            strcpy(HW_Serial, g_MultiHarp.serial);
+            mhSerial_ = g_MultiHarp.serial;
+            reused = true;
+            LogMessage("Reusing MultiHarp #" + mhSerial_ + " at index " + to_string(dev[0]), false);
+            return DEVICE_OK;
+        }
+        MH_CloseDevice(g_MultiHarp.index);
+        g_MultiHarp.Reset();
+    }
+    found = 0;
+    for (int i = 0; i < MAXDEVNUM; i++)
+    {
+        retcode = MH_OpenDevice(i, HW_Serial);
+        if (retcode == 0)
+        {
+            std::string sernum = HW_Serial;
+            if (!mhSerial_.empty() && mhSerial_ != sernum)
+            {
+                LogMessage("Skipping MultiHarp #" + sernum + " at index " + to_string(i), false);
+                MH_CloseDevice(i);
+                continue;
+            }
+            msgstr = "MultiHarp #" + sernum + " opened ok at index " + to_string(i);
+            LogMessage(msgstr, false);
+            dev[0] = i;
+            found = 1;
+            g_MultiHarp.index = i;
+            strcpy(g_MultiHarp.serial, HW_Serial);
+            g_MultiHarp.mode = -1;
+            g_MultiHarp.configValid = false;
+            mhSerial_ = sernum;
+            return DEVICE_OK;
+        }
+        if (retcode == MH_ERROR_DEVICE_OPEN_FAIL)
+        {
+            msgstr = "No MultiHarp at index " + to_string(i);
+            LogMessage(msgstr, false);
+        }
+        else
+        {
+            msgstr = "MultiHarp OpenDevice error message: " + MH_GetErrorString(Errorstring, retcode);
+            LogMessage(msgstr, false);
+        }
+    }
+    LogMessage(mhSerial_.empty() ? std::string("No MultiHarp found!") : "MultiHarp #" + mhSerial_ + " not found!");
+    return DEVICE_NOT_CONNECTED;
+}
+
+/**
+* Logs the sync and input count rates and any warnings of the just opened
+* MultiHarp. settle waits out the 150 ms the rates need after MH_Initialize.
+* Runs on rateProbe_ so Initialize() doesn't block on it; everything that
+* talks to the device afterwards goes through WaitForRateProbe() first, which
+* is also where the measured sync rate is taken over into Syncrate.
+*/
+int MH_camera::ProbeRates(bool settle)
+{
+    char errorText[40];
+    char dummy[100];
+    //Subsequently you get new values after every 100ms
+    if (settle)
+        Sleep(150);
+    int syncRate = 0;
+    int ret = MH_GetSyncRate(dev[0], &syncRate);
+    if (ret < 0)
+    {
+        MH_GetErrorString(errorText, ret);
+        sprintf(dummy, "MH_GetSyncRate error %d (%s).", ret, errorText);
+        LogMessage(dummy);
+        return DEVICE_ERR;
+    }
+    probedSyncRate_ = syncRate;
+    sprintf(dummy, "Sync rate: %d", syncRate);
+    LogMessage(dummy);
+
+    for (int i = 0; i < NumChannels; i++) // for all channels
+    {
+        int countRate = 0;
+        ret = MH_GetCountRate(dev[0], i, &countRate);
+        if (ret < 0)
+        {
+            MH_GetErrorString(errorText, ret);
+            sprintf(dummy, "MH_GetCountRate error %d (%s).", ret, errorText);
+            LogMessage(dummy);
+            return DEVICE_ERR;
+        }
+        sprintf(dummy, "Countrate[%1d]=%1d/s", i, countRate);
+        LogMessage(dummy);
+    }
+
+    //after getting the count rates, we can check for warnings
+    int warningBits = 0;
+    ret = MH_GetWarnings(dev[0], &warningBits);
+    if (ret < 0)
+    {
+        MH_GetErrorString(errorText, ret);
+        sprintf(dummy, "MH_GetWarnings error %d (%s).", ret, errorText);
+        LogMessage(dummy);
+        //Just warnings, not errors
+    }
+    else if (warningBits)
+    {
+        MH_GetWarningsText(dev[0], warningstext, warningBits);
+        LogMessage(warningstext);
+        //Just warnings, not errors
+    }
+    return DEVICE_OK;
+}
+
+void MH_camera::WaitForRateProbe()
+{
+    if (rateProbeRunning_)
+    {
+        rateProbe_->wait();
+        rateProbeRunning_ = false;
+        if (probedSyncRate_ > 0)
+            Syncrate = probedSyncRate_;
+    }
+}
+
+/**
+* Applies the sync, input and TCSPC settings to the opened MultiHarp.
+* MH_Initialize resets all of them, so this runs after every (re)initialization;
+* while g_MultiHarp.applied is still valid only the changed ones are reissued.
+*/
+int MH_camera::ApplyMultiHarpSettings(int measMode)
+{
+    MultiHarpConfig& applied = g_MultiHarp.applied;
+    bool cached = g_MultiHarp.configValid;
+    g_MultiHarp.configValid = false; //Until all of them went through
+    if (cached && applied.syncDiv == SyncDivider)
+        retcode = 0;
+    else
+        retcode = MH_SetSyncDiv(dev[0], SyncDivider);
     if (retcode < 0)
     {
         MH_GetErrorString(Errorstring, retcode);
@@ -625,13 +1191,17 @@ int MH_camera::Initialize()
         sprintf(dummy, "MH_SetSyncDiv error %d (%s). Aborted.", retcode, Errorstring);
         msgstr = dummy;
         LogMessage(msgstr);
-        goto fail;
+        return DEVICE_CAN_NOT_SET_PROPERTY;
     }
     else {
         LogMessage("MH_SetSyncDiv set Sync Divider to " + to_string(SyncDivider));
+        applied.syncDiv = SyncDivider;
     }
 
-    retcode = MH_SetSyncEdgeTrg(dev[0], SyncTriggerLevel, SyncTiggerEdge);
+    if (cached && applied.syncLevel == SyncTriggerLevel && applied.syncEdge == SyncTiggerEdge)
+        retcode = 0;
+    else
+        retcode = MH_SetSyncEdgeTrg(dev[0], SyncTriggerLevel, SyncTiggerEdge);
     if (retcode < 0)
     {
         MH_GetErrorString(Errorstring, retcode);
@@ -639,13 +1209,15 @@ int MH_camera::Initialize()
         sprintf(dummy, "MH_SetSyncEdgeTrg error % d(% s).Aborted.", retcode, Errorstring);
         msgstr = dummy;
         LogMessage(msgstr);
-        goto fail;
+        return DEVICE_CAN_NOT_SET_PROPERTY;
     }
     else {
         LogMessage("MH_SetSyncEdgeTrg set Sync Edge Trigger to " + to_string(SyncTriggerLevel) + " and " + to_string(SyncTiggerEdge));
+        applied.syncLevel = SyncTriggerLevel;
+        applied.syncEdge = SyncTiggerEdge;
     }
 
-    retcode = MH_SetSyncChannelOffset(dev[0], 0);
+    retcode = (cached && applied.syncOffset == 0) ? 0 : MH_SetSyncChannelOffset(dev[0], 0);
     if (retcode < 0)
     {
         MH_GetErrorString(Errorstring, retcode);
@@ -653,11 +1225,14 @@ int MH_camera::Initialize()
         sprintf(dummy, "MH_SetSyncChannelOffset error %d (%s). Aborted.", retcode, Errorstring);
         msgstr = dummy;
         LogMessage(msgstr);
-        goto fail;
+        return DEVICE_CAN_NOT_SET_PROPERTY;
     }
+    applied.syncOffset = 0;
 
     // WE ADDED THIS BIT! >>>  WAS 1,0,1,1
-    retcode = MH_SetMarkerEdges(dev[0], 1, 0, 1, 1);
+    //Markers only exist in the TTTR modes
+    bool markers = measMode != MODE_HIST;
+    retcode = (!markers || (cached && applied.markers)) ? 0 : MH_SetMarkerEdges(dev[0], 1, 0, 1, 1);
     if (retcode < 0)
     {
         MH_GetErrorString(Errorstring, retcode);
@@ -665,13 +1240,17 @@ int MH_camera::Initialize()
         sprintf(dummy, "MH_SetMarkerEdges error % d(% s).Aborted.\n", retcode, Errorstring);
         msgstr = dummy;
         LogMessage(msgstr);
-        goto fail;
+        return DEVICE_CAN_NOT_SET_PROPERTY;
     }
+    applied.markers = markers;
     // <<<WE ADDED THIS BIT!
 
     for (int i = 0; i < NumChannels; i++) //Uses the same input offset for all channels
     {
-        retcode = MH_SetInputEdgeTrg(dev[0], i, InputTriggerLevel, InputTriggerEdge);
+        if (cached && applied.inputLevel[i] == InputTriggerLevel && applied.inputEdge[i] == InputTriggerEdge)
+            retcode = 0;
+        else
+            retcode = MH_SetInputEdgeTrg(dev[0], i, InputTriggerLevel, InputTriggerEdge);
         if (retcode < 0)
         {
             MH_GetErrorString(Errorstring, retcode);
@@ -679,11 +1258,15 @@ int MH_camera::Initialize()
             sprintf(dummy, "MH_SetInputEdgeTrg error %d (%s). Aborted.", retcode, Errorstring);
             msgstr = dummy;
             LogMessage(msgstr);
-            goto fail;
+            return DEVICE_CAN_NOT_SET_PROPERTY;
         }
+        applied.inputLevel[i] = InputTriggerLevel;
+        applied.inputEdge[i] = InputTriggerEdge;
 
         //int hardcoded_init_offsets[6] = {0,1,2,3,4,5,6,7};
 
+        if (cached && applied.inputOffset[i] == hardcoded_init_offsets[i])
+            continue;
         retcode = MH_SetInputChannelOffset(dev[0], i, hardcoded_init_offsets[i]);
         if (retcode < 0)
         {
@@ -692,15 +1275,18 @@ int MH_camera::Initialize()
             sprintf(dummy, "MH_SetInputChannelOffset error %d (%s). Aborted.", retcode, Errorstring);
             msgstr = dummy;
             LogMessage(msgstr);
-            goto fail;
+            return DEVICE_CAN_NOT_SET_PROPERTY;
         }
         else {
             char dummy[100];
             sprintf(dummy, "Input channel %d offset set to %d.", i, hardcoded_init_offsets[i]);
             msgstr = dummy;
             LogMessage(msgstr);
+            applied.inputOffset[i] = hardcoded_init_offsets[i];
         }
 
+        if (cached && applied.inputEnabled[i])
+            continue;
         retcode = MH_SetInputChannelEnable(dev[0], i, 1);
         if (retcode < 0)
         {
@@ -709,13 +1295,15 @@ int MH_camera::Initialize()
             sprintf(dummy, "MH_SetInputChannelEnable error %d (%s). Aborted.", retcode, Errorstring);
             msgstr = dummy;
             LogMessage(msgstr);
-            goto fail;
+            return DEVICE_CAN_NOT_SET_PROPERTY;
         }
+        applied.inputEnabled[i] = true;
     }
 
-    if (Mode != MODE_T2)
+    if (measMode != MODE_T2)
     {
-        retcode = MH_SetBinning(dev[0], Binning);
+        int offset = offsets.empty() ? Offset : (int)offsets[0];
+        retcode = (cached && applied.binning == Binning) ? 0 : MH_SetBinning(dev[0], Binning);
         if (retcode < 0)
         {
             MH_GetErrorString(Errorstring, retcode);
@@ -723,10 +1311,11 @@ int MH_camera::Initialize()
             sprintf(dummy, "MH_SetBinning error %d (%s). Aborted.", retcode, Errorstring);
             msgstr = dummy;
             LogMessage(msgstr);
-            goto fail;
+            return DEVICE_CAN_NOT_SET_PROPERTY;
         }
+        applied.binning = Binning;
 
-        retcode = MH_SetOffset(dev[0], Offset);
+        retcode = (cached && applied.offset == offset) ? 0 : MH_SetOffset(dev[0], offset);
         if (retcode < 0)
         {
             MH_GetErrorString(Errorstring, retcode);
@@ -734,123 +1323,63 @@ int MH_camera::Initialize()
             sprintf(dummy, "MH_SetOffset error %d (%s). Aborted.", retcode, Errorstring);
             msgstr = dummy;
             LogMessage(msgstr);
-            goto fail;
-
+            return DEVICE_CAN_NOT_SET_PROPERTY;
         }
+        applied.offset = offset;
     }
+    g_MultiHarp.configValid = true;
+    return DEVICE_OK;
+}
 
-    char gummy[100];
-    sprintf(gummy, "EARLY OUTPUT");
-    msgstr = gummy;
-    LogMessage(msgstr);
-
-    retcode = MH_GetResolution(dev[0], &Resolution);
+/**
+* Re-initializes the MultiHarp in another measurement mode: MODE_T3 for the
+* imaging modes, MODE_HIST for the on-device histogram. Nothing to do if it is
+* already in that mode.
+*/
+int MH_camera::SetMeasurementMode(int measMode)
+{
+    WaitForRateProbe();
+    if (measMode == Mode)
+        return DEVICE_OK;
+    if (tttrSource_ != TTTR_SOURCE_MULTIHARP)
+        return ERR_MH_MODE; //Offline sources only carry T3 records
+    char dummy[100];
+    Mode = -1; //Unknown until the new mode is fully set up, so a failure is retried next time
+    g_MultiHarp.mode = -1;
+    g_MultiHarp.configValid = false; //MH_Initialize resets every setting
+    MH_CloseDevice(dev[0]);
+    retcode = MH_OpenDevice(dev[0], HW_Serial);
+    if (retcode >= 0)
+        retcode = MH_Initialize(dev[0], measMode, 0);
     if (retcode < 0)
     {
         MH_GetErrorString(Errorstring, retcode);
-        char dummy[100];
-        sprintf(dummy, "MH_GetResolution error %d (%s). Aborted.", retcode, Errorstring);
-        msgstr = dummy;
-        LogMessage(msgstr);
-        goto fail;
-    }
-    else {
-        char dummy[100];
-        sprintf(dummy, "MH_GetResolution gave %1.0lfps", retcode);
+        sprintf(dummy, "MH_Initialize in mode %d error %d (%s).", measMode, retcode, Errorstring);
         msgstr = dummy;
         LogMessage(msgstr);
-
+        return ERR_MH_MODE;
     }
-
-    // After Init allow 150 ms for valid  count rate readings
-    // Subsequently you get new values after every 100ms
-    Sleep(150);
-
-    retcode = MH_GetSyncRate(dev[0], &Syncrate);
-    if (retcode < 0)
+    if (ApplyMultiHarpSettings(measMode) != DEVICE_OK)
+        return ERR_MH_MODE;
+    if (measMode == MODE_HIST)
     {
-        MH_GetErrorString(Errorstring, retcode);
-        char dummy[100];
-        sprintf(dummy, "MH_GetSyncRate error%d (%s). Aborted.", retcode, Errorstring);
-        msgstr = dummy;
-        LogMessage(msgstr);
-        goto fail;
+        retcode = MH_SetHistoLen(dev[0], MAXLENCODE, &histoLen_);
+        if (retcode < 0)
+        {
+            MH_GetErrorString(Errorstring, retcode);
+            sprintf(dummy, "MH_SetHistoLen error %d (%s).", retcode, Errorstring);
+            msgstr = dummy;
+            LogMessage(msgstr);
+            return ERR_MH_MODE;
+        }
+        deviceHisto_.assign((size_t)NumChannels * histoLen_, 0);
     }
-    else {
-        char dummy[100];
-        sprintf(dummy, "Sync rate: %1.0lf", retcode);
-        msgstr = dummy;
-        LogMessage(msgstr);
-    }
-
-
-    for (int i = 0; i < NumChannels; i++) // for all channels
-    {
-        sprintf(gummy, "Checking countrate on channel %d", i);
-        msgstr = gummy;
-        LogMessage(msgstr);
-
-        retcode = MH_GetCountRate(dev[0], i, &Countrate);
-        if (retcode < 0)
-        {
-            MH_GetErrorString(Errorstring, retcode);
-            char dummy[100];
-            sprintf(dummy, "MH_GetCountRate error %d (%s). Aborted.", retcode, Errorstring);
-            msgstr = dummy;
-            LogMessage(msgstr);
-            goto fail;
-        }
-        char dummy[100];
-        sprintf(dummy, "Countrate[%1d]=%1d/s", i, Countrate);
-        msgstr = dummy;
-        LogMessage(msgstr);
-    }
-
-    //after getting the count rates, we can check for warnings
-    retcode = MH_GetWarnings(dev[0], &warnings);
-    if (retcode < 0)
-    {
-        MH_GetErrorString(Errorstring, retcode);
-        char dummy[100];
-        sprintf(dummy, "MH_GetWarnings error %d (%s). Aborted.", retcode, Errorstring);
-        msgstr = dummy;
-        LogMessage(msgstr);
-        //Just warnings, not errors
-    }
-    if (warnings)
-    {
-        MH_GetWarningsText(dev[0], warningstext, warnings);
-        char dummy[100];
-        sprintf(dummy, "%s", warningstext);
-        msgstr = dummy;
-        LogMessage(msgstr);
-        //Just warnings, not errors
-    }
-    //Next step in example tttrmode.c is to start upon pressing return, so switch to generating MM UI stuff instead...
-
-    //Set default stored values for offsets and other per-channel bits (all to zero?)
-    for (int i = 0; i < NumChannels; i++) {
-        offsets.push_back(hardcoded_init_offsets[i]);
-    }
-
-////////////////////////////////////////////////////////
-
-    // synchronize all properties
-    // --------------------------
-    nRet = UpdateStatus();
-    if (nRet != DEVICE_OK)
-        return nRet;
-
-    LogMessage("UpdateStatus ok", false);
-
-    // initialize image buffer
-    GenerateEmptyImage(img_);
+    MH_GetResolution(dev[0], &Resolution);
+    Mode = measMode;
+    g_MultiHarp.mode = measMode;
+    sprintf(dummy, "MultiHarp initialized in mode %d", measMode);
+    LogMessage(dummy);
     return DEVICE_OK;
-
-    fail:
-    LogMessage("MultiHarp initialisation failure! Shutting down in MultiHarp device adapter...");
-    Shutdown();
-    return DEVICE_CAN_NOT_SET_PROPERTY;
 }
 
 /**
@@ -863,7 +1392,19 @@ int MH_camera::Initialize()
 */
 int MH_camera::Shutdown()
 {
+    if (initialized_) {
+        Scan_hub* pHub = static_cast<Scan_hub*>(GetParentHub());
+        if (pHub)
+            pHub->RegisterCamera(0);
+    }
     initialized_ = false;
+    WaitForRateProbe();
+    fifoRing_.Free();
+    tttrFile_.Free();
+    framePool_.Free();
+    acqPixels_ = 0;
+    FreeDecayCube();
+    replay_.Close();
     return DEVICE_OK;
 }
 
@@ -889,14 +1430,17 @@ int MH_camera::SnapImage()
     if (!fastImage_)
     {
         LogMessage("Was !fastImage_", false);
-        start_acq();
+        //Blocks until the measurement (or a synchronized frame) is done, no further wait needed
+        int ret = (mode_ == MODE_MH_DEVICE_HISTO) ? AcquireDeviceHistogram(exp) : start_acq();
+        if (ret != DEVICE_OK)
+            return ret;
         GenerateSyntheticImage(img_, exp);
     }
 
     MM::MMTime s0(0, 0);
     if (s0 < startTime)
     {
-        while (exp > (GetCurrentMMTime() - startTime).getMsec())
+        while (fastImage_ && exp > (GetCurrentMMTime() - startTime).getMsec())
         {
             CDeviceUtils::SleepMs(1);
         }
@@ -929,10 +1473,85 @@ const unsigned char* MH_camera::GetImageBuffer()
     MMThreadGuard g(imgPixelsLock_);
     MM::MMTime readoutTime(readoutUs_);
     while (readoutTime > (GetCurrentMMTime() - readoutStartTime_)) {}
+    if (UsingFramePool()) {
+        const unsigned char* pShown = framePool_.Shown();
+        if (pShown)
+            return pShown;
+    }
     unsigned char* pB = (unsigned char*)(img_.GetPixels());
     return pB;
 }
 
+/**
+* The measuring modes bin into framePool_ instead of img_; img_ still holds
+* the geometry and the test/histogram patterns.
+*/
+bool MH_camera::UsingFramePool() const
+{
+    return (mode_ == MODE_MH_IMAGE || mode_ == MODE_MH_FLIM || mode_ == MODE_MH_PHASOR)
+        && acqPixels_ != 0 && framePool_.Matches(img_.Width(), img_.Height(), img_.Depth());
+}
+
+/**
+* Returns pixel data for one channel. Channel 0 is the intensity image, the
+* FLIM and phasor modes add the lifetime summaries as further channels.
+*/
+const unsigned char* MH_camera::GetImageBuffer(unsigned channelNr)
+{
+    if (channelNr == 0)
+        return GetImageBuffer();
+    if (channelNr >= GetNumberOfChannels())
+        return 0;
+    MMThreadGuard g(imgPixelsLock_);
+    if (mode_ == MODE_MH_IMAGE) {
+        ImgBuffer& gate = gateImages_[channelNr - 1];
+        if (gate.Width() != img_.Width() || gate.Height() != img_.Height() || gate.Depth() != img_.Depth()) {
+            //Nothing gated yet (or since the geometry changed)
+            gate.Resize(img_.Width(), img_.Height(), img_.Depth());
+            gate.ResetPixels();
+        }
+        return gate.GetPixels();
+    }
+    return flimSummary_[SummaryIndex(channelNr)].GetPixels();
+}
+
+unsigned MH_camera::GetNumberOfChannels() const
+{
+    if (mode_ == MODE_MH_FLIM)
+        return 1 + FLIM_N_SUMMARY;
+    if (mode_ == MODE_MH_PHASOR)
+        return 3;
+    if (mode_ == MODE_MH_IMAGE)
+        return 1 + (unsigned)nGates_;
+    return 1;
+}
+
+int MH_camera::GetChannelName(unsigned channel, char* name)
+{
+    if (channel >= GetNumberOfChannels())
+        return DEVICE_NONEXISTENT_CHANNEL;
+    if (mode_ == MODE_MH_FLIM)
+        CDeviceUtils::CopyLimitedString(name, g_Flim_Channel_Names[channel]);
+    else if (mode_ == MODE_MH_PHASOR)
+        CDeviceUtils::CopyLimitedString(name, g_Phasor_Channel_Names[channel]);
+    else if (nGates_ > 0 && channel == 0)
+        CDeviceUtils::CopyLimitedString(name, "Intensity");
+    else if (nGates_ > 0)
+        sprintf(name, "Gate %u", channel);
+    else
+        CDeviceUtils::CopyLimitedString(name, "");
+    return DEVICE_OK;
+}
+
+/**
+* flimSummary_ slot behind a summary channel (channel > 0). The phasor mode
+* has no mean arrival time image, so its g and s share the FLIM slots.
+*/
+int MH_camera::SummaryIndex(unsigned channel) const
+{
+    return (mode_ == MODE_MH_PHASOR) ? (int)channel : (int)channel - 1;
+}
+
 /**
 * Returns image buffer X-size in pixels.
 * Required by the MM::Camera API.
@@ -1002,6 +1621,7 @@ int MH_camera::SetROI(unsigned x, unsigned y, unsigned xSize, unsigned ySize)
     multiROIYs_.clear();
     multiROIWidths_.clear();
     multiROIHeights_.clear();
+    ++roiGeneration_;
     if (xSize == 0 && ySize == 0)
     {
         // effectively clear ROI
@@ -1044,6 +1664,7 @@ int MH_camera::ClearROI()
     ResizeImageBuffer();
     roiX_ = 0;
     roiY_ = 0;
+    ++roiGeneration_;
     multiROIXs_.clear();
     multiROIYs_.clear();
     multiROIWidths_.clear();
@@ -1134,6 +1755,7 @@ int MH_camera::SetMultiROI(const unsigned int* xs, const unsigned int* ys,
     img_.Resize(maxX - minX, maxY - minY);
     roiX_ = minX;
     roiY_ = minY;
+    ++roiGeneration_;
     return DEVICE_OK;
 }
 
@@ -1361,60 +1983,150 @@ int MH_camera::StartSequenceAcquisition(long numImages, double interval_ms, bool
 {
     if (IsCapturing())
         return DEVICE_CAMERA_BUSY_ACQUIRING;
+    liveSequence_ = (numImages == LONG_MAX);
 
     int ret = GetCoreCallback()->PrepareForAcq(this);
     if (ret != DEVICE_OK)
         return ret;
     sequenceStartTime_ = GetCurrentMMTime();
     imageCounter_ = 0;
+    BuildMetadataTemplate();
     thd_->Start(numImages, interval_ms);
     stopOnOverflow_ = stopOnOverflow;
     return DEVICE_OK;
 }
 
+/**
+* Value of a lifetime summary pixel at the top of its range: the integer
+* maximum for 8/16 bit, 1.0 for the float32 "32bit" type.
+*/
+static double SummaryFullScale(unsigned depth)
+{
+    switch (depth) {
+    case 1:
+        return 255.0;
+    case 4:
+        return 1.0;
+    default:
+        return 65535.0;
+    }
+}
+
+/**
+* Fills mdTemplate_ with the metadata that can't change while a sequence runs
+* (camera label, ROI, binning, gate windows, lifetime scaling), so that
+* InsertImage() doesn't look up properties or convert them for every frame.
+*/
+void MH_camera::BuildMetadataTemplate()
+{
+    char label[MM::MaxStrLength];
+    this->GetLabel(label);
+
+    mdTemplate_.Clear();
+    mdTemplate_.put("Camera", label);
+    mdTemplate_.put(MM::g_Keyword_Metadata_ROI_X, CDeviceUtils::ConvertToString((long)roiX_));
+    mdTemplate_.put(MM::g_Keyword_Metadata_ROI_Y, CDeviceUtils::ConvertToString((long)roiY_));
+    mdTemplate_.put(MM::g_Keyword_Binning, CDeviceUtils::ConvertToString(binSize_));
+
+    if (mode_ == MODE_MH_IMAGE) {
+        for (long gate = 0; gate < nGates_; gate++) {
+            char gateName[MM::MaxStrLength];
+            sprintf(gateName, "Gate%ld-WindowPs", gate + 1);
+            mdTemplate_.put(gateName, gateWindows_[gate].c_str());
+        }
+    }
+    if (mode_ == MODE_MH_FLIM || mode_ == MODE_MH_PHASOR) {
+        //Scaling needed to turn the summary channels back into physical values
+        double maxValue = SummaryFullScale(img_.Depth());
+        if (mode_ == MODE_MH_FLIM) {
+            mdTemplate_.put("FLIM-TimeBins", CDeviceUtils::ConvertToString((long)flimBins_));
+            mdTemplate_.put("FLIM-BinWidthPs", CDeviceUtils::ConvertToString(flimBinWidthPs_));
+            mdTemplate_.put("FLIM-MeanArrivalPsPerCount", CDeviceUtils::ConvertToString(flimBinWidthPs_ * flimBins_ / maxValue));
+        }
+        mdTemplate_.put("FLIM-PhasorFullScale", CDeviceUtils::ConvertToString(maxValue));
+    }
+}
+
 /*
  * Inserts Image and MetaData into MMCore circular Buffer
  */
-int MH_camera::InsertImage()
+int MH_camera::InsertImage(const unsigned char* pixels, bool preview)
 {
     MM::MMTime timeStamp = this->GetCurrentMMTime();
-    char label[MM::MaxStrLength];
-    this->GetLabel(label);
 
     // Important:  metadata about the image are generated here:
-    Metadata md;
-    md.put("Camera", label);
+    Metadata md(mdTemplate_);
 //    md.put(MM::g_Keyword_Metadata_StartTime, CDeviceUtils::ConvertToString(sequenceStartTime_.getMsec()));
     md.put(MM::g_Keyword_Elapsed_Time_ms, CDeviceUtils::ConvertToString((timeStamp - sequenceStartTime_).getMsec()));
-    md.put(MM::g_Keyword_Metadata_ROI_X, CDeviceUtils::ConvertToString((long)roiX_));
-    md.put(MM::g_Keyword_Metadata_ROI_Y, CDeviceUtils::ConvertToString((long)roiY_));
 
-    imageCounter_++;
-
-    char buf[MM::MaxStrLength];
-    GetProperty(MM::g_Keyword_Binning, buf);
-    md.put(MM::g_Keyword_Binning, buf);
+    //Live previews are partial copies of the frame still integrating, not images of their own
+    md.put("MH-PartialFrame", preview ? "1" : "0");
+    if (!preview)
+        imageCounter_++;
+
+    //Pipeline health so short or dim frames can be explained after the fact
+    md.put("MH-RecordsPerSecond", CDeviceUtils::ConvertToString(StatRecordRate()));
+    md.put("MH-PhotonsBinned", CDeviceUtils::ConvertToString((double)statPhotonsBinned_.load(std::memory_order_relaxed)));
+    md.put("MH-PhotonsDroppedFlyback", CDeviceUtils::ConvertToString((double)statDroppedFlyback_.load(std::memory_order_relaxed)));
+    md.put("MH-PhotonsDroppedNoFrame", CDeviceUtils::ConvertToString((double)statDroppedNoFrame_.load(std::memory_order_relaxed)));
+    md.put("MH-FifoReadHighWater", CDeviceUtils::ConvertToString(statFifoReadHighWater_.load(std::memory_order_relaxed)));
+    md.put("MH-RingHighWater", CDeviceUtils::ConvertToString(fifoRing_.HighWater()));
+    md.put("MH-DecodeNsPerRecord", CDeviceUtils::ConvertToString(StatDecodeNsPerRecord()));
+    md.put("MH-DiskMBps", CDeviceUtils::ConvertToString(StatDiskMBps()));
+    //Galvo property sequences can change the geometry mid-sequence
+    md.put("ScanGeometryVersion", CDeviceUtils::ConvertToString((long)geometryVersion_));
 
     MMThreadGuard g(imgPixelsLock_);
 
-    const unsigned char* pI;
-    pI = GetImageBuffer();
-
     unsigned int w = GetImageWidth();
     unsigned int h = GetImageHeight();
     unsigned int b = GetImageBytesPerPixel();
 
-    int ret = GetCoreCallback()->InsertImage(this, pI, w, h, b, nComponents_, md.Serialize().c_str());
-    if (!stopOnOverflow_ && ret == DEVICE_BUFFER_OVERFLOW)
+    int ret = DEVICE_OK;
+    unsigned nChannels = GetNumberOfChannels();
+    for (unsigned channel = 0; channel < nChannels && ret == DEVICE_OK; channel++)
     {
-        // do not stop on overflow - just reset the buffer
-        GetCoreCallback()->ClearImageBuffer(this);
-        // don't process this same image again...
-        return GetCoreCallback()->InsertImage(this, pI, w, h, b, nComponents_, md.Serialize().c_str(), false);
+        //The frame service thread passes the frame pool frame, which GetImageBuffer() may have moved on from
+        const unsigned char* pI = (channel == 0 && pixels != 0) ? pixels : GetImageBuffer(channel);
+        if (nChannels > 1)
+        {
+            char name[MM::MaxStrLength];
+            GetChannelName(channel, name);
+            md.put(MM::g_Keyword_CameraChannelIndex, CDeviceUtils::ConvertToString((long)channel));
+            md.put(MM::g_Keyword_CameraChannelName, name);
+        }
+
+        //The core copies the frame straight out of the frame pool (its only copy)
+        std::string serialized = md.Serialize();
+        ret = GetCoreCallback()->InsertImage(this, pI, w, h, b, nComponents_, serialized.c_str());
+        if (!stopOnOverflow_ && ret == DEVICE_BUFFER_OVERFLOW)
+        {
+            // do not stop on overflow - just reset the buffer
+            GetCoreCallback()->ClearImageBuffer(this);
+            // don't process this same image again...
+            ret = GetCoreCallback()->InsertImage(this, pI, w, h, b, nComponents_, serialized.c_str(), false);
+        }
     }
-    else
-    {
-        return ret;
+    return ret;
+}
+
+/**
+* Steps the trigger device, if one is set, ahead of the next frame. The
+* device has switched when this returns.
+*
+* In continuous sequences the later steps are host driven: FrameCompleted()
+* only counts them and the frame service thread fires them, so a step trails
+* the frame end by the FIFO, decode and service latency and the device can
+* switch partway into the next frame. Frame exact switching has to be stepped
+* in hardware, e.g. the frame clock wired to the device's trigger input.
+*/
+void MH_camera::FireTrigger()
+{
+    if (triggerDevice_.length() > 0) {
+        MM::Device* triggerDev = GetDevice(triggerDevice_.c_str());
+        if (triggerDev != 0) {
+            triggerDev->SetProperty("Trigger", "+");
+        }
     }
 }
 
@@ -1427,13 +2139,17 @@ int MH_camera::RunSequenceOnThread(MM::MMTime startTime)
     //SEQUENCE OR LIVE HERE?
     int ret = DEVICE_ERR;
 
-    // Trigger
-    if (triggerDevice_.length() > 0) {
-        MM::Device* triggerDev = GetDevice(triggerDevice_.c_str());
-        if (triggerDev != 0) {
-            LogMessage("trigger requested");
-            triggerDev->SetProperty("Trigger", "+");
-        }
+    // Trigger - continuous sequences step it again for every frame, from the frame service thread
+    if (triggerDevice_.length() > 0)
+        LogMessage("Stepping trigger device " + triggerDevice_);
+    FireTrigger();
+
+    if (continuousSequence_ && mode_ != MODE_MH_DEVICE_HISTO)
+    {
+        //Runs the whole sequence, frames go to InsertImage() from FrameCompleted()
+        LogMessage("Sequence continuous");
+        ret = start_acq(true);
+        return (ret != DEVICE_OK) ? ret : stream_ret_;
     }
 
     double exposure = GetSequenceExposure();
@@ -1441,13 +2157,15 @@ int MH_camera::RunSequenceOnThread(MM::MMTime startTime)
     if (!fastImage_)
     {
         LogMessage("Sequence non-fast");
-        start_acq();
+        ret = (mode_ == MODE_MH_DEVICE_HISTO) ? AcquireDeviceHistogram(exposure) : start_acq();
+        if (ret != DEVICE_OK)
+            return ret;
         GenerateSyntheticImage(img_, exposure);
     }
 
-    // Simulate exposure duration
+    // Simulate exposure duration - a real measurement has already taken it
     double finishTime = exposure * (imageCounter_ + 1);
-    while ((GetCurrentMMTime() - startTime).getMsec() < finishTime)
+    while (fastImage_ && (GetCurrentMMTime() - startTime).getMsec() < finishTime)
     {
         CDeviceUtils::SleepMs(1);
     }
@@ -1541,10 +2259,18 @@ int MySequenceThread::svc(void) throw()
     int ret = DEVICE_ERR;
     try
     {
-        do
+        camera_->stream_images_left_ = numImages_;
+        if (camera_->continuousSequence_)
         {
             ret = camera_->RunSequenceOnThread(startTime_);
-        } while (DEVICE_OK == ret && !IsStopped() && imageCounter_++ < numImages_ - 1);
+        }
+        else
+        {
+            do
+            {
+                ret = camera_->RunSequenceOnThread(startTime_);
+            } while (DEVICE_OK == ret && !IsStopped() && imageCounter_++ < numImages_ - 1);
+        }
         if (IsStopped())
             camera_->LogMessage("SeqAcquisition interrupted by the user\n");
     }
@@ -1559,1377 +2285,4420 @@ int MySequenceThread::svc(void) throw()
 
 
 ///////////////////////////////////////////////////////////////////////////////
-// MH_camera Action handlers
+// TTTRRing implementation
 ///////////////////////////////////////////////////////////////////////////////
 
-int MH_camera::OnMaxExposure(MM::PropertyBase* pProp, MM::ActionType eAct)
+TTTRRing::TTTRRing() :
+    nConsumers_(1),
+    highWater_(0)
 {
-    if (eAct == MM::BeforeGet)
-    {
-        pProp->Set(exposureMaximum_);
+    head_.value = 0;
+    for (int i = 0; i < MAX_CONSUMERS; i++) {
+        tails_[i].value = 0;
     }
-    else if (eAct == MM::AfterSet)
-    {
-        pProp->Get(exposureMaximum_);
+}
+
+TTTRRing::~TTTRRing()
+{
+    Free();
+}
+
+bool TTTRRing::Allocate(int nBlocks)
+{
+    if ((long)nBlocks == Capacity())
+        return true;
+    Free();
+    for (int i = 0; i < nBlocks; i++) {
+        TTTRBlock block;
+        block.records = (unsigned int*)_aligned_malloc(TTREADMAX * sizeof(unsigned int), CACHE_LINE_BYTES);
+        block.nRecords = 0;
+        block.last = false;
+        if (block.records == NULL) {
+            Free();
+            return false;
+        }
+        blocks_.push_back(block);
     }
-    return DEVICE_OK;
+    Reset(1);
+    return true;
 }
 
+void TTTRRing::Free()
+{
+    for (size_t i = 0; i < blocks_.size(); i++) {
+        _aligned_free(blocks_[i].records);
+    }
+    blocks_.clear();
+}
 
-/*
-* this Read Only property will update whenever any property is modified
+/**
+* Empties the ring. Only call this while no stage thread is running.
 */
-
-int MH_camera::OnTestProperty(MM::PropertyBase* pProp, MM::ActionType eAct, long indexx)
+void TTTRRing::Reset(int nConsumers)
 {
-    if (eAct == MM::BeforeGet)
-    {
-        pProp->Set(testProperty_[indexx]);
+    nConsumers_ = (std::min)(nConsumers, (int)MAX_CONSUMERS);
+    head_.value.store(0);
+    for (int i = 0; i < MAX_CONSUMERS; i++) {
+        tails_[i].value.store(0);
     }
-    else if (eAct == MM::AfterSet)
-    {
-        pProp->Get(testProperty_[indexx]);
+    highWater_.store(0);
+}
+
+uint64_t TTTRRing::MinTail() const
+{
+    uint64_t tail = tails_[0].value.load(std::memory_order_acquire);
+    for (int i = 1; i < nConsumers_; i++) {
+        tail = (std::min)(tail, tails_[i].value.load(std::memory_order_acquire));
     }
-    return DEVICE_OK;
+    return tail;
+}
 
+/**
+* Returns the next free block to fill, or NULL if every block is still held by a consumer.
+*/
+TTTRBlock* TTTRRing::AcquireWrite()
+{
+    uint64_t head = head_.value.load(std::memory_order_relaxed);
+    if (head - MinTail() >= blocks_.size())
+        return NULL;
+    TTTRBlock* block = &blocks_[head % blocks_.size()];
+    block->nRecords = 0;
+    block->last = false;
+    return block;
 }
 
+void TTTRRing::Publish()
+{
+    uint64_t head = head_.value.load(std::memory_order_relaxed) + 1;
+    head_.value.store(head, std::memory_order_release);
+    long inUse = (long)(head - MinTail());
+    if (inUse > highWater_.load(std::memory_order_relaxed)) {
+        highWater_.store(inUse, std::memory_order_relaxed);
+    }
+}
 
 /**
-* Handles "Binning" property.
+* Returns the next block this consumer has not seen yet, or NULL if it has caught up.
 */
-int MH_camera::OnBinning(MM::PropertyBase* pProp, MM::ActionType eAct)
+TTTRBlock* TTTRRing::AcquireRead(int consumer)
 {
-    int ret = DEVICE_ERR;
-    switch (eAct)
-    {
-    case MM::AfterSet:
-    {
-        if (IsCapturing())
-            return DEVICE_CAMERA_BUSY_ACQUIRING;
+    uint64_t tail = tails_[consumer].value.load(std::memory_order_relaxed);
+    if (tail == head_.value.load(std::memory_order_acquire))
+        return NULL;
+    return &blocks_[tail % blocks_.size()];
+}
 
-        // the user just set the new value for the property, so we have to
-        // apply this value to the 'hardware'.
-        long binFactor;
-        pProp->Get(binFactor);
-        if (binFactor > 0 && binFactor < 10)
-        {
-            // calculate ROI using the previous bin settings
-            double factor = (double)binFactor / (double)binSize_;
-            roiX_ = (unsigned int)(roiX_ / factor);
-            roiY_ = (unsigned int)(roiY_ / factor);
-            for (unsigned int i = 0; i < multiROIXs_.size(); ++i)
-            {
-                multiROIXs_[i] = (unsigned int)(multiROIXs_[i] / factor);
-                multiROIYs_[i] = (unsigned int)(multiROIYs_[i] / factor);
-                multiROIWidths_[i] = (unsigned int)(multiROIWidths_[i] / factor);
-                multiROIHeights_[i] = (unsigned int)(multiROIHeights_[i] / factor);
-            }
-            img_.Resize((unsigned int)(img_.Width() / factor),
-                (unsigned int)(img_.Height() / factor));
-            binSize_ = binFactor;
-            std::ostringstream os;
-            os << binSize_;
-            OnPropertyChanged("Binning", os.str().c_str());
-            ret = DEVICE_OK;
-        }
-    }break;
-    case MM::BeforeGet:
+void TTTRRing::Release(int consumer)
+{
+    uint64_t tail = tails_[consumer].value.load(std::memory_order_relaxed);
+    tails_[consumer].value.store(tail + 1, std::memory_order_release);
+}
+
+long TTTRRing::Occupancy() const
+{
+    return (long)(head_.value.load(std::memory_order_acquire) - MinTail());
+}
+
+int FifoReaderThread::svc(void) throw()
+{
+    int ret = DEVICE_ERR;
+    try
     {
-        ret = DEVICE_OK;
-        pProp->Set(binSize_);
-    }break;
-    default:
-        break;
+        ret = camera_->ReadFifoOnThread();
+    }
+    catch (...) {
+        camera_->LogMessage(g_Msg_EXCEPTION_IN_THREAD, false);
     }
     return ret;
 }
 
-/**
-* Handles "PixelType" property.
-*/
-int MH_camera::OnPixelType(MM::PropertyBase* pProp, MM::ActionType eAct)
+int TTTRWriterThread::svc(void) throw()
 {
     int ret = DEVICE_ERR;
-    switch (eAct)
-    {
-    case MM::AfterSet:
+    try
     {
-        if (IsCapturing())
-            return DEVICE_CAMERA_BUSY_ACQUIRING;
+        ret = camera_->WriteTTTROnThread();
+    }
+    catch (...) {
+        camera_->LogMessage(g_Msg_EXCEPTION_IN_THREAD, false);
+    }
+    return ret;
+}
 
-        string pixelType;
-        pProp->Get(pixelType);
+int FrameServiceThread::svc(void) throw()
+{
+    int ret = DEVICE_ERR;
+    try
+    {
+        ret = camera_->ServiceFramesOnThread();
+    }
+    catch (...) {
+        camera_->LogMessage(g_Msg_EXCEPTION_IN_THREAD, false);
+    }
+    return ret;
+}
 
-        if (pixelType.compare(g_PixelType_8bit) == 0)
+int RateProbeThread::svc(void) throw()
+{
+    int ret = DEVICE_ERR;
+    try
+    {
+        ret = camera_->ProbeRates(settle_);
+    }
+    catch (...) {
+        camera_->LogMessage(g_Msg_EXCEPTION_IN_THREAD, false);
+    }
+    return ret;
+}
+
+int BinWorkerThread::svc(void) throw()
+{
+    int ret = DEVICE_ERR;
+    try
+    {
+        ret = camera_->BinOnWorker(index_);
+    }
+    catch (...) {
+        camera_->LogMessage(g_Msg_EXCEPTION_IN_THREAD, false);
+    }
+    return ret;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// TTTRFileWriter implementation
+///////////////////////////////////////////////////////////////////////////////
+
+//PTU tag types and record type, from the PicoQuant file format demos
+#define PTU_TY_EMPTY8                   0xFFFF0008
+#define PTU_TY_INT8                     0x10000008
+#define PTU_TY_FLOAT8                   0x20000008
+#define PTU_TY_TDATETIME                0x21000008
+#define PTU_TY_ANSISTRING               0x4001FFFF
+#define PTU_RT_MULTIHARP_T3             0x00010307
+
+static void PtuTag(std::vector<unsigned char>& hdr, const char* ident, int idx, unsigned int type, const void* value)
+{
+    char name[32];
+    memset(name, 0, sizeof(name));
+    strncpy(name, ident, sizeof(name) - 1);
+    hdr.insert(hdr.end(), (unsigned char*)name, (unsigned char*)name + sizeof(name));
+    hdr.insert(hdr.end(), (unsigned char*)&idx, (unsigned char*)&idx + 4);
+    hdr.insert(hdr.end(), (unsigned char*)&type, (unsigned char*)&type + 4);
+    hdr.insert(hdr.end(), (const unsigned char*)value, (const unsigned char*)value + 8);
+}
+
+static void PtuInt(std::vector<unsigned char>& hdr, const char* ident, int idx, int64_t value)
+{
+    PtuTag(hdr, ident, idx, PTU_TY_INT8, &value);
+}
+
+static void PtuFloat(std::vector<unsigned char>& hdr, const char* ident, int idx, double value, unsigned int type = PTU_TY_FLOAT8)
+{
+    PtuTag(hdr, ident, idx, type, &value);
+}
+
+static void PtuString(std::vector<unsigned char>& hdr, const char* ident, const std::string& value, size_t length)
+{
+    int64_t len = (int64_t)length;
+    PtuTag(hdr, ident, -1, PTU_TY_ANSISTRING, &len);
+    size_t start = hdr.size();
+    hdr.resize(start + length, 0);
+    memcpy(&hdr[start], value.c_str(), (std::min)(value.size(), length - 1));
+}
+
+TTTRFileWriter::TTTRFileWriter() :
+    current_(0),
+    header_(NULL),
+    headerBytes_(0),
+    recordCountPos_(0),
+    file_(INVALID_HANDLE_VALUE),
+    rolloverBytes_(0),
+    fileOffset_(0),
+    partRecords_(0),
+    part_(0),
+    lastError_(0)
+{
+    for (int i = 0; i < N_TTTR_WRITE_BUFFERS; i++) {
+        buffers_[i].data = NULL;
+        buffers_[i].used = 0;
+        buffers_[i].pending = false;
+        memset(&buffers_[i].ov, 0, sizeof(OVERLAPPED));
+    }
+}
+
+TTTRFileWriter::~TTTRFileWriter()
+{
+    Free();
+}
+
+bool TTTRFileWriter::Allocate()
+{
+    if (header_)
+        return true;
+    header_ = (unsigned char*)_aligned_malloc(TTTR_HEADER_MAX_BYTES, TTTR_SECTOR_BYTES);
+    if (header_ == NULL)
+        return false;
+    for (int i = 0; i < N_TTTR_WRITE_BUFFERS; i++) {
+        buffers_[i].data = (unsigned char*)_aligned_malloc(TTTR_WRITE_BUFFER_BYTES, TTTR_SECTOR_BYTES);
+        buffers_[i].ov.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+        if (buffers_[i].data == NULL || buffers_[i].ov.hEvent == NULL) {
+            Free();
+            return false;
+        }
+    }
+    return true;
+}
+
+void TTTRFileWriter::Free()
+{
+    if (IsOpen())
+        Close();
+    for (int i = 0; i < N_TTTR_WRITE_BUFFERS; i++) {
+        if (buffers_[i].data)
+            _aligned_free(buffers_[i].data);
+        if (buffers_[i].ov.hEvent)
+            CloseHandle(buffers_[i].ov.hEvent);
+        buffers_[i].data = NULL;
+        buffers_[i].ov.hEvent = NULL;
+    }
+    if (header_)
+        _aligned_free(header_);
+    header_ = NULL;
+}
+
+bool TTTRFileWriter::Open(const std::string& basePath, const HeaderInfo& info, uint64_t rolloverBytes)
+{
+    if (header_ == NULL || IsOpen())
+        return false;
+    basePath_ = basePath;
+    info_ = info;
+    //Whole staging buffers per file, and at least one
+    rolloverBytes_ = rolloverBytes ? (std::max)(rolloverBytes - rolloverBytes % TTTR_WRITE_BUFFER_BYTES, (uint64_t)TTTR_WRITE_BUFFER_BYTES) : 0;
+    part_ = 0;
+    return OpenPart();
+}
+
+bool TTTRFileWriter::OpenPart()
+{
+    char suffix[32];
+    if (part_ == 0)
+        sprintf(suffix, ".ptu");
+    else
+        sprintf(suffix, "_part%03d.ptu", part_);
+    path_ = basePath_ + suffix;
+
+    file_ = CreateFileA(path_.c_str(), GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS,
+        FILE_ATTRIBUTE_NORMAL | FILE_FLAG_NO_BUFFERING | FILE_FLAG_OVERLAPPED, NULL);
+    if (file_ == INVALID_HANDLE_VALUE)
+        return Fail();
+
+    partRecords_ = 0;
+    current_ = 0;
+    for (int i = 0; i < N_TTTR_WRITE_BUFFERS; i++) {
+        buffers_[i].used = 0;
+        buffers_[i].pending = false;
+    }
+
+    //Header goes out first with a zero record count, ClosePart() rewrites it
+    BuildHeader();
+    fileOffset_ = 0;
+    OVERLAPPED ov;
+    memset(&ov, 0, sizeof(ov));
+    ov.hEvent = buffers_[0].ov.hEvent;
+    ResetEvent(ov.hEvent);
+    DWORD written = 0;
+    if (!WriteFile(file_, header_, (DWORD)headerBytes_, NULL, &ov) && GetLastError() != ERROR_IO_PENDING)
+        return Fail();
+    if (!GetOverlappedResult(file_, &ov, &written, TRUE) || written != headerBytes_)
+        return Fail();
+    fileOffset_ = headerBytes_;
+    return true;
+}
+
+/**
+* Lays out the PTU header in header_, padded with a File_Comment string so the
+* records start on a sector boundary.
+*/
+void TTTRFileWriter::BuildHeader()
+{
+    std::vector<unsigned char> hdr;
+    const char magic[8] = { 'P', 'Q', 'T', 'T', 'T', 'R', 0, 0 };
+    const char version[8] = { '1', '.', '0', '.', '0', '0', 0, 0 };
+    hdr.insert(hdr.end(), magic, magic + 8);
+    hdr.insert(hdr.end(), version, version + 8);
+
+    //TDateTime - days since 30/12/1899
+    PtuFloat(hdr, "File_CreatingTime", -1, (double)time(NULL) / 86400.0 + 25569.0, PTU_TY_TDATETIME);
+    PtuString(hdr, "CreatorSW_Name", "Micro-Manager MHCam", 24);
+    PtuString(hdr, "HW_Type", info_.hwModel, 32);
+    PtuString(hdr, "HW_PartNo", info_.hwPartNo, 16);
+    PtuString(hdr, "HW_Version", info_.hwVersion, 16);
+    PtuString(hdr, "HW_SerialNo", info_.hwSerial, 16);
+    PtuString(hdr, "HW_LibVersion", info_.libVersion, 16);
+    PtuInt(hdr, "HW_InpChannels", -1, (int64_t)info_.offsetsPs.size());
+    PtuInt(hdr, "Measurement_Mode", -1, 3); //T3
+    PtuInt(hdr, "Measurement_SubMode", -1, 3); //Imaging, markers carry the scan
+    PtuInt(hdr, "TTResultFormat_TTTRRecType", -1, PTU_RT_MULTIHARP_T3);
+    PtuInt(hdr, "TTResultFormat_BitsPerRecord", -1, 32);
+    PtuFloat(hdr, "MeasDesc_Resolution", -1, info_.resolutionPs * 1e-12);
+    PtuFloat(hdr, "MeasDesc_GlobalResolution", -1, info_.syncRate > 0 ? (double)info_.syncDivider / info_.syncRate : 0.0);
+    PtuInt(hdr, "MeasDesc_BinningFactor", -1, (int64_t)1 << info_.binning);
+    PtuInt(hdr, "TTResult_SyncRate", -1, info_.syncRate);
+    PtuInt(hdr, "TTResult_StopAfter", -1, info_.tacqMs);
+    PtuInt(hdr, "HWSync_Divider", -1, info_.syncDivider);
+    for (size_t i = 0; i < info_.offsetsPs.size(); i++) {
+        PtuInt(hdr, "HWInpChan_Offset", (int)i, info_.offsetsPs[i]);
+    }
+    recordCountPos_ = hdr.size() + 40; //Value field of the next tag
+    PtuInt(hdr, "TTResult_NumberOfRecords", -1, 0);
+
+    //Comment tag + its text + Header_End must round the header up to whole sectors
+    const size_t tagBytes = 48;
+    size_t fixed = hdr.size() + 2 * tagBytes;
+    size_t total = ((fixed + 8 + TTTR_SECTOR_BYTES - 1) / TTTR_SECTOR_BYTES) * TTTR_SECTOR_BYTES;
+    PtuString(hdr, "File_Comment", "Written by the MHCam device adapter", total - fixed);
+    int64_t empty = 0;
+    PtuTag(hdr, "Header_End", -1, PTU_TY_EMPTY8, &empty);
+
+    headerBytes_ = (std::min)(hdr.size(), (size_t)TTTR_HEADER_MAX_BYTES);
+    memcpy(header_, &hdr[0], headerBytes_);
+}
+
+/**
+* Copies records into the staging buffers, handing each full buffer to the OS
+* as one overlapped write. Only blocks if all buffers are still in flight.
+*/
+bool TTTRFileWriter::Append(const unsigned int* records, int nRecords)
+{
+    if (!IsOpen())
+        return false;
+    const unsigned char* src = (const unsigned char*)records;
+    size_t bytes = (size_t)nRecords * sizeof(unsigned int);
+    while (bytes) {
+        if (rolloverBytes_ && fileOffset_ - headerBytes_ >= rolloverBytes_) {
+            if (!ClosePart())
+                return false;
+            part_++;
+            if (!OpenPart())
+                return false;
+        }
+        WriteBuffer& buffer = buffers_[current_];
+        if (buffer.pending && !WaitWrite(buffer))
+            return false;
+        size_t n = (std::min)(bytes, (size_t)TTTR_WRITE_BUFFER_BYTES - buffer.used);
+        memcpy(buffer.data + buffer.used, src, n);
+        buffer.used += n;
+        src += n;
+        bytes -= n;
+        partRecords_ += n / sizeof(unsigned int);
+        if (buffer.used == TTTR_WRITE_BUFFER_BYTES) {
+            if (!IssueWrite(buffer, TTTR_WRITE_BUFFER_BYTES))
+                return false;
+            current_ = (current_ + 1) % N_TTTR_WRITE_BUFFERS;
+        }
+    }
+    return true;
+}
+
+bool TTTRFileWriter::IssueWrite(WriteBuffer& buffer, DWORD bytes)
+{
+    buffer.ov.Offset = (DWORD)(fileOffset_ & 0xFFFFFFFF);
+    buffer.ov.OffsetHigh = (DWORD)(fileOffset_ >> 32);
+    ResetEvent(buffer.ov.hEvent);
+    if (!WriteFile(file_, buffer.data, bytes, NULL, &buffer.ov) && GetLastError() != ERROR_IO_PENDING)
+        return Fail();
+    buffer.pending = true;
+    fileOffset_ += bytes;
+    return true;
+}
+
+bool TTTRFileWriter::WaitWrite(WriteBuffer& buffer)
+{
+    DWORD written = 0;
+    buffer.pending = false;
+    buffer.used = 0;
+    if (!GetOverlappedResult(file_, &buffer.ov, &written, TRUE))
+        return Fail();
+    return true;
+}
+
+/**
+* Flushes the partial buffer (padded to a sector), rewrites the header with
+* the record count and trims the padding off through a buffered handle.
+*/
+bool TTTRFileWriter::ClosePart()
+{
+    bool ok = true;
+    WriteBuffer& tail = buffers_[current_];
+    if (tail.pending)
+        ok = WaitWrite(tail) && ok;
+    uint64_t dataEnd = fileOffset_ + tail.used;
+    if (ok && tail.used) {
+        size_t padded = ((tail.used + TTTR_SECTOR_BYTES - 1) / TTTR_SECTOR_BYTES) * TTTR_SECTOR_BYTES;
+        memset(tail.data + tail.used, 0, padded - tail.used);
+        ok = IssueWrite(tail, (DWORD)padded);
+    }
+    for (int i = 0; i < N_TTTR_WRITE_BUFFERS; i++) {
+        if (buffers_[i].pending)
+            ok = WaitWrite(buffers_[i]) && ok;
+    }
+
+    if (ok) {
+        int64_t nRecords = (int64_t)partRecords_;
+        memcpy(header_ + recordCountPos_, &nRecords, sizeof(nRecords));
+        OVERLAPPED ov;
+        memset(&ov, 0, sizeof(ov));
+        ov.hEvent = buffers_[0].ov.hEvent;
+        ResetEvent(ov.hEvent);
+        DWORD written = 0;
+        if ((!WriteFile(file_, header_, (DWORD)headerBytes_, NULL, &ov) && GetLastError() != ERROR_IO_PENDING)
+            || !GetOverlappedResult(file_, &ov, &written, TRUE))
+            ok = Fail();
+    }
+    CloseHandle(file_);
+    file_ = INVALID_HANDLE_VALUE;
+
+    HANDLE trim = CreateFileA(path_.c_str(), GENERIC_WRITE, 0, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (trim == INVALID_HANDLE_VALUE)
+        return Fail();
+    LARGE_INTEGER end;
+    end.QuadPart = (LONGLONG)dataEnd;
+    if (!SetFilePointerEx(trim, end, NULL, FILE_BEGIN) || !SetEndOfFile(trim))
+        ok = Fail();
+    CloseHandle(trim);
+    return ok;
+}
+
+bool TTTRFileWriter::Close()
+{
+    if (!IsOpen())
+        return false;
+    return ClosePart();
+}
+
+bool TTTRFileWriter::Fail()
+{
+    lastError_ = GetLastError();
+    return false;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// TTTRReplaySource implementation
+///////////////////////////////////////////////////////////////////////////////
+
+#define PTU_TY_WIDESTRING               0x4002FFFF
+#define PTU_TY_BINARYBLOB               0xFFFFFFFF
+#define T3_OVERFLOW_RECORD              0xFE000000 //Special bit + channel 63, nsync holds the count
+#define T3_WRAPAROUND                   1024
+
+TTTRReplaySource::TTTRReplaySource() :
+    file_(0),
+    dataStart_(0),
+    fileHasRecords_(false),
+    seamOverflow_(false),
+    globalResolutionPs_(0),
+    resolutionPs_(0),
+    synthetic_(false),
+    rng_(0x9E3779B97F4A7C15ULL),
+    overflows_(0),
+    nextPhoton_(0),
+    frameStart_(0),
+    markerIndex_(0)
+{
+    memset(&config_, 0, sizeof(config_));
+}
+
+TTTRReplaySource::~TTTRReplaySource()
+{
+    Close();
+}
+
+bool TTTRReplaySource::OpenFile(const std::string& path)
+{
+    Close();
+    file_ = fopen(path.c_str(), "rb");
+    if (file_ == 0)
+        return false;
+    setvbuf(file_, NULL, _IOFBF, 1 << 20);
+    if (!ReadPtuHeader()) {
+        Close();
+        return false;
+    }
+    unsigned int first;
+    fileHasRecords_ = fread(&first, sizeof(first), 1, file_) == 1;
+    fseek(file_, dataStart_, SEEK_SET);
+    return true;
+}
+
+/**
+* Skips the PTU tag list, keeping the two resolutions. A file without the
+* PTU magic is taken to be a raw record dump.
+*/
+bool TTTRReplaySource::ReadPtuHeader()
+{
+    globalResolutionPs_ = 0;
+    resolutionPs_ = 0;
+    char magic[8];
+    if (fread(magic, 1, sizeof(magic), file_) != sizeof(magic) || memcmp(magic, "PQTTTR", 6) != 0) {
+        dataStart_ = 0;
+        return fseek(file_, 0, SEEK_SET) == 0;
+    }
+    if (fseek(file_, 8, SEEK_CUR) != 0) //Version
+        return false;
+
+    struct
+    {
+        char ident[32];
+        int idx;
+        unsigned int type;
+        int64_t value;
+    } tag;
+    while (fread(&tag, sizeof(tag), 1, file_) == 1) {
+        tag.ident[31] = 0;
+        if (tag.type == PTU_TY_ANSISTRING || tag.type == PTU_TY_WIDESTRING || tag.type == PTU_TY_BINARYBLOB) {
+            if (fseek(file_, (long)tag.value, SEEK_CUR) != 0)
+                return false;
+        }
+        else if (tag.type == PTU_TY_FLOAT8) {
+            double value;
+            memcpy(&value, &tag.value, sizeof(value));
+            if (strcmp(tag.ident, "MeasDesc_GlobalResolution") == 0)
+                globalResolutionPs_ = value * 1e12;
+            else if (strcmp(tag.ident, "MeasDesc_Resolution") == 0)
+                resolutionPs_ = value * 1e12;
+        }
+        if (strcmp(tag.ident, "Header_End") == 0) {
+            dataStart_ = ftell(file_);
+            return true;
+        }
+    }
+    return false;
+}
+
+void TTTRReplaySource::OpenSynthetic(const SyntheticT3Config& config)
+{
+    Close();
+    config_ = config;
+    config_.beams = (std::max)(1, (std::min)(config_.beams, 63));
+    config_.linesPerFrame = (std::max)(1, config_.linesPerFrame);
+    config_.binsPerSync = (std::max)(1, (std::min)(config_.binsPerSync, 0x8000));
+    synthetic_ = true;
+    overflows_ = 0;
+    frameStart_ = 0;
+    markerIndex_ = 0;
+    nextPhoton_ = (config_.photonRateHz > 0) ? -log(NextUniform()) * config_.syncRateHz / config_.photonRateHz : 1e300;
+    globalResolutionPs_ = 1e12 / config_.syncRateHz;
+    resolutionPs_ = 0;
+}
+
+void TTTRReplaySource::Close()
+{
+    if (file_ != 0)
+        fclose(file_);
+    file_ = 0;
+    synthetic_ = false;
+    seamOverflow_ = false;
+}
+
+bool TTTRReplaySource::Rewind()
+{
+    if (synthetic_)
+        return true;
+    if (file_ == 0 || !fileHasRecords_)
+        return false;
+    //The file restarts at a small nsync; one extra wraparound keeps time monotonic
+    seamOverflow_ = true;
+    return fseek(file_, dataStart_, SEEK_SET) == 0;
+}
+
+/**
+* Uniform in (0, 1), xorshift64* - cheap and the same stream every run.
+*/
+double TTTRReplaySource::NextUniform()
+{
+    rng_ ^= rng_ >> 12;
+    rng_ ^= rng_ << 25;
+    rng_ ^= rng_ >> 27;
+    return ((double)((rng_ * 2685821657736338717ULL) >> 11) + 1.0) / 9007199254740993.0;
+}
+
+/**
+* Sync time of marker index within the current frame: 0 is the frame clock,
+* then a line start and a line end per line.
+*/
+double TTTRReplaySource::MarkerTime(int index) const
+{
+    double period = config_.linePeriodS * config_.syncRateHz;
+    if (index == 0)
+        return frameStart_;
+    int line = (index - 1) / 2;
+    double start = frameStart_ + line * period;
+    return (index & 1) ? start : start + period * (1.0 - config_.flybackFraction);
+}
+
+int TTTRReplaySource::Read(unsigned int* records, int maxRecords)
+{
+    int n = 0;
+    if (file_ != 0) {
+        if (seamOverflow_ && maxRecords > 0) {
+            records[n++] = T3_OVERFLOW_RECORD | 1;
+            seamOverflow_ = false;
+        }
+        n += (int)fread(records + n, sizeof(unsigned int), maxRecords - n, file_);
+        return n;
+    }
+    if (!synthetic_)
+        return 0;
+
+    double photonSpacing = (config_.photonRateHz > 0) ? config_.syncRateHz / config_.photonRateHz : 1e300;
+    double nextMarker = MarkerTime(markerIndex_);
+    while (n < maxRecords) {
+        uint64_t sync = (uint64_t)(std::min)(nextPhoton_, nextMarker);
+        uint64_t wraps = sync / T3_WRAPAROUND;
+        if (wraps > overflows_) {
+            uint64_t count = (std::min)(wraps - overflows_, (uint64_t)(T3_WRAPAROUND - 1));
+            records[n++] = T3_OVERFLOW_RECORD | (unsigned int)count;
+            overflows_ += count;
+            continue;
+        }
+        unsigned int nsync = (unsigned int)(sync % T3_WRAPAROUND);
+        if (nextMarker <= nextPhoton_) {
+            //Marker bits as HandleMarker reads them: 4 frame clock, 2 line start, 1 line end
+            unsigned int marker = (markerIndex_ == 0) ? 4 : ((markerIndex_ & 1) ? 2 : 1);
+            records[n++] = 0x80000000 | (marker << 25) | nsync;
+            if (++markerIndex_ > 2 * config_.linesPerFrame) {
+                frameStart_ += config_.linesPerFrame * config_.linePeriodS * config_.syncRateHz;
+                markerIndex_ = 0;
+            }
+            nextMarker = MarkerTime(markerIndex_);
+        }
+        else {
+            unsigned int channel = (std::min)((unsigned int)(NextUniform() * config_.beams), (unsigned int)config_.beams - 1);
+            unsigned int dtime = (unsigned int)(-log(NextUniform()) * config_.lifetimeBins) % (unsigned int)config_.binsPerSync;
+            records[n++] = (channel << 25) | ((dtime & 0x7FFF) << 10) | nsync;
+            nextPhoton_ += -log(NextUniform()) * photonSpacing;
+        }
+    }
+    return n;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// FramePool implementation
+///////////////////////////////////////////////////////////////////////////////
+
+FramePool::FramePool() :
+    bytes_(0),
+    width_(0),
+    height_(0),
+    depth_(0),
+    filling_(-1),
+    shown_(-1),
+    seq_(0),
+    stalls_(0),
+    idle_(CreateEvent(NULL, TRUE, TRUE, NULL))
+{
+    for (int i = 0; i < N_FRAME_BUFFERS; i++) {
+        frames_[i].pixels = NULL;
+        frames_[i].state = FRAME_DIRTY;
+        frames_[i].seq = 0;
+        frames_[i].preview = false;
+    }
+}
+
+FramePool::~FramePool()
+{
+    Free();
+    CloseHandle(idle_);
+}
+
+bool FramePool::Allocate(unsigned width, unsigned height, unsigned depth)
+{
+    if (Matches(width, height, depth))
+        return true;
+    Free();
+    MMThreadGuard g(lock_);
+    bytes_ = (size_t)width * height * depth;
+    for (int i = 0; i < N_FRAME_BUFFERS; i++) {
+        frames_[i].pixels = (unsigned char*)_aligned_malloc(bytes_, CACHE_LINE_BYTES);
+        if (frames_[i].pixels == NULL) {
+            for (int j = 0; j < i; j++) {
+                _aligned_free(frames_[j].pixels);
+                frames_[j].pixels = NULL;
+            }
+            bytes_ = 0;
+            return false;
+        }
+        memset(frames_[i].pixels, 0, bytes_);
+        frames_[i].state = FRAME_ZEROED;
+    }
+    width_ = width;
+    height_ = height;
+    depth_ = depth;
+    return true;
+}
+
+void FramePool::Free()
+{
+    MMThreadGuard g(lock_);
+    for (int i = 0; i < N_FRAME_BUFFERS; i++) {
+        if (frames_[i].pixels)
+            _aligned_free(frames_[i].pixels);
+        frames_[i].pixels = NULL;
+        frames_[i].state = FRAME_DIRTY;
+    }
+    bytes_ = 0;
+    width_ = height_ = depth_ = 0;
+    filling_ = -1;
+    shown_ = -1;
+    SetEvent(idle_);
+}
+
+bool FramePool::Matches(unsigned width, unsigned height, unsigned depth) const
+{
+    return bytes_ != 0 && width == width_ && height == height_ && depth == depth_;
+}
+
+/**
+* Hands the decoder a zeroed frame to bin into, or with resumeShown the shown
+* frame again (accumulating over several measurements). Clears a used frame
+* inline only if the service thread has fallen behind; queued, publishing and
+* shown frames are waited out, never reused.
+*/
+unsigned char* FramePool::Begin(bool resumeShown)
+{
+    while (1)
+    {
         {
-            nComponents_ = 1;
-            img_.Resize(img_.Width(), img_.Height(), 1);
-            bitDepth_ = 8;
-            ret = DEVICE_OK;
+            MMThreadGuard g(lock_);
+            if (bytes_ == 0)
+                return NULL;
+            if (resumeShown && shown_ >= 0 && frames_[shown_].state == FRAME_SHOWN) {
+                filling_ = shown_;
+                shown_ = -1;
+                frames_[filling_].state = FRAME_FILLING;
+                return frames_[filling_].pixels;
+            }
+            int dirty = -1;
+            for (int i = 0; i < N_FRAME_BUFFERS; i++) {
+                if (frames_[i].state == FRAME_ZEROED) {
+                    filling_ = i;
+                    frames_[i].state = FRAME_FILLING;
+                    return frames_[i].pixels;
+                }
+                if (dirty < 0 && frames_[i].state == FRAME_DIRTY)
+                    dirty = i;
+            }
+            stalls_++;
+            if (dirty >= 0) {
+                filling_ = dirty;
+                frames_[dirty].state = FRAME_FILLING;
+                memset(frames_[dirty].pixels, 0, bytes_);
+                return frames_[dirty].pixels;
+            }
+        }
+        //Everything is queued, being inserted, shown or being cleared - wait for the service thread
+        Sleep(0);
+    }
+}
+
+/**
+* The filling frame is complete: either queue it for InsertImage() or make it
+* the shown frame straight away. A queued preview is inserted tagged as one.
+*/
+void FramePool::Finish(bool queue, bool preview)
+{
+    MMThreadGuard g(lock_);
+    if (filling_ < 0)
+        return;
+    if (queue) {
+        frames_[filling_].state = FRAME_QUEUED;
+        frames_[filling_].seq = ++seq_;
+        frames_[filling_].preview = preview;
+        ResetEvent(idle_);
+    }
+    else {
+        ShowLocked(filling_);
+    }
+    filling_ = -1;
+}
+
+long FramePool::Queued() const
+{
+    MMThreadGuard g(lock_);
+    long n = 0;
+    for (int i = 0; i < N_FRAME_BUFFERS; i++) {
+        if (frames_[i].state == FRAME_QUEUED)
+            n++;
+    }
+    return n;
+}
+
+long FramePool::Pending() const
+{
+    MMThreadGuard g(lock_);
+    return PendingLocked();
+}
+
+long FramePool::PendingLocked() const
+{
+    long n = 0;
+    for (int i = 0; i < N_FRAME_BUFFERS; i++) {
+        if (frames_[i].state == FRAME_QUEUED || frames_[i].state == FRAME_PUBLISHING)
+            n++;
+    }
+    return n;
+}
+
+int FramePool::NextQueued() const
+{
+    MMThreadGuard g(lock_);
+    int next = -1;
+    for (int i = 0; i < N_FRAME_BUFFERS; i++) {
+        if (frames_[i].state == FRAME_QUEUED && (next < 0 || frames_[i].seq < frames_[next].seq))
+            next = i;
+    }
+    return next;
+}
+
+/**
+* Makes a queued frame the shown one for InsertImage(), which reads it through
+* the returned pointer. It isn't released until Published().
+*/
+const unsigned char* FramePool::Publish(int frame, bool& preview)
+{
+    MMThreadGuard g(lock_);
+    preview = frames_[frame].preview;
+    ShowLocked(frame);
+    frames_[frame].state = FRAME_PUBLISHING;
+    return frames_[frame].pixels;
+}
+
+void FramePool::Published(int frame)
+{
+    MMThreadGuard g(lock_);
+    if (frames_[frame].state != FRAME_PUBLISHING)
+        return;
+    //A later frame may have been shown meanwhile
+    frames_[frame].state = (frame == shown_) ? FRAME_SHOWN : FRAME_DIRTY;
+    if (PendingLocked() == 0)
+        SetEvent(idle_);
+}
+
+/**
+* Decoder side: waits until nothing is queued or being inserted, or timeoutMs
+* has passed. True if the pool went idle.
+*/
+bool FramePool::WaitIdle(DWORD timeoutMs) const
+{
+    return WaitForSingleObject(idle_, timeoutMs) == WAIT_OBJECT_0;
+}
+
+void FramePool::ShowLocked(int frame)
+{
+    //A frame still being inserted is released by Published() instead
+    if (shown_ >= 0 && shown_ != frame && frames_[shown_].state == FRAME_SHOWN)
+        frames_[shown_].state = FRAME_DIRTY;
+    shown_ = frame;
+    frames_[frame].state = FRAME_SHOWN;
+}
+
+/**
+* Zeroes one used frame outside the lock. Returns false if there was nothing
+* to clear.
+*/
+bool FramePool::ClearOne()
+{
+    int frame = -1;
+    {
+        MMThreadGuard g(lock_);
+        for (int i = 0; i < N_FRAME_BUFFERS; i++) {
+            if (frames_[i].state == FRAME_DIRTY && frames_[i].pixels) {
+                frame = i;
+                frames_[i].state = FRAME_CLEARING;
+                break;
+            }
+        }
+    }
+    if (frame < 0)
+        return false;
+    memset(frames_[frame].pixels, 0, bytes_);
+    MMThreadGuard g(lock_);
+    frames_[frame].state = FRAME_ZEROED;
+    return true;
+}
+
+const unsigned char* FramePool::Shown() const
+{
+    MMThreadGuard g(lock_);
+    return (shown_ >= 0) ? frames_[shown_].pixels : NULL;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// MH_camera Action handlers
+///////////////////////////////////////////////////////////////////////////////
+
+int MH_camera::OnMaxExposure(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+    if (eAct == MM::BeforeGet)
+    {
+        pProp->Set(exposureMaximum_);
+    }
+    else if (eAct == MM::AfterSet)
+    {
+        pProp->Get(exposureMaximum_);
+    }
+    return DEVICE_OK;
+}
+
+
+/*
+* this Read Only property will update whenever any property is modified
+*/
+
+int MH_camera::OnTestProperty(MM::PropertyBase* pProp, MM::ActionType eAct, long indexx)
+{
+    if (eAct == MM::BeforeGet)
+    {
+        pProp->Set(testProperty_[indexx]);
+    }
+    else if (eAct == MM::AfterSet)
+    {
+        pProp->Get(testProperty_[indexx]);
+    }
+    return DEVICE_OK;
+
+}
+
+
+/**
+* Handles "Binning" property.
+*/
+int MH_camera::OnBinning(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+    int ret = DEVICE_ERR;
+    switch (eAct)
+    {
+    case MM::AfterSet:
+    {
+        if (IsCapturing())
+            return DEVICE_CAMERA_BUSY_ACQUIRING;
+
+        // the user just set the new value for the property, so we have to
+        // apply this value to the 'hardware'.
+        long binFactor;
+        pProp->Get(binFactor);
+        if (binFactor > 0 && binFactor < 10)
+        {
+            // calculate ROI using the previous bin settings
+            double factor = (double)binFactor / (double)binSize_;
+            roiX_ = (unsigned int)(roiX_ / factor);
+            roiY_ = (unsigned int)(roiY_ / factor);
+            for (unsigned int i = 0; i < multiROIXs_.size(); ++i)
+            {
+                multiROIXs_[i] = (unsigned int)(multiROIXs_[i] / factor);
+                multiROIYs_[i] = (unsigned int)(multiROIYs_[i] / factor);
+                multiROIWidths_[i] = (unsigned int)(multiROIWidths_[i] / factor);
+                multiROIHeights_[i] = (unsigned int)(multiROIHeights_[i] / factor);
+            }
+            img_.Resize((unsigned int)(img_.Width() / factor),
+                (unsigned int)(img_.Height() / factor));
+            binSize_ = binFactor;
+            std::ostringstream os;
+            os << binSize_;
+            OnPropertyChanged("Binning", os.str().c_str());
+            ret = DEVICE_OK;
+        }
+    }break;
+    case MM::BeforeGet:
+    {
+        ret = DEVICE_OK;
+        pProp->Set(binSize_);
+    }break;
+    default:
+        break;
+    }
+    return ret;
+}
+
+/**
+* Handles "PixelType" property.
+*/
+int MH_camera::OnPixelType(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+    int ret = DEVICE_ERR;
+    switch (eAct)
+    {
+    case MM::AfterSet:
+    {
+        if (IsCapturing())
+            return DEVICE_CAMERA_BUSY_ACQUIRING;
+
+        string pixelType;
+        pProp->Get(pixelType);
+
+        if (pixelType.compare(g_PixelType_8bit) == 0)
+        {
+            nComponents_ = 1;
+            img_.Resize(img_.Width(), img_.Height(), 1);
+            bitDepth_ = 8;
+            ret = DEVICE_OK;
+        }
+        else if (pixelType.compare(g_PixelType_16bit) == 0)
+        {
+            nComponents_ = 1;
+            img_.Resize(img_.Width(), img_.Height(), 2);
+            bitDepth_ = 16;
+            ret = DEVICE_OK;
+        }
+        else if (pixelType.compare(g_PixelType_32bit) == 0)
+        {
+            //The photon counts as float32, which is how the core reads 4 byte
+            //pixels; nothing saturates or wraps, counts are exact up to 2^24
+            nComponents_ = 1;
+            img_.Resize(img_.Width(), img_.Height(), 4);
+            bitDepth_ = 32;
+            ret = DEVICE_OK;
+        }
+        else
+        {
+            // on error switch to default pixel type
+            nComponents_ = 1;
+            img_.Resize(img_.Width(), img_.Height(), 1);
+            pProp->Set(g_PixelType_8bit);
+            bitDepth_ = 8;
+            ret = ERR_UNKNOWN_MODE;
+        }
+    }
+    break;
+    case MM::BeforeGet:
+    {
+        long bytesPerPixel = GetImageBytesPerPixel();
+        if (bytesPerPixel == 1)
+        {
+            pProp->Set(g_PixelType_8bit);
+        }
+        else if (bytesPerPixel == 2)
+        {
+            pProp->Set(g_PixelType_16bit);
+        }
+        else if (bytesPerPixel == 4)
+        {
+            pProp->Set(g_PixelType_32bit);
+        }
+        else
+        {
+            pProp->Set(g_PixelType_8bit);
+        }
+        ret = DEVICE_OK;
+    } break;
+    default:
+        break;
+    }
+    return ret;
+}
+
+/**
+* Handles "BitDepth" property.
+*/
+int MH_camera::OnBitDepth(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+    int ret = DEVICE_ERR;
+    switch (eAct)
+    {
+    case MM::AfterSet:
+    {
+        if (IsCapturing())
+            return DEVICE_CAMERA_BUSY_ACQUIRING;
+
+        long bitDepth;
+        pProp->Get(bitDepth);
+
+        unsigned int bytesPerComponent;
+
+        switch (bitDepth) {
+        case 8:
+            bytesPerComponent = 1;
+            bitDepth_ = 8;
+            ret = DEVICE_OK;
+            break;
+        case 10:
+            bytesPerComponent = 2;
+            bitDepth_ = 10;
+            ret = DEVICE_OK;
+            break;
+        case 12:
+            bytesPerComponent = 2;
+            bitDepth_ = 12;
+            ret = DEVICE_OK;
+            break;
+        case 14:
+            bytesPerComponent = 2;
+            bitDepth_ = 14;
+            ret = DEVICE_OK;
+            break;
+        case 16:
+            bytesPerComponent = 2;
+            bitDepth_ = 16;
+            ret = DEVICE_OK;
+            break;
+        case 32:
+            bytesPerComponent = 4;
+            bitDepth_ = 32;
+            ret = DEVICE_OK;
+            break;
+        default:
+            // on error switch to default pixel type
+            bytesPerComponent = 1;
+
+            pProp->Set((long)8);
+            bitDepth_ = 8;
+            ret = ERR_UNKNOWN_MODE;
+            break;
+        }
+        char buf[MM::MaxStrLength];
+        GetProperty(MM::g_Keyword_PixelType, buf);
+        std::string pixelType(buf);
+        unsigned int bytesPerPixel = 1;
+
+
+        // automagickally change pixel type when bit depth exceeds possible value
+        if (4 == bytesPerComponent)
+        {
+            if (pixelType.compare(g_PixelType_32bit) != 0)
+                SetProperty(MM::g_Keyword_PixelType, g_PixelType_32bit);
+            bytesPerPixel = 4;
+        }
+        else if (pixelType.compare(g_PixelType_8bit) == 0)
+        {
+            if (2 == bytesPerComponent)
+            {
+                SetProperty(MM::g_Keyword_PixelType, g_PixelType_16bit);
+                bytesPerPixel = 2;
+            }
+            else
+            {
+                bytesPerPixel = 1;
+            }
+        }
+        else if (pixelType.compare(g_PixelType_16bit) == 0 || pixelType.compare(g_PixelType_32bit) == 0)
+        {
+            bytesPerPixel = 2;
+            if (pixelType.compare(g_PixelType_32bit) == 0)
+                SetProperty(MM::g_Keyword_PixelType, g_PixelType_16bit);
+        }
+        img_.Resize(img_.Width(), img_.Height(), bytesPerPixel);
+
+    } break;
+    case MM::BeforeGet:
+    {
+        pProp->Set((long)bitDepth_);
+        ret = DEVICE_OK;
+    } break;
+    default:
+        break;
+    }
+    return ret;
+}
+/**
+* Handles "ReadoutTime" property.
+*/
+int MH_camera::OnReadoutTime(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+    if (eAct == MM::AfterSet)
+    {
+        double readoutMs;
+        pProp->Get(readoutMs);
+
+        readoutUs_ = readoutMs * 1000.0;
+    }
+    else if (eAct == MM::BeforeGet)
+    {
+        pProp->Set(readoutUs_ / 1000.0);
+    }
+
+    return DEVICE_OK;
+}
+
+int MH_camera::OnDropPixels(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+    if (eAct == MM::AfterSet)
+    {
+        long tvalue = 0;
+        pProp->Get(tvalue);
+        dropPixels_ = (0 == tvalue) ? false : true;
+    }
+    else if (eAct == MM::BeforeGet)
+    {
+        pProp->Set(dropPixels_ ? 1L : 0L);
+    }
+
+    return DEVICE_OK;
+}
+
+int MH_camera::OnFastImage(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+    if (eAct == MM::AfterSet)
+    {
+        long tvalue = 0;
+        pProp->Get(tvalue);
+        fastImage_ = (0 == tvalue) ? false : true;
+    }
+    else if (eAct == MM::BeforeGet)
+    {
+        pProp->Set(fastImage_ ? 1L : 0L);
+    }
+
+    return DEVICE_OK;
+}
+
+int MH_camera::OnSaturatePixels(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+    if (eAct == MM::AfterSet)
+    {
+        long tvalue = 0;
+        pProp->Get(tvalue);
+        saturatePixels_ = (0 == tvalue) ? false : true;
+    }
+    else if (eAct == MM::BeforeGet)
+    {
+        pProp->Set(saturatePixels_ ? 1L : 0L);
+    }
+
+    return DEVICE_OK;
+}
+
+int MH_camera::OnFractionOfPixelsToDropOrSaturate(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+    if (eAct == MM::AfterSet)
+    {
+        double tvalue = 0;
+        pProp->Get(tvalue);
+        fractionOfPixelsToDropOrSaturate_ = tvalue;
+    }
+    else if (eAct == MM::BeforeGet)
+    {
+        pProp->Set(fractionOfPixelsToDropOrSaturate_);
+    }
+
+    return DEVICE_OK;
+}
+
+int MH_camera::OnShouldRotateImages(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+    if (eAct == MM::AfterSet)
+    {
+        long tvalue = 0;
+        pProp->Get(tvalue);
+        shouldRotateImages_ = (tvalue != 0);
+    }
+    else if (eAct == MM::BeforeGet)
+    {
+        pProp->Set((long)shouldRotateImages_);
+    }
+
+    return DEVICE_OK;
+}
+
+int MH_camera::OnShouldDisplayImageNumber(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+    if (eAct == MM::AfterSet)
+    {
+        long tvalue = 0;
+        pProp->Get(tvalue);
+        shouldDisplayImageNumber_ = (tvalue != 0);
+    }
+    else if (eAct == MM::BeforeGet)
+    {
+        pProp->Set((long)shouldDisplayImageNumber_);
+    }
+
+    return DEVICE_OK;
+}
+
+int MH_camera::OnStripeWidth(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+    if (eAct == MM::AfterSet)
+    {
+        pProp->Get(stripeWidth_);
+    }
+    else if (eAct == MM::BeforeGet)
+    {
+        pProp->Set(stripeWidth_);
+    }
+
+    return DEVICE_OK;
+}
+
+int MH_camera::OnSupportsMultiROI(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+    if (eAct == MM::AfterSet)
+    {
+        long tvalue = 0;
+        pProp->Get(tvalue);
+        supportsMultiROI_ = (tvalue != 0);
+    }
+    else if (eAct == MM::BeforeGet)
+    {
+        pProp->Set((long)supportsMultiROI_);
+    }
+
+    return DEVICE_OK;
+}
+
+int MH_camera::OnMultiROIFillValue(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+    if (eAct == MM::AfterSet)
+    {
+        long tvalue = 0;
+        pProp->Get(tvalue);
+        multiROIFillValue_ = (int)tvalue;
+    }
+    else if (eAct == MM::BeforeGet)
+    {
+        pProp->Set((long)multiROIFillValue_);
+    }
+
+    return DEVICE_OK;
+}
+
+/*
+* Handles "ScanMode" property.
+* Changes allowed Binning values to test whether the UI updates properly
+*/
+int MH_camera::OnScanMode(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+    if (eAct == MM::AfterSet) {
+        pProp->Get(scanMode_);
+        SetAllowedBinning();
+        if (initialized_) {
+            int ret = OnPropertiesChanged();
+            if (ret != DEVICE_OK)
+                return ret;
+        }
+    }
+    else if (eAct == MM::BeforeGet) {
+        LogMessage("Reading property ScanMode", true);
+        pProp->Set(scanMode_);
+    }
+    return DEVICE_OK;
+}
+
+int MH_camera::Onn_beams_X(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+    if (eAct == MM::BeforeGet)
+    {
+        pProp->Set(n_beams_X_);
+    }
+    else if (eAct == MM::AfterSet)
+    {
+        long value;
+        pProp->Get(value);
+        if ((value < 1) || (8 < value))
+            return DEVICE_ERR;  // invalid image size
+        if (value != n_beams_X_)
+        {
+            ScanGeometry geometry = CurrentScanGeometry();
+            geometry.beamsX = value;
+            return SetScanGeometry(geometry);
+        }
+    }
+    return DEVICE_OK;
+}
+
+int MH_camera::Onn_beams_Y(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+    if (eAct == MM::BeforeGet)
+    {
+        pProp->Set(n_beams_Y_);
+    }
+    else if (eAct == MM::AfterSet)
+    {
+        long value;
+        pProp->Get(value);
+        if ((value < 1) || (8 < value))
+            return DEVICE_ERR;  // invalid image size
+        if (value != n_beams_Y_)
+        {
+            ScanGeometry geometry = CurrentScanGeometry();
+            geometry.beamsY = value;
+            return SetScanGeometry(geometry);
+        }
+    }
+    return DEVICE_OK;
+}
+
+int MH_camera::Onn_scanPixels_X(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+    if (eAct == MM::BeforeGet)
+    {
+        pProp->Set(n_scanPixels_X_);
+    }
+    else if (eAct == MM::AfterSet)
+    {
+        long value;
+        pProp->Get(value);
+        if ((value < 16) || (33000 < value))
+            return DEVICE_ERR;  // invalid image size
+        if (value != n_scanPixels_X_)
+        {
+            ScanGeometry geometry = CurrentScanGeometry();
+            geometry.pixelsX = value;
+            return SetScanGeometry(geometry);
+        }
+    }
+    return DEVICE_OK;
+}
+
+int MH_camera::Onn_scanPixels_Y(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+    if (eAct == MM::BeforeGet)
+    {
+        pProp->Set(n_scanPixels_Y_);
+    }
+    else if (eAct == MM::AfterSet)
+    {
+        long value;
+        pProp->Get(value);
+        if ((value < 16) || (33000 < value))
+            return DEVICE_ERR;  // invalid image size
+        if (value != n_scanPixels_Y_)
+        {
+            ScanGeometry geometry = CurrentScanGeometry();
+            geometry.pixelsY = value;
+            return SetScanGeometry(geometry);
+        }
+    }
+    return DEVICE_OK;
+}
+
+/**
+* Takes over a new scan geometry, including the time per image as the exposure
+* and the scan pixel size. The buffer is only resized when the image size
+* actually changes; the accumulators and line maps follow on the next
+* start_acq() through accumulatorKey_.
+*/
+int MH_camera::ApplyScanGeometry(const ScanGeometry& geometry)
+{
+    bool resize = geometry.pixelsX != n_scanPixels_X_ || geometry.pixelsY != n_scanPixels_Y_ ||
+        geometry.beamsX != n_beams_X_ || geometry.beamsY != n_beams_Y_;
+    if (resize && IsCapturing())
+        return DEVICE_CAMERA_BUSY_ACQUIRING;
+    if (geometry.timePerImage > 0 && geometry.timePerImage != GetExposure() && HasProperty(MM::g_Keyword_Exposure))
+    {
+        //Outside the exposure limits the whole geometry is refused, the hub keeps the old one
+        int ret = SetProperty(MM::g_Keyword_Exposure, CDeviceUtils::ConvertToString(geometry.timePerImage));
+        if (ret != DEVICE_OK)
+            return ret;
+        if (GetCoreCallback())
+            GetCoreCallback()->OnExposureChanged(this, geometry.timePerImage);
+    }
+    if (geometry.micronsPerPixel > 0)
+        scanPixelSizeUm_ = geometry.micronsPerPixel;
+    if (geometry.magnification > 0)
+        scanMagnification_ = geometry.magnification;
+
+    n_scanPixels_X_ = geometry.pixelsX;
+    n_scanPixels_Y_ = geometry.pixelsY;
+    n_beams_X_ = geometry.beamsX;
+    n_beams_Y_ = geometry.beamsY;
+    flyback_fraction_ = geometry.flyback;
+    n_frame_repeats_ = (int)geometry.frameRepeats;
+    geometryVersion_ = geometry.version;
+    if (!resize)
+        return DEVICE_OK;
+
+    cameraCCDXSize_ = n_scanPixels_X_ * n_beams_X_;
+    cameraCCDYSize_ = n_scanPixels_Y_ * n_beams_Y_;
+    //Not initialized_: RegisterCamera() hands over the hub geometry before Initialize() finishes
+    return HasProperty(MM::g_Keyword_PixelType) ? ResizeImageBuffer() : DEVICE_OK;
+}
+
+ScanGeometry MH_camera::CurrentScanGeometry()
+{
+    Scan_hub* pHub = static_cast<Scan_hub*>(GetParentHub());
+    if (pHub)
+        return pHub->GetGeometry();
+
+    ScanGeometry geometry;
+    geometry.pixelsX = n_scanPixels_X_;
+    geometry.pixelsY = n_scanPixels_Y_;
+    geometry.beamsX = n_beams_X_;
+    geometry.beamsY = n_beams_Y_;
+    geometry.timePerImage = GetExposure();
+    geometry.flyback = flyback_fraction_;
+    geometry.magnification = scanMagnification_;
+    geometry.micronsPerPixel = scanPixelSizeUm_;
+    geometry.frameRepeats = n_frame_repeats_;
+    geometry.version = geometryVersion_;
+    return geometry;
+}
+
+/**
+* Geometry changes go through the hub so the galvo sees the same model.
+*/
+int MH_camera::SetScanGeometry(const ScanGeometry& geometry)
+{
+    Scan_hub* pHub = static_cast<Scan_hub*>(GetParentHub());
+    if (pHub)
+        return pHub->SetGeometry(geometry);
+
+    ScanGeometry local = geometry;
+    local.version = geometryVersion_ + 1;
+    return ApplyScanGeometry(local);
+}
+
+int MH_camera::OnTriggerDevice(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+    if (eAct == MM::BeforeGet)
+    {
+        pProp->Set(triggerDevice_.c_str());
+    }
+    else if (eAct == MM::AfterSet)
+    {
+        pProp->Get(triggerDevice_);
+    }
+    return DEVICE_OK;
+}
+
+
+int MH_camera::OnCCDTemp(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+    if (eAct == MM::BeforeGet)
+    {
+        pProp->Set(ccdT_);
+    }
+    else if (eAct == MM::AfterSet)
+    {
+        pProp->Get(ccdT_);
+    }
+    return DEVICE_OK;
+}
+
+int MH_camera::OnIsSequenceable(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+    std::string val = "Yes";
+    if (eAct == MM::BeforeGet)
+    {
+        if (!isSequenceable_)
+        {
+            val = "No";
+        }
+        pProp->Set(val.c_str());
+    }
+    else if (eAct == MM::AfterSet)
+    {
+        isSequenceable_ = false;
+        pProp->Get(val);
+        if (val == "Yes")
+        {
+            isSequenceable_ = true;
+        }
+    }
+
+    return DEVICE_OK;
+}
+
+
+int MH_camera::OnMode(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+    std::string val;
+    if (eAct == MM::BeforeGet)
+    {
+        switch (mode_)
+        {
+        case MODE_MH_TEST:
+            val = g_MH_Test;
+            break;
+        case MODE_MH_HISTO:
+            val = g_MH_Histo;
+            break;
+        case MODE_MH_IMAGE:
+            val = g_MH_Image;
+            break;
+        case MODE_MH_FLIM:
+            val = g_MH_Flim;
+            break;
+        case MODE_MH_PHASOR:
+            val = g_MH_Phasor;
+            break;
+        case MODE_MH_DEVICE_HISTO:
+            val = g_MH_DeviceHisto;
+            break;
+        default:
+            val = g_MH_Test;
+            break;
+        }
+        pProp->Set(val.c_str());
+    }
+    else if (eAct == MM::AfterSet)
+    {
+        pProp->Get(val);
+        if (val == g_MH_Test)
+        {
+            mode_ = MODE_MH_TEST;
+        }
+        else if (val == g_MH_Histo)
+        {
+            mode_ = MODE_MH_HISTO;
+        }
+        else if (val == g_MH_Image)
+        {
+            mode_ = MODE_MH_IMAGE;
+        }
+        else if (val == g_MH_Flim)
+        {
+            mode_ = MODE_MH_FLIM;
+        }
+        else if (val == g_MH_Phasor)
+        {
+            mode_ = MODE_MH_PHASOR;
+        }
+        else if (val == g_MH_DeviceHisto)
+        {
+            mode_ = MODE_MH_DEVICE_HISTO;
+        }
+        else
+        {
+            mode_ = MODE_MH_TEST;
+        }
+    }
+    return DEVICE_OK;
+}
+
+int MH_camera::OnPCF(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+    if (eAct == MM::BeforeGet)
+    {
+        pProp->Set(pcf_);
+    }
+    else if (eAct == MM::AfterSet)
+    {
+        pProp->Get(pcf_);
+    }
+    return DEVICE_OK;
+}
+
+int MH_camera::OnPhotonFlux(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+    if (eAct == MM::BeforeGet)
+    {
+        pProp->Set(photonFlux_);
+    }
+    else if (eAct == MM::AfterSet)
+    {
+        pProp->Get(photonFlux_);
+    }
+    return DEVICE_OK;
+}
+
+int MH_camera::OnReadNoise(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+    if (eAct == MM::BeforeGet)
+    {
+        pProp->Set(readNoise_);
+    }
+    else if (eAct == MM::AfterSet)
+    {
+        pProp->Get(readNoise_);
+    }
+    return DEVICE_OK;
+}
+
+
+int MH_camera::OnCrash(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+    AddAllowedValue("SimulateCrash", "");
+    AddAllowedValue("SimulateCrash", "Dereference Null Pointer");
+    AddAllowedValue("SimulateCrash", "Divide by Zero");
+    if (eAct == MM::BeforeGet)
+    {
+        pProp->Set("");
+    }
+    else if (eAct == MM::AfterSet)
+    {
+        std::string choice;
+        pProp->Get(choice);
+        if (choice == "Dereference Null Pointer")
+        {
+            int* p = 0;
+            volatile int i = *p;
+            i++;
+        }
+        else if (choice == "Divide by Zero")
+        {
+            volatile int i = 1, j = 0, k;
+            k = i / j;
+        }
+    }
+    return DEVICE_OK;
+}
+
+int MH_camera::OnLifetime(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+    if (eAct == MM::BeforeGet)
+    {
+        pProp->Set(Sim_lifetime_);
+    }
+    else if (eAct == MM::AfterSet)
+    {
+        long value;
+        pProp->Get(value);
+        Sim_lifetime_ = value;
+    }
+    return DEVICE_OK;
+
+}
+
+int MH_camera::OnDecOrRat(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+    if (eAct == MM::BeforeGet)
+    {
+        std::string current_val;
+        if (rates_or_decays_) {
+            current_val = "Rates";
+        }
+        else {
+            current_val = "Decays";
+        }
+        pProp->Set(current_val.c_str());
+    }
+    else if (eAct == MM::AfterSet)
+    {
+        std::string choice;
+        pProp->Get(choice);
+        if (choice == "Decay") {
+            rates_or_decays_ = false;
+        }
+        else {
+            rates_or_decays_ = true;
+        }
+    }
+    return DEVICE_OK;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Private MH_camera methods
+///////////////////////////////////////////////////////////////////////////////
+
+/**
+* Sync internal image buffer size to the chosen property values.
+*/
+int MH_camera::ResizeImageBuffer()
+{
+    char buf[MM::MaxStrLength];
+    //int ret = GetProperty(MM::g_Keyword_Binning, buf);
+    //if (ret != DEVICE_OK)
+    //   return ret;
+    //binSize_ = atol(buf);
+
+    int ret = GetProperty(MM::g_Keyword_PixelType, buf);
+    if (ret != DEVICE_OK)
+        return ret;
+
+    std::string pixelType(buf);
+    int byteDepth = 0;
+
+    if (pixelType.compare(g_PixelType_8bit) == 0)
+    {
+        byteDepth = 1;
+    }
+    else if (pixelType.compare(g_PixelType_16bit) == 0)
+    {
+        byteDepth = 2;
+    }
+    else if (pixelType.compare(g_PixelType_32bit) == 0)
+    {
+        byteDepth = 4;
+    }
+
+    img_.Resize(cameraCCDXSize_ / binSize_, cameraCCDYSize_ / binSize_, byteDepth);
+    return DEVICE_OK;
+}
+
+static inline void SetSummaryPixel(ImgBuffer& img, long index, double value, double maxValue)
+{
+    double clamped = (std::max)(0.0, (std::min)(value, maxValue));
+    unsigned int v = (unsigned int)(clamped + 0.5);
+    unsigned char* pBuf = const_cast<unsigned char*>(img.GetPixels());
+    switch (img.Depth()) {
+    case 1:
+        pBuf[index] = (unsigned char)v;
+        break;
+    case 2:
+        ((unsigned short*)pBuf)[index] = (unsigned short)v;
+        break;
+    case 4:
+        ((float*)pBuf)[index] = (float)clamped;
+        break;
+    }
+}
+
+/**
+* Reduces the decay cube to the FLIM summary channels: mean arrival time
+* (0..full scale = one histogram period) and first harmonic phasor g and s
+* at the sync frequency (0..1 = 0..full scale). img is the intensity image
+* and only sets the geometry.
+*/
+void MH_camera::GenerateDecay(ImgBuffer &img)
+{
+    MMThreadGuard g(imgPixelsLock_);
+    for (int i = 0; i < FLIM_N_SUMMARY; i++) {
+        if (flimSummary_[i].Width() != img.Width() || flimSummary_[i].Height() != img.Height() || flimSummary_[i].Depth() != img.Depth())
+            flimSummary_[i].Resize(img.Width(), img.Height(), img.Depth());
+        flimSummary_[i].ResetPixels();
+    }
+    if (decayCube_ == 0 || binLifetimes_ == &MH_camera::BinPhotonsNone)
+        return;
+
+    double maxValue = SummaryFullScale(img.Depth());
+    long nPixels = (long)img.Width() * img.Height();
+    int nBins = flimBins_;
+    for (long px = 0; px < nPixels; px++) {
+        const unsigned short* decay = decayCube_ + (size_t)px * nBins;
+        double total = 0, first = 0, g_sum = 0, s_sum = 0;
+        for (int bin = 0; bin < nBins; bin++) {
+            double counts = decay[bin];
+            total += counts;
+            first += counts * (bin + 0.5);
+            g_sum += counts * flimCos_[bin];
+            s_sum += counts * flimSin_[bin];
+        }
+        if (total == 0)
+            continue;
+        SetSummaryPixel(flimSummary_[0], px, first / total / nBins * maxValue, maxValue);
+        SetSummaryPixel(flimSummary_[1], px, g_sum / total * maxValue, maxValue);
+        SetSummaryPixel(flimSummary_[2], px, s_sum / total * maxValue, maxValue);
+    }
+}
+
+/**
+* Turns the running phasor sums into g and s images (0..1 = 0..full scale).
+* Channel 0 stays the intensity image binned alongside.
+*/
+void MH_camera::GeneratePhasor(ImgBuffer& img)
+{
+    MMThreadGuard g(imgPixelsLock_);
+    for (int i = 1; i < FLIM_N_SUMMARY; i++) {
+        if (flimSummary_[i].Width() != img.Width() || flimSummary_[i].Height() != img.Height() || flimSummary_[i].Depth() != img.Depth())
+            flimSummary_[i].Resize(img.Width(), img.Height(), img.Depth());
+        flimSummary_[i].ResetPixels();
+    }
+    long nPixels = (long)img.Width() * img.Height();
+    if (binLifetimes_ == &MH_camera::BinPhotonsNone || (long)phasorAccum_.size() < nPixels)
+        return;
+
+    double maxValue = SummaryFullScale(img.Depth());
+    for (long px = 0; px < nPixels; px++) {
+        const PhasorAccum& acc = phasorAccum_[px];
+        if (acc.n == 0)
+            continue;
+        SetSummaryPixel(flimSummary_[1], px, acc.g / acc.n * maxValue, maxValue);
+        SetSummaryPixel(flimSummary_[2], px, acc.s / acc.n * maxValue, maxValue);
+    }
+}
+
+template <class PixelT>
+static void NarrowGateCounts(const unsigned int* counts, PixelT* out, long nPixels, bool saturate)
+{
+    const unsigned int maxValue = (PixelT)~(PixelT)0;
+    for (long px = 0; px < nPixels; px++) {
+        unsigned int v = counts[(size_t)px * MAX_GATES];
+        out[px] = (PixelT)(saturate ? (std::min)(v, maxValue) : v);
+    }
+}
+
+//The float32 "32bit" type holds every count, there is nothing to saturate or wrap
+static void NarrowGateCounts(const unsigned int* counts, float* out, long nPixels, bool saturate)
+{
+    for (long px = 0; px < nPixels; px++) {
+        out[px] = (float)counts[(size_t)px * MAX_GATES];
+    }
+}
+
+/**
+* Turns the gated counts into one image per gate, saturated or wrapped like
+* the intensity image. img is the intensity image and only sets the geometry.
+*/
+void MH_camera::GenerateGates(ImgBuffer& img)
+{
+    MMThreadGuard g(imgPixelsLock_);
+    for (int i = 0; i < nGates_; i++) {
+        if (gateImages_[i].Width() != img.Width() || gateImages_[i].Height() != img.Height() || gateImages_[i].Depth() != img.Depth())
+            gateImages_[i].Resize(img.Width(), img.Height(), img.Depth());
+        gateImages_[i].ResetPixels();
+    }
+    long nPixels = (long)img.Width() * img.Height();
+    if (binLifetimes_ == &MH_camera::BinPhotonsNone || (long)gateCounts_.size() < nPixels * MAX_GATES)
+        return;
+
+    for (int i = 0; i < nGates_; i++) {
+        unsigned char* pixels = const_cast<unsigned char*>(gateImages_[i].GetPixels());
+        const unsigned int* counts = &gateCounts_[i];
+        switch (img.Depth()) {
+        case 1:
+            NarrowGateCounts(counts, pixels, nPixels, saturateCounts_);
+            break;
+        case 2:
+            NarrowGateCounts(counts, reinterpret_cast<unsigned short*>(pixels), nPixels, saturateCounts_);
+            break;
+        case 4:
+            NarrowGateCounts(counts, reinterpret_cast<float*>(pixels), nPixels, saturateCounts_);
+            break;
+        }
+    }
+}
+
+uint64_t MH_camera::TimestampDeltaToPs(uint64_t timestamp_delta) {
+    return (timestamp_delta * MeasDesc_GlobalResolution_);
+}
+
+
+//#   +----------------------+ T3 32 bit record  +---------------------+
+//#   |x|x|x|x|x|x|x|x|x|x|x|x|x|x|x|x|  |x|x|x|x|x|x|x|x|x|x|x|x|x|x|x|x| --> 32 bit record
+//#   +-------------------------------+  +-------------------------------+
+//#   +-------------------------------+  +-------------------------------+
+//#   | | | | | | | | | | | | | | | | |  | | | | | | |x|x|x|x|x|x|x|x|x|x|  --> Sync
+//#   +-------------------------------+  +-------------------------------+
+//#   +-------------------------------+  +-------------------------------+
+//#   | | | | | | | |x|x|x|x|x|x|x|x|x|  |x|x|x|x|x|x| | | | | | | | | | |  --> TCSPC bin
+//#   +-------------------------------+  +-------------------------------+
+//#   +-------------------------------+  +-------------------------------+
+//#   | |x|x|x|x|x|x| | | | | | | | | |  | | | | | | | | | | | | | | | | |  --> Spectral/TCSPC input Channel
+//#   +-------------------------------+  +-------------------------------+
+//#   +-------------------------------+  +-------------------------------+
+//#   |x| | | | | | | | | | | | | | | |  | | | | | | | | | | | | | | | | |  --> Special markers
+//#   +-------------------------------+  +-------------------------------+
+
+void MH_camera::Interpret_TTTR(unsigned int& record, unsigned int& sync, unsigned int& tcspc, unsigned int& channel, bool& special) {
+    //Try to extract relevant information with a minimum amount of duplication
+    //Bit-mask a copy, then shift as appropriate for each element?
+    //Reminder: For MultiHarp
+    //val will be one record from the unsigned int buffer[TTREADMAX]
+    //Multiharp: ## special: 1 ## channel: 6 ## dtime : 15 ## nsync : 10
+    //Do some shifting for direct comparisons
+    unsigned int nsync_mask = 0x00003ff; // 10x 1
+    unsigned int tcspc_mask = 0x0007fff; // 15x 1
+    unsigned int chan_mask = 0x000003f; // 6x 1
+    unsigned int special_mask = 0x0000001; // 1x 1
+    int nsync_shift = 0;
+    int tcspc_shift = 10;
+    int chan_shift = 25;
+    int special_shift = 31;
+    sync = (record >> nsync_shift) & nsync_mask;
+    tcspc = (record >> tcspc_shift) & tcspc_mask;
+    channel = (record >> chan_shift) & chan_mask;
+    special = (record >> special_shift) & special_mask;
+}
+
+/**
+* Last line of a frame in a synchronized or replayed snap: the snap sums
+* n_frame_repeats_ scans, so it only ends once that many have completed.
+*/
+void MH_camera::SnapFrameEnded() {
+    if (++snapFramesDone_ >= n_frame_repeats_) {
+        stopAcq_ = true;
+    }
+}
+
+/**
+* Updates the line/frame/overflow state from one special record.
+*/
+void MH_camera::HandleMarker(unsigned int record) {
+    bool special;
+    unsigned int tcspc;
+    unsigned int channel;
+    unsigned int nsync;
+
+    Interpret_TTTR(record, nsync, tcspc, channel, special);
+    //NEED TO ACCOUNT FOR ROLLOVERS - Every 1024 syncs it'll overflow, as it is a 10-bit counter
+    uint64_t overflowtime = (uint64_t)overflow_counter_ * ((uint64_t)1024);
+    uint64_t timestamp = (uint64_t)nsync + overflowtime;//in sync periods, TimestampDeltaToPs() converts
+    //Handle special tagged channel numbers here:
+    //Line start - 000010 :: Line end - 000001 :: Frame start - 000011
+    switch (channel) {
+        case 1:
+            //Use for pixel timing - the scale for the next line comes from this one
+            last_line_end_ = timestamp;
+            line_end_clock_seen_ = true;
+            if (last_line_end_ > last_line_start_) {
+                UpdateLineScale(last_line_end_ - last_line_start_);
+            }
+            if (frame_active_ && current_line_ == n_scanPixels_Y_ - 1) {
+                if (streaming_) {
+                    FrameCompleted();
+                }
+                else if (stopOnFrameEnd_) {
+                    SnapFrameEnded();
+                }
+            }
+            break;
+        case 2:
+            if (!line_end_clock_seen_ && last_line_start_ != 0 && timestamp > last_line_start_) {
+                //No line-end clock: take the active part of the last line period
+                UpdateLineScale((uint64_t)((double)(timestamp - last_line_start_) * (1.0 - flyback_fraction_)));
+            }
+            last_line_start_ = timestamp;
+            if (frame_active_) {
+                //Once we've had a frame clock...
+                current_line_++;
+                if (previewing_ && current_line_ > 0) {
+                    PublishPreview();
+                }
+                if (!line_end_clock_seen_ && current_line_ == n_scanPixels_Y_) {
+                    //Without a line-end clock the last line only ends when the next one starts
+                    if (streaming_) {
+                        FrameCompleted();
+                    }
+                    else if (stopOnFrameEnd_) {
+                        SnapFrameEnded();
+                    }
+                }
+            }
+            if (current_line_ > cameraCCDYSize_) {
+                frame_active_ = false;
+            }
+            break;
+        case 3:
+        case 4: //frame clock
+            if (streaming_ && frame_active_ && current_line_ >= 0 && !frame_completed_) {
+                //Frame clock before the line count was reached - hand over what we have
+                FrameCompleted();
+            }
+            frame_completed_ = false;
+            current_line_ = -1;//First line clock will then correspond to line 0, assuming it comes right after the frame clock?
+            frame_active_ = true;
+            n_frame_tracker_++;
+            break;
+        case 63:
+            overflow_counter_ += nsync;
+            break;
+        default:
+            break;
+    }
+}
+
+/**
+* Live mode: hands the partial frame to the frame service thread every
+* previewLines_ lines or previewIntervalMs_, from the line start clock. The
+* counts are not cleared, so the full frame still comes out at the end.
+* Previews are tagged MH-PartialFrame and don't advance the image counter;
+* previewing_ keeps them out of anything but live mode. A preview is skipped
+* rather than wait for the frame service thread.
+*/
+void MH_camera::PublishPreview() {
+    if (previewMode_ == PREVIEW_LINES) {
+        if (++previewLineCount_ < previewLines_)
+            return;
+    }
+    else {
+        LARGE_INTEGER now;
+        QueryPerformanceCounter(&now);
+        if ((double)(now.QuadPart - previewTicks_) * 1000.0 < previewIntervalMs_ * (double)perfFrequency_)
+            return;
+        previewTicks_ = now.QuadPart;
+    }
+    previewLineCount_ = 0;
+    if (acqPixels_ == 0 || framePool_.Pending() > 0 || stopAcq_)
+        return;
+    if (!binWorkers_.empty()) {
+        //The bin workers otherwise only catch up at frame ends and block ends
+        FlushBinRuns();
+    }
+    PublishFrameCounts(acqPixels_, false);
+    ApplyRoiFill(acqPixels_);
+    framePool_.Finish(true, true);
+    acqPixels_ = framePool_.Begin(false);
+}
+
+/**
+* Continuous sequences: called on the decoding thread when the last line of a
+* frame has ended. Every n_frame_repeats_ frames the sum goes to InsertImage()
+* and accumulation restarts; the measurement itself keeps running.
+*/
+void MH_camera::FrameCompleted() {
+    frame_completed_ = true;
+    if (stream_images_left_ <= 0 || stopAcq_) {
+        return;
+    }
+    if (++stream_frames_summed_ < n_frame_repeats_) {
+        return;
+    }
+    stream_frames_summed_ = 0;
+
+    if (acqPixels_ == 0) {
+        //Nothing binned into the pool (test pattern, mismatched geometry) - publish img_ in line
+        GenerateSyntheticImage(img_, GetSequenceExposure());
+        int ret = InsertImage();
+        if (ret != DEVICE_OK) {
+            stream_ret_ = ret;
+            stopAcq_ = true;
         }
-        else if (pixelType.compare(g_PixelType_16bit) == 0)
-        {
-            nComponents_ = 1;
-            img_.Resize(img_.Width(), img_.Height(), 2);
-            bitDepth_ = 16;
-            ret = DEVICE_OK;
+        else if (--stream_images_left_ <= 0) {
+            stopAcq_ = true;
         }
-        else
-        {
-            // on error switch to default pixel type
-            nComponents_ = 1;
-            img_.Resize(img_.Width(), img_.Height(), 1);
-            pProp->Set(g_PixelType_8bit);
-            bitDepth_ = 8;
-            ret = ERR_UNKNOWN_MODE;
+        else {
+            triggerSteps_++;
         }
+        return;
     }
-    break;
-    case MM::BeforeGet:
+
+    if (binLifetimes_ != &MH_camera::BinPhotonsNone) {
+        //The lifetime summaries are single buffered, let InsertImage() finish the previous frame with its own.
+        //Woken by Published(); the timeout only lets a stopping measurement get out
+        while (!framePool_.WaitIdle(FRAME_IDLE_WAIT_MS) && !stopAcq_) {
+        }
+        GenerateSyntheticImage(img_, GetSequenceExposure());
+        ResetLifetimeAccumulators();
+    }
+    //The frame service thread inserts it, binning carries on from zero counts
+    PublishFrameCounts(acqPixels_, true);
+    ApplyRoiFill(acqPixels_);
+    framePool_.Finish(true);
+    acqPixels_ = framePool_.Begin(false);
+    if (--stream_images_left_ <= 0) {
+        stopAcq_ = true;
+    }
+    else {
+        //The measurement runs on, the frame service thread steps the trigger device
+        triggerSteps_++;
+    }
+}
+
+/**
+* Frame service thread body: steps the trigger device for finished frames,
+* inserts queued frames in order and zeroes used frames until start_acq()
+* raises stopFrameService_ and the queue is empty.
+*/
+int MH_camera::ServiceFramesOnThread()
+{
+    while (1)
     {
-        long bytesPerPixel = GetImageBytesPerPixel();
-        if (bytesPerPixel == 1)
-        {
-            pProp->Set(g_PixelType_8bit);
+        bool stopping = stopFrameService_;
+        //Before the insert, the step is already late for the frame being acquired
+        while (triggerSteps_ > 0 && !stopAcq_) {
+            triggerSteps_--;
+            FireTrigger();
         }
-        else if (bytesPerPixel == 2)
-        {
-            pProp->Set(g_PixelType_16bit);
+        int frame = framePool_.NextQueued();
+        if (frame >= 0) {
+            bool preview;
+            const unsigned char* pixels = framePool_.Publish(frame, preview);
+            int ret = InsertImage(pixels, preview);
+            framePool_.Published(frame);
+            if (ret != DEVICE_OK) {
+                stream_ret_ = ret;
+                stopAcq_ = true;
+            }
+            continue;
         }
-        //else if (bytesPerPixel == 4)
-        //{
-        //    if (nComponents_ == 1)
-        //    {
-        //        pProp->Set(::g_PixelType_32bit);
-        //    }
-        //} 
-        else
-        {
-            pProp->Set(g_PixelType_8bit);
+        if (framePool_.ClearOne()) {
+            continue;
         }
-        ret = DEVICE_OK;
-    } break;
-    default:
-        break;
+        if (stopping) {
+            break;
+        }
+        Sleep(1);
     }
-    return ret;
+    return DEVICE_OK;
 }
 
 /**
-* Handles "BitDepth" property.
+* Books the beam photons of a run that BinPhotonsT could not place: before
+* the first frame clock/line timing, or in X/Y flyback.
 */
-int MH_camera::OnBitDepth(MM::PropertyBase* pProp, MM::ActionType eAct)
-{
-    int ret = DEVICE_ERR;
-    switch (eAct)
-    {
-    case MM::AfterSet:
-    {
-        if (IsCapturing())
-            return DEVICE_CAMERA_BUSY_ACQUIRING;
+void MH_camera::CountDroppedRun(const unsigned int* records, int nRecords, const BinContext& ctx) {
+    int64_t beamPhotons = 0;
+    for (int i = 0; i < nRecords; i++) {
+        beamPhotons += beamLUT_[(records[i] >> 25) & 0x3F].inc;
+    }
+    if (ctx.noFrame)
+        statDroppedNoFrame_.fetch_add(beamPhotons, std::memory_order_relaxed);
+    else
+        statDroppedFlyback_.fetch_add(beamPhotons, std::memory_order_relaxed);
+}
 
-        long bitDepth;
-        pProp->Get(bitDepth);
+MH_camera::BinContext MH_camera::CurrentBinContext() const {
+    BinContext ctx;
+    ctx.overflowtime = (uint64_t)overflow_counter_ * ((uint64_t)1024);
+    ctx.lineStart = last_line_start_;
+    ctx.scale = line_pixel_scale_;
+    ctx.line = current_line_;
+    ctx.valid = LineContextValid();
+    ctx.noFrame = !frame_active_ || current_line_ < 0 || line_pixel_scale_ == 0;
+    return ctx;
+}
 
-        unsigned int bytesPerComponent;
+void MH_camera::CountLiveRates(const unsigned int* records, int nRecords) {
+    for (int i = 0; i < nRecords; i++) {
+        unsigned int chan = (records[i] >> 25) & 0x3F;
+        if (chan < MAX_N_CHANNELS) {
+            live_rates[chan] += 1;
+        }
+    }
+}
 
-        switch (bitDepth) {
-        case 8:
-            bytesPerComponent = 1;
-            bitDepth_ = 8;
-            ret = DEVICE_OK;
-            break;
-        case 10:
-            bytesPerComponent = 2;
-            bitDepth_ = 10;
-            ret = DEVICE_OK;
-            break;
-        case 12:
-            bytesPerComponent = 2;
-            bitDepth_ = 12;
-            ret = DEVICE_OK;
-            break;
-        case 14:
-            bytesPerComponent = 2;
-            bitDepth_ = 14;
-            ret = DEVICE_OK;
-            break;
-        case 16:
-            bytesPerComponent = 2;
-            bitDepth_ = 16;
-            ret = DEVICE_OK;
-            break;
-        case 32:
-            bytesPerComponent = 4;
-            bitDepth_ = 32;
-            ret = DEVICE_OK;
-            break;
-        default:
-            // on error switch to default pixel type
-            bytesPerComponent = 1;
+/**
+* Refreshes the per-line fixed point scale from the active duration of the
+* last line. One division per line instead of two per photon.
+*/
+void MH_camera::UpdateLineScale(uint64_t active_syncs) {
+    if (active_syncs == 0)
+        return;
+    uint64_t steps = (line_map_mode_ == LINE_MAP_LINEAR) ? (uint64_t)n_scanPixels_X_ : (uint64_t)LINE_MAP_SIZE;
+    line_pixel_scale_ = (steps << 32) / active_syncs;
+    pixel_dwelltime_ps_ = TimestampDeltaToPs(active_syncs) / n_scanPixels_X_;
+}
 
-            pProp->Set((long)8);
-            bitDepth_ = 8;
-            ret = ERR_UNKNOWN_MODE;
-            break;
-        }
-        char buf[MM::MaxStrLength];
-        GetProperty(MM::g_Keyword_PixelType, buf);
-        std::string pixelType(buf);
-        unsigned int bytesPerPixel = 1;
+/**
+* Fills line_map_ (phase step -> pixel) for the table based line maps.
+* A resonant scanner moves as (1 - cos(pi * phase)) / 2 across the line.
+*/
+void MH_camera::BuildLineMap() {
+    const double pi = 3.14159265358979323846;
+    unsigned int nPixels = (unsigned int)n_scanPixels_X_;
+    for (int i = 0; i < LINE_MAP_SIZE; i++) {
+        double phase = ((double)i + 0.5) / (double)LINE_MAP_SIZE;
+        double position = (1.0 - cos(pi * phase)) / 2.0;
+        line_map_[i] = (std::min)((unsigned int)(position * nPixels), nPixels - 1);
+    }
+    line_map_[LINE_MAP_SIZE] = nPixels; //Past the end of the line - flyback
+}
 
+/**
+* Bins a run of photon records that all share the current line context,
+* i.e. there is no marker anywhere in the run. One instantiation per pixel
+* type, count policy and line map; the beam layout comes from beamLUT_, so
+* the loop itself has no branches or divisions.
+*/
+template <class PixelT, class CountPolicy, class LineMap>
+void MH_camera::BinPhotonsT(const unsigned int* records, int nRecords, const BinContext& ctx) {
+    //Line context can only change at a marker, so the flyback/position checks are per run
+    if (!ctx.valid) {
+        //X flyback, an unknown position in the scan (Y flyback, before the first frame clock) or no line timing yet
+        //Ignore it for now and just lose the counts. Worst case is just losing one line's worth?
+        CountDroppedRun(records, nRecords, ctx);
+        return;
+    }
 
-        // automagickally change pixel type when bit depth exceeds possible value
-        if (pixelType.compare(g_PixelType_8bit) == 0)
-        {
-            if (2 == bytesPerComponent)
-            {
-                SetProperty(MM::g_Keyword_PixelType, g_PixelType_16bit);
-                bytesPerPixel = 2;
+    uint64_t overflowtime = ctx.overflowtime;
+    uint64_t line_start = ctx.lineStart;
+    uint64_t scale = ctx.scale;
+    uint64_t nPixels = (uint64_t)n_scanPixels_X_;
+    const unsigned int* map = &line_map_[0];
+    int lineOffset = ctx.line * cameraCCDXSize_;
+    PixelT* pixels = reinterpret_cast<PixelT*>(&frameCounts_[0]);
+    int64_t beamPhotons = 0;
+    int64_t binned = 0;
+
+    for (int i = 0; i < nRecords; i++) {
+        unsigned int record = records[i];
+        const BeamLUTEntry& beam = beamLUT_[(record >> 25) & 0x3F];
+        uint64_t x_px = LineMap::Pixel(((uint64_t)(record & 0x3FF) + overflowtime) - line_start, scale, map);
+        //Flyback photons and non-beam channels (e.g. NDD) both end up "adding" nothing at beam.offset,
+        //the first pixel of the owning tile (offset 0 for non-beam channels)
+        int keep = -(int)(x_px < nPixels);
+        int inc = beam.inc & keep;
+        CountPolicy::Add(pixels[beam.offset + ((lineOffset + (int)x_px) & beam.mask & keep)], (PixelT)inc);
+        beamPhotons += beam.inc;
+        binned += inc;
+    }
+    statPhotonsBinned_.fetch_add(binned, std::memory_order_relaxed);
+    statDroppedFlyback_.fetch_add(beamPhotons - binned, std::memory_order_relaxed);
+}
+
+/**
+* ROI counterpart of BinPhotonsT: only pixels inside the ROI(s) exist in the
+* output, which is the ROI (or multi-ROI bounding box) sized frame. The run's
+* line is fixed, so each beam's row of the span table is looked up once per
+* run; a photon then costs one empty-row test or a short span scan. Photons
+* outside every ROI are discarded on purpose and not booked as dropped.
+*/
+template <class PixelT, class CountPolicy, class LineMap>
+void MH_camera::BinPhotonsRoiT(const unsigned int* records, int nRecords, const BinContext& ctx) {
+    if (!ctx.valid) {
+        CountDroppedRun(records, nRecords, ctx);
+        return;
+    }
+
+    uint64_t overflowtime = ctx.overflowtime;
+    uint64_t line_start = ctx.lineStart;
+    uint64_t scale = ctx.scale;
+    uint64_t nPixels = (uint64_t)n_scanPixels_X_;
+    const unsigned int* map = &line_map_[0];
+    const RoiSpan* spans = roiSpans_.empty() ? 0 : &roiSpans_[0];
+    PixelT* pixels = reinterpret_cast<PixelT*>(&frameCounts_[0]);
+    int64_t beamPhotons = 0;
+    int64_t binned = 0;
+    int64_t flyback = 0;
+
+    int first[BEAM_LUT_SIZE], last[BEAM_LUT_SIZE], base[BEAM_LUT_SIZE];
+    for (int channel = 0; channel < BEAM_LUT_SIZE; channel++) {
+        const BeamLUTEntry& beam = beamLUT_[channel];
+        int row = beam.y + ctx.line;
+        if (beam.inc && row < cameraCCDYSize_) {
+            first[channel] = roiRowStart_[row];
+            last[channel] = roiRowStart_[row + 1];
+            base[channel] = roiRowBase_[row] + beam.x;
+        }
+        else {
+            first[channel] = last[channel] = base[channel] = 0;
+        }
+    }
+
+    for (int i = 0; i < nRecords; i++) {
+        unsigned int record = records[i];
+        unsigned int channel = (record >> 25) & 0x3F;
+        beamPhotons += beamLUT_[channel].inc;
+        int span = first[channel], end = last[channel];
+        if (span == end) {
+            continue; //Not a beam, or no ROI pixel on this beam's line
+        }
+        uint64_t x_px = LineMap::Pixel(((uint64_t)(record & 0x3FF) + overflowtime) - line_start, scale, map);
+        if (x_px >= nPixels) {
+            flyback++;
+            continue;
+        }
+        int column = beamLUT_[channel].x + (int)x_px;
+        //Spans are sorted and disjoint, so stop at the first one that ends past the column
+        for (; span < end; span++) {
+            if (column < spans[span].x1) {
+                if (column >= spans[span].x0) {
+                    CountPolicy::Add(pixels[base[channel] + (int)x_px], (PixelT)1);
+                    binned++;
+                }
+                break;
             }
+        }
+    }
+    statPhotonsBinned_.fetch_add(binned, std::memory_order_relaxed);
+    statDroppedFlyback_.fetch_add(flyback, std::memory_order_relaxed);
+}
+
+/**
+* FLIM mode counterpart of BinPhotonsT: adds each photon to its pixel's decay
+* histogram instead of the intensity image. Arrivals past the last histogram
+* bin are dropped the same way flyback photons are.
+*/
+template <class LineMap>
+void MH_camera::BinDecaysT(const unsigned int* records, int nRecords, const BinContext& ctx) {
+    if (!ctx.valid) {
+        return;
+    }
+
+    uint64_t overflowtime = ctx.overflowtime;
+    uint64_t line_start = ctx.lineStart;
+    uint64_t scale = ctx.scale;
+    uint64_t nPixels = (uint64_t)n_scanPixels_X_;
+    const unsigned int* map = &line_map_[0];
+    int lineOffset = ctx.line * cameraCCDXSize_;
+    unsigned short* cube = decayCube_;
+    unsigned int nBins = (unsigned int)flimBins_;
+    int shift = flimBinShift_;
+
+    for (int i = 0; i < nRecords; i++) {
+        unsigned int record = records[i];
+        const BeamLUTEntry& beam = beamLUT_[(record >> 25) & 0x3F];
+        uint64_t x_px = LineMap::Pixel(((uint64_t)(record & 0x3FF) + overflowtime) - line_start, scale, map);
+        unsigned int bin = ((record >> 10) & 0x7FFF) >> shift;
+        int keep = -(int)((x_px < nPixels) & (bin < nBins));
+        size_t pixel = (size_t)(beam.offset + ((lineOffset + (int)x_px) & beam.mask & keep));
+        SaturatingCount::Add(cube[pixel * nBins + (bin & keep)], (unsigned short)(beam.inc & keep));
+    }
+}
+
+/**
+* Phasor mode counterpart of BinPhotonsT: adds the cos/sin of each photon's
+* TCSPC phase to its pixel. O(pixels) memory, so it keeps up at video rate.
+*/
+template <class LineMap>
+void MH_camera::BinPhasorT(const unsigned int* records, int nRecords, const BinContext& ctx) {
+    if (!ctx.valid) {
+        return;
+    }
+
+    uint64_t overflowtime = ctx.overflowtime;
+    uint64_t line_start = ctx.lineStart;
+    uint64_t scale = ctx.scale;
+    uint64_t nPixels = (uint64_t)n_scanPixels_X_;
+    const unsigned int* map = &line_map_[0];
+    int lineOffset = ctx.line * cameraCCDXSize_;
+    PhasorAccum* accum = &phasorAccum_[0];
+    const PhasorLUTEntry* lut = &phasorLUT_[0];
+
+    for (int i = 0; i < nRecords; i++) {
+        unsigned int record = records[i];
+        const BeamLUTEntry& beam = beamLUT_[(record >> 25) & 0x3F];
+        uint64_t x_px = LineMap::Pixel(((uint64_t)(record & 0x3FF) + overflowtime) - line_start, scale, map);
+        int keep = -(int)(x_px < nPixels);
+        float weight = (float)(beam.inc & keep);
+        const PhasorLUTEntry& phase = lut[(record >> (10 + 15 - PHASOR_LUT_BITS)) & ((1 << PHASOR_LUT_BITS) - 1)];
+        PhasorAccum& acc = accum[beam.offset + ((lineOffset + (int)x_px) & beam.mask & keep)];
+        acc.g += phase.cosPhase * weight;
+        acc.s += phase.sinPhase * weight;
+        acc.n += weight;
+    }
+}
+
+/**
+* Time gated counterpart of BinPhotonsT: looks up the photon's gate bits by
+* channel and TCSPC time and adds one to each gate it falls into. The gate
+* counts of a pixel are adjacent, so this is one cache line and no branches.
+*/
+template <class LineMap>
+void MH_camera::BinGatesT(const unsigned int* records, int nRecords, const BinContext& ctx) {
+    if (!ctx.valid) {
+        return;
+    }
+
+    uint64_t overflowtime = ctx.overflowtime;
+    uint64_t line_start = ctx.lineStart;
+    uint64_t scale = ctx.scale;
+    uint64_t nPixels = (uint64_t)n_scanPixels_X_;
+    const unsigned int* map = &line_map_[0];
+    int lineOffset = ctx.line * cameraCCDXSize_;
+    unsigned int* counts = &gateCounts_[0];
+    const unsigned char* lut = &gateLUT_[0];
+    int shift = gateShift_;
+
+    for (int i = 0; i < nRecords; i++) {
+        unsigned int record = records[i];
+        unsigned int channel = (record >> 25) & 0x3F;
+        const BeamLUTEntry& beam = beamLUT_[channel];
+        uint64_t x_px = LineMap::Pixel(((uint64_t)(record & 0x3FF) + overflowtime) - line_start, scale, map);
+        int keep = -(int)(x_px < nPixels) & -beam.inc;
+        unsigned int gates = lut[channel * GATE_LUT_STEPS + ((((record >> 10) & 0x7FFF) >> shift) & (GATE_LUT_STEPS - 1))] & (unsigned int)keep;
+        unsigned int* px = counts + (size_t)(beam.offset + ((lineOffset + (int)x_px) & beam.mask & keep)) * MAX_GATES;
+        px[0] += gates & 1;
+        px[1] += (gates >> 1) & 1;
+        px[2] += (gates >> 2) & 1;
+        px[3] += (gates >> 3) & 1;
+    }
+}
+
+//The 32 bit frame counts can't overflow within any sensible integration, so the
+//kernels just add; the count overflow policy applies when they are narrowed
+MH_camera::BinPhotonsFn MH_camera::PickBinPhotons(int lineMap) {
+    if (lineMap == LINE_MAP_LINEAR) {
+        return &MH_camera::BinPhotonsT<unsigned int, WrappingCount, LinearLineMap>;
+    }
+    return &MH_camera::BinPhotonsT<unsigned int, WrappingCount, TableLineMap>;
+}
+
+MH_camera::BinPhotonsFn MH_camera::PickBinPhotonsRoi(int lineMap) {
+    if (lineMap == LINE_MAP_LINEAR) {
+        return &MH_camera::BinPhotonsRoiT<unsigned int, WrappingCount, LinearLineMap>;
+    }
+    return &MH_camera::BinPhotonsRoiT<unsigned int, WrappingCount, TableLineMap>;
+}
+
+MH_camera::AccumulatorKey MH_camera::CurrentAccumulatorKey() const {
+    AccumulatorKey key;
+    memset(&key, 0, sizeof(key));
+    key.width = img_.Width();
+    key.height = img_.Height();
+    key.depth = img_.Depth();
+    key.beamsX = n_beams_X_;
+    key.beamsY = n_beams_Y_;
+    key.scanX = n_scanPixels_X_;
+    key.scanY = n_scanPixels_Y_;
+    key.saturate = saturateCounts_;
+    key.lineMap = line_map_mode_;
+    key.mode = mode_;
+    key.flimBins = (mode_ == MODE_MH_FLIM) ? flimBins_ : 0;
+    key.roi = roiGeneration_;
+    key.gates = gateGeneration_;
+    key.correction = beamCorrGeneration_;
+    return key;
+}
+
+/**
+* Turns the current ROI, or every rectangle of a multi-ROI, into the sorted,
+* merged per-row span table BinPhotonsRoiT tests photons against. For a
+* multi-ROI the uncovered parts of the bounding box go into roiFill_.
+* Returns false if no ROI pixel lies inside the mosaic.
+*/
+bool MH_camera::BuildRoiSpans() {
+    int width = (int)img_.Width();
+    int height = (int)img_.Height();
+    int boxX1 = (std::min)((int)roiX_ + width, (int)cameraCCDXSize_);
+    int boxY1 = (std::min)((int)roiY_ + height, (int)cameraCCDYSize_);
+    size_t nRois = multiROIXs_.size();
+    std::vector<std::vector<RoiSpan> > rows(cameraCCDYSize_);
+    for (size_t i = 0; i < (nRois ? nRois : 1); i++) {
+        int x0 = nRois ? (int)multiROIXs_[i] : (int)roiX_;
+        int y0 = nRois ? (int)multiROIYs_[i] : (int)roiY_;
+        int x1 = (std::min)(x0 + (nRois ? (int)multiROIWidths_[i] : width), boxX1);
+        int y1 = (std::min)(y0 + (nRois ? (int)multiROIHeights_[i] : height), boxY1);
+        for (int y = y0; y < y1 && x0 < x1; y++) {
+            RoiSpan span = { x0, x1 };
+            rows[y].push_back(span);
+        }
+    }
+
+    roiSpans_.clear();
+    roiFill_.clear();
+    roiRowStart_.assign(cameraCCDYSize_ + 1, 0);
+    roiRowBase_.assign(cameraCCDYSize_, 0);
+    for (int y = 0; y < cameraCCDYSize_; y++) {
+        std::vector<RoiSpan>& row = rows[y];
+        std::sort(row.begin(), row.end(), [](const RoiSpan& a, const RoiSpan& b) { return a.x0 < b.x0; });
+        roiRowStart_[y] = (int)roiSpans_.size();
+        roiRowBase_[y] = (y - (int)roiY_) * width - (int)roiX_;
+        for (size_t i = 0; i < row.size(); i++) {
+            if (roiSpans_.size() > (size_t)roiRowStart_[y] && row[i].x0 <= roiSpans_.back().x1)
+                roiSpans_.back().x1 = (std::max)(roiSpans_.back().x1, row[i].x1);
             else
-            {
-                bytesPerPixel = 1;
+                roiSpans_.push_back(row[i]);
+        }
+        if (nRois == 0 || y < (int)roiY_ || y >= (int)roiY_ + height)
+            continue;
+        int column = (int)roiX_;
+        for (size_t i = (size_t)roiRowStart_[y]; i < roiSpans_.size(); i++) {
+            if (roiSpans_[i].x0 > column) {
+                PixelRun run = { roiRowBase_[y] + column, roiRowBase_[y] + roiSpans_[i].x0 };
+                roiFill_.push_back(run);
             }
+            column = roiSpans_[i].x1;
         }
-        else if (pixelType.compare(g_PixelType_16bit) == 0)
-        {
-            bytesPerPixel = 2;
+        if (column < (int)roiX_ + width) {
+            PixelRun run = { roiRowBase_[y] + column, roiRowBase_[y] + (int)roiX_ + width };
+            roiFill_.push_back(run);
         }
-        img_.Resize(img_.Width(), img_.Height(), bytesPerPixel);
+    }
+    roiRowStart_[cameraCCDYSize_] = (int)roiSpans_.size();
+    return !roiSpans_.empty();
+}
 
-    } break;
-    case MM::BeforeGet:
-    {
-        pProp->Set((long)bitDepth_);
-        ret = DEVICE_OK;
-    } break;
-    default:
-        break;
+//SSE2 has no unsigned 32 bit compare, so the counts are biased into signed range
+template <bool Saturate>
+static inline __m128i LimitCounts(__m128i counts, __m128i maxValue, __m128i maxBiased)
+{
+    if (!Saturate)
+        return _mm_and_si128(counts, maxValue);
+    __m128i over = _mm_cmpgt_epi32(_mm_xor_si128(counts, _mm_set1_epi32((int)0x80000000)), maxBiased);
+    return _mm_or_si128(_mm_andnot_si128(over, counts), _mm_and_si128(over, maxValue));
+}
+
+template <bool Saturate>
+static void NarrowCounts(const unsigned int* counts, unsigned char* out, size_t n)
+{
+    const __m128i maxValue = _mm_set1_epi32(0xFF);
+    const __m128i maxBiased = _mm_set1_epi32((int)(0xFFu ^ 0x80000000u));
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        const __m128i* in = (const __m128i*)(counts + i);
+        __m128i lo = _mm_packs_epi32(LimitCounts<Saturate>(_mm_loadu_si128(in), maxValue, maxBiased), LimitCounts<Saturate>(_mm_loadu_si128(in + 1), maxValue, maxBiased));
+        __m128i hi = _mm_packs_epi32(LimitCounts<Saturate>(_mm_loadu_si128(in + 2), maxValue, maxBiased), LimitCounts<Saturate>(_mm_loadu_si128(in + 3), maxValue, maxBiased));
+        _mm_storeu_si128((__m128i*)(out + i), _mm_packus_epi16(lo, hi));
+    }
+    for (; i < n; i++) {
+        out[i] = (unsigned char)(Saturate ? (std::min)(counts[i], 0xFFu) : counts[i]);
+    }
+}
+
+template <bool Saturate>
+static void NarrowCounts(const unsigned int* counts, unsigned short* out, size_t n)
+{
+    const __m128i maxValue = _mm_set1_epi32(0xFFFF);
+    const __m128i maxBiased = _mm_set1_epi32((int)(0xFFFFu ^ 0x80000000u));
+    //packs_epi32 is signed: shift down by 0x8000, pack, and flip the top bit back
+    const __m128i half = _mm_set1_epi32(0x8000);
+    const __m128i flip = _mm_set1_epi16((short)0x8000);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        const __m128i* in = (const __m128i*)(counts + i);
+        __m128i lo = _mm_sub_epi32(LimitCounts<Saturate>(_mm_loadu_si128(in), maxValue, maxBiased), half);
+        __m128i hi = _mm_sub_epi32(LimitCounts<Saturate>(_mm_loadu_si128(in + 1), maxValue, maxBiased), half);
+        _mm_storeu_si128((__m128i*)(out + i), _mm_xor_si128(_mm_packs_epi32(lo, hi), flip));
+    }
+    for (; i < n; i++) {
+        out[i] = (unsigned short)(Saturate ? (std::min)(counts[i], 0xFFFFu) : counts[i]);
+    }
+}
+
+//cvtepi32_ps is signed, so the two 16 bit halves are converted separately and
+//recombined: exact up to 2^24 counts, rounded like (float) beyond
+static void CountsToFloat(const unsigned int* counts, float* out, size_t n)
+{
+    const __m128i low = _mm_set1_epi32(0xFFFF);
+    const __m128 scale = _mm_set1_ps(65536.0f);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(counts + i));
+        __m128 hi = _mm_mul_ps(_mm_cvtepi32_ps(_mm_srli_epi32(v, 16)), scale);
+        _mm_storeu_ps(out + i, _mm_add_ps(hi, _mm_cvtepi32_ps(_mm_and_si128(v, low))));
+    }
+    for (; i < n; i++) {
+        out[i] = (float)counts[i];
     }
-    return ret;
 }
+
 /**
-* Handles "ReadoutTime" property.
+* Writes the 32 bit frame counts into a frame of the image's pixel type, once
+* per published frame: saturated or wrapped as the count overflow property
+* says for 8/16 bit, as float32 for 32 bit (GRAY32 to the core).
 */
-int MH_camera::OnReadoutTime(MM::PropertyBase* pProp, MM::ActionType eAct)
+void MH_camera::PublishFrameCounts(unsigned char* pixels, bool clear)
 {
-    if (eAct == MM::AfterSet)
-    {
-        double readoutMs;
-        pProp->Get(readoutMs);
+    size_t n = (size_t)img_.Width() * img_.Height();
+    if (pixels == 0 || n == 0 || frameCounts_.size() != n)
+        return;
+    const unsigned int* counts = beamCorrActive_ ? CorrectFrameCounts() : &frameCounts_[0];
+    switch (img_.Depth()) {
+    case 1:
+        if (saturateCounts_)
+            NarrowCounts<true>(counts, pixels, n);
+        else
+            NarrowCounts<false>(counts, pixels, n);
+        break;
+    case 2:
+        if (saturateCounts_)
+            NarrowCounts<true>(counts, reinterpret_cast<unsigned short*>(pixels), n);
+        else
+            NarrowCounts<false>(counts, reinterpret_cast<unsigned short*>(pixels), n);
+        break;
+    case 4:
+        CountsToFloat(counts, reinterpret_cast<float*>(pixels), n);
+        break;
+    }
+    if (clear)
+        memset(&frameCounts_[0], 0, n * sizeof(unsigned int));
+}
 
-        readoutUs_ = readoutMs * 1000.0;
+template <class PixelT, class Run>
+static void FillPixelRuns(unsigned char* pixels, const std::vector<Run>& runs, int value)
+{
+    PixelT* p = reinterpret_cast<PixelT*>(pixels);
+    for (size_t i = 0; i < runs.size(); i++) {
+        std::fill(p + runs[i].begin, p + runs[i].end, (PixelT)value);
     }
-    else if (eAct == MM::BeforeGet)
-    {
-        pProp->Set(readoutUs_ / 1000.0);
+}
+
+/**
+* Writes the multi-ROI fill value into the bounding box pixels outside every
+* ROI. Those are never binned, so doing it once per finished frame is enough.
+*/
+void MH_camera::ApplyRoiFill(unsigned char* pixels) const {
+    if (pixels == 0 || roiFill_.empty() || multiROIFillValue_ == 0)
+        return;
+    switch (img_.Depth()) {
+    case 1:
+        FillPixelRuns<unsigned char>(pixels, roiFill_, multiROIFillValue_);
+        break;
+    case 2:
+        FillPixelRuns<unsigned short>(pixels, roiFill_, multiROIFillValue_);
+        break;
+    case 4:
+        FillPixelRuns<float>(pixels, roiFill_, multiROIFillValue_);
+        break;
+    }
+}
+
+/**
+* Rebuilds the channel -> beam tile table and picks the BinPhotonsT
+* instantiation for the current pixel type and count policy.
+*/
+void MH_camera::SelectAccumulator() {
+    //Making the assumption that channels correspond in order to beams as follows (e.g. for a 3x2 array - X assumed to always go first):
+    //X1Y1, X2Y1, X3Y1, X1Y2, X2Y2, X3Y2
+    int nBeamsTotal = n_beams_X_ * n_beams_Y_;
+    for (int channel = 0; channel < BEAM_LUT_SIZE; channel++) {
+        BeamLUTEntry& entry = beamLUT_[channel];
+        if (channel < nBeamsTotal) {
+            int tmpchan = (nBeamsTotal - 1) - channel;//change this to change order that beams are shown in
+            int x_shift = (tmpchan / n_beams_Y_) * n_scanPixels_X_;
+            int y_shift = (tmpchan % n_beams_Y_) * n_scanPixels_Y_;
+            entry.offset = x_shift + y_shift * cameraCCDXSize_;
+            entry.mask = ~0;
+            entry.inc = 1;
+            entry.x = x_shift;
+            entry.y = y_shift;
+        }
+        else {
+            entry.offset = 0;
+            entry.mask = 0;
+            entry.inc = 0;
+            entry.x = 0;
+            entry.y = 0;
+        }
     }
 
-    return DEVICE_OK;
-}
-
-int MH_camera::OnDropPixels(MM::PropertyBase* pProp, MM::ActionType eAct)
-{
-    if (eAct == MM::AfterSet)
-    {
-        long tvalue = 0;
-        pProp->Get(tvalue);
-        dropPixels_ = (0 == tvalue) ? false : true;
+    if (line_map_mode_ != LINE_MAP_LINEAR) {
+        BuildLineMap();
+    }
+
+    accumulatorKey_ = CurrentAccumulatorKey();
+    roiFill_.clear();
+    beamCorrActive_ = false;
+    //A cropped buffer is binned sparsely through the ROI span table; the lifetime
+    //accumulators are still laid out over the whole mosaic
+    bool roi = img_.Width() != (unsigned)cameraCCDXSize_ || img_.Height() != (unsigned)cameraCCDYSize_;
+    bool gated = mode_ == MODE_MH_IMAGE && nGates_ > 0;
+    if (roi && (binSize_ != 1 || mode_ == MODE_MH_FLIM || mode_ == MODE_MH_PHASOR || gated || !BuildRoiSpans())) {
+        //Binned buffers don't match the beam tiles - count rates only rather than write out of bounds
+        LogMessage("Image buffer is neither the full multibeam mosaic nor an intensity ROI of it, photons will not be binned");
+        binPhotons_ = &MH_camera::BinPhotonsNone;
+        binLifetimes_ = &MH_camera::BinPhotonsNone;
+        acqPixels_ = 0;
+        frameCounts_.clear();
+        return;
     }
-    else if (eAct == MM::BeforeGet)
-    {
-        pProp->Set(dropPixels_ ? 1L : 0L);
+    binLifetimes_ = &MH_camera::BinPhotonsNone;
+    if (mode_ == MODE_MH_FLIM && SetupDecayCube()) {
+        binLifetimes_ = (line_map_mode_ == LINE_MAP_LINEAR) ? &MH_camera::BinDecaysT<LinearLineMap> : &MH_camera::BinDecaysT<TableLineMap>;
+    }
+    else if (mode_ == MODE_MH_PHASOR && SetupPhasor()) {
+        binLifetimes_ = (line_map_mode_ == LINE_MAP_LINEAR) ? &MH_camera::BinPhasorT<LinearLineMap> : &MH_camera::BinPhasorT<TableLineMap>;
+    }
+    else if (gated && SetupGates()) {
+        binLifetimes_ = (line_map_mode_ == LINE_MAP_LINEAR) ? &MH_camera::BinGatesT<LinearLineMap> : &MH_camera::BinGatesT<TableLineMap>;
     }
+    if (!framePool_.Allocate(img_.Width(), img_.Height(), img_.Depth())) {
+        LogMessage("Could not allocate the frame pool, photons will not be binned");
+        binPhotons_ = &MH_camera::BinPhotonsNone;
+        acqPixels_ = 0;
+        frameCounts_.clear();
+        return;
+    }
+    frameCounts_.assign((size_t)img_.Width() * img_.Height(), 0);
+    switch (img_.Depth()) {
+    case 1:
+    case 2:
+    case 4:
+        binPhotons_ = roi ? PickBinPhotonsRoi(line_map_mode_) : PickBinPhotons(line_map_mode_);
+        if (beamCorrection_ && roi)
+            LogMessage("Beam correction needs the full multibeam mosaic, frames will not be corrected");
+        else if (beamCorrection_)
+            SetupBeamCorrection();
+        break;
+    default:
+        binPhotons_ = &MH_camera::BinPhotonsNone;
+        frameCounts_.clear();
+        break;
+    }
+}
 
-    return DEVICE_OK;
+/**
+* TCSPC time bins in one (divided) sync period - the TCSPC time restarts every
+* sync, so this is the useful range of record bits 10-24.
+*/
+double MH_camera::TcspcBinsPerSync() const {
+    double period_ps = (Syncrate > 0) ? 1e12 * SyncDivider / Syncrate : (double)MeasDesc_GlobalResolution_;
+    return (Resolution > 0) ? period_ps / Resolution : 32768.0;
 }
 
-int MH_camera::OnFastImage(MM::PropertyBase* pProp, MM::ActionType eAct)
-{
-    if (eAct == MM::AfterSet)
-    {
-        long tvalue = 0;
-        pProp->Get(tvalue);
-        fastImage_ = (0 == tvalue) ? false : true;
+/**
+* Sizes the decay cube for the current mosaic and histogram length and works
+* out how TCSPC bins fold into histogram bins for the current sync period.
+*/
+bool MH_camera::SetupDecayCube() {
+    size_t needed = (size_t)cameraCCDXSize_ * cameraCCDYSize_ * flimBins_;
+    if (needed != decayCubeSize_) {
+        if (decayCube_)
+            _aligned_free(decayCube_);
+        decayCubeSize_ = 0;
+        decayCube_ = (unsigned short*)_aligned_malloc(needed * sizeof(unsigned short), CACHE_LINE_BYTES);
+        if (decayCube_ == 0) {
+            LogMessage("Could not allocate the FLIM decay cube, decays will not be binned");
+            return false;
+        }
+        decayCubeSize_ = needed;
     }
-    else if (eAct == MM::BeforeGet)
-    {
-        pProp->Set(fastImage_ ? 1L : 0L);
+    memset(decayCube_, 0, decayCubeSize_ * sizeof(unsigned short));
+
+    double tcspc_per_period = TcspcBinsPerSync();
+    flimBinShift_ = 0;
+    while (flimBinShift_ < 15 && tcspc_per_period / (double)(1 << flimBinShift_) > flimBins_) {
+        flimBinShift_++;
     }
+    flimBinWidthPs_ = (Resolution > 0 ? Resolution : 1.0) * (1 << flimBinShift_);
 
-    return DEVICE_OK;
+    const double pi = 3.14159265358979323846;
+    flimCos_.resize(flimBins_);
+    flimSin_.resize(flimBins_);
+    for (int bin = 0; bin < flimBins_; bin++) {
+        double phase = 2.0 * pi * ((bin + 0.5) * (1 << flimBinShift_)) / tcspc_per_period;
+        flimCos_[bin] = cos(phase);
+        flimSin_[bin] = sin(phase);
+    }
+    return true;
 }
 
-int MH_camera::OnSaturatePixels(MM::PropertyBase* pProp, MM::ActionType eAct)
-{
-    if (eAct == MM::AfterSet)
-    {
-        long tvalue = 0;
-        pProp->Get(tvalue);
-        saturatePixels_ = (0 == tvalue) ? false : true;
+/**
+* Sizes the phasor sums for the current mosaic and fills the phase table for
+* the current sync period, indexed by the top PHASOR_LUT_BITS of the TCSPC time.
+*/
+bool MH_camera::SetupPhasor() {
+    phasorAccum_.resize((size_t)cameraCCDXSize_ * cameraCCDYSize_);
+    memset(&phasorAccum_[0], 0, phasorAccum_.size() * sizeof(PhasorAccum));
+
+    const double pi = 3.14159265358979323846;
+    double tcspc_per_period = TcspcBinsPerSync();
+    int lutShift = 15 - PHASOR_LUT_BITS;
+    phasorLUT_.resize(1 << PHASOR_LUT_BITS);
+    for (int i = 0; i < (1 << PHASOR_LUT_BITS); i++) {
+        double phase = 2.0 * pi * ((i + 0.5) * (1 << lutShift)) / tcspc_per_period;
+        phasorLUT_[i].cosPhase = (float)cos(phase);
+        phasorLUT_[i].sinPhase = (float)sin(phase);
     }
-    else if (eAct == MM::BeforeGet)
+    return true;
+}
+
+/**
+* Parses a comma separated list of numbers, empty meaning none.
+*/
+bool MH_camera::ParseNumberList(const std::string& text, std::vector<double>& values) {
+    values.clear();
+    std::istringstream list(text);
+    std::string item;
+    while (std::getline(list, item, ','))
     {
-        pProp->Set(saturatePixels_ ? 1L : 0L);
+        char* end = 0;
+        double value = strtod(item.c_str(), &end);
+        while (end != 0 && (*end == ' ' || *end == '\t'))
+            end++;
+        if (end == item.c_str() || *end != 0)
+            return false;
+        values.push_back(value);
     }
-
-    return DEVICE_OK;
+    return true;
 }
 
-int MH_camera::OnFractionOfPixelsToDropOrSaturate(MM::PropertyBase* pProp, MM::ActionType eAct)
-{
-    if (eAct == MM::AfterSet)
-    {
-        double tvalue = 0;
-        pProp->Get(tvalue);
-        fractionOfPixelsToDropOrSaturate_ = tvalue;
+/**
+* Compiles the beam correction properties for the current mosaic:
+*   corrected_b = gain_b(x, y) * sum_c M[b][c] * (counts_c - offset_c)
+* over the pixel (x, y) of every beam tile c. The offsets fold into one bias
+* per beam and zero matrix entries are dropped, so without crosstalk it is one
+* term per pixel. Settings that don't fit the beam layout are logged and left out.
+*/
+bool MH_camera::SetupBeamCorrection() {
+    int nBeams = (std::min)((int)(n_beams_X_ * n_beams_Y_), BEAM_LUT_SIZE);
+    size_t tilePixels = (size_t)n_scanPixels_X_ * n_scanPixels_Y_;
+    if (nBeams <= 0 || tilePixels == 0)
+        return false;
+    std::vector<double> gains, offsets, matrix;
+    ParseNumberList(beamGains_, gains);
+    ParseNumberList(beamOffsets_, offsets);
+    ParseNumberList(beamCrosstalk_, matrix);
+    if (!matrix.empty() && matrix.size() != (size_t)nBeams * nBeams) {
+        LogMessage("Beam crosstalk matrix does not match the number of beams, it is left out");
+        matrix.clear();
+    }
+
+    beamGainMap_.assign((size_t)nBeams * tilePixels, 1.0f);
+    if (!beamFlatField_.empty()) {
+        FILE* file = fopen(beamFlatField_.c_str(), "rb");
+        bool loaded = false;
+        if (file != 0) {
+            loaded = fread(&beamGainMap_[0], sizeof(float), beamGainMap_.size(), file) == beamGainMap_.size() && fgetc(file) == EOF;
+            fclose(file);
+        }
+        if (!loaded) {
+            LogMessage("Beam flat-field file is missing or not one float32 tile per beam, it is left out");
+            beamGainMap_.assign((size_t)nBeams * tilePixels, 1.0f);
+        }
     }
-    else if (eAct == MM::BeforeGet)
-    {
-        pProp->Set(fractionOfPixelsToDropOrSaturate_);
+    for (int beam = 0; beam < nBeams; beam++) {
+        float gain = gains.empty() ? 1.0f : (float)gains[(std::min)((size_t)beam, gains.size() - 1)];
+        float* map = &beamGainMap_[beam * tilePixels];
+        for (size_t i = 0; i < tilePixels; i++)
+            map[i] *= gain;
+    }
+
+    beamCorrTerms_.clear();
+    beamCorrRowStart_.assign(nBeams + 1, 0);
+    beamCorrBias_.assign(nBeams, 0.0f);
+    for (int beam = 0; beam < nBeams; beam++) {
+        beamCorrRowStart_[beam] = (int)beamCorrTerms_.size();
+        double bias = 0;
+        for (int source = 0; source < nBeams; source++) {
+            double weight = matrix.empty() ? (source == beam ? 1.0 : 0.0) : matrix[beam * nBeams + source];
+            if (weight == 0)
+                continue;
+            CrosstalkTerm term = { beamLUT_[source].offset, (float)weight };
+            beamCorrTerms_.push_back(term);
+            bias += weight * (offsets.empty() ? 0.0 : offsets[(std::min)((size_t)source, offsets.size() - 1)]);
+        }
+        beamCorrBias_[beam] = (float)bias;
     }
-
-    return DEVICE_OK;
+    beamCorrRowStart_[nBeams] = (int)beamCorrTerms_.size();
+    correctedCounts_.assign(frameCounts_.size(), 0);
+    beamCorrActive_ = true;
+    return true;
 }
 
-int MH_camera::OnShouldRotateImages(MM::PropertyBase* pProp, MM::ActionType eAct)
+/**
+* Runs the beam correction over the finished frame counts into
+* correctedCounts_, four pixels of a tile row at a time. Results are rounded
+* and clamped to [0, 2^31), the narrowing in PublishFrameCounts() does the rest.
+*/
+const unsigned int* MH_camera::CorrectFrameCounts()
 {
-    if (eAct == MM::AfterSet)
-    {
-        long tvalue = 0;
-        pProp->Get(tvalue);
-        shouldRotateImages_ = (tvalue != 0);
-    }
-    else if (eAct == MM::BeforeGet)
-    {
-        pProp->Set((long)shouldRotateImages_);
+    const unsigned int* counts = &frameCounts_[0];
+    unsigned int* out = &correctedCounts_[0];
+    int nBeams = (int)beamCorrBias_.size();
+    int scanX = (int)n_scanPixels_X_;
+    int scanY = (int)n_scanPixels_Y_;
+    size_t tilePixels = (size_t)scanX * scanY;
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 top = _mm_set1_ps(2147483520.0f); //Largest float below 2^31
+    for (int beam = 0; beam < nBeams; beam++) {
+        const CrosstalkTerm* terms = beamCorrTerms_.empty() ? 0 : &beamCorrTerms_[0] + beamCorrRowStart_[beam];
+        int nTerms = beamCorrRowStart_[beam + 1] - beamCorrRowStart_[beam];
+        float biasValue = beamCorrBias_[beam];
+        const __m128 bias = _mm_set1_ps(biasValue);
+        for (int y = 0; y < scanY; y++) {
+            size_t row = (size_t)y * cameraCCDXSize_;
+            unsigned int* dst = out + beamLUT_[beam].offset + row;
+            const float* gain = &beamGainMap_[beam * tilePixels + (size_t)y * scanX];
+            int x = 0;
+            for (; x + 4 <= scanX; x += 4) {
+                __m128 sum = zero;
+                for (int t = 0; t < nTerms; t++) {
+                    __m128i n = _mm_loadu_si128((const __m128i*)(counts + terms[t].offset + row + x));
+                    sum = _mm_add_ps(sum, _mm_mul_ps(_mm_set1_ps(terms[t].weight), _mm_cvtepi32_ps(n)));
+                }
+                __m128 v = _mm_mul_ps(_mm_sub_ps(sum, bias), _mm_loadu_ps(gain + x));
+                v = _mm_min_ps(_mm_max_ps(v, zero), top);
+                _mm_storeu_si128((__m128i*)(dst + x), _mm_cvtps_epi32(v));
+            }
+            for (; x < scanX; x++) {
+                float sum = 0;
+                for (int t = 0; t < nTerms; t++)
+                    sum += terms[t].weight * (float)(int)counts[terms[t].offset + row + x];
+                float v = (std::min)((std::max)((sum - biasValue) * gain[x], 0.0f), 2147483520.0f);
+                dst[x] = (unsigned int)(v + 0.5f);
+            }
+        }
     }
-
-    return DEVICE_OK;
+    return out;
 }
 
-int MH_camera::OnShouldDisplayImageNumber(MM::PropertyBase* pProp, MM::ActionType eAct)
-{
-    if (eAct == MM::AfterSet)
+/**
+* Parses a gate window property: "start-end" in ps for every channel, or a
+* comma separated list of them, one per T3 channel (the last one repeats).
+*/
+bool MH_camera::ParseGateWindows(const std::string& text, std::vector<std::pair<double, double> >& windows) {
+    windows.clear();
+    std::istringstream list(text);
+    std::string item;
+    while (std::getline(list, item, ','))
     {
-        long tvalue = 0;
-        pProp->Get(tvalue);
-        shouldDisplayImageNumber_ = (tvalue != 0);
+        double start = 0, end = 0;
+        if (sscanf(item.c_str(), "%lf-%lf", &start, &end) != 2 || start < 0 || end <= start)
+            return false;
+        windows.push_back(std::make_pair(start, end));
     }
-    else if (eAct == MM::BeforeGet)
-    {
-        pProp->Set((long)shouldDisplayImageNumber_);
+    return !windows.empty();
+}
+
+/**
+* Compiles the gate windows into gateLUT_ for the current sync period: one
+* row of GATE_LUT_STEPS gate bit masks per channel, indexed by the TCSPC time
+* >> gateShift_. A step is in a gate if its centre is inside the window, so
+* the gate edges are as fine as one step (Resolution << gateShift_).
+*/
+bool MH_camera::SetupGates() {
+    double tcspc_per_period = TcspcBinsPerSync();
+    gateShift_ = 0;
+    while (gateShift_ < 15 && tcspc_per_period / (double)(1 << gateShift_) > GATE_LUT_STEPS) {
+        gateShift_++;
+    }
+    double stepPs = (Resolution > 0 ? Resolution : 1.0) * (1 << gateShift_);
+
+    gateLUT_.assign(BEAM_LUT_SIZE * GATE_LUT_STEPS, 0);
+    for (int gate = 0; gate < nGates_; gate++) {
+        std::vector<std::pair<double, double> > windows;
+        if (!ParseGateWindows(gateWindows_[gate], windows))
+            continue;
+        for (int channel = 0; channel < BEAM_LUT_SIZE; channel++) {
+            const std::pair<double, double>& window = windows[(std::min)((size_t)channel, windows.size() - 1)];
+            unsigned char* row = &gateLUT_[channel * GATE_LUT_STEPS];
+            for (int step = 0; step < GATE_LUT_STEPS; step++) {
+                double t = (step + 0.5) * stepPs;
+                if (t >= window.first && t < window.second)
+                    row[step] |= (unsigned char)(1 << gate);
+            }
+        }
     }
+    gateCounts_.assign((size_t)cameraCCDXSize_ * cameraCCDYSize_ * MAX_GATES, 0);
+    return true;
+}
 
-    return DEVICE_OK;
+void MH_camera::ResetLifetimeAccumulators() {
+    if (binLifetimes_ == &MH_camera::BinPhotonsNone)
+        return;
+    if (mode_ == MODE_MH_FLIM && decayCube_)
+        memset(decayCube_, 0, decayCubeSize_ * sizeof(unsigned short));
+    else if (mode_ == MODE_MH_PHASOR && !phasorAccum_.empty())
+        memset(&phasorAccum_[0], 0, phasorAccum_.size() * sizeof(PhasorAccum));
+    else if (mode_ == MODE_MH_IMAGE && !gateCounts_.empty())
+        memset(&gateCounts_[0], 0, gateCounts_.size() * sizeof(unsigned int));
 }
 
-int MH_camera::OnStripeWidth(MM::PropertyBase* pProp, MM::ActionType eAct)
-{
-    if (eAct == MM::AfterSet)
-    {
-        pProp->Get(stripeWidth_);
-    }
-    else if (eAct == MM::BeforeGet)
-    {
-        pProp->Set(stripeWidth_);
+void MH_camera::FreeDecayCube() {
+    if (decayCube_) {
+        _aligned_free(decayCube_);
+        decayCube_ = 0;
     }
+    decayCubeSize_ = 0;
+    binLifetimes_ = &MH_camera::BinPhotonsNone;
+    memset(&accumulatorKey_, 0, sizeof(accumulatorKey_));
+}
 
-    return DEVICE_OK;
+void MH_camera::GenerateEmptyImage(ImgBuffer& img)
+{
+    MMThreadGuard g(imgPixelsLock_);
+    if (img.Height() == 0 || img.Width() == 0 || img.Depth() == 0)
+        return;
+    unsigned char* pBuf = const_cast<unsigned char*>(img.GetPixels());
+    memset(pBuf, 0, img.Height() * img.Width() * img.Depth());
 }
 
-int MH_camera::OnSupportsMultiROI(MM::PropertyBase* pProp, MM::ActionType eAct)
+
+
+/**
+* Generates an image.
+*
+*/
+
+void MH_camera::GenerateSyntheticImage(ImgBuffer& img, double exp)
 {
-    if (eAct == MM::AfterSet)
+
+    MMThreadGuard g(imgPixelsLock_);
+
+    if (mode_ == MODE_MH_TEST)
     {
-        long tvalue = 0;
-        pProp->Get(tvalue);
-        supportsMultiROI_ = (tvalue != 0);
+        if (GenerateMHTestPattern(img))
+            return;
     }
-    else if (eAct == MM::BeforeGet)
+    else if (mode_ == MODE_MH_HISTO)
     {
-        pProp->Set((long)supportsMultiROI_);
+        if (GenerateMHHisto(img))
+            return;
     }
-
-    return DEVICE_OK;
-}
-
-int MH_camera::OnMultiROIFillValue(MM::PropertyBase* pProp, MM::ActionType eAct)
-{
-    if (eAct == MM::AfterSet)
+    else if (mode_ == MODE_MH_DEVICE_HISTO)
     {
-        long tvalue = 0;
-        pProp->Get(tvalue);
-        multiROIFillValue_ = (int)tvalue;
+        if (GenerateDeviceHisto(img))
+            return;
     }
-    else if (eAct == MM::BeforeGet)
-    {
-        pProp->Set((long)multiROIFillValue_);
+    else if (mode_ == MODE_MH_IMAGE) {
+        if (nGates_ > 0)
+            GenerateGates(img);
+        if (GenerateMHImage(img))
+            return;
+    }
+    else if (mode_ == MODE_MH_FLIM) {
+        //Intensity is already in img, the decays were binned alongside it
+        GenerateDecay(img);
+        return;
+    }
+    else if (mode_ == MODE_MH_PHASOR) {
+        GeneratePhasor(img);
+        return;
     }
 
-    return DEVICE_OK;
+    //std::string pixelType;
+    char buf[MM::MaxStrLength];
+    GetProperty(MM::g_Keyword_PixelType, buf);
+    std::string pixelType(buf);
+
+    if (img.Height() == 0 || img.Width() == 0 || img.Depth() == 0) {
+        return;
+    }
 }
 
-/*
-* Handles "ScanMode" property.
-* Changes allowed Binning values to test whether the UI updates properly
+/**
+* Checkerboard of 50 pixel squares. Every row is one of two phases, which only
+* change with the image size and type, so they are rendered once and each
+* frame is just a row copy per line.
 */
-int MH_camera::OnScanMode(MM::PropertyBase* pProp, MM::ActionType eAct)
-{
-    if (eAct == MM::AfterSet) {
-        pProp->Get(scanMode_);
-        SetAllowedBinning();
-        if (initialized_) {
-            int ret = OnPropertiesChanged();
-            if (ret != DEVICE_OK)
-                return ret;
+bool MH_camera::GenerateMHTestPattern(ImgBuffer& img) {
+    unsigned width = img.Width(), height = img.Height(), depth = img.Depth();
+    const unsigned check_stride = 50;
+    size_t rowBytes = (size_t)width * depth;
+    if (depth != 1 && depth != 2 && depth != 4)
+        return true;
+
+    if (patternWidth_ != width || patternDepth_ != depth) {
+        patternRows_.assign(2 * rowBytes, 0);
+        //A lit square is all ones for the integer types, 1.0 for float32 (all ones is a NaN)
+        const float litFloat = 1.0f;
+        unsigned char lit[4] = { 0xFF, 0xFF, 0xFF, 0xFF };
+        if (depth == 4)
+            memcpy(lit, &litFloat, sizeof(lit));
+        for (unsigned x = 0; x < width; ++x) {
+            bool on = (x / check_stride) % 2 != 0;
+            if (on)
+                memcpy(&patternRows_[x * depth], lit, depth);
+            else
+                memcpy(&patternRows_[rowBytes + x * depth], lit, depth);
         }
+        patternWidth_ = width;
+        patternDepth_ = depth;
     }
-    else if (eAct == MM::BeforeGet) {
-        LogMessage("Reading property ScanMode", true);
-        pProp->Set(scanMode_);
+
+    unsigned char* pixels = const_cast<unsigned char*>(img.GetPixels());
+    for (unsigned y = 0; y < height; ++y) {
+        memcpy(pixels + y * rowBytes, &patternRows_[((y / check_stride) % 2) * rowBytes], rowBytes);
     }
-    return DEVICE_OK;
+    return true;
 }
 
-int MH_camera::Onn_beams_X(MM::PropertyBase* pProp, MM::ActionType eAct)
-{
-    if (eAct == MM::BeforeGet)
-    {
-        pProp->Set(n_beams_X_);
-    }
-    else if (eAct == MM::AfterSet)
-    {
-        long value;
-        pProp->Get(value);
-        if ((value < 1) || (8 < value))
-            return DEVICE_ERR;  // invalid image size
-        if (value != n_beams_X_)
-        {
-            n_beams_X_ = value;
-            cameraCCDXSize_ = n_scanPixels_X_ * n_beams_X_;
-            img_.Resize(cameraCCDXSize_ / binSize_, cameraCCDYSize_ / binSize_);
+bool MH_camera::GenerateMHImage(ImgBuffer& img) {
+    unsigned width = img.Width(), height = img.Height();
+    char buf[MM::MaxStrLength];
+    GetProperty(MM::g_Keyword_PixelType, buf);
+    std::string pixelType(buf);
+    int maxValue = 1 << GetBitDepth();
+
+    return true;
+}
+
+bool MH_camera::GenerateMHHisto(ImgBuffer& img) {
+    //Either display a bar chart with count rates or a decay curve
+    unsigned width = img.Width(), height = img.Height();
+    //Represent everything as having the same number of bins as the width of the image
+    bins_.resize(width);
+
+    //For chunks, e.g. one bar per actual channel in a bar chart...
+    int n_channels = MAX_N_CHANNELS;
+
+    double exposure_scaling_factor = (1000 / GetExposure());
+
+    for (unsigned int i = 0; i < width; i++) {
+        int which_ch = (int)((float)i * n_channels / (float)width);
+        if (rates_or_decays_) {
+            bins_[i] = (int)(live_rates[which_ch]*exposure_scaling_factor);
+        } else {
+            int t = (int)((float)Lifetime_range_ * (float)i / (float)width);
+            int threshold = (int)(height * exp((-1 * t) / (float)Sim_lifetime_));
+            int noise = (int)((height / 10) * (double)rand() / (double)RAND_MAX);
+            bins_[i] = threshold + noise;
         }
     }
-    return DEVICE_OK;
+
+    RenderHistogramColumns(img, bins_);
+    return true;
 }
 
-int MH_camera::Onn_beams_Y(MM::PropertyBase* pProp, MM::ActionType eAct)
+/**
+* One on-device histogram measurement of exposureMs: the MultiHarp bins the
+* arrival times itself, so no TTTR records cross USB whatever the count rate.
+* Leaves the curves in deviceHisto_ and the rates in deviceRates_.
+*/
+int MH_camera::AcquireDeviceHistogram(double exposureMs)
 {
-    if (eAct == MM::BeforeGet)
+    int ret = SetMeasurementMode(MODE_HIST);
+    if (ret != DEVICE_OK)
+        return ret;
+    char dummy[100];
+    int tacq = (std::max)(ACQTMIN, (std::min)(ACQTMAX, (int)exposureMs));
+    retcode = MH_ClearHistMem(dev[0]);
+    if (retcode >= 0)
+        retcode = MH_StartMeas(dev[0], tacq);
+    if (retcode < 0)
     {
-        pProp->Set(n_beams_Y_);
+        MH_GetErrorString(Errorstring, retcode);
+        sprintf(dummy, "Histogram MH_StartMeas error %d (%s).", retcode, Errorstring);
+        msgstr = dummy;
+        LogMessage(msgstr);
+        return ERR_MH_HISTOGRAM;
     }
-    else if (eAct == MM::AfterSet)
+    MM::MMTime deadline = GetCurrentMMTime() + MM::MMTime(1000.0 * (tacq + 1000));
+    int status = 0;
+    while (status == 0)
     {
-        long value;
-        pProp->Get(value);
-        if ((value < 1) || (8 < value))
-            return DEVICE_ERR;  // invalid image size
-        if (value != n_beams_Y_)
+        retcode = MH_CTCStatus(dev[0], &status);
+        if (retcode < 0 || GetCurrentMMTime() > deadline)
         {
-            n_beams_Y_ = value;
-            cameraCCDYSize_ = n_scanPixels_Y_ * n_beams_Y_;
-            img_.Resize(cameraCCDXSize_ / binSize_, cameraCCDYSize_ / binSize_);
+            MH_StopMeas(dev[0]);
+            LogMessage("Histogram measurement did not finish");
+            return ERR_MH_HISTOGRAM;
         }
+        if (status == 0)
+            CDeviceUtils::SleepMs(1);
+    }
+    MH_StopMeas(dev[0]);
+    retcode = MH_GetAllHistograms(dev[0], &deviceHisto_[0]);
+    if (retcode >= 0)
+        retcode = MH_GetAllCountRates(dev[0], &deviceSyncRate_, deviceRates_);
+    if (retcode < 0)
+    {
+        MH_GetErrorString(Errorstring, retcode);
+        sprintf(dummy, "MH_GetAllHistograms/MH_GetAllCountRates error %d (%s).", retcode, Errorstring);
+        msgstr = dummy;
+        LogMessage(msgstr);
+        return ERR_MH_HISTOGRAM;
     }
     return DEVICE_OK;
 }
 
-int MH_camera::Onn_scanPixels_X(MM::PropertyBase* pProp, MM::ActionType eAct)
+/**
+* Draws the last on-device histogram at the image width: the per-channel
+* count rates as bars, or the decay summed over all channels.
+*/
+bool MH_camera::GenerateDeviceHisto(ImgBuffer& img)
 {
-    if (eAct == MM::BeforeGet)
-    {
-        pProp->Set(n_scanPixels_X_);
+    unsigned width = img.Width(), height = img.Height();
+    if (width == 0 || height == 0 || deviceHisto_.empty())
+        return false;
+    std::vector<double> columns(width, 0.0);
+    if (rates_or_decays_) {
+        for (unsigned i = 0; i < width; i++) {
+            columns[i] = deviceRates_[(size_t)i * NumChannels / width];
+        }
     }
-    else if (eAct == MM::AfterSet)
-    {
-        long value;
-        pProp->Get(value);
-        if ((value < 16) || (33000 < value))
-            return DEVICE_ERR;  // invalid image size
-        if (value != n_scanPixels_X_)
-        {
-            n_scanPixels_X_ = value;
-            cameraCCDXSize_ = n_scanPixels_X_ * n_beams_X_;
-            img_.Resize(cameraCCDXSize_ / binSize_, cameraCCDYSize_ / binSize_);
+    else {
+        //Only the first sync period of the histogram can hold photons
+        int nBins = (std::min)(histoLen_, (std::max)(1, (int)TcspcBinsPerSync()));
+        for (int ch = 0; ch < NumChannels; ch++) {
+            const unsigned int* curve = &deviceHisto_[(size_t)ch * histoLen_];
+            for (int bin = 0; bin < nBins; bin++) {
+                columns[(size_t)bin * width / nBins] += curve[bin];
+            }
         }
     }
-    MM::Hub* pHub = GetParentHub();  
-    int newval = (int)n_scanPixels_X_;
-    char buf[MM::MaxStrLength];
-    _itoa(newval, buf, 10);
-    pHub->SetProperty(g_N_Hub_Scan_Px_X,buf);
-    pHub->GetProperty(g_N_Hub_Scan_Px_X, buf);
-    LogMessage("real value should be next");
-    std::string tmp(buf);
-    LogMessage(tmp.c_str());
-
-    return DEVICE_OK;
+    double peak = *std::max_element(columns.begin(), columns.end());
+    std::vector<int> heights(width, -1);
+    for (unsigned i = 0; i < width; i++) {
+        if (peak > 0 && columns[i] > 0)
+            heights[i] = (int)(columns[i] * (height - 1) / peak);
+    }
+    RenderHistogramColumns(img, heights);
+    return true;
 }
 
-int MH_camera::Onn_scanPixels_Y(MM::PropertyBase* pProp, MM::ActionType eAct)
+/**
+* Fills each column from the top down to (and including) row heights[x];
+* a height below 0 leaves the column empty. Rows every column reaches and rows
+* none reaches are single memsets; the rows in between compare 8 (16 bit) or
+* 16 (8 bit) column heights per SSE2 instruction, and the compare mask is
+* already the pixel value (widened and masked to 1.0f for the float32 type),
+* so there is no per-pixel branch.
+*/
+void MH_camera::RenderHistogramColumns(ImgBuffer& img, const std::vector<int>& heights)
 {
-    if (eAct == MM::BeforeGet)
-    {
-        pProp->Set(n_scanPixels_Y_);
-    }
-    else if (eAct == MM::AfterSet)
-    {
-        long value;
-        pProp->Get(value);
-        if ((value < 16) || (33000 < value))
-            return DEVICE_ERR;  // invalid image size
-        if (value != n_scanPixels_Y_)
-        {
-            n_scanPixels_Y_ = value;
-            cameraCCDYSize_ = n_scanPixels_Y_ * n_beams_Y_;
-            img_.Resize(cameraCCDXSize_ / binSize_, cameraCCDYSize_ / binSize_);
+    unsigned width = img.Width(), height = img.Height(), depth = img.Depth();
+    if (width == 0 || height == 0 || (depth != 1 && depth != 2 && depth != 4))
+        return;
+    //16 bit heights for the packed compares
+    int top = (std::min)((int)height - 1, 32766);
+    columnHeights_.resize(width);
+    int lowest = top, highest = -1;
+    for (unsigned x = 0; x < width; ++x) {
+        int h = (std::max)(-1, (std::min)(heights[x], top));
+        columnHeights_[x] = (short)h;
+        lowest = (std::min)(lowest, h);
+        highest = (std::max)(highest, h);
+    }
+
+    unsigned char* pixels = const_cast<unsigned char*>(img.GetPixels());
+    size_t rowBytes = (size_t)width * depth;
+    unsigned fullRows = (unsigned)(lowest + 1);
+    unsigned usedRows = (unsigned)(highest + 1);
+    if (depth == 4)
+        std::fill(reinterpret_cast<float*>(pixels), reinterpret_cast<float*>(pixels) + (size_t)fullRows * width, 1.0f);
+    else
+        memset(pixels, 0xFF, fullRows * rowBytes);
+    memset(pixels + usedRows * rowBytes, 0, (height - usedRows) * rowBytes);
+    const __m128i litFloat = _mm_set1_epi32(0x3F800000); //1.0f
+
+    const short* h = &columnHeights_[0];
+    for (unsigned y = fullRows; y < usedRows; ++y) {
+        __m128i limit = _mm_set1_epi16((short)(y - 1)); //Lit where the height is >= y
+        unsigned char* row = pixels + y * rowBytes;
+        unsigned x = 0;
+        if (depth == 4) {
+            float* out = reinterpret_cast<float*>(row);
+            for (; x + 8 <= width; x += 8) {
+                __m128i lit = _mm_cmpgt_epi16(_mm_loadu_si128((const __m128i*)(h + x)), limit);
+                _mm_storeu_si128((__m128i*)(out + x), _mm_and_si128(_mm_unpacklo_epi16(lit, lit), litFloat));
+                _mm_storeu_si128((__m128i*)(out + x + 4), _mm_and_si128(_mm_unpackhi_epi16(lit, lit), litFloat));
+            }
+            for (; x < width; ++x) {
+                out[x] = (h[x] >= (int)y) ? 1.0f : 0.0f;
+            }
+        }
+        else if (depth == 2) {
+            unsigned short* out = reinterpret_cast<unsigned short*>(row);
+            for (; x + 8 <= width; x += 8) {
+                _mm_storeu_si128((__m128i*)(out + x), _mm_cmpgt_epi16(_mm_loadu_si128((const __m128i*)(h + x)), limit));
+            }
+            for (; x < width; ++x) {
+                out[x] = (unsigned short)-(int)(h[x] >= (int)y);
+            }
+        }
+        else {
+            for (; x + 16 <= width; x += 16) {
+                __m128i lo = _mm_cmpgt_epi16(_mm_loadu_si128((const __m128i*)(h + x)), limit);
+                __m128i hi = _mm_cmpgt_epi16(_mm_loadu_si128((const __m128i*)(h + x + 8)), limit);
+                _mm_storeu_si128((__m128i*)(row + x), _mm_packs_epi16(lo, hi));
+            }
+            for (; x < width; ++x) {
+                row[x] = (unsigned char)-(int)(h[x] >= (int)y);
+            }
         }
     }
-    return DEVICE_OK;
 }
 
-int MH_camera::OnTriggerDevice(MM::PropertyBase* pProp, MM::ActionType eAct)
+void MH_camera::TestResourceLocking(const bool recurse)
 {
-    if (eAct == MM::BeforeGet)
-    {
-        pProp->Set(triggerDevice_.c_str());
-    }
-    else if (eAct == MM::AfterSet)
-    {
-        pProp->Get(triggerDevice_);
-    }
-    return DEVICE_OK;
+    if (recurse)
+        TestResourceLocking(false);
 }
 
 
-int MH_camera::OnCCDTemp(MM::PropertyBase* pProp, MM::ActionType eAct)
-{
-    if (eAct == MM::BeforeGet)
-    {
-        pProp->Set(ccdT_);
-    }
-    else if (eAct == MM::AfterSet)
-    {
-        pProp->Get(ccdT_);
-    }
-    return DEVICE_OK;
-}
+/**
+* Generate an image with offset plus noise
+*/
 
-int MH_camera::OnIsSequenceable(MM::PropertyBase* pProp, MM::ActionType eAct)
+int MH_camera::RegisterImgManipulatorCallBack(ImgManipulator* imgManpl)
 {
-    std::string val = "Yes";
-    if (eAct == MM::BeforeGet)
-    {
-        if (!isSequenceable_)
-        {
-            val = "No";
-        }
-        pProp->Set(val.c_str());
-    }
-    else if (eAct == MM::AfterSet)
-    {
-        isSequenceable_ = false;
-        pProp->Get(val);
-        if (val == "Yes")
-        {
-            isSequenceable_ = true;
-        }
-    }
-
+    imgManpl_ = imgManpl;
     return DEVICE_OK;
 }
 
 
-int MH_camera::OnMode(MM::PropertyBase* pProp, MM::ActionType eAct)
-{
-    std::string val;
-    if (eAct == MM::BeforeGet)
-    {
-        switch (mode_)
-        {
-        case MODE_MH_TEST:
-            val = g_MH_Test;
-            break;
-        case MODE_MH_HISTO:
-            val = g_MH_Histo;
-            break;
-        case MODE_MH_IMAGE:
-            val = g_MH_Image;
-            break;
-        default:
-            val = g_MH_Test;
-            break;
-        }
-        pProp->Set(val.c_str());
-    }
-    else if (eAct == MM::AfterSet)
+// Added bitsfrom MH Device Adapter
+int MH_camera::On_Offset_Ch1(MM::PropertyBase* pProp, MM::ActionType eAct) {
     {
-        pProp->Get(val);
-        if (val == g_MH_Test)
-        {
-            mode_ = MODE_MH_TEST;
-        }
-        else if (val == g_MH_Histo)
-        {
-            mode_ = MODE_MH_HISTO;
-        }
-        else if (val == g_MH_Image)
-        {
-            mode_ = MODE_MH_IMAGE;
+        long test_val = 1;
+        if (eAct == MM::BeforeGet) {
+            pProp->Set(offsets[0]);
+            // nothing to do, let the caller use cached property
         }
-        else
+        else if (eAct == MM::AfterSet)
         {
-            mode_ = MODE_MH_TEST;
+            char dummy[100];
+            // Set timer for the Busy signal
+            MH_changedTime_ = GetCurrentMMTime();
+            if (Mode == MODE_T2) {
+                sprintf(dummy, "Offset cannot be set in T2 mode!");
+                msgstr = dummy;
+                LogMessage(msgstr);
+            }
+            else {
+
+                //No ints, just longs
+                long val_toset;
+                pProp->Get(offsets[0]);
+                WaitForRateProbe();
+                retcode = MH_SetOffset(dev[0], offsets[0]);
+                if (retcode < 0)
+                {
+                    MH_GetErrorString(Errorstring, retcode);
+                    sprintf(dummy, "MH_SetOffset error %d on channel %d (%s). Aborted.", retcode, 0, Errorstring);
+                    msgstr = dummy;
+                    LogMessage(msgstr);
+                    return retcode;
+                }
+                else {
+                    sprintf(dummy, "MH_SetOffset on channel %d set to %d ps.", 0, offsets[0]);
+                    msgstr = dummy;
+                    LogMessage(msgstr);
+                    g_MultiHarp.applied.offset = (int)offsets[0];
+                }
+            }
         }
+        return DEVICE_OK;
     }
-    return DEVICE_OK;
 }
 
-int MH_camera::OnPCF(MM::PropertyBase* pProp, MM::ActionType eAct)
+int MH_camera::On_Integ_t(MM::PropertyBase* pProp, MM::ActionType eAct)
 {
     if (eAct == MM::BeforeGet)
     {
-        pProp->Set(pcf_);
+        pProp->Set(Tacq);
     }
     else if (eAct == MM::AfterSet)
     {
-        pProp->Get(pcf_);
+        pProp->Get(Tacq);
     }
     return DEVICE_OK;
 }
 
-int MH_camera::OnPhotonFlux(MM::PropertyBase* pProp, MM::ActionType eAct)
+int MH_camera::On_MH_Status(MM::PropertyBase* pProp, MM::ActionType eAct)
 {
+    //PROPERTY SETTING LOGIC NEEDS A CHECK OR 5...
     if (eAct == MM::BeforeGet)
     {
-        pProp->Set(photonFlux_);
+        if (MH_Status_ == 0)
+        {
+            pProp->Set("Idle");
+        }
+        else if (MH_Status_ == 1) {
+            pProp->Set("Start");
+        }
+        else if (MH_Status_ == 2) {
+            pProp->Set("Running");
+        }
+        else if (MH_Status_ == 3) {
+            pProp->Set("Abort");
+        }
+        else {
+            pProp->Set("Idle");//duplication for clarity
+        }
+        // nothing to do, let the caller use cached property
     }
     else if (eAct == MM::AfterSet)
     {
-        pProp->Get(photonFlux_);
+        LogMessage("AN ACTION WAS DONE");
+        // Set timer for the Busy signal
+        MH_changedTime_ = GetCurrentMMTime();
+        std::string MH_Status_str;
+        //Returns a std::string
+        pProp->Get(MH_Status_str);
+        if (MH_Status_str.compare("Idle") == 0)// 0 means a string matches
+        {
+            MH_Status_ = 0;
+            LogMessage("Set Idle");
+            pProp->Set("Idle");
+        }
+        else if (MH_Status_str.compare("Start") == 0) {
+            MH_Status_ = 2;
+            LogMessage("Set Start");
+            pProp->Set("Running");
+            start_acq();
+        }
+        else if (MH_Status_str.compare("Running") == 0) {
+            LogMessage("Set Running");
+            pProp->Set("Idle");
+            MH_Status_ = 2;
+        }
+        else if (MH_Status_str.compare("Abort") == 0) {
+            MH_Status_ = 0;
+            LogMessage("Set Abort");
+            pProp->Set("Idle");
+        }
+        else {//Idle
+            LogMessage("Set Idle");
+            MH_Status_ = 0;
+        }
+        int ret = OnPropertiesChanged();
+        if (ret != DEVICE_OK)
+        {
+            return ret;
+        }
     }
     return DEVICE_OK;
 }
 
-int MH_camera::OnReadNoise(MM::PropertyBase* pProp, MM::ActionType eAct)
+
+int MH_camera::On_Save_Enable(MM::PropertyBase* pProp, MM::ActionType eAct)
 {
+    //PROPERTY SETTING LOGIC NEEDS A CHECK OR 5...
     if (eAct == MM::BeforeGet)
     {
-        pProp->Set(readNoise_);
+        if (MH_Saving_ == 0)
+        {
+            pProp->Set("False");
+            saving_ = false;
+        }
+        else if (MH_Saving_ == 1) {
+            pProp->Set("True");
+            saving_ = true;
+        }
+        else {
+            pProp->Set("False");//duplication for clarity
+            saving_ = false;
+        }
+        // nothing to do, let the caller use cached property
     }
     else if (eAct == MM::AfterSet)
     {
-        pProp->Get(readNoise_);
+        LogMessage("AN ACTION WAS DONE");
+        // Set timer for the Busy signal
+        MH_changedTime_ = GetCurrentMMTime();
+        std::string MH_Saving_str;
+        //Returns a std::string
+        pProp->Get(MH_Saving_str);
+        if (MH_Saving_str.compare("False") == 0)// 0 means a string matches
+        {
+            MH_Saving_ = 0;
+            LogMessage("Saving set to False");
+            pProp->Set("False");
+            saving_ = false;
+        }
+        else if (MH_Saving_str.compare("True") == 0) {
+            MH_Saving_ = 1;
+            LogMessage("Saving set to True");
+            pProp->Set("True");
+            saving_ = true;
+            //start_acq();//do we want to do an acquisition every time we set saving to true?
+        }
+        else {//Idle
+            LogMessage("Saving set to False");
+            MH_Status_ = 0;
+        }
+        int ret = OnPropertiesChanged();
+        if (ret != DEVICE_OK)
+        {
+            return ret;
+        }
     }
     return DEVICE_OK;
 }
 
-
-int MH_camera::OnCrash(MM::PropertyBase* pProp, MM::ActionType eAct)
+/**
+* Handles the live preview mode, its line count and its interval (which = 0, 1, 2).
+*/
+int MH_camera::OnPreview(MM::PropertyBase* pProp, MM::ActionType eAct, long which)
 {
-    AddAllowedValue("SimulateCrash", "");
-    AddAllowedValue("SimulateCrash", "Dereference Null Pointer");
-    AddAllowedValue("SimulateCrash", "Divide by Zero");
     if (eAct == MM::BeforeGet)
     {
-        pProp->Set("");
+        if (which == 0)
+            pProp->Set(previewMode_ == PREVIEW_LINES ? g_Preview_Lines : previewMode_ == PREVIEW_INTERVAL ? g_Preview_Interval : g_Preview_Off);
+        else if (which == 1)
+            pProp->Set(previewLines_);
+        else
+            pProp->Set(previewIntervalMs_);
     }
     else if (eAct == MM::AfterSet)
     {
-        std::string choice;
-        pProp->Get(choice);
-        if (choice == "Dereference Null Pointer")
-        {
-            int* p = 0;
-            volatile int i = *p;
-            i++;
-        }
-        else if (choice == "Divide by Zero")
+        if (IsCapturing())
+            return DEVICE_CAMERA_BUSY_ACQUIRING;
+        if (which == 0)
         {
-            volatile int i = 1, j = 0, k;
-            k = i / j;
+            std::string mode;
+            pProp->Get(mode);
+            previewMode_ = (mode.compare(g_Preview_Lines) == 0) ? PREVIEW_LINES : (mode.compare(g_Preview_Interval) == 0) ? PREVIEW_INTERVAL : PREVIEW_OFF;
         }
+        else if (which == 1)
+            pProp->Get(previewLines_);
+        else
+            pProp->Get(previewIntervalMs_);
     }
     return DEVICE_OK;
 }
 
-int MH_camera::OnLifetime(MM::PropertyBase* pProp, MM::ActionType eAct)
+/**
+* Handles the "FIFO polling" policy: adaptive back-off or a spinning reader.
+*/
+int MH_camera::OnFifoPolling(MM::PropertyBase* pProp, MM::ActionType eAct)
 {
     if (eAct == MM::BeforeGet)
     {
-        pProp->Set(Sim_lifetime_);
+        pProp->Set(adaptivePolling_ ? g_FIFO_Polling_Adaptive : g_FIFO_Polling_Spin);
     }
     else if (eAct == MM::AfterSet)
     {
-        long value;
-        pProp->Get(value);
-        Sim_lifetime_ = value;
+        if (IsCapturing())
+            return DEVICE_CAMERA_BUSY_ACQUIRING;
+        std::string policy;
+        pProp->Get(policy);
+        adaptivePolling_ = (policy.compare(g_FIFO_Polling_Spin) != 0);
     }
     return DEVICE_OK;
-
 }
 
-int MH_camera::OnDecOrRat(MM::PropertyBase* pProp, MM::ActionType eAct)
+/**
+* Handles the read-only FIFO pipeline counters.
+*/
+int MH_camera::OnPipelineStat(MM::PropertyBase* pProp, MM::ActionType eAct, long which)
 {
     if (eAct == MM::BeforeGet)
     {
-        std::string current_val;
-        if (rates_or_decays_) {
-            current_val = "Rates";
-        }
-        else {
-            current_val = "Decays";
-        }
-        pProp->Set(current_val.c_str());
-    }
-    else if (eAct == MM::AfterSet)
-    {
-        std::string choice;
-        pProp->Get(choice);
-        if (choice == "Decay") {
-            rates_or_decays_ = false;
+        switch (which) {
+        case 0:
+            pProp->Set(fifoRing_.Occupancy());
+            break;
+        case 1:
+            pProp->Set(fifoRing_.HighWater());
+            break;
+        case 2:
+            pProp->Set(ringFullStalls_.load());
+            break;
+        case 3:
+            pProp->Set(fifoNearFullReads_.load());
+            break;
+        case 4:
+            pProp->Set(framePool_.Stalls());
+            break;
+        case 5:
+            pProp->Set(StatRecordRate());
+            break;
+        case 6:
+            pProp->Set((double)statPhotonsBinned_.load(std::memory_order_relaxed));
+            break;
+        case 7:
+            pProp->Set((double)statDroppedFlyback_.load(std::memory_order_relaxed));
+            break;
+        case 8:
+            pProp->Set((double)statDroppedNoFrame_.load(std::memory_order_relaxed));
+            break;
+        case 9:
+            pProp->Set(statFifoReadHighWater_.load(std::memory_order_relaxed));
+            break;
+        case 10:
+            pProp->Set(StatDecodeNsPerRecord());
+            break;
+        case 11:
+            pProp->Set(StatDiskMBps());
+            break;
+        case 12:
+            pProp->Set(g_Poll_State_Names[pollState_.load(std::memory_order_relaxed)]);
+            break;
+        case 13:
+        {
+            double elapsed = StatElapsedSeconds();
+            pProp->Set(elapsed > 0 ? 100.0 * 1e-7 * (double)statReaderCpu_.load(std::memory_order_relaxed) / elapsed : 0.0);
+            break;
         }
-        else {
-            rates_or_decays_ = true;
+        case 14:
+            pProp->Set(fifoOverruns_.load());
+            break;
+        default:
+            break;
         }
     }
     return DEVICE_OK;
 }
 
-///////////////////////////////////////////////////////////////////////////////
-// Private MH_camera methods
-///////////////////////////////////////////////////////////////////////////////
+void MH_camera::ResetPipelineStats()
+{
+    statRecordsRead_ = 0;
+    statPhotonsBinned_ = 0;
+    statDroppedFlyback_ = 0;
+    statDroppedNoFrame_ = 0;
+    statDecodeTicks_ = 0;
+    statDecodeRecords_ = 0;
+    statDiskBytes_ = 0;
+    statFifoReadHighWater_ = 0;
+    statReaderCpu_ = 0;
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    statStartTicks_ = now.QuadPart;
+    statStopTicks_ = 0;
+}
 
 /**
-* Sync internal image buffer size to the chosen property values.
+* Seconds since the current (or up to the end of the last) measurement started.
 */
-int MH_camera::ResizeImageBuffer()
+double MH_camera::StatElapsedSeconds() const
 {
-    char buf[MM::MaxStrLength];
-    //int ret = GetProperty(MM::g_Keyword_Binning, buf);
-    //if (ret != DEVICE_OK)
-    //   return ret;
-    //binSize_ = atol(buf);
-
-    int ret = GetProperty(MM::g_Keyword_PixelType, buf);
-    if (ret != DEVICE_OK)
-        return ret;
-
-    std::string pixelType(buf);
-    int byteDepth = 0;
-
-    if (pixelType.compare(g_PixelType_8bit) == 0)
-    {
-        byteDepth = 1;
-    }
-    else if (pixelType.compare(g_PixelType_16bit) == 0)
-    {
-        byteDepth = 2;
+    int64_t stop = statStopTicks_.load(std::memory_order_relaxed);
+    if (stop == 0) {
+        LARGE_INTEGER now;
+        QueryPerformanceCounter(&now);
+        stop = now.QuadPart;
     }
+    return (double)(stop - statStartTicks_.load(std::memory_order_relaxed)) / (double)perfFrequency_;
+}
 
-    img_.Resize(cameraCCDXSize_ / binSize_, cameraCCDYSize_ / binSize_, byteDepth);
-    return DEVICE_OK;
+double MH_camera::StatRecordRate() const
+{
+    double elapsed = StatElapsedSeconds();
+    return (elapsed > 0) ? (double)statRecordsRead_.load(std::memory_order_relaxed) / elapsed : 0.0;
 }
 
-void MH_camera::GenerateDecay(ImgBuffer &img)
+double MH_camera::StatDecodeNsPerRecord() const
 {
+    int64_t records = statDecodeRecords_.load(std::memory_order_relaxed);
+    return records ? (double)statDecodeTicks_.load(std::memory_order_relaxed) * 1e9 / (double)perfFrequency_ / (double)records : 0.0;
+}
 
+double MH_camera::StatDiskMBps() const
+{
+    double elapsed = StatElapsedSeconds();
+    return (elapsed > 0) ? (double)statDiskBytes_.load(std::memory_order_relaxed) / (1024.0 * 1024.0) / elapsed : 0.0;
 }
 
-uint64_t MH_camera::TimestampDeltaToPs(uint64_t timestamp_delta) {
-    return (timestamp_delta * MeasDesc_GlobalResolution_);
+/**
+* CPU time (user + kernel) of the calling thread in 100 ns units.
+*/
+static int64_t ThreadCpuTime()
+{
+    FILETIME created, exited, kernel, user;
+    if (!GetThreadTimes(GetCurrentThread(), &created, &exited, &kernel, &user))
+        return 0;
+    uint64_t k = ((uint64_t)kernel.dwHighDateTime << 32) | kernel.dwLowDateTime;
+    uint64_t u = ((uint64_t)user.dwHighDateTime << 32) | user.dwLowDateTime;
+    return (int64_t)(k + u);
 }
 
+/**
+* FIFO reader thread body. Does nothing but poll the MultiHarp and hand filled
+* blocks to the ring; always finishes by publishing a block marked as last.
+* With adaptive polling the wait after each read follows its size.
+*/
+int MH_camera::ReadFifoOnThread()
+{
+    char dummy[100];
+    char error[40]; //MH_GetErrorString needs 40
+    int ret = DEVICE_OK;
+    TTTRBlock* block = NULL;
+    bool adaptive = adaptivePolling_;
+    int lastRead = 0;
+    int readsSinceFlags = 0;
+    unsigned loops = 0;
+    int64_t cpuStart = ThreadCpuTime();
+    pollState_ = POLL_SPIN;
 
-//#   +----------------------+ T3 32 bit record  +---------------------+
-//#   |x|x|x|x|x|x|x|x|x|x|x|x|x|x|x|x|  |x|x|x|x|x|x|x|x|x|x|x|x|x|x|x|x| --> 32 bit record
-//#   +-------------------------------+  +-------------------------------+
-//#   +-------------------------------+  +-------------------------------+
-//#   | | | | | | | | | | | | | | | | |  | | | | | | |x|x|x|x|x|x|x|x|x|x|  --> Sync
-//#   +-------------------------------+  +-------------------------------+
-//#   +-------------------------------+  +-------------------------------+
-//#   | | | | | | | |x|x|x|x|x|x|x|x|x|  |x|x|x|x|x|x| | | | | | | | | | |  --> TCSPC bin
-//#   +-------------------------------+  +-------------------------------+
-//#   +-------------------------------+  +-------------------------------+
-//#   | |x|x|x|x|x|x| | | | | | | | | |  | | | | | | | | | | | | | | | | |  --> Spectral/TCSPC input Channel
-//#   +-------------------------------+  +-------------------------------+
-//#   +-------------------------------+  +-------------------------------+
-//#   |x| | | | | | | | | | | | | | | |  | | | | | | | | | | | | | | | | |  --> Special markers
-//#   +-------------------------------+  +-------------------------------+
+    while (1)
+    {
+        if ((++loops % FIFO_FLAG_CHECK_READS) == 0) {
+            statReaderCpu_.store(ThreadCpuTime() - cpuStart, std::memory_order_relaxed);
+        }
 
-void MH_camera::Interpret_TTTR(unsigned int& record, unsigned int& sync, unsigned int& tcspc, unsigned int& channel, bool& special) {
-    //Try to extract relevant information with a minimum amount of duplication
-    //Bit-mask a copy, then shift as appropriate for each element?
-    //Reminder: For MultiHarp
-    //val will be one record from the unsigned int buffer[TTREADMAX]
-    //Multiharp: ## special: 1 ## channel: 6 ## dtime : 15 ## nsync : 10
-    //Do some shifting for direct comparisons
-    unsigned int nsync_mask = 0x00003ff; // 10x 1
-    unsigned int tcspc_mask = 0x0007fff; // 15x 1
-    unsigned int chan_mask = 0x000003f; // 6x 1
-    unsigned int special_mask = 0x0000001; // 1x 1
-    int nsync_shift = 0;
-    int tcspc_shift = 10;
-    int chan_shift = 25;
-    int special_shift = 31;
-    sync = (record >> nsync_shift) & nsync_mask;
-    tcspc = (record >> tcspc_shift) & tcspc_mask;
-    channel = (record >> chan_shift) & chan_mask;
-    special = (record >> special_shift) & special_mask;
-}
+        while ((block = fifoRing_.AcquireWrite()) == NULL) {
+            //Consumers still hold every block - the hardware FIFO is taking up the slack
+            ringFullStalls_++;
+            Sleep(0);
+        }
 
-void MH_camera::TranslateRecord(unsigned int val, ImgBuffer& img) {
-    bool special;
-    unsigned int tcspc;
-    unsigned int channel;
-    unsigned int nsync;
-    uint64_t timestamp_ps;
-    uint64_t pulse_interval_ps = MeasDesc_GlobalResolution_;//in ps?
-    
-    Interpret_TTTR(val,nsync,tcspc,channel,special);
-    //NEED TO ACCOUNT FOR ROLLOVERS - Every 1024 syncs it'll overflow, as it is a 10-bit counter
-    uint64_t overflowtime = (uint64_t)overflow_counter_ * ((uint64_t)1024);
-    timestamp_ps = (((uint64_t)nsync + overflowtime)* MeasDesc_GlobalResolution_);//this should convert to ps
-    if (special) {
-        //Handle special tagged channel numbers here:
-        //Line start - 000010 :: Line end - 000001 :: Frame start - 000011
-        switch (channel) {
-            case 1:
-                //Use for pixel timing
-                last_line_end_ = timestamp_ps;
-                //This will be invalid for the first line
-                pixel_dwelltime_ps_ = (last_line_end_ - last_line_start_) / (cameraCCDXSize_);
-                break;
-            case 2:
-                last_line_start_ = timestamp_ps;//this is in ps
-                if (frame_active_) {
-                    //Once we've had a frame clock...
-                    current_line_++;
-                }
-                if (current_line_> cameraCCDYSize_) {
-                    frame_active_ = false;
+        if (stopAcq_) {
+            break;
+        }
+
+        if (tttrSource_ != TTTR_SOURCE_MULTIHARP) {
+            //Offline source: nothing to poll, a file just ends (snaps) or wraps around (sequences)
+            int nReplay = replay_.Read(block->records, TTREADMAX);
+            if (nReplay == 0) {
+                bool more = replay_.Rewind();
+                if (!streaming_ || !more) {
+                    break;
                 }
+                continue;
+            }
+            statRecordsRead_.fetch_add(nReplay, std::memory_order_relaxed);
+            block->nRecords = nReplay;
+            fifoRing_.Publish();
+            continue;
+        }
+
+        //Adaptive polling asks for the flags every few reads, and always after an empty or
+        //near-full one - an overrun builds up over many big reads, so it is never missed
+        int fifoRet;
+        if (!adaptive || lastRead == 0 || lastRead >= FIFO_NEAR_FULL_RECORDS || ++readsSinceFlags >= FIFO_FLAG_CHECK_READS)
+        {
+            readsSinceFlags = 0;
+            int readFlags;
+            fifoRet = MH_GetFlags(dev[0], &readFlags);
+            if (fifoRet < 0)
+            {
+                MH_GetErrorString(error, fifoRet);
+                LogMessage(std::string("MH_GetFlags failed, stopping the measurement: ") + error);
+                ret = ERR_MH_FIFO;
                 break;
-            case 3:
-            case 4: //frame clock
-                current_line_ = -1;//First line clock will then correspond to line 0, assuming it comes right after the frame clock?
-                frame_active_ = true;
-                n_frame_tracker_++;
+            }
+
+            if (readFlags & FLAG_FIFOFULL)
+            {
+                fifoOverruns_++;
+                LogMessage("MultiHarp FIFO overrun, ending the measurement early");
+                ret = DEVICE_BUFFER_OVERFLOW;
                 break;
-            case 63:
-                overflow_counter_ += nsync;
+            }
+        }
+
+        int nRead = 0;
+        fifoRet = MH_ReadFiFo(dev[0], block->records, &nRead);	//may return less!
+        if (fifoRet < 0)
+        {
+            MH_GetErrorString(error, fifoRet);
+            LogMessage(std::string("MH_ReadFiFo failed, stopping the measurement: ") + error);
+            ret = ERR_MH_FIFO;
+            break;
+        }
+
+        if (nRead)
+        {
+            if (nRead >= FIFO_NEAR_FULL_RECORDS) {
+                fifoNearFullReads_++;
+            }
+            statRecordsRead_.fetch_add(nRead, std::memory_order_relaxed);
+            if (nRead > statFifoReadHighWater_.load(std::memory_order_relaxed)) {
+                statFifoReadHighWater_.store(nRead, std::memory_order_relaxed);
+            }
+            block->nRecords = nRead;
+            fifoRing_.Publish();
+        }
+        else
+        {
+            int status;
+            fifoRet = MH_CTCStatus(dev[0], &status);
+            if (fifoRet < 0)
+            {
+                MH_GetErrorString(error, fifoRet);
+                LogMessage(std::string("MH_CTCStatus failed, stopping the measurement: ") + error);
+                ret = ERR_MH_FIFO;
                 break;
-            default:
+            }
+            if (status)
+            {
                 break;
+            }
+        }
+
+        lastRead = nRead;
+        if (adaptive)
+        {
+            //At low rates each wait lets a bigger batch build up in the hardware FIFO
+            int state = (nRead >= FIFO_SPIN_RECORDS) ? POLL_SPIN : (nRead >= FIFO_YIELD_RECORDS) ? POLL_YIELD : POLL_SLEEP;
+            pollState_.store(state, std::memory_order_relaxed);
+            if (state == POLL_YIELD) {
+                Sleep(0);
+            }
+            else if (state == POLL_SLEEP) {
+                Sleep(FIFO_SLEEP_MS);
+            }
+        }
+    }
+    statReaderCpu_.store(ThreadCpuTime() - cpuStart, std::memory_order_relaxed);
+    fifoReadResult_ = ret;
+    if (ret != DEVICE_OK) {
+        stopAcq_ = true;
+    }
+
+    //Wake the consumers up one last time, whatever the reason for stopping
+    while ((block = fifoRing_.AcquireWrite()) == NULL) {
+        Sleep(0);
+    }
+    block->last = true;
+    fifoRing_.Publish();
+
+    sprintf(dummy, "FIFO reader done, ring high-water mark %ld of %ld blocks", fifoRing_.HighWater(), fifoRing_.Capacity());
+    LogMessage(dummy);
+    return ret;
+}
+
+/**
+* Disk writer thread body. A failed write stops the measurement, but blocks keep
+* being released so the reader never deadlocks on a full ring.
+*/
+int MH_camera::WriteTTTROnThread()
+{
+    int ret = DEVICE_OK;
+    while (1)
+    {
+        TTTRBlock* block = fifoRing_.AcquireRead(TTTRRing::RING_WRITER);
+        if (block == NULL) {
+            Sleep(0);
+            continue;
+        }
+        if (block->nRecords && ret == DEVICE_OK) {
+            if (tttrFile_.Append(block->records, block->nRecords))
+            {
+                statDiskBytes_.fetch_add((int64_t)block->nRecords * sizeof(unsigned int), std::memory_order_relaxed);
+            }
+            else
+            {
+                char dummy[100];
+                sprintf(dummy, "TTTR file write failed (error %lu), stopping the measurement", tttrFile_.LastError());
+                LogMessage(dummy);
+                stopAcq_ = true;
+                ret = DEVICE_ERR;
+            }
         }
-        if (overflow_counter_ % 10 == 0) {
-            //char dummy1[100];
-            //sprintf(dummy1, "Syncs : %" PRIu64 " syncs", nsync);
-            //msgstr = dummy1;
-            //LogMessage(msgstr); 
+        bool last = block->last;
+        fifoRing_.Release(TTTRRing::RING_WRITER);
+        if (last) {
+            break;
         }
     }
-    else {
-        
-        if (last_line_end_ < last_line_start_ && channel !=6) {//If not in X flyback... ignore NDD for now
-            if (current_line_ >= 0) {//Or Y flyback?
-                //For multibeam add switch for channel here which tells us the x and y shift needed to add to x_px and y_px below? test code done below
-                //Making the assumption that channels correspond in order to beams as follows (e.g. for a 3x2 array - X assumed to always go first):
-                //X1Y1, X2Y1, X3Y1, X1Y2, X2Y2, X3Y2
-                int x_shift = 0;
-                int y_shift = 0;
-                //int tmpchan = ((n_beams_X_ * n_beams_Y_)-1) - channel;//change this to change order that beams are shown in
-                int tmpchan =  5-channel;//change this to change order that beams are shown in
-                x_shift = (tmpchan / n_beams_Y_) * n_scanPixels_X_;
-                y_shift = (tmpchan % n_beams_Y_) * n_scanPixels_Y_;
-                
-
-                //If we have had a frame clock...
-                //int x_px = GetPixnumInLine(timestamp_ps, last_line_start_);
-                int x_px = GetPixnumInLine(timestamp_ps, last_line_start_)+ x_shift;
-                //int x_px = std::rand()*cameraCCDXSize_/RAND_MAX;// "simulation"
-                int y_px = current_line_+y_shift;
-
-                //These parts to be moved into superfunction. Based off the memory structure rather than the variable interpretations, which may change out of sync?
-                char buf[MM::MaxStrLength];
-                GetProperty(MM::g_Keyword_PixelType, buf);
-                std::string pixelType(buf);
-                int maxValue = 1 << GetBitDepth();
-                long nrPixels = img.Width() * img.Height();
-                int target_px = x_px + y_px * cameraCCDXSize_;
-
-                if (overflow_counter_ % 10 == 0) {
-                    char dummy1[100];
-                    sprintf(dummy1, "px : %d, channel %" PRIu64 " . ", y_px, channel);
-                    msgstr = dummy1;
-                    LogMessage(msgstr);
-                }
+    return ret;
+}
 
-                if (channel >= 0) {//DELETE THIS LATER
-                    if (pixelType.compare(g_PixelType_8bit) == 0) {//REALLY shouldn't be using this... too few DN per pixel
-                        maxValue = 255;//Future overflow check? Current behaviour is to saturate
-                        unsigned char* rawShorts = (unsigned char*) const_cast<unsigned char*>(img.GetPixels());
-                        if (rawShorts[target_px] != maxValue) {
-                            rawShorts[target_px] += 1;
-                        }
-                    }
-                    else if (pixelType.compare(g_PixelType_16bit) == 0) {
-                        maxValue = 65535;//Future overflow check? Current behaviour is to saturate
-                        unsigned short* rawShorts = (unsigned short*) const_cast<unsigned char*>(img.GetPixels());
-                        //channel * cameraCCDXSize_* (cameraCCDYSize_ / nBeams);
-                        if (rawShorts[target_px] != maxValue) {
-                            rawShorts[target_px] += 1;
-                        }
-                    }
-                }
+/**
+* Decodes one whole FIFO block: splits it into marker records and the photon
+* runs between them, and bins each run against the line context it belongs to.
+*/
+void MH_camera::DecodeBlock(const unsigned int* records, int nRecords)
+{
+    bool parallel = !binWorkers_.empty();
+    int i = 0;
+    while (i < nRecords) {
+        int next = useAVX2_ ? FindNextMarkerAVX2(records, i, nRecords) : FindNextMarkerScalar(records, i, nRecords);
+        if (next > i) {
+            CountLiveRates(records + i, next - i);
+            if (parallel) {
+                QueueBinRun(records + i, next - i);
             }
             else {
-                //Not sure what to do if we are in an unknown position in a scan... could accumulate in separate memory and shift/fix retrospectively?
-                //Ignore it for now and just lose the counts. Worst case is just loning one line's worth?
+                BinContext ctx = CurrentBinContext();
+                (this->*binPhotons_)(records + i, next - i, ctx);
+                (this->*binLifetimes_)(records + i, next - i, ctx);
+            }
+        }
+        if (next < nRecords) {
+            if (parallel && MarkerMayEndFrame(records[next])) {
+                //FrameCompleted() hands the frame on, everything queued belongs in it
+                FlushBinRuns();
             }
+            HandleMarker(records[next]);
         }
+        i = next + 1;
+    }
+    if (parallel) {
+        //The queues point into the block, which goes back to the ring after this
+        FlushBinRuns();
     }
 }
 
-int MH_camera::GetPixnumInLine(uint64_t timestamp, uint64_t linestart_timestamp) {
-    //Try to calculate which pixel in a line a photon belongs in
-    //uint64_t time_into_line_ps = TimestampDeltaToPs(timestamp - linestart_timestamp);
-    uint64_t time_into_line_ps = (timestamp - linestart_timestamp);
-    uint64_t pn = (time_into_line_ps / pixel_dwelltime_ps_);
-    int pixnum = (int)pn/ n_beams_X_;
-    if (overflow_counter_ % 1 == 0) {
-        char dummy1[100];
-        sprintf(dummy1, "pn : %" PRIu64 " px, dwelltime: %" PRIu64 ", y line num: %dpx", pn, pixel_dwelltime_ps_, current_line_);
-        msgstr = dummy1;
-        //LogMessage(msgstr);
+/**
+* Starts the binning workers for a measurement if more than one binning thread
+* is asked for and there is something to bin. Each beam channel is owned by
+* one worker (round robin), so there are never more workers than beams.
+*/
+void MH_camera::StartBinWorkers()
+{
+    StopBinWorkers();
+    memset(binOwner_, -1, sizeof(binOwner_));
+    int nBeamsTotal = (std::min)((int)(n_beams_X_ * n_beams_Y_), BEAM_LUT_SIZE);
+    int nWorkers = (std::min)((int)binThreads_, nBeamsTotal);
+    if (nWorkers < 2 || (binPhotons_ == &MH_camera::BinPhotonsNone && binLifetimes_ == &MH_camera::BinPhotonsNone)) {
+        return;
     }
-    //Assume the fast scan axis is in x...
-    if (pixnum >= cameraCCDXSize_) {
-        //If there's too many pixels in a line, dump things here
-        pixnum = cameraCCDXSize_-1;
+    for (int channel = 0; channel < nBeamsTotal; channel++) {
+        binOwner_[channel] = (signed char)(channel % nWorkers);
+    }
+    binDone_ = CreateEvent(NULL, FALSE, FALSE, NULL);
+    binQuit_ = false;
+    for (int w = 0; w < nWorkers; w++) {
+        BinWorker* worker = new BinWorker;
+        worker->thread = new BinWorkerThread(this, w);
+        worker->go = CreateEvent(NULL, FALSE, FALSE, NULL);
+        worker->records.resize(TTREADMAX); //A queue never outlives its block
+        worker->nRecords = 0;
+        binWorkers_.push_back(worker);
+    }
+    for (int w = 0; w < nWorkers; w++) {
+        binWorkers_[w]->thread->Start();
     }
-    return pixnum;
 }
 
-void MH_camera::GenerateEmptyImage(ImgBuffer& img)
+void MH_camera::StopBinWorkers()
 {
-    MMThreadGuard g(imgPixelsLock_);
-    if (img.Height() == 0 || img.Width() == 0 || img.Depth() == 0)
+    if (binWorkers_.empty()) {
         return;
-    unsigned char* pBuf = const_cast<unsigned char*>(img.GetPixels());
-    memset(pBuf, 0, img.Height() * img.Width() * img.Depth());
+    }
+    binQuit_ = true;
+    for (size_t w = 0; w < binWorkers_.size(); w++) {
+        SetEvent(binWorkers_[w]->go);
+    }
+    for (size_t w = 0; w < binWorkers_.size(); w++) {
+        binWorkers_[w]->thread->wait();
+        delete binWorkers_[w]->thread;
+        CloseHandle(binWorkers_[w]->go);
+        delete binWorkers_[w];
+    }
+    binWorkers_.clear();
+    CloseHandle(binDone_);
+    binDone_ = NULL;
 }
 
-
-
 /**
-* Generates an image.
-*
+* Sequential part of parallel binning: snapshots the run's line context and
+* sorts its photons into the queue of the worker that owns their beam.
 */
-
-void MH_camera::GenerateSyntheticImage(ImgBuffer& img, double exp)
+void MH_camera::QueueBinRun(const unsigned int* records, int nRecords)
 {
-
-    MMThreadGuard g(imgPixelsLock_);
-
-    if (mode_ == MODE_MH_TEST)
-    {
-        if (GenerateMHTestPattern(img))
-            return;
-    }
-    else if (mode_ == MODE_MH_HISTO)
-    {
-        if (GenerateMHHisto(img))
-            return;
+    BinContext ctx = CurrentBinContext();
+    size_t nWorkers = binWorkers_.size();
+    for (size_t w = 0; w < nWorkers; w++) {
+        BinRun run = { binWorkers_[w]->nRecords, 0, ctx };
+        binWorkers_[w]->runs.push_back(run);
+    }
+    BinWorker* const* workers = &binWorkers_[0];
+    for (int i = 0; i < nRecords; i++) {
+        unsigned int record = records[i];
+        int owner = binOwner_[(record >> 25) & 0x3F];
+        if (owner >= 0) {
+            BinWorker* worker = workers[owner];
+            worker->records[worker->nRecords++] = record;
+        }
     }
-    else if (mode_ == MODE_MH_IMAGE) {
-        if (GenerateMHImage(img))
-            return;
+    for (size_t w = 0; w < nWorkers; w++) {
+        BinRun& run = binWorkers_[w]->runs.back();
+        run.nRecords = binWorkers_[w]->nRecords - run.begin;
     }
+}
 
-    //std::string pixelType;
-    char buf[MM::MaxStrLength];
-    GetProperty(MM::g_Keyword_PixelType, buf);
-    std::string pixelType(buf);
-
-    if (img.Height() == 0 || img.Width() == 0 || img.Depth() == 0) {
+/**
+* Lets every worker bin its queue and waits until all of them are done.
+*/
+void MH_camera::FlushBinRuns()
+{
+    if (binWorkers_[0]->runs.empty()) {
         return;
     }
+    binPending_ = (long)binWorkers_.size();
+    for (size_t w = 0; w < binWorkers_.size(); w++) {
+        SetEvent(binWorkers_[w]->go);
+    }
+    WaitForSingleObject(binDone_, INFINITE);
+    for (size_t w = 0; w < binWorkers_.size(); w++) {
+        binWorkers_[w]->runs.clear();
+        binWorkers_[w]->nRecords = 0;
+    }
 }
 
-bool MH_camera::GenerateMHTestPattern(ImgBuffer& img) {
-    unsigned width = img.Width(), height = img.Height();
-    //const unsigned char maxVal = 65535;
-    char buf[MM::MaxStrLength];
-    GetProperty(MM::g_Keyword_PixelType, buf);
-    std::string pixelType(buf);
-
-    int maxValue = 1 << GetBitDepth();
-    long nrPixels = img.Width() * img.Height();
-    int check_stride = 50;
+/**
+* True if HandleMarker() may call FrameCompleted() for this marker, a little
+* conservatively (any line clock on the last two lines).
+*/
+bool MH_camera::MarkerMayEndFrame(unsigned int record) const
+{
+    unsigned int channel = (record >> 25) & 0x3F;
+    if (!streaming_ || channel == 63) {
+        return false;
+    }
+    return channel == 3 || channel == 4 || ((channel == 1 || channel == 2) && current_line_ >= n_scanPixels_Y_ - 2);
+}
 
-    if (pixelType.compare(g_PixelType_8bit) == 0)
+/**
+* Binning worker thread body: bins the owned photons of every queued run in
+* order, each against its own line context.
+*/
+int MH_camera::BinOnWorker(int index)
+{
+    BinWorker& worker = *binWorkers_[index];
+    while (1)
     {
-        maxValue = 255;
-        unsigned char* rawShorts = (unsigned char*) const_cast<unsigned char*>(img.GetPixels());
-        for (unsigned y = 0; y < height; ++y)
-        {
-            for (unsigned x = 0; x < width; ++x)
-            {
-                if (y == 0)
-                {
-                    if (int(x / check_stride) % 2 == 0) {
-                        rawShorts[x] = (unsigned char)0;
-                    }
-                    else {
-                        rawShorts[x] = (unsigned char)maxValue;
-                    }
-                }
-                else {
-                    if (int(y / check_stride) % 2 == 0) {
-                        rawShorts[x + y * width] = (unsigned char)rawShorts[x];
-                    }
-                    else {
-                        rawShorts[x + y * width] = (unsigned char)(maxValue - rawShorts[x]);
-                    }
-                }
-            }
+        WaitForSingleObject(worker.go, INFINITE);
+        if (binQuit_) {
+            break;
         }
-    }
-    else if (pixelType.compare(g_PixelType_16bit) == 0)
-    {
-        maxValue = 65535;
-        unsigned short* rawShorts = (unsigned short*) const_cast<unsigned char*>(img.GetPixels());
-        for (unsigned y = 0; y < height; ++y)
-        {
-            for (unsigned x = 0; x < width; ++x)
-            {
-                if (y == 0)
-                {
-                    if (int(x / check_stride) % 2 == 0) {
-                        rawShorts[x] = (unsigned short)0;
-                    }
-                    else {
-                        rawShorts[x] = (unsigned short)maxValue;
-                    }
-                }
-                else {
-                    if (int(y / check_stride) % 2 == 0) {
-                        rawShorts[x + y * width] = (unsigned short)rawShorts[x];
-                    }
-                    else {
-                        rawShorts[x + y * width] = (unsigned short)(maxValue - rawShorts[x]);
-                    }
-                }
+        const unsigned int* records = worker.records.empty() ? 0 : &worker.records[0];
+        for (size_t i = 0; i < worker.runs.size(); i++) {
+            const BinRun& run = worker.runs[i];
+            if (run.nRecords > 0) {
+                (this->*binPhotons_)(records + run.begin, run.nRecords, run.ctx);
+                (this->*binLifetimes_)(records + run.begin, run.nRecords, run.ctx);
             }
         }
+        if (--binPending_ == 0) {
+            SetEvent(binDone_);
+        }
     }
-    return true;
+    return DEVICE_OK;
 }
 
-bool MH_camera::GenerateMHImage(ImgBuffer& img) {
-    unsigned width = img.Width(), height = img.Height();
-    char buf[MM::MaxStrLength];
-    GetProperty(MM::g_Keyword_PixelType, buf);
-    std::string pixelType(buf);
-    int maxValue = 1 << GetBitDepth();
-
-    return true;
+int MH_camera::OnCountOverflow(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+    if (eAct == MM::BeforeGet)
+    {
+        pProp->Set(saturateCounts_ ? "Saturate" : "Wrap");
+    }
+    else if (eAct == MM::AfterSet)
+    {
+        if (IsCapturing())
+            return DEVICE_CAMERA_BUSY_ACQUIRING;
+        std::string policy;
+        pProp->Get(policy);
+        saturateCounts_ = (policy.compare("Wrap") != 0);
+    }
+    return DEVICE_OK;
 }
 
-bool MH_camera::GenerateMHHisto(ImgBuffer& img) {
-    //Either display a bar chart with count rates or a decay curve
-    unsigned width = img.Width(), height = img.Height();
-    char buf[MM::MaxStrLength];
-    GetProperty(MM::g_Keyword_PixelType, buf);
-    std::string pixelType(buf);
-    int maxValue = 1 << GetBitDepth();
-    std::vector<int>old_bins;
-    if (!bins_.empty()) {
-        old_bins = bins_;
-        //store values
+int MH_camera::OnLineMap(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+    if (eAct == MM::BeforeGet)
+    {
+        pProp->Set(line_map_mode_ == LINE_MAP_SINUSOIDAL ? "Sinusoidal" : "Linear");
     }
-    else {
-
+    else if (eAct == MM::AfterSet)
+    {
+        if (IsCapturing())
+            return DEVICE_CAMERA_BUSY_ACQUIRING;
+        std::string mapping;
+        pProp->Get(mapping);
+        line_map_mode_ = (mapping.compare("Sinusoidal") == 0) ? LINE_MAP_SINUSOIDAL : LINE_MAP_LINEAR;
     }
-    bins_.clear();
-    //Represent everything as having the same number of bins as the width of the image
-    int nbins = width;
-    //Maximum displayable rate
-    int max_rate = 500;
+    return DEVICE_OK;
+}
 
-    //For chunks, e.g. one bar per actual channel in a bar chart...
-    int n_channels = MAX_N_CHANNELS;
+int MH_camera::OnBinThreads(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+    if (eAct == MM::BeforeGet)
+    {
+        pProp->Set(binThreads_);
+    }
+    else if (eAct == MM::AfterSet)
+    {
+        if (IsCapturing())
+            return DEVICE_CAMERA_BUSY_ACQUIRING;
+        long threads;
+        pProp->Get(threads);
+        binThreads_ = (std::max)(1L, (std::min)(threads, (long)MAX_BIN_THREADS));
+    }
+    return DEVICE_OK;
+}
 
-    if (rates_or_decays_) {//True is rates
-        if (counts_.empty()) {//Initialise
-            //We have an array of count rates equal in length to the image width - worry about chunking into bars later
-            for (int i = 0; i < nbins; i++) {
-                counts_.push_back(0);
-            }
+int MH_camera::OnGates(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+    if (eAct == MM::BeforeGet)
+    {
+        pProp->Set(nGates_);
+    }
+    else if (eAct == MM::AfterSet)
+    {
+        if (IsCapturing())
+            return DEVICE_CAMERA_BUSY_ACQUIRING;
+        long gates;
+        pProp->Get(gates);
+        gates = (std::max)(0L, (std::min)(gates, (long)MAX_GATES));
+        if (gates != nGates_) {
+            nGates_ = gates;
+            gateGeneration_++;
         }
     }
+    return DEVICE_OK;
+}
 
-    double exposure_scaling_factor = (1000 / GetExposure());
-
-    for (unsigned int i = 0; i < width; i++) {
-        int which_ch = (int)((float)i * n_channels / (float)width);
-        if (rates_or_decays_) {
-            int threshold = (int)(live_rates[which_ch]*exposure_scaling_factor);
-            bins_.push_back(threshold);
-        } else {
-            //int threshold = (int)((float)width * i / (float)height);
-            int t = (int)((float)Lifetime_range_ * (float)i / (float)width);
-            int threshold = (int)(height * exp((-1 * t) / (float)Sim_lifetime_));
-            int noise = (int)((height / 10) * (double)rand() / (double)RAND_MAX);
-            //threshold = threshold + noise;
-            bins_.push_back(threshold + noise);
+int MH_camera::OnGateWindow(MM::PropertyBase* pProp, MM::ActionType eAct, long gate)
+{
+    if (eAct == MM::BeforeGet)
+    {
+        pProp->Set(gateWindows_[gate].c_str());
+    }
+    else if (eAct == MM::AfterSet)
+    {
+        if (IsCapturing())
+            return DEVICE_CAMERA_BUSY_ACQUIRING;
+        std::string windows;
+        pProp->Get(windows);
+        std::vector<std::pair<double, double> > parsed;
+        if (!ParseGateWindows(windows, parsed))
+        {
+            pProp->Set(gateWindows_[gate].c_str());
+            return DEVICE_INVALID_PROPERTY_VALUE;
         }
+        gateWindows_[gate] = windows;
+        gateGeneration_++;
     }
+    return DEVICE_OK;
+}
 
-    if (pixelType.compare(g_PixelType_8bit) == 0)
+int MH_camera::OnBeamCorrection(MM::PropertyBase* pProp, MM::ActionType eAct, long which)
+{
+    std::string* setting = which == 1 ? &beamGains_ : which == 2 ? &beamOffsets_ : which == 3 ? &beamCrosstalk_ : which == 4 ? &beamFlatField_ : 0;
+    if (eAct == MM::BeforeGet)
+    {
+        if (setting == 0)
+            pProp->Set(beamCorrection_ ? "On" : "Off");
+        else
+            pProp->Set(setting->c_str());
+    }
+    else if (eAct == MM::AfterSet)
     {
-        maxValue = 255;
-        unsigned char* rawShorts = (unsigned char*) const_cast<unsigned char*>(img.GetPixels());
-        for (unsigned y = 0; y < height; ++y)
+        if (IsCapturing())
+            return DEVICE_CAMERA_BUSY_ACQUIRING;
+        std::string value;
+        pProp->Get(value);
+        if (setting == 0)
         {
-            for (unsigned x = 0; x < width; ++x)
+            beamCorrection_ = value.compare("On") == 0;
+        }
+        else
+        {
+            std::vector<double> parsed;
+            if ((which == 1 || which == 2 || which == 3) && !ParseNumberList(value, parsed))
             {
-                if (y > bins_[x]) {
-                    rawShorts[x + y * width] = (unsigned char)0;
-                }
-                else {
-                    rawShorts[x + y * width] = (unsigned char)maxValue;
-                }
+                pProp->Set(setting->c_str());
+                return DEVICE_INVALID_PROPERTY_VALUE;
             }
+            *setting = value;
         }
+        beamCorrGeneration_++;
     }
-    else if (pixelType.compare(g_PixelType_16bit) == 0)
+    return DEVICE_OK;
+}
+
+int MH_camera::OnFlybackFraction(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+    if (eAct == MM::BeforeGet)
     {
-        maxValue = 65535;
-        unsigned short* rawShorts = (unsigned short*) const_cast<unsigned char*>(img.GetPixels());
-        for (unsigned y = 0; y < height; ++y)
+        pProp->Set(flyback_fraction_);
+    }
+    else if (eAct == MM::AfterSet)
+    {
+        double flyback;
+        pProp->Get(flyback);
+        if (flyback != flyback_fraction_)
         {
-            for (unsigned x = 0; x < width; ++x)
-            {
-                if (y > bins_[x]) {
-                    rawShorts[x + y * width] = (unsigned short)0;
-                }
-                else {
-                    rawShorts[x + y * width] = (unsigned short)maxValue;
-                }
-            }
+            ScanGeometry geometry = CurrentScanGeometry();
+            geometry.flyback = flyback;
+            return SetScanGeometry(geometry);
         }
     }
-    return true;
+    return DEVICE_OK;
 }
 
+int MH_camera::OnFlimBins(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+    if (eAct == MM::BeforeGet)
+    {
+        pProp->Set((long)flimBins_);
+    }
+    else if (eAct == MM::AfterSet)
+    {
+        if (IsCapturing())
+            return DEVICE_CAMERA_BUSY_ACQUIRING;
+        long bins;
+        pProp->Get(bins);
+        flimBins_ = (int)bins;
+    }
+    return DEVICE_OK;
+}
 
-void MH_camera::TestResourceLocking(const bool recurse)
+int MH_camera::OnTTTRRollover(MM::PropertyBase* pProp, MM::ActionType eAct)
 {
-    if (recurse)
-        TestResourceLocking(false);
+    if (eAct == MM::BeforeGet)
+    {
+        pProp->Set(tttrRolloverMB_);
+    }
+    else if (eAct == MM::AfterSet)
+    {
+        pProp->Get(tttrRolloverMB_);
+    }
+    return DEVICE_OK;
 }
 
-
 /**
-* Generate an image with offset plus noise
+* Handles the pre-init "TTTR source" property.
 */
-
-int MH_camera::RegisterImgManipulatorCallBack(ImgManipulator* imgManpl)
+int MH_camera::OnTTTRSource(MM::PropertyBase* pProp, MM::ActionType eAct)
 {
-    imgManpl_ = imgManpl;
+    if (eAct == MM::BeforeGet)
+    {
+        if (tttrSource_ == TTTR_SOURCE_REPLAY)
+            pProp->Set(g_TTTR_Source_Replay);
+        else if (tttrSource_ == TTTR_SOURCE_SYNTHETIC)
+            pProp->Set(g_TTTR_Source_Synthetic);
+        else
+            pProp->Set(g_TTTR_Source_MultiHarp);
+    }
+    else if (eAct == MM::AfterSet)
+    {
+        std::string val;
+        pProp->Get(val);
+        if (val == g_TTTR_Source_Replay)
+            tttrSource_ = TTTR_SOURCE_REPLAY;
+        else if (val == g_TTTR_Source_Synthetic)
+            tttrSource_ = TTTR_SOURCE_SYNTHETIC;
+        else
+            tttrSource_ = TTTR_SOURCE_MULTIHARP;
+    }
     return DEVICE_OK;
 }
 
-
-// Added bitsfrom MH Device Adapter
-int MH_camera::On_Offset_Ch1(MM::PropertyBase* pProp, MM::ActionType eAct) {
+/**
+* Handles the pre-init "MultiHarp serial" property.
+*/
+int MH_camera::OnMultiHarpSerial(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+    if (eAct == MM::BeforeGet)
     {
-        long test_val = 1;
-        if (eAct == MM::BeforeGet) {
-            pProp->Set(offsets[0]);
-            // nothing to do, let the caller use cached property
-        }
-        else if (eAct == MM::AfterSet)
-        {
-            char dummy[100];
-            // Set timer for the Busy signal
-            MH_changedTime_ = GetCurrentMMTime();
-            if (Mode == MODE_T2) {
-                sprintf(dummy, "Offset cannot be set in T2 mode!");
-                msgstr = dummy;
-                LogMessage(msgstr);
-            }
-            else {
-
-                //No ints, just longs
-                long val_toset;
-                pProp->Get(offsets[0]);
-                retcode = MH_SetOffset(dev[0], offsets[0]);
-                if (retcode < 0)
-                {
-                    MH_GetErrorString(Errorstring, retcode);
-                    sprintf(dummy, "MH_SetOffset error %d on channel %d (%s). Aborted.", retcode, 0, Errorstring);
-                    msgstr = dummy;
-                    LogMessage(msgstr);
-                    return retcode;
-                }
-                else {
-                    sprintf(dummy, "MH_SetOffset on channel %d set to %d ps.", 0, offsets[0]);
-                    msgstr = dummy;
-                    LogMessage(msgstr);
-                }
-            }
-        }
-        return DEVICE_OK;
+        pProp->Set(mhSerial_.c_str());
+    }
+    else if (eAct == MM::AfterSet)
+    {
+        if (initialized_)
+            return DEVICE_CAN_NOT_SET_PROPERTY;
+        pProp->Get(mhSerial_);
     }
+    return DEVICE_OK;
 }
 
-int MH_camera::On_Integ_t(MM::PropertyBase* pProp, MM::ActionType eAct)
+int MH_camera::OnReplayFile(MM::PropertyBase* pProp, MM::ActionType eAct)
 {
     if (eAct == MM::BeforeGet)
     {
-        pProp->Set(Tacq);
+        pProp->Set(replayPath_.c_str());
     }
     else if (eAct == MM::AfterSet)
     {
-        pProp->Get(Tacq);
+        if (IsCapturing())
+            return DEVICE_CAMERA_BUSY_ACQUIRING;
+        pProp->Get(replayPath_);
+        //Opened again from the start by the next acquisition
+        replay_.Close();
     }
     return DEVICE_OK;
 }
 
-int MH_camera::On_MH_Status(MM::PropertyBase* pProp, MM::ActionType eAct)
+int MH_camera::OnSyntheticParam(MM::PropertyBase* pProp, MM::ActionType eAct, long which)
 {
-    //PROPERTY SETTING LOGIC NEEDS A CHECK OR 5...
+    double& value = (which == 0) ? synthPhotonRate_ : synthSyncMHz_;
     if (eAct == MM::BeforeGet)
     {
-        if (MH_Status_ == 0)
-        {
-            pProp->Set("Idle");
-        }
-        else if (MH_Status_ == 1) {
-            pProp->Set("Start");
-        }
-        else if (MH_Status_ == 2) {
-            pProp->Set("Running");
-        }
-        else if (MH_Status_ == 3) {
-            pProp->Set("Abort");
-        }
-        else {
-            pProp->Set("Idle");//duplication for clarity
-        }
-        // nothing to do, let the caller use cached property
+        pProp->Set(value);
     }
     else if (eAct == MM::AfterSet)
     {
-        LogMessage("AN ACTION WAS DONE");
-        // Set timer for the Busy signal
-        MH_changedTime_ = GetCurrentMMTime();
-        std::string MH_Status_str;
-        //Returns a std::string
-        pProp->Get(MH_Status_str);
-        if (MH_Status_str.compare("Idle") == 0)// 0 means a string matches
-        {
-            MH_Status_ = 0;
-            LogMessage("Set Idle");
-            pProp->Set("Idle");
-        }
-        else if (MH_Status_str.compare("Start") == 0) {
-            MH_Status_ = 2;
-            LogMessage("Set Start");
-            pProp->Set("Running");
-            start_acq();
-        }
-        else if (MH_Status_str.compare("Running") == 0) {
-            LogMessage("Set Running");
-            pProp->Set("Idle");
-            MH_Status_ = 2;
-        }
-        else if (MH_Status_str.compare("Abort") == 0) {
-            MH_Status_ = 0;
-            LogMessage("Set Abort");
-            pProp->Set("Idle");
-        }
-        else {//Idle
-            LogMessage("Set Idle");
-            MH_Status_ = 0;
-        }
-        int ret = OnPropertiesChanged();
-        if (ret != DEVICE_OK)
-        {
-            return ret;
-        }
+        pProp->Get(value);
     }
     return DEVICE_OK;
 }
 
+/**
+* Gets the offline source ready for a measurement and points the time base at
+* it. The synthetic stream is rebuilt every time so it follows the current
+* scan geometry; a replay file carries on where the last measurement stopped.
+*/
+int MH_camera::OpenReplaySource()
+{
+    if (tttrSource_ == TTTR_SOURCE_SYNTHETIC)
+    {
+        ScanGeometry geometry = CurrentScanGeometry();
+        SyntheticT3Config config;
+        config.syncRateHz = synthSyncMHz_ * 1e6;
+        config.photonRateHz = synthPhotonRate_;
+        config.beams = (int)(n_beams_X_ * n_beams_Y_);
+        config.linesPerFrame = (int)n_scanPixels_Y_;
+        config.linePeriodS = geometry.timePerImage * 1e-3 / (std::max)(1L, n_scanPixels_Y_);
+        config.flybackFraction = flyback_fraction_;
+        config.lifetimeBins = (Resolution > 0) ? Sim_lifetime_ / Resolution : 100.0;
+        config.binsPerSync = (Resolution > 0) ? (int)(1e12 / config.syncRateHz / Resolution) : 0x8000;
+        replay_.OpenSynthetic(config);
+    }
+    else if (!replay_.IsOpen() && !replay_.OpenFile(replayPath_))
+    {
+        LogMessage("Could not open the TTTR replay file " + replayPath_);
+        return ERR_REPLAY_SOURCE;
+    }
+    if (replay_.GlobalResolutionPs() > 0)
+    {
+        MeasDesc_GlobalResolution_ = (uint64_t)(replay_.GlobalResolutionPs() + 0.5);
+        Syncrate = (int)(SyncDivider * 1e12 / replay_.GlobalResolutionPs());
+    }
+    if (replay_.ResolutionPs() > 0)
+        Resolution = replay_.ResolutionPs();
+    return DEVICE_OK;
+}
 
-int MH_camera::On_Save_Enable(MM::PropertyBase* pProp, MM::ActionType eAct)
+int MH_camera::OnSequenceMode(MM::PropertyBase* pProp, MM::ActionType eAct)
 {
-    //PROPERTY SETTING LOGIC NEEDS A CHECK OR 5...
     if (eAct == MM::BeforeGet)
     {
-        if (MH_Saving_ == 0)
-        {
-            pProp->Set("False");
-            saving_ = false;
-        }
-        else if (MH_Saving_ == 1) {
-            pProp->Set("True");
-            saving_ = true;
-        }
-        else {
-            pProp->Set("False");//duplication for clarity
-            saving_ = false;
-        }
-        // nothing to do, let the caller use cached property
+        pProp->Set(continuousSequence_ ? g_Sequence_Continuous : g_Sequence_Frame_By_Frame);
     }
     else if (eAct == MM::AfterSet)
     {
-        LogMessage("AN ACTION WAS DONE");
-        // Set timer for the Busy signal
-        MH_changedTime_ = GetCurrentMMTime();
-        std::string MH_Saving_str;
-        //Returns a std::string
-        pProp->Get(MH_Saving_str);
-        if (MH_Saving_str.compare("False") == 0)// 0 means a string matches
-        {
-            MH_Saving_ = 0;
-            LogMessage("Saving set to False");
-            pProp->Set("False");
-            saving_ = false;
-        }
-        else if (MH_Saving_str.compare("True") == 0) {
-            MH_Saving_ = 1;
-            LogMessage("Saving set to True");
-            pProp->Set("True");
-            saving_ = true;
-            //start_acq();//do we want to do an acquisition every time we set saving to true?
-        }
-        else {//Idle
-            LogMessage("Saving set to False");
-            MH_Status_ = 0;
-        }
-        int ret = OnPropertiesChanged();
-        if (ret != DEVICE_OK)
-        {
-            return ret;
-        }
+        if (IsCapturing())
+            return DEVICE_CAMERA_BUSY_ACQUIRING;
+        std::string seqMode;
+        pProp->Get(seqMode);
+        continuousSequence_ = (seqMode.compare(g_Sequence_Continuous) == 0);
     }
     return DEVICE_OK;
 }
 
-int MH_camera::start_acq()
+/**
+* Runs one MultiHarp measurement through the reader/decoder/writer pipeline.
+* continuous == false: one exposure, the image is left in img_.
+* continuous == true: runs until the sequence thread is stopped or
+* stream_images_left_ frames have been handed to InsertImage().
+*/
+int MH_camera::start_acq(bool continuous)
 {
-    if (n_frame_tracker_ % n_frame_repeats_ == 0) {//Allows the accumulation and reset of frame clock to both work?
-        img_.ResetPixels();
-    }
+    int modeRet = SetMeasurementMode(MODE_T3);
+    if (modeRet != DEVICE_OK)
+        return modeRet;
+    bool resetFrame = continuous || (n_frame_tracker_ % n_frame_repeats_ == 0);
     //LogMessage("Ran start acq function");
     char dummy[100];
     //Reset trackers
@@ -2938,18 +6707,65 @@ int MH_camera::start_acq()
     frame_active_ = false;
     last_line_start_ = 0;
     last_line_end_ = 0;
+    line_pixel_scale_ = 0;
+    line_end_clock_seen_ = false;
+    streaming_ = continuous;
+    frame_completed_ = false;
+    stream_frames_summed_ = 0;
+    stream_ret_ = DEVICE_OK;
+    triggerSteps_ = 0;
+    ResetPipelineStats();
+    if (!(CurrentAccumulatorKey() == accumulatorKey_)) {
+        SelectAccumulator();
+        BuildMetadataTemplate(); //The FLIM scaling comes from the new accumulators
+    }
+    else if (resetFrame) {
+        ResetLifetimeAccumulators();
+    }
+    if (binPhotons_ != &MH_camera::BinPhotonsNone) {
+        //Allows the accumulation and reset of frame clock to both work?
+        if (resetFrame) {
+            std::fill(frameCounts_.begin(), frameCounts_.end(), 0u);
+        }
+        acqPixels_ = framePool_.Begin(!resetFrame);
+    }
+    else if (resetFrame) {
+        img_.ResetPixels();
+    }
+    stopFrameService_ = false;
+    frameService_->Start();
+    //The lifetime summaries are single buffered, so only plain intensity frames are previewed
+    previewing_ = previewMode_ != PREVIEW_OFF && liveSequence_ && IsCapturing() && acqPixels_ != 0
+        && binLifetimes_ == &MH_camera::BinPhotonsNone;
+    previewLineCount_ = 0;
+    {
+        LARGE_INTEGER now;
+        QueryPerformanceCounter(&now);
+        previewTicks_ = now.QuadPart;
+    }
 
     for (int i = 0; i < MAX_N_CHANNELS; i++) {
         live_rates[i] = 0;
     }
 
-    //Processing stuff
-    unsigned int chan_mask = 0x000003f;
-    int chan_shift = 25;
     int tot_rec = 0;
-    int acq_duration_ms = (int)GetExposure();
+    int ret = DEVICE_OK;
+    bool saveThis = saving_; //Saving can be toggled mid-measurement, the pipeline can't
+    Scan_hub* pHub = static_cast<Scan_hub*>(GetParentHub());
+    bool replay = tttrSource_ != TTTR_SOURCE_MULTIHARP;
+    bool syncStart = !replay && (pHub != 0) && pHub->SynchronizedStart();
+    //A synchronized or replayed snap ends on the last line clock of its last repeat, the timer is only a fallback
+    stopOnFrameEnd_ = (syncStart || replay) && !continuous;
+    snapFramesDone_ = 0;
+    int acq_duration_ms = continuous ? ACQTMAX : (int)GetExposure() * (stopOnFrameEnd_ ? n_frame_repeats_ : 1) + (syncStart ? SYNC_START_MARGIN_MS : 0);
 
-    retcode = MH_StartMeas(dev[0], acq_duration_ms);
+    if (replay) {
+        ret = OpenReplaySource();
+        retcode = (ret == DEVICE_OK) ? 0 : -1;
+    }
+    else {
+        retcode = MH_StartMeas(dev[0], acq_duration_ms);
+    }
 
 
     //original
@@ -2979,7 +6795,7 @@ int MH_camera::start_acq()
     std::string subfolder = "tttr_raws/"; // Corrected: Removed leading slash for relative path
     std::string fpath(subfolder);  // Add subfolder to the path
     fpath.append(fpathbuffer);     // Append the formatted date and time
-    fpath.append("_tttr.out");     // Append the file extension
+    fpath.append("_tttr");         // TTTRFileWriter adds .ptu (or _partNNN.ptu)
 
     // Step 4: Ensure the subfolder exists (create it if necessary)
     const char* folderPath = "tttr_raws";
@@ -2993,7 +6809,8 @@ int MH_camera::start_acq()
     int loopctr = 0;
     if (retcode < 0)
     {
-        MH_GetErrorString(Errorstring, retcode);
+        if (tttrSource_ == TTTR_SOURCE_MULTIHARP) //Offline sources never opened the device
+            MH_GetErrorString(Errorstring, retcode);
         //printf("\nMH_StartMeas error %d (%s). Aborted.\n", retcode, Errorstring);
         sprintf(dummy, "Error at 546");
         msgstr = dummy;
@@ -3003,116 +6820,99 @@ int MH_camera::start_acq()
     //
     sprintf(dummy, "About to start while loop");
     msgstr = dummy;
-    LogMessage(msgstr);
-
-
-    if (saving_) {
-        if ((fpout = fopen(fpath.c_str(), "wb")) == NULL)
+    LogMessage(msgstr, true);
+
+
+    if (saveThis) {
+        TTTRFileWriter::HeaderInfo info;
+        info.resolutionPs = Resolution;
+        info.syncRate = Syncrate;
+        info.syncDivider = SyncDivider;
+        info.binning = Binning;
+        info.tacqMs = acq_duration_ms;
+        info.offsetsPs = offsets;
+        info.hwModel = HW_Model;
+        info.hwPartNo = HW_Partno;
+        info.hwVersion = HW_Version;
+        info.hwSerial = HW_Serial;
+        info.libVersion = LIB_Version;
+        if (!tttrFile_.Open(fpath, info, (uint64_t)tttrRolloverMB_ << 20))
         {
-            sprintf(dummy, "Failed to open a file!");
+            sprintf(dummy, "Failed to open a file! (error %lu)", tttrFile_.LastError());
             msgstr = dummy;
             LogMessage(msgstr);
+            if (tttrSource_ == TTTR_SOURCE_MULTIHARP)
+                MH_StopMeas(dev[0]);
             goto fail;
         }
     }
     
-    while (1)
-    {
-        retcode = MH_GetFlags(dev[0], &flags);
-        if (retcode < 0)
-        {
-            MH_GetErrorString(Errorstring, retcode);
-            //printf("\nMH_GetFlags error %d (%s). Aborted.\n", retcode, Errorstring);
-            sprintf(dummy, "Get Flags failed");
-            msgstr = dummy;
-            LogMessage(msgstr);
-            goto fail;
+    //Reader thread drains the FIFO, this thread decodes (the binning workers, if any, bin) and the writer thread (if any) saves
+    StartBinWorkers();
+    fifoRing_.Reset(saveThis ? 2 : 1);
+    stopAcq_ = false;
+    fifoReadResult_ = DEVICE_OK;
+    fifoReader_->Start();
+    if (saveThis) {
+        tttrWriter_->Start();
+    }
+
+    if (syncStart) {
+        //MultiHarp is armed and being drained, so the first frame clock can't be missed
+        ret = pHub->StartGalvoScan();
+        if (ret != DEVICE_OK) {
+            LogMessage("Synchronized galvo start failed, ending the measurement");
+            stopAcq_ = true;
         }
+    }
 
-        if (flags & FLAG_FIFOFULL)
-        {
-            sprintf(dummy, "Flags and FIFOFull");
-            msgstr = dummy;
-            LogMessage(msgstr);
-            goto stoptttr;
+    while (1)
+    {
+        if (continuous && !stopAcq_ && thd_->IsStopped()) {
+            //Sequence stopped by the user - let the reader wind down, keep draining until its last block
+            stopAcq_ = true;
         }
-
-        retcode = MH_ReadFiFo(dev[0], buffer, &nRecords);	//may return less!  
-        if (retcode < 0)
-        {
-            MH_GetErrorString(Errorstring, retcode);
-            //printf("\nMH_ReadFiFo error %d (%s). Aborted.\n", retcode, Errorstring);
-            sprintf(dummy, "Read Fifo failed");
-            msgstr = dummy;
-            LogMessage(msgstr);
-            goto stoptttr;
+        TTTRBlock* block = fifoRing_.AcquireRead(TTTRRing::RING_DECODER);
+        if (block == NULL) {
+            Sleep(0);
+            continue;
         }
-
-        if (nRecords)
+        if (block->nRecords)
         {
-            //TRY UPDATING RATES
-            unsigned int* ptrToBuf = buffer;
-            //https://wiki.sei.cmu.edu/confluence/display/c/EXP08-C.+Ensure+pointer+arithmetic+is+used+correctly
-            for (int i = 0; i < nRecords; i++) {
-                unsigned int record = ptrToBuf[i];
-                unsigned int chan = (record >> chan_shift) & chan_mask;//shift 25 bits down to get record at the start
-                TranslateRecord(record, img_);//for just the MH acquisition we don't need to do any translating... to
-                if (chan < MAX_N_CHANNELS) {
-                    live_rates[chan] += 1;
-                }
-            }
-            //WRITE TO DISK
-            //tot_rec += nRecords;
-            if (saving_) {
-                if (fwrite(buffer, 4, nRecords, fpout) != (unsigned)nRecords)//The 4 is bytes per element - https://cplusplus.com/reference/cstdio/fwrite/
-                {
-                    //printf("\nfile write error\n");
-                    sprintf(dummy, "nRecords failed?");
-                    msgstr = dummy;
-                    LogMessage(msgstr);
-                    goto stoptttr;
-                }
-            }
-            Progress += nRecords;
-            //printf("\b\b\b\b\b\b\b\b\b\b\b\b%12u", Progress);
-            fflush(stdout);
+            LARGE_INTEGER t0, t1;
+            QueryPerformanceCounter(&t0);
+            DecodeBlock(block->records, block->nRecords);
+            QueryPerformanceCounter(&t1);
+            statDecodeTicks_.fetch_add(t1.QuadPart - t0.QuadPart, std::memory_order_relaxed);
+            statDecodeRecords_.fetch_add(block->nRecords, std::memory_order_relaxed);
+            Progress += block->nRecords;
         }
-
-        else
-        {
-            retcode = MH_CTCStatus(dev[0], &ctcstatus);
-            if (retcode < 0)
-            {
-                MH_GetErrorString(Errorstring, retcode);
-                //printf("\nMH_CTCStatus error %d (%s). Aborted.\n", retcode, Errorstring);
-                sprintf(dummy, "CTCstatus failed");
-                msgstr = dummy;
-                LogMessage(msgstr);
-                goto fail;
-            }
-            if (ctcstatus)
-            {
-                //printf("\nDone\n");
-                goto stoptttr;
-            }
+        bool last = block->last;
+        fifoRing_.Release(TTTRRing::RING_DECODER);
+        if (last) {
+            break;
         }
-        //Add other check code here e.g. look for abort set?
-
         loopctr++;
-
     }
+    fifoReader_->wait();
+    if (saveThis) {
+        tttrWriter_->wait();
+    }
+    if (ret == DEVICE_OK) {
+        ret = fifoReadResult_; //A dead device or an overrun ends the acquisition with an error
+    }
+
     //within this loop you can also read the count rates if needed.
-stoptttr:
     for (int i = 0; i < MAX_N_CHANNELS; i++) {
         sprintf(dummy, "Rate for channel %d: %d", i,live_rates[i]);
         msgstr = dummy;
-        LogMessage(msgstr);        
+        LogMessage(msgstr, true);
     }
     sprintf(dummy, "Got to stoptttr");
     msgstr = dummy;
-    LogMessage(msgstr);
+    LogMessage(msgstr, true);
 
-    retcode = MH_StopMeas(dev[0]);
+    retcode = replay ? 0 : MH_StopMeas(dev[0]);
     if (retcode < 0)
     {
         MH_GetErrorString(Errorstring, retcode);
@@ -3125,23 +6925,42 @@ stoptttr:
 
 fail:
     //Shutdown();
+    StopBinWorkers();
+    {
+        LARGE_INTEGER now;
+        QueryPerformanceCounter(&now);
+        statStopTicks_ = now.QuadPart;
+    }
+    if (acqPixels_) {
+        //The counts stay, a snap that doesn't reset the frame carries on from them
+        PublishFrameCounts(acqPixels_, false);
+        ApplyRoiFill(acqPixels_);
+        framePool_.Finish(false);
+    }
+    stopFrameService_ = true;
+    frameService_->wait();
+    streaming_ = false;
+    previewing_ = false;
+    stopOnFrameEnd_ = false;
     current_line_ = -99;
     sprintf(dummy, "Got to fail");
     msgstr = dummy;
-    LogMessage(msgstr);
+    LogMessage(msgstr, true);
 
     //sprintf(dummy, "nRecords latest: %d and total: %d", nRecords, tot_rec);
     //msgstr = dummy;
     //LogMessage(msgstr);
 
-    if (saving_) {
-        if (fpout)
+    if (tttrFile_.IsOpen()) {
+        if (!tttrFile_.Close())
         {
-            fclose(fpout);
+            sprintf(dummy, "Failed to finish %s (error %lu)", tttrFile_.CurrentPath().c_str(), tttrFile_.LastError());
+            msgstr = dummy;
+            LogMessage(msgstr);
         }
     }
 
-    return DEVICE_OK;
+    return ret;
 
 }
 
@@ -3175,6 +6994,7 @@ int SocketGalvo::Initialize()
         pHub->CreateStringProperty("Hub EXAMPLE STRING PROPERTY FROM GALVO", propval, true);
         //pHub->SetProperty("Hub EXAMPLE STRING PROPERTY FROM GALVO", propval2, true);
         SetParentID(hubLabel); // for backward comp.
+        pHub->RegisterGalvo(this);
     }
     else
         LogMessage(NoHubError);
@@ -3182,9 +7002,62 @@ int SocketGalvo::Initialize()
 
     galvo_control_port_ = 54321;
     galvo_control_IP_address_ = "127.0.0.1";
+
+    SetErrorText(ERR_GALVO_CONNECT, "Could not connect to the galvo scanner");
+    SetErrorText(ERR_GALVO_SEND, "Lost the connection to the galvo scanner");
+    SetErrorText(ERR_GALVO_TIMEOUT, "Timed out talking to the galvo scanner");
+
+    CreateStringProperty(g_PropName_Galvo_IP, galvo_control_IP_address_.c_str(), false, new CPropertyAction(this, &SocketGalvo::OnAddress));
+    CreateIntegerProperty(g_PropName_Galvo_Port, galvo_control_port_, false, new CPropertyAction(this, &SocketGalvo::OnPort));
+    SetPropertyLimits(g_PropName_Galvo_Port, 1, 65535);
+    CreateIntegerProperty(g_PropName_Galvo_Timeout, timeoutMs_, false, new CPropertyAction(this, &SocketGalvo::OnTimeout));
+    SetPropertyLimits(g_PropName_Galvo_Timeout, 10, 60000);
+    CreateStringProperty(g_PropName_Galvo_Wait_Reply, "No", false, new CPropertyAction(this, &SocketGalvo::OnWaitReply));
+    AddAllowedValue(g_PropName_Galvo_Wait_Reply, "No");
+    AddAllowedValue(g_PropName_Galvo_Wait_Reply, "Yes");
+    CreateStringProperty(g_Keyword_Socket_State, "Disconnected", true, new CPropertyAction(this, &SocketGalvo::OnSocketState));
+    CreateFloatProperty(g_PropName_Galvo_RTT, 0.0, true, new CPropertyAction(this, &SocketGalvo::OnRoundTrip));
+
+    CreateIntegerProperty(g_PropName_Scan_Pixels_X, scanConfig_.pixelsX, false, new CPropertyActionEx(this, &SocketGalvo::OnScanParam, 0));
+    SetPropertyLimits(g_PropName_Scan_Pixels_X, 1, MAX_SCAN_PIXELS);
+    CreateIntegerProperty(g_PropName_Scan_Pixels_Y, scanConfig_.pixelsY, false, new CPropertyActionEx(this, &SocketGalvo::OnScanParam, 1));
+    SetPropertyLimits(g_PropName_Scan_Pixels_Y, 1, MAX_SCAN_PIXELS);
+    CreateFloatProperty(g_PropName_Scan_Time, scanConfig_.timePerImage, false, new CPropertyActionEx(this, &SocketGalvo::OnScanParam, 2));
+    CreateIntegerProperty(g_PropName_Scan_Repeats, scanConfig_.frameRepeats, false, new CPropertyActionEx(this, &SocketGalvo::OnScanParam, 3));
+    SetPropertyLimits(g_PropName_Scan_Repeats, 1, 1000);
+    //Sequenceable: an MDA can load a list of geometries once and step through them
+    CreateStringProperty(g_PropName_Scan_Config, FormatScanConfig(scanConfig_).c_str(), false, new CPropertyAction(this, &SocketGalvo::OnScanConfig));
+    CreateStringProperty(g_PropName_Scan_Preload, "No", false, new CPropertyAction(this, &SocketGalvo::OnPreloadSequence));
+    AddAllowedValue(g_PropName_Scan_Preload, "No");
+    AddAllowedValue(g_PropName_Scan_Preload, "Yes");
+
+    //Not fatal - the scanner software may be started later, send_on_socket() reconnects
+    if (Connect() != DEVICE_OK) {
+        LogMessage("Galvo scanner not reachable yet, will retry on the first command");
+    }
+
     json_template_ = "{\"pixels_per_axisX\":p_p_a_X_value,\"microns_per_pixel\":m_p_p_value,\"time_per_image\":t_p_i_value,\"images\":n_im_value,\"flyback_fraction\":f_frac_value,\"magnification\":mag_value,\"scans_per_image\":s_p_i_value,\"pixels_per_axisY\":p_p_a_Y_value}";
     sg_command_template_ = "command1";
+    compiledConfig_ = RenderScanConfig(scanConfig_);
     SG_Status_ = 0;
+    initialized_ = true;
+    return DEVICE_OK;
+}
+
+int SocketGalvo::Shutdown()
+{
+    if (initialized_) {
+        Scan_hub* pHub = static_cast<Scan_hub*>(GetParentHub());
+        if (pHub) {
+            pHub->RegisterGalvo(0);
+        }
+    }
+    Disconnect();
+    if (wsaStarted_) {
+        WSACleanup();
+        wsaStarted_ = false;
+    }
+    initialized_ = false;
     return DEVICE_OK;
 }
 
@@ -3192,19 +7065,11 @@ int SocketGalvo::Initialize()
 // ----------------
 int SocketGalvo::OnSocketSend(MM::PropertyBase* pProp, MM::ActionType eAct) {
     
-    //>>>REPLACE THESE TEMP VALUES ONCE CALLING THE PARENT HUB IS SORTED
-    float m_p_p = 1.0;//MH_camera::GetPixelSizeUm();//BINNING?!
-    float t_p_i = 1000;//MH_camera::GetExposure();//Time per image
-    float flyback_fraction = 0.1;
-    float magnification = 20;
-    int n_scanPixels_X_ = 120;
-    int n_scanPixels_Y_ = 80;
-    int n_frame_repeats_ = 1;
-    //<<<REPLACE
-    std::string galvo_json_string = prep_json(json_template_, n_scanPixels_X_, n_scanPixels_Y_, m_p_p, t_p_i, 1, flyback_fraction, magnification, n_frame_repeats_);
-    send_on_socket(galvo_json_string, galvo_control_IP_address_, galvo_control_port_);
+    int ret = send_on_socket(compiledConfig_);
+    if (ret == DEVICE_OK)
+        configPending_ = false;
     SG_changedTime_ = GetCurrentMMTime();
-    return DEVICE_OK;//test
+    return ret;
 }
 
 int SocketGalvo::On_SG_Status(MM::PropertyBase* pProp, MM::ActionType eAct)
@@ -3265,28 +7130,393 @@ int SocketGalvo::On_SG_Status(MM::PropertyBase* pProp, MM::ActionType eAct)
 }
 
 int SocketGalvo::OnMsgChange(MM::PropertyBase* pProp, MM::ActionType eAct) {
-    send_on_socket(sg_command_template_, galvo_control_IP_address_, galvo_control_port_);
+    return send_on_socket(sg_command_template_);
+}
+
+int SocketGalvo::OnAddress(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+    if (eAct == MM::BeforeGet)
+    {
+        pProp->Set(galvo_control_IP_address_.c_str());
+    }
+    else if (eAct == MM::AfterSet)
+    {
+        std::string address;
+        pProp->Get(address);
+        if (address != galvo_control_IP_address_) {
+            galvo_control_IP_address_ = address;
+            Disconnect();
+        }
+    }
+    return DEVICE_OK;
+}
+
+int SocketGalvo::OnPort(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+    if (eAct == MM::BeforeGet)
+    {
+        pProp->Set((long)galvo_control_port_);
+    }
+    else if (eAct == MM::AfterSet)
+    {
+        long port;
+        pProp->Get(port);
+        if (port != galvo_control_port_) {
+            galvo_control_port_ = (int)port;
+            Disconnect();
+        }
+    }
+    return DEVICE_OK;
+}
+
+int SocketGalvo::OnTimeout(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+    if (eAct == MM::BeforeGet)
+    {
+        pProp->Set(timeoutMs_);
+    }
+    else if (eAct == MM::AfterSet)
+    {
+        pProp->Get(timeoutMs_);
+    }
+    return DEVICE_OK;
+}
+
+int SocketGalvo::OnWaitReply(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+    if (eAct == MM::BeforeGet)
+    {
+        pProp->Set(waitReply_ ? "Yes" : "No");
+    }
+    else if (eAct == MM::AfterSet)
+    {
+        std::string wait;
+        pProp->Get(wait);
+        waitReply_ = (wait.compare("Yes") == 0);
+    }
+    return DEVICE_OK;
+}
+
+int SocketGalvo::OnSocketState(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+    if (eAct == MM::BeforeGet)
+    {
+        pProp->Set(sock_ != INVALID_SOCKET ? "Connected" : "Disconnected");
+    }
+    return DEVICE_OK;
+}
+
+int SocketGalvo::OnRoundTrip(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+    if (eAct == MM::BeforeGet)
+    {
+        pProp->Set(lastRoundTripMs_);
+    }
+    return DEVICE_OK;
+}
+
+int SocketGalvo::OnScanParam(MM::PropertyBase* pProp, MM::ActionType eAct, long param)
+{
+    if (eAct == MM::BeforeGet)
+    {
+        switch (param) {
+        case 0: pProp->Set(scanConfig_.pixelsX); break;
+        case 1: pProp->Set(scanConfig_.pixelsY); break;
+        case 2: pProp->Set(scanConfig_.timePerImage); break;
+        default: pProp->Set(scanConfig_.frameRepeats); break;
+        }
+    }
+    else if (eAct == MM::AfterSet)
+    {
+        Scan_hub* pHub = static_cast<Scan_hub*>(GetParentHub());
+        ScanGeometry geometry;
+        if (pHub) {
+            geometry = pHub->GetGeometry();
+        }
+        else {
+            geometry.beamsX = geometry.beamsY = 1;
+            geometry.flyback = scanFlyback_;
+            geometry.magnification = magnification_;
+            geometry.micronsPerPixel = micronsPerPixel_;
+            geometry.pixelsX = scanConfig_.pixelsX;
+            geometry.pixelsY = scanConfig_.pixelsY;
+            geometry.timePerImage = scanConfig_.timePerImage;
+            geometry.frameRepeats = scanConfig_.frameRepeats;
+            geometry.version = geometryVersion_;
+        }
+        switch (param) {
+        case 0: pProp->Get(geometry.pixelsX); break;
+        case 1: pProp->Get(geometry.pixelsY); break;
+        case 2: pProp->Get(geometry.timePerImage); break;
+        default: pProp->Get(geometry.frameRepeats); break;
+        }
+        return SetScanGeometry(geometry);
+    }
+    return DEVICE_OK;
+}
+
+/**
+* Geometry changes go through the hub so the camera sees the same model.
+*/
+int SocketGalvo::SetScanGeometry(const ScanGeometry& geometry)
+{
+    Scan_hub* pHub = static_cast<Scan_hub*>(GetParentHub());
+    if (pHub)
+        return pHub->SetGeometry(geometry);
+
+    ScanGeometry local = geometry;
+    local.version = geometryVersion_ + 1;
+    ApplyScanGeometry(local);
+    return DEVICE_OK;
+}
+
+/**
+* Takes over a new geometry from the hub and renders its JSON once; the
+* scanner gets it with the next start_scan().
+*/
+void SocketGalvo::ApplyScanGeometry(const ScanGeometry& geometry)
+{
+    scanConfig_.pixelsX = geometry.pixelsX;
+    scanConfig_.pixelsY = geometry.pixelsY;
+    scanConfig_.timePerImage = geometry.timePerImage;
+    scanConfig_.frameRepeats = geometry.frameRepeats;
+    micronsPerPixel_ = geometry.micronsPerPixel;
+    scanFlyback_ = geometry.flyback;
+    magnification_ = geometry.magnification;
+    geometryVersion_ = geometry.version;
+    compiledConfig_ = RenderScanConfig(scanConfig_);
+    configPending_ = true;
+}
+
+/**
+* Scan geometry as one "X,Y,ms,repeats" value so it can be sequenced. Setting
+* it renders the geometry and marks it pending; start_scan() sends it ahead of
+* the next scan. A loaded sequence is rendered once and stepped through by
+* start_scan().
+*/
+int SocketGalvo::OnScanConfig(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+    if (eAct == MM::BeforeGet)
+    {
+        pProp->Set(FormatScanConfig(scanConfig_).c_str());
+    }
+    else if (eAct == MM::AfterSet)
+    {
+        std::string text;
+        pProp->Get(text);
+        GalvoScanConfig config;
+        if (!ParseScanConfig(text, config)) {
+            return DEVICE_INVALID_PROPERTY_VALUE;
+        }
+        Scan_hub* pHub = static_cast<Scan_hub*>(GetParentHub());
+        ScanGeometry geometry;
+        if (pHub) {
+            geometry = pHub->GetGeometry();
+        }
+        else {
+            geometry.beamsX = geometry.beamsY = 1;
+            geometry.flyback = scanFlyback_;
+            geometry.magnification = magnification_;
+            geometry.micronsPerPixel = micronsPerPixel_;
+            geometry.version = geometryVersion_;
+        }
+        geometry.pixelsX = config.pixelsX;
+        geometry.pixelsY = config.pixelsY;
+        geometry.timePerImage = config.timePerImage;
+        geometry.frameRepeats = config.frameRepeats;
+        return SetScanGeometry(geometry);
+    }
+    else if (eAct == MM::IsSequenceable)
+    {
+        pProp->SetSequenceable(GALVO_MAX_SEQUENCE);
+    }
+    else if (eAct == MM::AfterLoadSequence)
+    {
+        std::vector<std::string> sequence = pProp->GetSequence();
+        std::vector<std::string> compiled;
+        compiled.reserve(sequence.size());
+        for (size_t i = 0; i < sequence.size(); i++) {
+            GalvoScanConfig config;
+            if (!ParseScanConfig(sequence[i], config)) {
+                LogMessage("Bad scan configuration in sequence: " + sequence[i]);
+                return DEVICE_INVALID_PROPERTY_VALUE;
+            }
+            compiled.push_back(RenderScanConfig(config));
+        }
+        compiledSequence_.swap(compiled);
+        sequenceUploaded_ = false;
+    }
+    else if (eAct == MM::StartSequence)
+    {
+        if (compiledSequence_.empty()) {
+            return DEVICE_OK;
+        }
+        if (preloadSequence_ && !sequenceUploaded_) {
+            int ret = UploadSequence();
+            if (ret != DEVICE_OK) {
+                return ret;
+            }
+        }
+        sequenceIndex_ = 0;
+        sequenceRunning_ = true;
+    }
+    else if (eAct == MM::StopSequence)
+    {
+        sequenceRunning_ = false;
+    }
+    return DEVICE_OK;
+}
+
+int SocketGalvo::OnPreloadSequence(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+    if (eAct == MM::BeforeGet)
+    {
+        pProp->Set(preloadSequence_ ? "Yes" : "No");
+    }
+    else if (eAct == MM::AfterSet)
+    {
+        std::string preload;
+        pProp->Get(preload);
+        preloadSequence_ = (preload.compare("Yes") == 0);
+    }
     return DEVICE_OK;
 }
 
+bool SocketGalvo::ParseScanConfig(const std::string& text, GalvoScanConfig& config)
+{
+    long x, y, repeats;
+    double t;
+    if (sscanf(text.c_str(), "%ld,%ld,%lf,%ld", &x, &y, &t, &repeats) != 4) {
+        return false;
+    }
+    if (x < 1 || y < 1 || x > MAX_SCAN_PIXELS || y > MAX_SCAN_PIXELS || t <= 0.0 || repeats < 1) {
+        return false;
+    }
+    config.pixelsX = x;
+    config.pixelsY = y;
+    config.timePerImage = t;
+    config.frameRepeats = repeats;
+    return true;
+}
+
+std::string SocketGalvo::FormatScanConfig(const GalvoScanConfig& config)
+{
+    std::ostringstream os;
+    os << config.pixelsX << "," << config.pixelsY << "," << config.timePerImage << "," << config.frameRepeats;
+    return os.str();
+}
+
+std::string SocketGalvo::RenderScanConfig(const GalvoScanConfig& config)
+{
+    return prep_json(json_template_, config.pixelsX, config.pixelsY, (float)micronsPerPixel_, (float)config.timePerImage, 1, (float)scanFlyback_, (float)magnification_, config.frameRepeats);
+}
+
+/**
+* Stores every compiled entry on the scanner under its index ("preload:<i>:"
+* followed by the JSON) so each step of the sequence is a "select:<i>" trigger.
+* The commands are pipelined and not acknowledged individually.
+*/
+int SocketGalvo::UploadSequence()
+{
+    MMThreadGuard g(socketLock_); //Pipelined, nothing else may go out in between
+    for (int attempt = 0; attempt < 2; attempt++) {
+        sequenceUploaded_ = true; //Cleared by Connect() if a send had to reconnect
+        for (size_t i = 0; i < compiledSequence_.size(); i++) {
+            int ret = send_on_socket("preload:" + std::to_string(i) + ":" + compiledSequence_[i]);
+            if (ret != DEVICE_OK) {
+                sequenceUploaded_ = false;
+                return ret;
+            }
+        }
+        if (sequenceUploaded_) {
+            return DEVICE_OK;
+        }
+        LogMessage("Galvo connection was reopened during the sequence upload, uploading again");
+    }
+    return ERR_GALVO_CONNECT;
+}
+
 
 Scan_hub::Scan_hub() :
     HubBase<Scan_hub>(),
-    hub_n_scanPixels_X_(120),
-    hub_n_scanPixels_Y_(80)
+    camera_(0),
+    galvo_(0),
+    syncStart_(false)
 {
-
+    //Same defaults as the camera and galvo have on their own
+    geometry_.pixelsX = 120;
+    geometry_.pixelsY = 80;
+    geometry_.beamsX = 2;
+    geometry_.beamsY = 3;
+    geometry_.timePerImage = 1000.0;
+    geometry_.flyback = 0.1;
+    geometry_.magnification = 20.0;
+    geometry_.micronsPerPixel = 1.0;
+    geometry_.frameRepeats = 1;
+    geometry_.version = 0;
 }
 
 int Scan_hub::Initialize()
 {
     initialized_ = true;
-    CPropertyAction* pAct = new CPropertyAction(this, &Scan_hub::Onn_hubscanPixels_X);
-    CreateIntegerProperty(g_N_Hub_Scan_Px_X, 120, false, pAct);
-    //SetPropertyLimits(g_N_Scan_Px_X, 1, 1024);
-    pAct = new CPropertyAction(this, &Scan_hub::Onn_hubscanPixels_Y);
-    CreateIntegerProperty(g_N_Hub_Scan_Px_Y, 80, false, pAct);
-    //SetPropertyLimits(g_N_Scan_Px_Y, 1, 1024);
+    CPropertyActionEx* pActEx = new CPropertyActionEx(this, &Scan_hub::OnGeometryParam, GEOM_PIXELS_X);
+    CreateIntegerProperty(g_N_Hub_Scan_Px_X, geometry_.pixelsX, false, pActEx);
+    SetPropertyLimits(g_N_Hub_Scan_Px_X, 1, MAX_SCAN_PIXELS);
+    pActEx = new CPropertyActionEx(this, &Scan_hub::OnGeometryParam, GEOM_PIXELS_Y);
+    CreateIntegerProperty(g_N_Hub_Scan_Px_Y, geometry_.pixelsY, false, pActEx);
+    SetPropertyLimits(g_N_Hub_Scan_Px_Y, 1, MAX_SCAN_PIXELS);
+    pActEx = new CPropertyActionEx(this, &Scan_hub::OnGeometryParam, GEOM_BEAMS_X);
+    CreateIntegerProperty(g_N_Hub_Beams_X, geometry_.beamsX, false, pActEx);
+    SetPropertyLimits(g_N_Hub_Beams_X, 1, MAX_N_CHANNELS);
+    pActEx = new CPropertyActionEx(this, &Scan_hub::OnGeometryParam, GEOM_BEAMS_Y);
+    CreateIntegerProperty(g_N_Hub_Beams_Y, geometry_.beamsY, false, pActEx);
+    SetPropertyLimits(g_N_Hub_Beams_Y, 1, MAX_N_CHANNELS);
+    pActEx = new CPropertyActionEx(this, &Scan_hub::OnGeometryParam, GEOM_TIME);
+    CreateFloatProperty(g_PropName_Hub_Time, geometry_.timePerImage, false, pActEx);
+    pActEx = new CPropertyActionEx(this, &Scan_hub::OnGeometryParam, GEOM_FLYBACK);
+    CreateFloatProperty(g_PropName_Hub_Flyback, geometry_.flyback, false, pActEx);
+    SetPropertyLimits(g_PropName_Hub_Flyback, 0.0, 0.9);
+    pActEx = new CPropertyActionEx(this, &Scan_hub::OnGeometryParam, GEOM_MAGNIFICATION);
+    CreateFloatProperty(g_PropName_Hub_Magnification, geometry_.magnification, false, pActEx);
+    pActEx = new CPropertyActionEx(this, &Scan_hub::OnGeometryParam, GEOM_PIXEL_SIZE);
+    CreateFloatProperty(g_PropName_Hub_Pixel_Size, geometry_.micronsPerPixel, false, pActEx);
+    pActEx = new CPropertyActionEx(this, &Scan_hub::OnGeometryParam, GEOM_REPEATS);
+    CreateIntegerProperty(g_PropName_Hub_Repeats, geometry_.frameRepeats, false, pActEx);
+    SetPropertyLimits(g_PropName_Hub_Repeats, 1, 1000);
+    CPropertyAction* pAct = new CPropertyAction(this, &Scan_hub::OnGeometryVersion);
+    CreateIntegerProperty(g_PropName_Geometry_Version, 0, true, pAct);
+    pAct = new CPropertyAction(this, &Scan_hub::OnSyncStart);
+    //Off by default: existing configurations keep their start behaviour, and the galvo server has to support it
+    CreateStringProperty(g_PropName_Sync_Start, "No", false, pAct);
+    AddAllowedValue(g_PropName_Sync_Start, "No");
+    AddAllowedValue(g_PropName_Sync_Start, "Yes");
+    return DEVICE_OK;
+}
+
+/**
+* Fires the galvo once the camera has armed the MultiHarp. Only called by the
+* camera from start_acq(), so the scan can't run ahead of the measurement.
+*/
+int Scan_hub::StartGalvoScan()
+{
+    if (galvo_ == 0) {
+        return DEVICE_OK;
+    }
+    return galvo_->start_scan();
+}
+
+int Scan_hub::OnSyncStart(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+    if (eAct == MM::BeforeGet)
+    {
+        pProp->Set(syncStart_ ? "Yes" : "No");
+    }
+    else if (eAct == MM::AfterSet)
+    {
+        std::string sync;
+        pProp->Get(sync);
+        syncStart_ = (sync.compare("Yes") == 0);
+    }
     return DEVICE_OK;
 }
 
@@ -3317,29 +7547,99 @@ void Scan_hub::GetName(char* pName) const
     CDeviceUtils::CopyLimitedString(pName, g_HubDeviceName);
 }
 
-int Scan_hub::Onn_hubscanPixels_X(MM::PropertyBase* pProp, MM::ActionType eAct)
+int Scan_hub::OnGeometryParam(MM::PropertyBase* pProp, MM::ActionType eAct, long field)
 {
     if (eAct == MM::BeforeGet)
     {
-       
+        ScanGeometry geometry = GetGeometry();
+        switch (field) {
+        case GEOM_PIXELS_X: pProp->Set(geometry.pixelsX); break;
+        case GEOM_PIXELS_Y: pProp->Set(geometry.pixelsY); break;
+        case GEOM_BEAMS_X: pProp->Set(geometry.beamsX); break;
+        case GEOM_BEAMS_Y: pProp->Set(geometry.beamsY); break;
+        case GEOM_TIME: pProp->Set(geometry.timePerImage); break;
+        case GEOM_FLYBACK: pProp->Set(geometry.flyback); break;
+        case GEOM_MAGNIFICATION: pProp->Set(geometry.magnification); break;
+        case GEOM_PIXEL_SIZE: pProp->Set(geometry.micronsPerPixel); break;
+        default: pProp->Set(geometry.frameRepeats); break;
+        }
     }
     else if (eAct == MM::AfterSet)
     {
-       
+        ScanGeometry geometry = GetGeometry();
+        switch (field) {
+        case GEOM_PIXELS_X: pProp->Get(geometry.pixelsX); break;
+        case GEOM_PIXELS_Y: pProp->Get(geometry.pixelsY); break;
+        case GEOM_BEAMS_X: pProp->Get(geometry.beamsX); break;
+        case GEOM_BEAMS_Y: pProp->Get(geometry.beamsY); break;
+        case GEOM_TIME: pProp->Get(geometry.timePerImage); break;
+        case GEOM_FLYBACK: pProp->Get(geometry.flyback); break;
+        case GEOM_MAGNIFICATION: pProp->Get(geometry.magnification); break;
+        case GEOM_PIXEL_SIZE: pProp->Get(geometry.micronsPerPixel); break;
+        default: pProp->Get(geometry.frameRepeats); break;
+        }
+        return SetGeometry(geometry);
     }
     return DEVICE_OK;
 }
 
-int Scan_hub::Onn_hubscanPixels_Y(MM::PropertyBase* pProp, MM::ActionType eAct)
+int Scan_hub::OnGeometryVersion(MM::PropertyBase* pProp, MM::ActionType eAct)
 {
     if (eAct == MM::BeforeGet)
     {
-        
+        pProp->Set((long)GetGeometry().version);
     }
-    else if (eAct == MM::AfterSet)
-    {
-         
+    return DEVICE_OK;
+}
+
+void Scan_hub::RegisterCamera(MH_camera* camera)
+{
+    MMThreadGuard g(geometryLock_);
+    camera_ = camera;
+    if (camera_)
+        camera_->ApplyScanGeometry(geometry_);
+}
+
+void Scan_hub::RegisterGalvo(SocketGalvo* galvo)
+{
+    MMThreadGuard g(geometryLock_);
+    galvo_ = galvo;
+    if (galvo_)
+        galvo_->ApplyScanGeometry(geometry_);
+}
+
+ScanGeometry Scan_hub::GetGeometry()
+{
+    MMThreadGuard g(geometryLock_);
+    return geometry_;
+}
+
+/**
+* Commits a new geometry and pushes it to the children under one lock, so
+* they never see a half-updated model. The camera goes first and may refuse
+* (e.g. while acquiring), in which case nothing changes. The version is only
+* bumped when something did change.
+*/
+int Scan_hub::SetGeometry(const ScanGeometry& geometry)
+{
+    MMThreadGuard g(geometryLock_);
+    if (geometry.pixelsX == geometry_.pixelsX && geometry.pixelsY == geometry_.pixelsY &&
+        geometry.beamsX == geometry_.beamsX && geometry.beamsY == geometry_.beamsY &&
+        geometry.timePerImage == geometry_.timePerImage && geometry.flyback == geometry_.flyback &&
+        geometry.magnification == geometry_.magnification && geometry.micronsPerPixel == geometry_.micronsPerPixel &&
+        geometry.frameRepeats == geometry_.frameRepeats)
+        return DEVICE_OK;
+
+    ScanGeometry next = geometry;
+    next.version = geometry_.version + 1;
+    if (camera_) {
+        int ret = camera_->ApplyScanGeometry(next);
+        if (ret != DEVICE_OK)
+            return ret;
     }
+    if (galvo_)
+        galvo_->ApplyScanGeometry(next);
+    geometry_ = next;
     return DEVICE_OK;
 }
 
@@ -3348,55 +7648,166 @@ int Scan_hub::Onn_hubscanPixels_Y(MM::PropertyBase* pProp, MM::ActionType eAct)
 //Utility functions																			 //
 ///////////////////////////////////////////////////////////////////////////////////////////////
 
-int SocketGalvo::send_on_socket(std::string message_string, std::string IP_address, int port_number) {
-    WSADATA wsaData;
-    int result = WSAStartup(MAKEWORD(2, 2), &wsaData);
-    if (result != 0) {
-        std::cerr << "WSAStartup failed: " << result << std::endl;
+/**
+* Opens the scanner connection if it isn't open already. Non-blocking, so a
+* missing scanner costs one timeout rather than the OS connect timeout.
+*/
+int SocketGalvo::Connect() {
+    MMThreadGuard g(socketLock_);
+    if (sock_ != INVALID_SOCKET) {
+        return DEVICE_OK;
+    }
+    if (!wsaStarted_) {
+        WSADATA wsaData;
+        int result = WSAStartup(MAKEWORD(2, 2), &wsaData);
+        if (result != 0) {
+            LogMessage("WSAStartup failed: " + std::to_string(result));
+            return ERR_GALVO_CONNECT;
+        }
+        wsaStarted_ = true;
     }
+
     SOCKET sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
     if (sock == INVALID_SOCKET) {
-        std::cerr << "Error creating socket: " << WSAGetLastError() << std::endl;
-        WSACleanup();
+        LogMessage("Error creating socket: " + std::to_string(WSAGetLastError()));
+        return ERR_GALVO_CONNECT;
     }
+    unsigned long nonBlocking = 1;
+    ioctlsocket(sock, FIONBIO, &nonBlocking);
+    int noDelay = 1; //Commands are small and latency matters more than packing
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (const char*)&noDelay, sizeof(noDelay));
+
     sockaddr_in serverAddress;
+    memset(&serverAddress, 0, sizeof(serverAddress));
     serverAddress.sin_family = AF_INET;
-    serverAddress.sin_port = htons(port_number);
-    serverAddress.sin_addr.s_addr = inet_addr(IP_address.c_str());
+    serverAddress.sin_port = htons(galvo_control_port_);
+    serverAddress.sin_addr.s_addr = inet_addr(galvo_control_IP_address_.c_str());
 
-    result = connect(sock, (sockaddr*)&serverAddress, sizeof(serverAddress));
-    if (result == SOCKET_ERROR) {
-        std::cerr << "Connection failed: " << WSAGetLastError() << std::endl;
+    int result = connect(sock, (sockaddr*)&serverAddress, sizeof(serverAddress));
+    if (result == SOCKET_ERROR && WSAGetLastError() != WSAEWOULDBLOCK) {
+        LogMessage("Connection failed: " + std::to_string(WSAGetLastError()));
         closesocket(sock);
-        WSACleanup();
+        return ERR_GALVO_CONNECT;
+    }
+    int soError = 0;
+    int soLen = sizeof(soError);
+    if (!WaitSocket(sock, true) || getsockopt(sock, SOL_SOCKET, SO_ERROR, (char*)&soError, &soLen) != 0 || soError != 0) {
+        LogMessage("Connection to " + galvo_control_IP_address_ + ":" + std::to_string(galvo_control_port_) + " failed or timed out");
+        closesocket(sock);
+        return ERR_GALVO_CONNECT;
+    }
+    sock_ = sock;
+    rxBuffer_.clear();
+    sequenceUploaded_ = false; //A new connection can't be assumed to hold the preloaded table
+    LogMessage("Connected to galvo scanner at " + galvo_control_IP_address_ + ":" + std::to_string(galvo_control_port_));
+    return DEVICE_OK;
+}
+
+void SocketGalvo::Disconnect() {
+    MMThreadGuard g(socketLock_);
+    if (sock_ != INVALID_SOCKET) {
+        shutdown(sock_, SD_BOTH);
+        closesocket(sock_);
+        sock_ = INVALID_SOCKET;
     }
+    rxBuffer_.clear();
+}
 
-    //FIX ZERO PADDING FOR 4 BYTES
-    int cmd_len = message_string.size();
-    std::string cmd_len_padded = std::to_string(cmd_len);
-    unsigned int number_of_zeros = 4 - cmd_len_padded.length(); // pad with zeros until length is 4 (expected in LabVIEW)
-    cmd_len_padded.insert(0, number_of_zeros, '0');
-    message_string = cmd_len_padded + message_string + "\r\n";
-    const char* message = message_string.c_str();
+bool SocketGalvo::WaitSocket(SOCKET sock, bool forWrite) {
+    fd_set set;
+    FD_ZERO(&set);
+    FD_SET(sock, &set);
+    timeval timeout;
+    timeout.tv_sec = timeoutMs_ / 1000;
+    timeout.tv_usec = (timeoutMs_ % 1000) * 1000;
+    return select(0, forWrite ? NULL : &set, forWrite ? &set : NULL, NULL, &timeout) > 0;
+}
 
-    result = send(sock, message, strlen(message), 0);
-    if (result == SOCKET_ERROR) {
-        std::cerr << "Send failed: " << WSAGetLastError() << std::endl;
-        closesocket(sock);
-        WSACleanup();
+int SocketGalvo::SendAll(const std::string& data) {
+    size_t sent = 0;
+    while (sent < data.size()) {
+        int result = send(sock_, data.c_str() + sent, (int)(data.size() - sent), 0);
+        if (result == SOCKET_ERROR) {
+            if (WSAGetLastError() != WSAEWOULDBLOCK) {
+                return ERR_GALVO_SEND;
+            }
+            if (!WaitSocket(sock_, true)) {
+                return ERR_GALVO_TIMEOUT;
+            }
+            continue;
+        }
+        sent += result;
     }
+    return DEVICE_OK;
+}
 
-    closesocket(sock);
-    WSACleanup();
-    return 0;
+/**
+* Reads one CRLF terminated reply. Anything after it stays in rxBuffer_ for
+* the next reply, so pipelined commands are answered in order.
+*/
+int SocketGalvo::ReadReply(std::string& reply) {
+    size_t eol;
+    while ((eol = rxBuffer_.find("\r\n")) == std::string::npos) {
+        if (!WaitSocket(sock_, false)) {
+            return ERR_GALVO_TIMEOUT;
+        }
+        char chunk[512];
+        int result = recv(sock_, chunk, sizeof(chunk), 0);
+        if (result == 0 || (result == SOCKET_ERROR && WSAGetLastError() != WSAEWOULDBLOCK)) {
+            return ERR_GALVO_SEND;
+        }
+        if (result > 0) {
+            rxBuffer_.append(chunk, result);
+        }
+    }
+    reply = rxBuffer_.substr(0, eol);
+    rxBuffer_.erase(0, eol + 2);
+    return DEVICE_OK;
+}
+
+/**
+* Sends one framed command ("%04d" length, message, CRLF) on the persistent
+* connection, reconnecting and retrying once if it turns out to be stale.
+*/
+int SocketGalvo::send_on_socket(const std::string& message_string) {
+    if (message_string.size() > 9999) {
+        LogMessage("Galvo command too long for the 4 digit length prefix");
+        return ERR_GALVO_SEND;
+    }
+    char prefix[8];
+    sprintf(prefix, "%04d", (int)message_string.size()); // pad with zeros until length is 4 (expected in LabVIEW)
+    std::string framed = prefix + message_string + "\r\n";
+
+    MMThreadGuard g(socketLock_);
+    int ret = DEVICE_OK;
+    for (int attempt = 0; attempt < 2; attempt++) {
+        ret = Connect();
+        if (ret != DEVICE_OK) {
+            continue;
+        }
+        MM::MMTime start = GetCurrentMMTime();
+        ret = SendAll(framed);
+        if (ret == DEVICE_OK && waitReply_) {
+            ret = ReadReply(lastReply_);
+        }
+        if (ret == DEVICE_OK) {
+            lastRoundTripMs_ = (GetCurrentMMTime() - start).getMsec();
+            return DEVICE_OK;
+        }
+        Disconnect();
+    }
+    LogMessage("Galvo command failed: " + message_string);
+    return ret;
 }
 
-std::string SocketGalvo::replace_str(std::string source, std::string target, std::string replacement)
+void SocketGalvo::replace_str(std::string& source, const std::string& target, const std::string& replacement)
 {
     //https://stackoverflow.com/questions/3418231/replace-part-of-a-string-with-another-string
-    std::string destination = source;
-    while (source.find(target) != string::npos) destination.replace(source.find(target), target.size(), replacement);
-    return destination;
+    size_t pos = 0;
+    while ((pos = source.find(target, pos)) != std::string::npos) {
+        source.replace(pos, target.size(), replacement);
+        pos += replacement.size();
+    }
 }
 
 std::string SocketGalvo::prep_json(std::string json_template, int scan_pixels_per_axis_X, int scan_pixels_per_axis_Y, float microns_per_pixel, float time_per_image, int n_images, float flyback_fraction, float magnification, int scans_per_image)
@@ -3416,8 +7827,35 @@ std::string SocketGalvo::prep_json(std::string json_template, int scan_pixels_pe
 
 int SocketGalvo::start_scan()
 {
-    send_on_socket(sg_command_template_, galvo_control_IP_address_, galvo_control_port_);
-    return DEVICE_OK;
+    MMThreadGuard g(socketLock_); //Geometry and start command back to back
+    if (sequenceRunning_ && !compiledSequence_.empty()) {
+        if (preloadSequence_) {
+            //Reconnecting drops the uploaded table, put it back before selecting from it
+            int ret = Connect();
+            if (ret == DEVICE_OK && !sequenceUploaded_) {
+                ret = UploadSequence();
+            }
+            if (ret != DEVICE_OK) {
+                return ret;
+            }
+        }
+        //Next geometry of the loaded sequence, the render was done in AfterLoadSequence
+        int ret = sequenceUploaded_ ? send_on_socket("select:" + std::to_string(sequenceIndex_)) : send_on_socket(compiledSequence_[sequenceIndex_]);
+        sequenceIndex_ = (sequenceIndex_ + 1) % compiledSequence_.size();
+        if (ret != DEVICE_OK) {
+            return ret;
+        }
+        configPending_ = true; //The scanner no longer holds scanConfig_
+    }
+    else if (configPending_) {
+        //Geometry changed since the last scan, it was rendered when it was applied
+        int ret = send_on_socket(compiledConfig_);
+        if (ret != DEVICE_OK) {
+            return ret;
+        }
+        configPending_ = false;
+    }
+    return send_on_socket(sg_command_template_);
 }
 
 std::string MH_camera::convertToString(char* a, boolean drop_last)
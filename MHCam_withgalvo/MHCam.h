@@ -20,6 +20,7 @@
 
 //DA BITS
 #include <vector>
+#include <atomic>
 
 static const char* g_MHDeviceName = "MultiHarp";
 static const char* g_Keyword_Ver = "MultiHarp library version";
@@ -39,9 +40,80 @@ static const char* g_N_Beams_X = "Number of beams in array along X direction";
 static const char* g_N_Beams_Y = "Number of beams in array along Y direction";
 static const char* g_PropName_Socket_Msg_To_Send = "Message to send on socket";
 static const char* g_Keyword_Socket_State = "Socket state";
+static const char* g_PropName_Galvo_IP = "Galvo control IP address";
+static const char* g_PropName_Galvo_Port = "Galvo control port";
+static const char* g_PropName_Galvo_Timeout = "Galvo socket timeout [ms]";
+static const char* g_PropName_Galvo_Wait_Reply = "Wait for galvo reply";
+static const char* g_PropName_Galvo_RTT = "Galvo round trip [ms]";
+static const char* g_PropName_Scan_Config = "Scan configuration (X,Y,ms,repeats)";
+static const char* g_PropName_Scan_Pixels_X = "Scan pixels X";
+static const char* g_PropName_Scan_Pixels_Y = "Scan pixels Y";
+static const char* g_PropName_Scan_Time = "Scan time per image [ms]";
+static const char* g_PropName_Scan_Repeats = "Scan frame repeats";
+static const char* g_PropName_Scan_Preload = "Preload scan sequence on scanner";
 static const char* g_N_Hub_Scan_Px_X = "Number of hub scan points in X";
 static const char* g_N_Hub_Scan_Px_Y = "Number of hub scan points in Y";
+static const char* g_N_Hub_Beams_X = "Number of hub beams in X";
+static const char* g_N_Hub_Beams_Y = "Number of hub beams in Y";
+static const char* g_PropName_Hub_Time = "Hub time per image [ms]";
+static const char* g_PropName_Hub_Flyback = "Hub flyback fraction";
+static const char* g_PropName_Hub_Magnification = "Hub magnification";
+static const char* g_PropName_Hub_Pixel_Size = "Hub microns per pixel";
+static const char* g_PropName_Hub_Repeats = "Hub frame repeats";
+static const char* g_PropName_Geometry_Version = "Scan geometry version";
 static const char* g_PropName_ScanStatus = "Scanner status";
+static const char* g_PropName_Sync_Start = "Synchronized galvo start";
+static const char* g_PropName_Ring_Occupancy = "FIFO ring blocks in use";
+static const char* g_PropName_Ring_HighWater = "FIFO ring high-water mark";
+static const char* g_PropName_Ring_Stalls = "FIFO ring full stalls";
+static const char* g_PropName_FIFO_NearFull = "FIFO near-full reads";
+static const char* g_PropName_FIFO_Overruns = "FIFO overruns";
+static const char* g_PropName_Frame_Stalls = "Frame pool stalls";
+static const char* g_PropName_Stat_RecordRate = "Records read per second";
+static const char* g_PropName_Stat_Binned = "Photons binned";
+static const char* g_PropName_Stat_Flyback = "Photons dropped in flyback";
+static const char* g_PropName_Stat_NoFrame = "Photons dropped before frame clock";
+static const char* g_PropName_Stat_FifoHighWater = "Largest FIFO read [records]";
+static const char* g_PropName_Stat_DecodeNs = "Decode time per record [ns]";
+static const char* g_PropName_Stat_DiskRate = "Disk write rate [MB/s]";
+static const char* g_PropName_Stat_PollState = "FIFO poll state";
+static const char* g_PropName_Stat_ReaderCpu = "FIFO reader CPU [%]";
+static const char* g_PropName_FIFO_Polling = "FIFO polling";
+static const char* g_PropName_Preview = "Live preview";
+static const char* g_PropName_Preview_Lines = "Live preview every N lines";
+static const char* g_PropName_Preview_Interval = "Live preview interval [ms]";
+static const char* g_Preview_Off = "Off";
+static const char* g_Preview_Lines = "Every N lines";
+static const char* g_Preview_Interval = "Fixed interval";
+static const char* g_FIFO_Polling_Adaptive = "Adaptive";
+static const char* g_FIFO_Polling_Spin = "Spin";
+static const char* g_Poll_State_Names[] = { "Spin", "Yield", "Sleep" };
+static const char* g_PropName_TTTR_Rollover = "TTTR file rollover [MB] (0 = off)";
+static const char* g_PropName_Count_Overflow = "Pixel count overflow";
+static const char* g_PropName_Line_Map = "Line pixel mapping";
+static const char* g_PropName_Flyback = "Line flyback fraction (no line-end clock)";
+static const char* g_PropName_Flim_Bins = "FLIM time bins";
+static const char* g_PropName_Bin_Threads = "Binning threads";
+static const char* g_PropName_Gates = "Time gates";
+static const char* g_PropName_Gate_Window = "Time gate %d window [ps]";
+static const char* g_PropName_Beam_Correction = "Beam correction";
+static const char* g_PropName_Beam_Gains = "Beam gains";
+static const char* g_PropName_Beam_Offsets = "Beam offsets [counts]";
+static const char* g_PropName_Beam_Crosstalk = "Beam crosstalk matrix";
+static const char* g_PropName_Beam_FlatField = "Beam flat-field file";
+static const char* g_PropName_Sequence_Mode = "Sequence acquisition";
+static const char* g_PropName_TTTR_Source = "TTTR source";
+static const char* g_PropName_MH_Serial = "MultiHarp serial (empty = first found)";
+static const char* g_PropName_Replay_File = "TTTR replay file";
+static const char* g_PropName_Synth_Rate = "Synthetic photon rate [counts/s]";
+static const char* g_PropName_Synth_Sync = "Synthetic sync rate [MHz]";
+static const char* g_TTTR_Source_MultiHarp = "MultiHarp";
+static const char* g_TTTR_Source_Replay = "Replay file";
+static const char* g_TTTR_Source_Synthetic = "Synthetic";
+static const char* g_Sequence_Frame_By_Frame = "Measurement per frame";
+static const char* g_Sequence_Continuous = "Continuous (frame clock)";
+static const char* g_Flim_Channel_Names[] = { "Intensity", "Mean arrival time", "Phasor G", "Phasor S" };
+static const char* g_Phasor_Channel_Names[] = { "Intensity", "Phasor G", "Phasor S" };
 
 #define command_wait_time				100
 
@@ -53,8 +125,31 @@ static const char* g_PropName_ScanStatus = "Scanner status";
 #define MIN_INTEG_MS					1000
 #define MAX_INTEG_MS					100000
 #define MAX_N_CHANNELS                  8
-
-unsigned int buffer[TTREADMAX];
+#define MAX_SCAN_PIXELS                 1024 //Scan points per axis; camera, hub and galvo share one geometry
+#define N_TTTR_BLOCKS                   8 //FIFO read blocks in the acquisition ring, TTREADMAX records each
+#define FIFO_NEAR_FULL_RECORDS          (TTREADMAX - TTREADMAX / 4) //A read this big means the FIFO is backing up
+#define FIFO_SPIN_RECORDS               (TTREADMAX / 2) //Adaptive polling: after a read this big read again straight away,
+#define FIFO_YIELD_RECORDS              (TTREADMAX / 64) //after one this big yield, after a smaller one sleep
+#define FIFO_SLEEP_MS                   1
+#define FIFO_FLAG_CHECK_READS           16 //Adaptive polling checks the FIFO flags every this many reads
+#define CACHE_LINE_BYTES                64
+#define N_FRAME_BUFFERS                 3 //Filling, publishing and clearing
+#define FRAME_IDLE_WAIT_MS              10 //Recheck of stopAcq_ while waiting for InsertImage()
+#define N_TTTR_WRITE_BUFFERS            4 //Staging buffers in flight for the TTTR file
+#define TTTR_WRITE_BUFFER_BYTES         (4 << 20)
+#define TTTR_SECTOR_BYTES               4096 //Unbuffered writes must be whole sectors, 4096 covers 512e and 4Kn disks
+#define TTTR_HEADER_MAX_BYTES           (4 * TTTR_SECTOR_BYTES)
+#define BEAM_LUT_SIZE                   64 //One entry per possible T3 channel number (6 bits)
+#define LINE_MAP_SIZE                   8192 //Phase steps per line for the nonlinear line map
+#define LINE_MAP_LINEAR                 0
+#define LINE_MAP_SINUSOIDAL             1
+#define FLIM_DEFAULT_BINS               64
+#define MAX_BIN_THREADS                 8
+#define FLIM_N_SUMMARY                  3 //Mean arrival time, phasor g, phasor s
+#define PHASOR_LUT_BITS                 12 //Phasor table resolution, the top bits of the 15-bit TCSPC time
+#define MAX_GATES                       4 //Time gates, one bit each in the gate table
+#define GATE_LUT_STEPS                  256 //Gate table steps per channel, spread over one sync period
+#define GATE_DEFAULT_WINDOW             "0-100000"
 
 ///////////////////////////////////////////////////////////////////////////////
 // FILE:          MH_Cam.h
@@ -106,6 +201,13 @@ unsigned int buffer[TTREADMAX];
 #define ERR_SEQUENCE_INACTIVE    105
 #define ERR_STAGE_MOVING         106
 #define HUB_NOT_AVAILABLE        107
+#define ERR_GALVO_CONNECT        108
+#define ERR_GALVO_SEND           109
+#define ERR_GALVO_TIMEOUT        110
+#define ERR_MH_MODE              111
+#define ERR_MH_HISTOGRAM         112
+#define ERR_REPLAY_SOURCE        113
+#define ERR_MH_FIFO              114
 
 const char* NoHubError = "Parent Hub not defined.";
 
@@ -119,6 +221,27 @@ public:
 // DemoHub
 //////////////////////
 
+//Extra measurement time on a synchronized start, in case the galvo is late or never scans
+#define SYNC_START_MARGIN_MS 2000
+
+class SocketGalvo;
+class MH_camera;
+
+//The one scan geometry model, owned by Scan_hub and pushed to the camera and galvo
+struct ScanGeometry
+{
+    long pixelsX;
+    long pixelsY;
+    long beamsX;
+    long beamsY;
+    double timePerImage;  //ms
+    double flyback;       //Fraction of the line period spent in flyback
+    double magnification;
+    double micronsPerPixel;
+    long frameRepeats;
+    unsigned long version; //Bumped by the hub on every change
+};
+
 class Scan_hub : public HubBase<Scan_hub>
 {
 public:
@@ -136,13 +259,28 @@ public:
     int DetectInstalledDevices();
 
     //HUB action interface
-    int Onn_hubscanPixels_X(MM::PropertyBase*, MM::ActionType);
-    int Onn_hubscanPixels_Y(MM::PropertyBase*, MM::ActionType);
+    int OnGeometryParam(MM::PropertyBase*, MM::ActionType, long field);
+    int OnGeometryVersion(MM::PropertyBase*, MM::ActionType);
+    int OnSyncStart(MM::PropertyBase*, MM::ActionType);
+
+    //Children register in Initialize() and are handed the current geometry
+    void RegisterCamera(MH_camera* camera);
+    void RegisterGalvo(SocketGalvo* galvo);
+    ScanGeometry GetGeometry();
+    int SetGeometry(const ScanGeometry& geometry);
+
+    //Coordinated start: the camera arms the MultiHarp, then asks the hub to start the galvo
+    bool SynchronizedStart() const { return syncStart_ && galvo_ != 0; }
+    int StartGalvoScan();
 
 private:
+    enum { GEOM_PIXELS_X, GEOM_PIXELS_Y, GEOM_BEAMS_X, GEOM_BEAMS_Y, GEOM_TIME, GEOM_FLYBACK, GEOM_MAGNIFICATION, GEOM_PIXEL_SIZE, GEOM_REPEATS };
     void GetPeripheralInventory();
-    long hub_n_scanPixels_X_;
-    long hub_n_scanPixels_Y_;
+    MMThreadLock geometryLock_;
+    ScanGeometry geometry_;
+    MH_camera* camera_;
+    SocketGalvo* galvo_;
+    bool syncStart_;
 
     std::vector<std::string> peripherals_;
     bool initialized_;
@@ -155,7 +293,298 @@ private:
 // Simulation of the Camera device
 //////////////////////////////////////////////////////////////////////////////
 
+//////////////////////////////////////////////////////////////////////////////
+// TTTRRing class
+// Fixed pool of preallocated FIFO read blocks shared between the FIFO reader
+// thread (single producer) and the decode/disk-writer stages (consumers).
+// Every consumer sees every block; a slot is reused once all have released it.
+//////////////////////////////////////////////////////////////////////////////
+
+struct TTTRBlock
+{
+    unsigned int* records; //TTREADMAX records, cache line aligned
+    int nRecords;
+    bool last; //Set on the final (possibly empty) block of a measurement
+};
+
+class TTTRRing
+{
+public:
+    enum { RING_DECODER = 0, RING_WRITER = 1, MAX_CONSUMERS = 2 };
+
+    TTTRRing();
+    ~TTTRRing();
+
+    bool Allocate(int nBlocks);
+    void Free();
+    void Reset(int nConsumers);
+
+    //Producer side - only ever called from the FIFO reader thread
+    TTTRBlock* AcquireWrite();
+    void Publish();
+
+    //Consumer side - one thread per consumer index
+    TTTRBlock* AcquireRead(int consumer);
+    void Release(int consumer);
+
+    long Occupancy() const;
+    long HighWater() const { return highWater_.load(std::memory_order_relaxed); }
+    long Capacity() const { return (long)blocks_.size(); }
+
+private:
+    struct PaddedIndex //Each index on its own cache line so producer and consumers don't false-share
+    {
+        std::atomic<uint64_t> value;
+        char pad[CACHE_LINE_BYTES - sizeof(std::atomic<uint64_t>)];
+    };
+    uint64_t MinTail() const;
+
+    std::vector<TTTRBlock> blocks_;
+    int nConsumers_;
+    PaddedIndex head_;
+    PaddedIndex tails_[MAX_CONSUMERS];
+    std::atomic<long> highWater_;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// FramePool class
+// Preallocated intensity frames rotating between the decoder (filling), the
+// frame service thread (InsertImage, then zeroing) and GetImageBuffer (shown),
+// so neither publishing nor clearing a frame holds up photon binning. A frame
+// stays FRAME_PUBLISHING until InsertImage() has returned, and neither it nor
+// the shown frame is ever handed back to the decoder.
+//////////////////////////////////////////////////////////////////////////////
+
+class FramePool
+{
+public:
+    enum FrameState { FRAME_DIRTY, FRAME_CLEARING, FRAME_ZEROED, FRAME_FILLING, FRAME_QUEUED, FRAME_PUBLISHING, FRAME_SHOWN };
+
+    FramePool();
+    ~FramePool();
+
+    bool Allocate(unsigned width, unsigned height, unsigned depth);
+    void Free();
+    bool Matches(unsigned width, unsigned height, unsigned depth) const;
+
+    //Decoder side
+    unsigned char* Begin(bool resumeShown);
+    void Finish(bool queue, bool preview = false);
+    long Queued() const;
+    long Pending() const; //Queued or still being inserted
+    bool WaitIdle(DWORD timeoutMs) const; //Until Pending() is 0, signalled by Published()
+
+    //Frame service side
+    int NextQueued() const;
+    const unsigned char* Publish(int frame, bool& preview);
+    void Published(int frame);
+    bool ClearOne();
+
+    const unsigned char* Shown() const;
+    long Stalls() const { return stalls_; }
+
+private:
+    struct Frame
+    {
+        unsigned char* pixels; //Cache line aligned
+        FrameState state;
+        unsigned long seq;     //Queue order
+        bool preview;          //Live mode partial frame, see MH_camera::PublishPreview()
+    };
+    void ShowLocked(int frame);
+    long PendingLocked() const;
+
+    Frame frames_[N_FRAME_BUFFERS];
+    size_t bytes_;
+    unsigned width_, height_, depth_;
+    int filling_;
+    int shown_;
+    unsigned long seq_;
+    long stalls_; //Begin() found no zeroed frame and had to clear or wait inline
+    HANDLE idle_; //Manual reset, set while nothing is queued or being inserted
+    mutable MMThreadLock lock_;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// TTTRFileWriter class
+// PicoQuant .ptu files written with large sector aligned overlapped writes
+// (FILE_FLAG_NO_BUFFERING) from a small pool of staging buffers. The header is
+// padded to a whole number of sectors so the records stay aligned, and is
+// rewritten with the record count when a file is closed. Optional rollover
+// starts a new _partNNN file once a file reaches a size limit.
+//////////////////////////////////////////////////////////////////////////////
+
+class TTTRFileWriter
+{
+public:
+    struct HeaderInfo
+    {
+        double resolutionPs;
+        int syncRate;
+        int syncDivider;
+        int binning;
+        int tacqMs;
+        std::vector<long> offsetsPs;
+        std::string hwModel, hwPartNo, hwVersion, hwSerial, libVersion;
+    };
+
+    TTTRFileWriter();
+    ~TTTRFileWriter();
+
+    bool Allocate();
+    void Free();
+
+    bool Open(const std::string& basePath, const HeaderInfo& info, uint64_t rolloverBytes);
+    bool Append(const unsigned int* records, int nRecords);
+    bool Close();
+    bool IsOpen() const { return file_ != INVALID_HANDLE_VALUE; }
+
+    const std::string& CurrentPath() const { return path_; }
+    DWORD LastError() const { return lastError_; }
+
+private:
+    struct WriteBuffer
+    {
+        unsigned char* data; //TTTR_WRITE_BUFFER_BYTES, sector aligned
+        size_t used;
+        OVERLAPPED ov;
+        bool pending;
+    };
+
+    bool OpenPart();
+    bool ClosePart();
+    void BuildHeader();
+    bool IssueWrite(WriteBuffer& buffer, DWORD bytes);
+    bool WaitWrite(WriteBuffer& buffer);
+    bool Fail();
+
+    WriteBuffer buffers_[N_TTTR_WRITE_BUFFERS];
+    int current_;
+    unsigned char* header_;  //TTTR_HEADER_MAX_BYTES, sector aligned
+    size_t headerBytes_;
+    size_t recordCountPos_;  //Offset of the TTResult_NumberOfRecords value in header_
+    HANDLE file_;
+    std::string basePath_;
+    std::string path_;
+    HeaderInfo info_;
+    uint64_t rolloverBytes_;
+    uint64_t fileOffset_;    //Next write position, always sector aligned
+    uint64_t partRecords_;
+    int part_;
+    DWORD lastError_;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// TTTRReplaySource class
+// Offline stand-in for the MultiHarp FIFO: replays a recorded T3 stream (.ptu
+// or a raw _tttr.out dump) or synthesizes one with a given photon rate, beam
+// count and frame/line clocks. The records go through the same ring, decode
+// and binning path as a measurement, as fast as the consumers take them.
+//////////////////////////////////////////////////////////////////////////////
+
+struct SyntheticT3Config
+{
+    double syncRateHz;
+    double photonRateHz;    //All beams together
+    int beams;
+    int linesPerFrame;
+    double linePeriodS;
+    double flybackFraction; //Line end clock this far before the next line start
+    double lifetimeBins;    //Mean arrival time in TCSPC bins
+    int binsPerSync;
+};
+
+class TTTRReplaySource
+{
+public:
+    TTTRReplaySource();
+    ~TTTRReplaySource();
+
+    bool OpenFile(const std::string& path);
+    void OpenSynthetic(const SyntheticT3Config& config);
+    void Close();
+    bool IsOpen() const { return file_ != 0 || synthetic_; }
+
+    //Fills up to maxRecords, 0 at the end of a file
+    int Read(unsigned int* records, int maxRecords);
+    //Back to the first record; time keeps running forward across the seam
+    bool Rewind();
+
+    //From the PTU header, 0 if the file didn't have them
+    double GlobalResolutionPs() const { return globalResolutionPs_; }
+    double ResolutionPs() const { return resolutionPs_; }
+
+private:
+    bool ReadPtuHeader();
+    double NextUniform();
+    double MarkerTime(int index) const;
+
+    FILE* file_;
+    long dataStart_;
+    bool fileHasRecords_;
+    bool seamOverflow_; //Rewind() owes the decoder one wraparound
+    double globalResolutionPs_;
+    double resolutionPs_;
+
+    bool synthetic_;
+    SyntheticT3Config config_;
+    uint64_t rng_;
+    uint64_t overflows_;   //Wraparounds already emitted
+    double nextPhoton_;    //In sync periods
+    double frameStart_;
+    int markerIndex_;      //0 frame clock, then line start/end pairs
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// Photon count policies for MH_camera::BinPhotonsT
+// inc is 0 or 1, so neither policy needs a branch
+//////////////////////////////////////////////////////////////////////////////
+
+struct SaturatingCount
+{
+    template <class PixelT> static inline void Add(PixelT& px, PixelT inc) { px += (PixelT)(inc & (PixelT)(px != (PixelT)~(PixelT)0)); }
+};
+
+struct WrappingCount
+{
+    template <class PixelT> static inline void Add(PixelT& px, PixelT inc) { px += inc; }
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// Time-into-line -> pixel maps for MH_camera::BinPhotonsT
+// scale is a 32.32 fixed point reciprocal refreshed once per line, so there is
+// no division per photon. Anything >= the number of scan pixels is flyback.
+//////////////////////////////////////////////////////////////////////////////
+
+struct LinearLineMap
+{
+    static inline uint64_t Pixel(uint64_t dt, uint64_t scale, const unsigned int*) { return (dt * scale) >> 32; }
+};
+
+struct TableLineMap
+{
+    //scale maps dt onto LINE_MAP_SIZE phase steps; map[LINE_MAP_SIZE] holds the flyback value
+    static inline uint64_t Pixel(uint64_t dt, uint64_t scale, const unsigned int* map) {
+        return map[(std::min)((dt * scale) >> 32, (uint64_t)LINE_MAP_SIZE)];
+    }
+};
+
 class MySequenceThread;
+class FifoReaderThread;
+class TTTRWriterThread;
+class FrameServiceThread;
+class BinWorkerThread;
+class RateProbeThread;
+
+//Settings last written to the MultiHarp, so that only changed ones are reissued
+struct MultiHarpConfig
+{
+    int syncDiv, syncLevel, syncEdge, syncOffset;
+    bool markers;
+    int inputLevel[MAXINPCHAN], inputEdge[MAXINPCHAN], inputOffset[MAXINPCHAN];
+    bool inputEnabled[MAXINPCHAN];
+    int binning, offset;
+};
 
 class MH_camera : public CCameraBase<MH_camera>
 {
@@ -174,6 +603,9 @@ public:
     // ------------
     int SnapImage();
     const unsigned char* GetImageBuffer();
+    const unsigned char* GetImageBuffer(unsigned channelNr);
+    unsigned GetNumberOfChannels() const;
+    int GetChannelName(unsigned channel, char* name);
     unsigned GetImageWidth() const;
     unsigned GetImageHeight() const;
     unsigned GetImageBytesPerPixel() const;
@@ -196,12 +628,12 @@ public:
     int StartSequenceAcquisition(double interval);
     int StartSequenceAcquisition(long numImages, double interval_ms, bool stopOnOverflow);
     int StopSequenceAcquisition();
-    int InsertImage();
+    int InsertImage(const unsigned char* pixels = 0, bool preview = false);
     int RunSequenceOnThread(MM::MMTime startTime);
     bool IsCapturing();
     void OnThreadExiting() throw();
-    double GetNominalPixelSizeUm() const { return nominalPixelSizeUm_; }
-    double GetPixelSizeUm() const { return nominalPixelSizeUm_ * GetBinning(); }
+    double GetNominalPixelSizeUm() const { return scanPixelSizeUm_; }
+    double GetPixelSizeUm() const { return scanPixelSizeUm_ * GetBinning(); }
     int GetBinning() const;
     int SetBinning(int bS);
 
@@ -231,6 +663,8 @@ public:
     int Onn_scanPixels_Y(MM::PropertyBase*, MM::ActionType);
     int Onn_beams_X(MM::PropertyBase*, MM::ActionType);
     int Onn_beams_Y(MM::PropertyBase*, MM::ActionType);
+    //Called by Scan_hub (or locally without one); resizes only when the image size changes
+    int ApplyScanGeometry(const ScanGeometry& geometry);
     
 
     int OnCameraCCDXSize(MM::PropertyBase*, MM::ActionType);
@@ -262,6 +696,23 @@ public:
 
     //Things we added
     int On_Save_Enable(MM::PropertyBase* pProp, MM::ActionType eAct);
+    int OnPipelineStat(MM::PropertyBase* pProp, MM::ActionType eAct, long which);
+    int OnFifoPolling(MM::PropertyBase* pProp, MM::ActionType eAct);
+    int OnPreview(MM::PropertyBase* pProp, MM::ActionType eAct, long which);
+    int OnCountOverflow(MM::PropertyBase* pProp, MM::ActionType eAct);
+    int OnLineMap(MM::PropertyBase* pProp, MM::ActionType eAct);
+    int OnFlybackFraction(MM::PropertyBase* pProp, MM::ActionType eAct);
+    int OnBinThreads(MM::PropertyBase* pProp, MM::ActionType eAct);
+    int OnGates(MM::PropertyBase* pProp, MM::ActionType eAct);
+    int OnGateWindow(MM::PropertyBase* pProp, MM::ActionType eAct, long gate);
+    int OnBeamCorrection(MM::PropertyBase* pProp, MM::ActionType eAct, long which);
+    int OnFlimBins(MM::PropertyBase* pProp, MM::ActionType eAct);
+    int OnSequenceMode(MM::PropertyBase* pProp, MM::ActionType eAct);
+    int OnTTTRRollover(MM::PropertyBase* pProp, MM::ActionType eAct);
+    int OnTTTRSource(MM::PropertyBase* pProp, MM::ActionType eAct);
+    int OnMultiHarpSerial(MM::PropertyBase* pProp, MM::ActionType eAct);
+    int OnReplayFile(MM::PropertyBase* pProp, MM::ActionType eAct);
+    int OnSyntheticParam(MM::PropertyBase* pProp, MM::ActionType eAct, long which);
 
     // Special public DemoCamera methods
     int RegisterImgManipulatorCallBack(ImgManipulator* imgManpl);
@@ -278,16 +729,47 @@ private:
     void AcquireMHImage(ImgBuffer& img, double exp);
     bool GenerateMHTestPattern(ImgBuffer& img);
     bool GenerateMHHisto(ImgBuffer& img);
+    bool GenerateDeviceHisto(ImgBuffer& img);
+    void RenderHistogramColumns(ImgBuffer& img, const std::vector<int>& heights);
+    int AcquireDeviceHistogram(double exposureMs);
     bool GenerateMHImage(ImgBuffer& img);
     int ResizeImageBuffer();
     void GenerateDecay(ImgBuffer& img);
     uint64_t TimestampDeltaToPs(uint64_t timestamp_delta);
-    void TranslateRecord(unsigned int val, ImgBuffer& img);
-    int GetPixnumInLine(uint64_t timestamp, uint64_t linestart_timestamp);
+    void UpdateLineScale(uint64_t active_syncs);
+    void BuildLineMap();
+    void HandleMarker(unsigned int record);
+    void FrameCompleted();
+    void CountLiveRates(const unsigned int* records, int nRecords);
+    void ResetPipelineStats();
+    double StatElapsedSeconds() const;
+    double StatRecordRate() const;
+    double StatDecodeNsPerRecord() const;
+    double StatDiskMBps() const;
+    inline bool LineContextValid() const {
+        return (last_line_end_ < last_line_start_) && current_line_ >= 0 && current_line_ < n_scanPixels_Y_ && line_pixel_scale_ != 0;
+    }
+    double TcspcBinsPerSync() const;
+    bool SetupDecayCube();
+    void FreeDecayCube();
+    bool SetupPhasor();
+    void GeneratePhasor(ImgBuffer& img);
+    void ResetLifetimeAccumulators();
+    int SummaryIndex(unsigned channel) const;
+    void SelectAccumulator();
+    bool BuildRoiSpans();
+    void ApplyRoiFill(unsigned char* pixels) const;
+    void DecodeBlock(const unsigned int* records, int nRecords);
+    int ReadFifoOnThread();
+    int WriteTTTROnThread();
+    int ServiceFramesOnThread();
+    bool UsingFramePool() const;
     //Utility
     std::string format_JSON_for_galvo();
 
     static const double nominalPixelSizeUm_;
+    double scanPixelSizeUm_;   //From the scan geometry, nominalPixelSizeUm_ until one is applied
+    double scanMagnification_;
 
     double exposureMaximum_;
     double dPhase_;
@@ -301,7 +783,10 @@ private:
     int bitDepth_;
     unsigned roiX_;
     unsigned roiY_;
+    unsigned roiGeneration_; //Bumped by every SetROI/SetMultiROI/ClearROI
     MM::MMTime sequenceStartTime_;
+    Metadata mdTemplate_; //The image metadata that is fixed for a sequence, see BuildMetadataTemplate()
+    void BuildMetadataTemplate();
     bool isSequenceable_;
     long sequenceMaxLength_;
     bool sequenceRunning_;
@@ -318,6 +803,7 @@ private:
     long cameraCCDYSize_;
     double ccdT_;
     std::string triggerDevice_;
+    void FireTrigger();
 
     bool stopOnOverflow_;
 
@@ -335,13 +821,78 @@ private:
     std::vector<unsigned> multiROIWidths_;
     std::vector<unsigned> multiROIHeights_;
     std::vector<int> bins_;
-    std::vector<int> counts_;
+    std::vector<short> columnHeights_; //RenderHistogramColumns() scratch, kept between frames
+    std::vector<unsigned char> patternRows_; //The two test pattern row phases
+    unsigned patternWidth_ = 0;
+    unsigned patternDepth_ = 0;
 
     double testProperty_[10];
     MMThreadLock imgPixelsLock_;
     friend class MySequenceThread;
+    friend class FifoReaderThread;
+    friend class TTTRWriterThread;
+    friend class FrameServiceThread;
+    friend class BinWorkerThread;
+    friend class RateProbeThread;
     int nComponents_;
     MySequenceThread* thd_;
+    FifoReaderThread* fifoReader_;
+    TTTRWriterThread* tttrWriter_;
+    TTTRRing fifoRing_;
+    TTTRFileWriter tttrFile_;
+    long tttrRolloverMB_;
+    //Offline TTTR sources, see TTTRReplaySource
+    enum { TTTR_SOURCE_MULTIHARP, TTTR_SOURCE_REPLAY, TTTR_SOURCE_SYNTHETIC };
+    int tttrSource_;
+    TTTRReplaySource replay_;
+    std::string replayPath_;
+    double synthPhotonRate_;
+    double synthSyncMHz_;
+    int OpenReplaySource();
+    FrameServiceThread* frameService_;
+    FramePool framePool_;
+    unsigned char* acqPixels_; //Frame being filled, from framePool_
+    std::vector<unsigned int> frameCounts_; //Photon counts binned into, narrowed into acqPixels_ per published frame
+    void PublishFrameCounts(unsigned char* pixels, bool clear);
+
+    //Live mode previews: the partial frame goes out through the frame pool every few lines
+    //or milliseconds, while the counts carry on accumulating, see PublishPreview()
+    enum { PREVIEW_OFF, PREVIEW_LINES, PREVIEW_INTERVAL };
+    int previewMode_;
+    long previewLines_;
+    double previewIntervalMs_;
+    bool liveSequence_; //StartSequenceAcquisition() without an image count, i.e. live mode
+    bool previewing_;   //Previews in the current measurement
+    long previewLineCount_;
+    int64_t previewTicks_;
+    void PublishPreview();
+    std::atomic<bool> stopFrameService_;
+    std::atomic<long> triggerSteps_; //Counted by FrameCompleted(), fired by the frame service thread
+    std::atomic<bool> stopAcq_; //Raised by any pipeline stage to end the measurement early
+    bool stopOnFrameEnd_; //Synchronized snaps end on the last line clock, not the measurement timer
+    int snapFramesDone_;  //Frames completed in such a snap, it ends after n_frame_repeats_
+    void SnapFrameEnded();
+    std::atomic<long> fifoNearFullReads_;
+    std::atomic<long> fifoOverruns_; //FLAG_FIFOFULL seen, records were lost
+    int fifoReadResult_; //How the FIFO reader ended, reported by start_acq()
+    std::atomic<long> ringFullStalls_;
+    enum { POLL_SPIN, POLL_YIELD, POLL_SLEEP };
+    bool adaptivePolling_;
+    std::atomic<int> pollState_;
+
+    //Hot path counters, updated once per block/run and read from property handlers and InsertImage()
+    std::atomic<int64_t> statRecordsRead_;
+    std::atomic<int64_t> statPhotonsBinned_;
+    std::atomic<int64_t> statDroppedFlyback_;
+    std::atomic<int64_t> statDroppedNoFrame_;
+    std::atomic<int64_t> statDecodeTicks_;
+    std::atomic<int64_t> statDecodeRecords_;
+    std::atomic<int64_t> statDiskBytes_;
+    std::atomic<long> statFifoReadHighWater_;
+    std::atomic<int64_t> statReaderCpu_; //FIFO reader thread CPU time, 100 ns units
+    std::atomic<int64_t> statStartTicks_;
+    std::atomic<int64_t> statStopTicks_; //0 while the measurement runs
+    int64_t perfFrequency_;
     int mode_;
     ImgManipulator* imgManpl_;
     double pcf_;
@@ -356,17 +907,193 @@ private:
     unsigned int nsync_mask_;
     uint64_t pixel_dwelltime_ps_;
     uint64_t MeasDesc_GlobalResolution_;
-    uint64_t last_line_start_;
-    uint64_t last_line_end_;
+    uint64_t last_line_start_; //in sync periods since the start of the measurement
+    uint64_t last_line_end_;   //in sync periods since the start of the measurement
+    uint64_t line_pixel_scale_; //32.32 fixed point, see LinearLineMap/TableLineMap
+    bool line_end_clock_seen_;
+    double flyback_fraction_;
+    int line_map_mode_;
+    std::vector<unsigned int> line_map_;
     int current_line_;
     int n_line_repeats_;
     int n_frame_repeats_;
+    unsigned long geometryVersion_;
+    ScanGeometry CurrentScanGeometry();
+    int SetScanGeometry(const ScanGeometry& geometry);
     int n_frame_tracker_;
     int nBeams;
     unsigned int overflow_counter_;
     bool saving_;
     bool frame_active_;
 
+    //Continuous sequences: one measurement for the whole sequence, frames cut on frame clocks
+    bool continuousSequence_; //Property setting
+    bool streaming_;          //The running measurement is a continuous one
+    bool frame_completed_;    //Current frame already handed over, wait for the next frame clock
+    int stream_frames_summed_;
+    long stream_images_left_;
+    int stream_ret_;
+    bool useAVX2_;
+    bool saturateCounts_;
+
+    //FLIM mode: per-pixel decay histograms, pixel-major so one pixel's decay is contiguous
+    unsigned short* decayCube_;
+    size_t decayCubeSize_;  //Elements allocated in decayCube_
+    int flimBins_;
+    int flimBinShift_;      //TCSPC bins (record bits 10-24) per histogram bin, as a shift
+    double flimBinWidthPs_;
+    std::vector<double> flimCos_;
+    std::vector<double> flimSin_;
+    ImgBuffer flimSummary_[FLIM_N_SUMMARY];
+
+    //Time gated intensity mode: each gate counts the photons inside its TCSPC window(s), one
+    //image channel per gate. gateLUT_ holds the gate bits per (channel, TCSPC time >> gateShift_).
+    long nGates_;
+    std::string gateWindows_[MAX_GATES]; //"start-end" in ps, or a comma separated list with one per channel
+    unsigned gateGeneration_; //Bumped by every gate property change
+    int gateShift_;
+    std::vector<unsigned char> gateLUT_;
+    std::vector<unsigned int> gateCounts_; //MAX_GATES counts per mosaic pixel, so a photon touches one cache line
+    ImgBuffer gateImages_[MAX_GATES];
+    static bool ParseGateWindows(const std::string& text, std::vector<std::pair<double, double> >& windows);
+    bool SetupGates();
+    void GenerateGates(ImgBuffer& img);
+
+    //Beam correction: per-channel dark offsets, a crosstalk (unmixing) matrix and per-beam
+    //flat-field gains, applied to the finished frame counts tile by tile in PublishFrameCounts()
+    struct CrosstalkTerm
+    {
+        int offset;   //Tile offset of the source beam
+        float weight;
+    };
+    bool beamCorrection_;
+    std::string beamGains_;     //Comma separated, one per channel (the last one repeats)
+    std::string beamOffsets_;   //Likewise, in counts per frame
+    std::string beamCrosstalk_; //Row-major, beams x beams, empty for none
+    std::string beamFlatField_; //Raw float32 gain maps, one tile per beam in channel order
+    unsigned beamCorrGeneration_; //Bumped by every beam correction property change
+    bool beamCorrActive_;       //Tables below match the current accumulator
+    std::vector<CrosstalkTerm> beamCorrTerms_; //Nonzero terms of each beam's row, from beamCorrRowStart_
+    std::vector<int> beamCorrRowStart_;
+    std::vector<float> beamCorrBias_; //Offsets folded through the crosstalk row
+    std::vector<float> beamGainMap_;  //Tile pixels per beam
+    std::vector<unsigned int> correctedCounts_;
+    static bool ParseNumberList(const std::string& text, std::vector<double>& values);
+    bool SetupBeamCorrection();
+    const unsigned int* CorrectFrameCounts();
+
+    //Phasor mode: running cos/sin sums per pixel, one 16 byte slot so a photon touches one cache line
+    struct PhasorAccum
+    {
+        float g, s, n, pad;
+    };
+    struct PhasorLUTEntry
+    {
+        float cosPhase, sinPhase;
+    };
+    std::vector<PhasorAccum> phasorAccum_;
+    std::vector<PhasorLUTEntry> phasorLUT_;
+
+    //Photon accumulator, rebuilt in start_acq() only when the image geometry changes
+    struct BeamLUTEntry
+    {
+        int offset; //Top-left pixel of this channel's beam tile
+        int mask;   //~0 for beam channels, 0 otherwise
+        int inc;    //1 for beam channels, 0 otherwise
+        int x, y;   //Mosaic column/row of the tile's top-left pixel
+    };
+    //Columns [x0, x1) of one mosaic row that fall inside the ROI(s)
+    struct RoiSpan
+    {
+        int x0, x1;
+    };
+    //Output pixels [begin, end) outside every ROI of a multi-ROI bounding box
+    struct PixelRun
+    {
+        int begin, end;
+    };
+    struct AccumulatorKey
+    {
+        unsigned width, height, depth;
+        long beamsX, beamsY, scanX, scanY;
+        bool saturate;
+        int lineMap;
+        int mode;
+        int flimBins; //0 unless in FLIM mode
+        unsigned roi; //roiGeneration_
+        unsigned gates; //gateGeneration_
+        unsigned correction; //beamCorrGeneration_
+        bool operator==(const AccumulatorKey& o) const {
+            return width == o.width && height == o.height && depth == o.depth && beamsX == o.beamsX && beamsY == o.beamsY
+                && scanX == o.scanX && scanY == o.scanY && saturate == o.saturate && lineMap == o.lineMap
+                && mode == o.mode && flimBins == o.flimBins && roi == o.roi && gates == o.gates
+                && correction == o.correction;
+        }
+    };
+    AccumulatorKey CurrentAccumulatorKey() const;
+    //Line context of one marker-free run, taken on the decoding thread so that
+    //deferred (worker thread) binning sees the markers that preceded the run
+    struct BinContext
+    {
+        uint64_t overflowtime;
+        uint64_t lineStart;
+        uint64_t scale;
+        int line;
+        bool valid;   //LineContextValid()
+        bool noFrame; //Before the first frame clock/line timing, rather than in flyback
+    };
+    BinContext CurrentBinContext() const;
+    void CountDroppedRun(const unsigned int* records, int nRecords, const BinContext& ctx);
+    template <class PixelT, class CountPolicy, class LineMap> void BinPhotonsT(const unsigned int* records, int nRecords, const BinContext& ctx);
+    template <class PixelT, class CountPolicy, class LineMap> void BinPhotonsRoiT(const unsigned int* records, int nRecords, const BinContext& ctx);
+    void BinPhotonsNone(const unsigned int*, int, const BinContext&) {}
+    template <class LineMap> void BinDecaysT(const unsigned int* records, int nRecords, const BinContext& ctx);
+    template <class LineMap> void BinPhasorT(const unsigned int* records, int nRecords, const BinContext& ctx);
+    template <class LineMap> void BinGatesT(const unsigned int* records, int nRecords, const BinContext& ctx);
+    typedef void (MH_camera::*BinPhotonsFn)(const unsigned int*, int, const BinContext&);
+    static BinPhotonsFn PickBinPhotons(int lineMap);
+    static BinPhotonsFn PickBinPhotonsRoi(int lineMap);
+    BinPhotonsFn binPhotons_;
+    BinPhotonsFn binLifetimes_; //BinDecaysT, BinPhasorT or BinGatesT, depending on mode_
+    AccumulatorKey accumulatorKey_;
+    BeamLUTEntry beamLUT_[BEAM_LUT_SIZE];
+
+    //Sparse ROI binning: per mosaic row, the ROI spans (roiSpans_[roiRowStart_[y]] to
+    //roiSpans_[roiRowStart_[y + 1]]) and the output index of column 0 of that row
+    std::vector<RoiSpan> roiSpans_;
+    std::vector<int> roiRowStart_;
+    std::vector<int> roiRowBase_;
+
+    //Parallel binning: beam channels are dealt out to the workers, the decoding thread sorts
+    //each run's photons into the owning worker's queue. Beam tiles don't overlap, so every
+    //worker bins straight into the shared frame/lifetime accumulators without a merge.
+    struct BinRun
+    {
+        int begin, nRecords; //Into BinWorker::records
+        BinContext ctx;
+    };
+    struct BinWorker
+    {
+        BinWorkerThread* thread;
+        HANDLE go; //Auto-reset, set by FlushBinRuns()
+        std::vector<unsigned int> records;
+        int nRecords;
+        std::vector<BinRun> runs;
+    };
+    long binThreads_;
+    std::vector<BinWorker*> binWorkers_;
+    signed char binOwner_[BEAM_LUT_SIZE]; //Worker index per channel, -1 for non-beam channels
+    std::atomic<long> binPending_;
+    HANDLE binDone_;
+    std::atomic<bool> binQuit_;
+    void StartBinWorkers();
+    void StopBinWorkers();
+    void QueueBinRun(const unsigned int* records, int nRecords);
+    void FlushBinRuns();
+    bool MarkerMayEndFrame(unsigned int record) const;
+    int BinOnWorker(int index);
+    std::vector<PixelRun> roiFill_;
+
     //From MH Device Adapter
     MM::MMTime MH_changedTime_;
     std::string msgstr;
@@ -378,7 +1105,6 @@ private:
     //Items from the PicoQuant tttrmode.c demo - some comments modified for my purposes
     int dev[MAXDEVNUM];
     int found = 0;
-    FILE* fpout;
     int retcode;
     int ctcstatus;
     char LIB_Version[8];
@@ -410,7 +1136,22 @@ private:
     unsigned int Progress;
     unsigned int live_rates[MAX_N_CHANNELS];
 
-    int start_acq();
+    int start_acq(bool continuous = false);
+    std::string mhSerial_; //Pre-init: the MultiHarp to open, remembered once one is found
+    int OpenMultiHarp(bool& reused);
+    int ApplyMultiHarpSettings(int measMode);
+    //Sync/count rate and warning check after initialization, done in the background
+    RateProbeThread* rateProbe_;
+    bool rateProbeRunning_;
+    int probedSyncRate_; //Only touched by the probe while it runs, see WaitForRateProbe()
+    int ProbeRates(bool settle);
+    void WaitForRateProbe();
+    int SetMeasurementMode(int measMode);
+    //On-device histogram mode (MODE_HIST), filled by AcquireDeviceHistogram()
+    int histoLen_ = 0;
+    std::vector<unsigned int> deviceHisto_;
+    int deviceSyncRate_ = 0;
+    int deviceRates_[MAXINPCHAN] = {};
     //int On_Offset_General(MM::PropertyBase* pProp, MM::ActionType eAct, int which_channel);
     std::vector<long> offsets;
     int MH_Status_;
@@ -451,25 +1192,132 @@ private:
     MMThreadLock suspendLock_;
 };
 
+//////////////////////////////////////////////////////////////////////////////
+// FifoReaderThread class
+// Only drains the MultiHarp FIFO into the TTTRRing, so that decoding and disk
+// writes can never hold up the next MH_ReadFiFo call
+//////////////////////////////////////////////////////////////////////////////
+class FifoReaderThread : public MMDeviceThreadBase
+{
+public:
+    FifoReaderThread(MH_camera* pCam) : camera_(pCam) {}
+    ~FifoReaderThread() {}
+    void Start() { activate(); }
+private:
+    int svc(void) throw();
+    MH_camera* camera_;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// TTTRWriterThread class
+// Second TTTRRing consumer, streams raw blocks to disk when saving is enabled
+//////////////////////////////////////////////////////////////////////////////
+class TTTRWriterThread : public MMDeviceThreadBase
+{
+public:
+    TTTRWriterThread(MH_camera* pCam) : camera_(pCam) {}
+    ~TTTRWriterThread() {}
+    void Start() { activate(); }
+private:
+    int svc(void) throw();
+    MH_camera* camera_;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// FrameServiceThread class
+// Inserts queued frames into the core and zeroes used ones in the background
+//////////////////////////////////////////////////////////////////////////////
+class FrameServiceThread : public MMDeviceThreadBase
+{
+public:
+    FrameServiceThread(MH_camera* pCam) : camera_(pCam) {}
+    ~FrameServiceThread() {}
+    void Start() { activate(); }
+private:
+    int svc(void) throw();
+    MH_camera* camera_;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// BinWorkerThread class
+// Bins the photons of the beams one worker owns, see MH_camera::FlushBinRuns()
+//////////////////////////////////////////////////////////////////////////////
+class BinWorkerThread : public MMDeviceThreadBase
+{
+public:
+    BinWorkerThread(MH_camera* pCam, int index) : camera_(pCam), index_(index) {}
+    ~BinWorkerThread() {}
+    void Start() { activate(); }
+private:
+    int svc(void) throw();
+    MH_camera* camera_;
+    int index_;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// RateProbeThread class
+// Logs the MultiHarp rates and warnings after Initialize(), see MH_camera::ProbeRates()
+//////////////////////////////////////////////////////////////////////////////
+class RateProbeThread : public MMDeviceThreadBase
+{
+public:
+    RateProbeThread(MH_camera* pCam) : camera_(pCam), settle_(true) {}
+    ~RateProbeThread() {}
+    void Start(bool settle) { settle_ = settle; activate(); }
+private:
+    int svc(void) throw();
+    MH_camera* camera_;
+    bool settle_;
+};
+
 //////////////////////////////////////////////////////////////////////////////
 // SocketGalvo class
 // Tries to talk to a galvo via a socket mostly using JSON strings
 // S.K.
 //////////////////////////////////////////////////////////////////////////////
+#define GALVO_MAX_SEQUENCE 256
+
+//One scan geometry, the unit of a galvo property sequence
+struct GalvoScanConfig
+{
+    long pixelsX;
+    long pixelsY;
+    double timePerImage;  //ms
+    long frameRepeats;
+};
+
 class SocketGalvo : public CGenericBase<SocketGalvo>
 {
 public:
-    SocketGalvo() : busy_(false) {
-        //
+    SocketGalvo() :
+        busy_(false),
+        initialized_(false),
+        sock_(INVALID_SOCKET),
+        wsaStarted_(false),
+        timeoutMs_(1000),
+        waitReply_(false),
+        lastRoundTripMs_(0.0),
+        micronsPerPixel_(1.0),
+        scanFlyback_(0.1),
+        magnification_(20.0),
+        preloadSequence_(false),
+        sequenceRunning_(false),
+        sequenceUploaded_(false),
+        sequenceIndex_(0),
+        configPending_(true),
+        geometryVersion_(0)
+    {
+        scanConfig_.pixelsX = 120;
+        scanConfig_.pixelsY = 80;
+        scanConfig_.timePerImage = 1000.0;
+        scanConfig_.frameRepeats = 1;
     }
 
     ~SocketGalvo() {
-        //
+        Shutdown();
     }
 
-    int Shutdown() {
-        return DEVICE_OK; 
-    }
+    int Shutdown();
 
     void GetName(char* name) const {
         strcpy(name, "Socket Galvo"); 
@@ -488,6 +1336,18 @@ public:
     //For socket comms
     int OnSocketSend(MM::PropertyBase* pProp, MM::ActionType eAct);
     int OnMsgChange(MM::PropertyBase* pProp, MM::ActionType eAct);
+    int OnAddress(MM::PropertyBase* pProp, MM::ActionType eAct);
+    int OnPort(MM::PropertyBase* pProp, MM::ActionType eAct);
+    int OnTimeout(MM::PropertyBase* pProp, MM::ActionType eAct);
+    int OnWaitReply(MM::PropertyBase* pProp, MM::ActionType eAct);
+    int OnSocketState(MM::PropertyBase* pProp, MM::ActionType eAct);
+    int OnRoundTrip(MM::PropertyBase* pProp, MM::ActionType eAct);
+    int OnScanConfig(MM::PropertyBase* pProp, MM::ActionType eAct);
+    int OnScanParam(MM::PropertyBase* pProp, MM::ActionType eAct, long param);
+    int OnPreloadSequence(MM::PropertyBase* pProp, MM::ActionType eAct);
+
+    int start_scan();
+    void ApplyScanGeometry(const ScanGeometry& geometry);
 
 private:
     bool busy_;
@@ -498,10 +1358,45 @@ private:
     std::string sg_command_template_;
     int SG_Status_;
     MM::MMTime SG_changedTime_;
-    int start_scan();
-    std::string replace_str(std::string source, std::string target, std::string replacement);
+    void replace_str(std::string& source, const std::string& target, const std::string& replacement);
     std::string prep_json(std::string json_template, int scan_pixels_per_axis_X, int scan_pixels_per_axis_Y, float microns_per_pixel, float time_per_image, int n_images, float flyback_fraction, float magnification, int scans_per_image);
-    int send_on_socket(std::string message_string, std::string IP_address, int port_number);
+    int send_on_socket(const std::string& message_string);
+
+    //Long-lived connection to the LabVIEW scanner, (re)opened on demand
+    int Connect();
+    void Disconnect();
+    bool WaitSocket(SOCKET sock, bool forWrite);
+    int SendAll(const std::string& data);
+    int ReadReply(std::string& reply);
+    SOCKET sock_;
+    bool wsaStarted_;
+    long timeoutMs_;
+    bool waitReply_;
+    double lastRoundTripMs_;
+    std::string rxBuffer_;  //Received bytes not yet consumed as a reply line
+    std::string lastReply_;
+    //The acquisition thread (synchronized start, geometry pushes) and the property handlers
+    //both talk to the scanner; held for every whole command/reply exchange
+    MMThreadLock socketLock_;
+
+    //Scan geometry and preloaded sequences
+    GalvoScanConfig scanConfig_;
+    double micronsPerPixel_;
+    double scanFlyback_;
+    double magnification_;
+    bool preloadSequence_;
+    bool sequenceRunning_;
+    bool sequenceUploaded_;
+    size_t sequenceIndex_;
+    std::vector<std::string> compiledSequence_;  //Rendered JSON per sequence entry
+    std::string compiledConfig_;  //Rendered JSON of scanConfig_, sent by start_scan() when pending
+    bool configPending_;
+    unsigned long geometryVersion_;
+    int SetScanGeometry(const ScanGeometry& geometry);
+    std::string RenderScanConfig(const GalvoScanConfig& config);
+    static bool ParseScanConfig(const std::string& text, GalvoScanConfig& config);
+    static std::string FormatScanConfig(const GalvoScanConfig& config);
+    int UploadSequence();
 };
 
 #endif //_DEMOCAMERA_H_
\ No newline at end of file
@@ -0,0 +1,128 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          MHCamBench.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Console benchmark of the MH Camera T3 decode and binning path.
+//                Runs the camera without a core, on the synthetic TTTR source
+//                or a replayed recording, so no MultiHarp has to be attached
+//                (mhlib64.dll still has to be found for the library check).
+//
+//                Usage: MHCamBench [frames] [beam layouts] [replay file]
+//                e.g.   MHCamBench 50 1x1,2x2,4x2 D:\data\scan_tttr.ptu
+//
+// COPYRIGHT:     Imperial College London 2022
+//
+// LICENSE:       This file is distributed under the BSD license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+
+#define _WINSOCK_DEPRECATED_NO_WARNINGS
+#include <winsock2.h> //Before windows.h, as in MHCam.cpp
+#include <windows.h>
+
+#include "MHCam.h"
+#include <cstdio>
+#include <cstdlib>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+static double GetNumber(MH_camera& camera, const char* name)
+{
+    char buf[MM::MaxStrLength];
+    if (camera.GetProperty(name, buf) != DEVICE_OK)
+        return 0.0;
+    return atof(buf);
+}
+
+/**
+* Times single-frame snaps for every pixel type and each "<X>x<Y>" beam layout
+* and prints decode throughput, decode time per record, photons binned and
+* wall clock time per frame. The counters are the camera's own pipeline
+* statistics, which start_acq() resets for every measurement.
+*/
+int main(int argc, char* argv[])
+{
+    long frames = (argc > 1) ? atol(argv[1]) : 20;
+    std::string layoutList = (argc > 2) ? argv[2] : "1x1";
+    std::string replayPath = (argc > 3) ? argv[3] : "";
+    if (frames < 1)
+    {
+        printf("Usage: MHCamBench [frames] [beam layouts, e.g. 1x1,2x2] [replay file]\n");
+        return 1;
+    }
+
+    std::vector<std::pair<long, long> > layouts;
+    std::istringstream list(layoutList);
+    std::string item;
+    while (std::getline(list, item, ','))
+    {
+        long beamsX = 0, beamsY = 0;
+        if (sscanf(item.c_str(), "%ldx%ld", &beamsX, &beamsY) == 2 && beamsX > 0 && beamsY > 0)
+            layouts.push_back(std::make_pair(beamsX, beamsY));
+        else
+            printf("Skipping beam layout \"%s\"\n", item.c_str());
+    }
+    if (layouts.empty())
+        layouts.push_back(std::make_pair(1L, 1L));
+
+    MH_camera* camera = new MH_camera();
+    camera->SetProperty(g_PropName_TTTR_Source, replayPath.empty() ? g_TTTR_Source_Synthetic : g_TTTR_Source_Replay);
+    int ret = camera->Initialize();
+    if (ret == DEVICE_OK && !replayPath.empty())
+        ret = camera->SetProperty(g_PropName_Replay_File, replayPath.c_str());
+    if (ret != DEVICE_OK)
+    {
+        printf("Could not initialize the camera on the %s source (error %d)\n", replayPath.empty() ? "synthetic" : "replay", ret);
+        camera->Shutdown();
+        delete camera;
+        return 1;
+    }
+
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+    const char* pixelTypes[] = { "8bit", "16bit", "32bit" };
+    for (int p = 0; p < 3 && ret == DEVICE_OK; p++)
+    {
+        ret = camera->SetProperty(MM::g_Keyword_PixelType, pixelTypes[p]);
+        for (size_t l = 0; l < layouts.size() && ret == DEVICE_OK; l++)
+        {
+            ret = camera->SetProperty(g_N_Beams_X, CDeviceUtils::ConvertToString(layouts[l].first));
+            if (ret == DEVICE_OK)
+                ret = camera->SetProperty(g_N_Beams_Y, CDeviceUtils::ConvertToString(layouts[l].second));
+            double wallS = 0, recordRate = 0, decodeNs = 0, photons = 0;
+            long done = 0;
+            for (; done < frames && ret == DEVICE_OK; done++)
+            {
+                LARGE_INTEGER t0, t1;
+                QueryPerformanceCounter(&t0);
+                ret = camera->SnapImage();
+                QueryPerformanceCounter(&t1);
+                wallS += (double)(t1.QuadPart - t0.QuadPart) / (double)frequency.QuadPart;
+                recordRate += GetNumber(*camera, g_PropName_Stat_RecordRate);
+                decodeNs += GetNumber(*camera, g_PropName_Stat_DecodeNs);
+                photons += GetNumber(*camera, g_PropName_Stat_Binned);
+            }
+            if (ret != DEVICE_OK)
+            {
+                printf("%s %ldx%ld: failed with error %d\n", pixelTypes[p], layouts[l].first, layouts[l].second, ret);
+                break;
+            }
+            printf("%s %ldx%ld: %.3g records/s, %.2f ns/record, %.0f photons/frame, %.2f ms/frame\n", pixelTypes[p],
+                layouts[l].first, layouts[l].second, recordRate / done, decodeNs / done, photons / done, 1e3 * wallS / done);
+        }
+    }
+
+    camera->Shutdown();
+    delete camera;
+    return (ret == DEVICE_OK) ? 0 : 1;
+}
@@ -0,0 +1,342 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          MySLM.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Santec SLM-200 through the SLMFunc SDK. Phase patterns are
+//                uploaded into the SLM's frame memories at setup and then
+//                shown by memory number instead of sending whole frames.
+//
+
+#ifdef WIN32
+   #include <windows.h>
+#endif
+
+#include "MySLM.h"
+#include <sstream>
+#include <algorithm>
+#include <stdlib.h>
+
+using namespace std;
+
+///////////////////////////////////////////////////////////////////////////////
+// Exported MMDevice API
+///////////////////////////////////////////////////////////////////////////////
+MODULE_API void InitializeModuleData()
+{
+    RegisterDevice(g_SLMDeviceName, MM::GenericDevice, "Santec SLM-200 with onboard pattern memory");
+}
+
+MODULE_API MM::Device* CreateDevice(const char* deviceName)
+{
+    if (deviceName == 0)
+        return 0;
+
+    if (strcmp(deviceName, g_SLMDeviceName) == 0)
+        return new SLMMicroscope();
+
+    return 0;
+}
+
+MODULE_API void DeleteDevice(MM::Device* pDevice)
+{
+    delete pDevice;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// SLMMicroscope
+///////////////////////////////////////////////////////////////////////////////
+SLMMicroscope::SLMMicroscope() :
+    initialized_(false),
+    slmNumber_(1),
+    wavelength_(1064),
+    wavelengthKnown_(false),
+    patternCount_(0),
+    pattern_(0),
+    sequenceRunning_(false)
+{
+    InitializeDefaultErrorMessages();
+    SetErrorText(ERR_SLM_NOT_FOUND, "No Santec SLM found with this SLM number");
+    SetErrorText(ERR_SLM_INIT_FAILED, "Could not put the SLM into memory mode");
+    SetErrorText(ERR_SLM_SET_WAVELENGTH_FAILED, "Could not set the SLM wavelength");
+    SetErrorText(ERR_SLM_UPLOAD_FAILED, "Could not upload the pattern files into the SLM memory");
+    SetErrorText(ERR_SLM_DISPLAY_FAILED, "Could not display the pattern");
+    SetErrorText(ERR_SLM_SEQUENCE_FAILED, "Could not load the pattern sequence into the SLM memory table");
+
+    //USB SLMs are numbered from 1 in the order the SDK finds them
+    CreateIntegerProperty(g_PropName_SLM_Number, (long)slmNumber_, false,
+        new CPropertyAction(this, &SLMMicroscope::OnSLMNumber), true);
+}
+
+SLMMicroscope::~SLMMicroscope()
+{
+    Shutdown();
+}
+
+void SLMMicroscope::GetName(char* pszName) const
+{
+    CDeviceUtils::CopyLimitedString(pszName, g_SLMDeviceName);
+}
+
+int SLMMicroscope::Initialize()
+{
+    if (initialized_)
+        return DEVICE_OK;
+
+    if (SLM_Ctrl_Open(slmNumber_) != SLM_OK)
+        return ERR_SLM_NOT_FOUND;
+    //Memory mode: show the frame memories rather than the DVI input
+    int ret = CheckStatus(SLM_Ctrl_WriteVI(slmNumber_, 0), "SLM_Ctrl_WriteVI", ERR_SLM_INIT_FAILED);
+    if (ret != DEVICE_OK) {
+        SLM_Ctrl_Close(slmNumber_);
+        return ret;
+    }
+
+    //Start from what the SLM has stored rather than overwriting it
+    DWORD wavelength = 0, phase = 0;
+    if (SLM_Ctrl_ReadWL(slmNumber_, &wavelength, &phase) == SLM_OK && wavelength > 0)
+    {
+        wavelength_ = (long)wavelength;
+        wavelengthKnown_ = true;
+    }
+    ret = CreateIntegerProperty(g_PropName_Wavelength, wavelength_, false, new CPropertyAction(this, &SLMMicroscope::OnWavelength));
+    if (ret != DEVICE_OK)
+        return ret;
+    SetPropertyLimits(g_PropName_Wavelength, 400, 1700);
+
+    ret = CreateStringProperty(g_PropName_Pattern_Files, patternFiles_.c_str(), false, new CPropertyAction(this, &SLMMicroscope::OnPatternFiles));
+    if (ret != DEVICE_OK)
+        return ret;
+    CreateIntegerProperty(g_PropName_Pattern_Count, 0, true, new CPropertyAction(this, &SLMMicroscope::OnPatternCount));
+    ret = CreateIntegerProperty(g_PropName_Pattern, pattern_, false, new CPropertyAction(this, &SLMMicroscope::OnImage));
+    if (ret != DEVICE_OK)
+        return ret;
+    SetPropertyLimits(g_PropName_Pattern, 0, 0);
+
+    initialized_ = true;
+    return DEVICE_OK;
+}
+
+int SLMMicroscope::Shutdown()
+{
+    if (!initialized_)
+        return DEVICE_OK;
+    if (sequenceRunning_)
+        SLM_Ctrl_WriteTI(slmNumber_, 0);
+    sequenceRunning_ = false;
+    SLM_Ctrl_Close(slmNumber_);
+    initialized_ = false;
+    return DEVICE_OK;
+}
+
+bool SLMMicroscope::Busy()
+{
+    return initialized_ && SLM_Ctrl_ReadSU(slmNumber_) == SLM_BS;
+}
+
+/**
+* Logs a failed SDK call and turns it into the device error code.
+*/
+int SLMMicroscope::CheckStatus(SLM_STATUS status, const char* call, int error)
+{
+    if (status == SLM_OK)
+        return DEVICE_OK;
+    ostringstream os;
+    os << call << " failed with status " << (int)status;
+    LogMessage(os.str());
+    return error;
+}
+
+/**
+* Uploads every file of the pattern list into frame memories 1..n, BMP or
+* CSV by extension. This is the slow part, so it happens once per list rather
+* than per displayed pattern.
+*/
+int SLMMicroscope::UploadPatterns()
+{
+    vector<string> files;
+    istringstream list(patternFiles_);
+    string item;
+    while (getline(list, item, ';'))
+    {
+        size_t begin = item.find_first_not_of(" \t");
+        size_t end = item.find_last_not_of(" \t");
+        if (begin != string::npos)
+            files.push_back(item.substr(begin, end - begin + 1));
+    }
+    if (files.size() > SLM_MEMORY_SLOTS) {
+        LogMessage("More pattern files than SLM frame memories");
+        return ERR_SLM_UPLOAD_FAILED;
+    }
+
+    patternCount_ = 0;
+    for (size_t i = 0; i < files.size(); i++)
+    {
+        string extension = files[i].substr(files[i].find_last_of('.') + 1);
+        transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+        DWORD memory = (DWORD)i + 1;
+        SLM_STATUS status = (extension == "csv") ? SLM_Ctrl_WriteMI_CSV(slmNumber_, memory, 0, files[i].c_str())
+                                                 : SLM_Ctrl_WriteMI_BMP(slmNumber_, memory, 0, files[i].c_str());
+        if (status != SLM_OK) {
+            LogMessage("Could not upload " + files[i]);
+            return CheckStatus(status, "SLM_Ctrl_WriteMI", ERR_SLM_UPLOAD_FAILED);
+        }
+        patternCount_ = (long)memory;
+    }
+    LogMessage(string("Uploaded ") + CDeviceUtils::ConvertToString(patternCount_) + " patterns", true);
+    SetPropertyLimits(g_PropName_Pattern, 0, (std::max)(0L, patternCount_ - 1));
+    if (patternCount_ == 0)
+        return DEVICE_OK;
+    return SelectPattern((std::min)(pattern_, patternCount_ - 1));
+}
+
+int SLMMicroscope::SelectPattern(long pattern)
+{
+    if (pattern < 0 || pattern >= patternCount_)
+        return DEVICE_INVALID_PROPERTY_VALUE;
+    int ret = CheckStatus(SLM_Ctrl_WriteDS(slmNumber_, (DWORD)pattern + 1), "SLM_Ctrl_WriteDS", ERR_SLM_DISPLAY_FAILED);
+    if (ret == DEVICE_OK)
+        pattern_ = pattern;
+    return ret;
+}
+
+/**
+* Writes a pattern sequence into the SLM memory table, one frame memory per
+* table entry, and limits the table range (WriteMR) to those entries for the
+* trigger input to step through.
+*/
+int SLMMicroscope::LoadSequence(const vector<string>& sequence)
+{
+    if (sequence.empty() || sequence.size() > SLM_TABLE_SIZE)
+        return DEVICE_SEQUENCE_TOO_LARGE;
+    for (size_t i = 0; i < sequence.size(); i++)
+    {
+        long pattern = atol(sequence[i].c_str());
+        if (pattern < 0 || pattern >= patternCount_)
+            return DEVICE_INVALID_PROPERTY_VALUE;
+        int ret = CheckStatus(SLM_Ctrl_WriteMT(slmNumber_, (DWORD)i + 1, (DWORD)pattern + 1), "SLM_Ctrl_WriteMT", ERR_SLM_SEQUENCE_FAILED);
+        if (ret != DEVICE_OK)
+            return ret;
+    }
+    return CheckStatus(SLM_Ctrl_WriteMR(slmNumber_, 1, (DWORD)sequence.size()), "SLM_Ctrl_WriteMR", ERR_SLM_SEQUENCE_FAILED);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Action handlers
+///////////////////////////////////////////////////////////////////////////////
+int SLMMicroscope::OnSLMNumber(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+    if (eAct == MM::BeforeGet)
+    {
+        pProp->Set((long)slmNumber_);
+    }
+    else if (eAct == MM::AfterSet)
+    {
+        if (initialized_)
+            return DEVICE_CAN_NOT_SET_PROPERTY;
+        long number;
+        pProp->Get(number);
+        slmNumber_ = (DWORD)number;
+    }
+    return DEVICE_OK;
+}
+
+int SLMMicroscope::OnWavelength(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+    if (eAct == MM::BeforeGet)
+    {
+        pProp->Set(wavelength_);
+    }
+    else if (eAct == MM::AfterSet)
+    {
+        long wavelength;
+        pProp->Get(wavelength);
+        //WriteAW is a flash write, so a cfg load that repeats the stored value writes nothing
+        if (wavelengthKnown_ && wavelength == wavelength_)
+            return DEVICE_OK;
+        //Phase range stays 2 pi, then store it on the SLM (WriteAW) so it survives a power cycle
+        int ret = CheckStatus(SLM_Ctrl_WriteWL(slmNumber_, (DWORD)wavelength, SLM_PHASE_2PI), "SLM_Ctrl_WriteWL", ERR_SLM_SET_WAVELENGTH_FAILED);
+        if (ret == DEVICE_OK)
+            ret = CheckStatus(SLM_Ctrl_WriteAW(slmNumber_), "SLM_Ctrl_WriteAW", ERR_SLM_SET_WAVELENGTH_FAILED);
+        if (ret != DEVICE_OK)
+        {
+            pProp->Set(wavelength_);
+            return ret;
+        }
+        wavelength_ = wavelength;
+        wavelengthKnown_ = true;
+    }
+    return DEVICE_OK;
+}
+
+int SLMMicroscope::OnPatternFiles(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+    if (eAct == MM::BeforeGet)
+    {
+        pProp->Set(patternFiles_.c_str());
+    }
+    else if (eAct == MM::AfterSet)
+    {
+        if (sequenceRunning_)
+            return DEVICE_CAN_NOT_SET_PROPERTY;
+        pProp->Get(patternFiles_);
+        return UploadPatterns();
+    }
+    return DEVICE_OK;
+}
+
+int SLMMicroscope::OnPatternCount(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+    if (eAct == MM::BeforeGet)
+    {
+        pProp->Set(patternCount_);
+    }
+    return DEVICE_OK;
+}
+
+/**
+* Shows a pattern of the bank by index; sequenceable through the SLM's
+* memory table and trigger input.
+*/
+int SLMMicroscope::OnImage(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+    if (eAct == MM::BeforeGet)
+    {
+        pProp->Set(pattern_);
+    }
+    else if (eAct == MM::AfterSet)
+    {
+        if (sequenceRunning_)
+            return DEVICE_CAN_NOT_SET_PROPERTY;
+        long pattern;
+        pProp->Get(pattern);
+        int ret = SelectPattern(pattern);
+        if (ret != DEVICE_OK)
+            pProp->Set(pattern_);
+        return ret;
+    }
+    else if (eAct == MM::IsSequenceable)
+    {
+        pProp->SetSequenceable(patternCount_ > 0 ? SLM_TABLE_SIZE : 0);
+    }
+    else if (eAct == MM::AfterLoadSequence)
+    {
+        return LoadSequence(pProp->GetSequence());
+    }
+    else if (eAct == MM::StartSequence)
+    {
+        //Back to the first table entry, then let the trigger input advance it
+        int ret = CheckStatus(SLM_Ctrl_WriteMP(slmNumber_, 1), "SLM_Ctrl_WriteMP", ERR_SLM_SEQUENCE_FAILED);
+        if (ret == DEVICE_OK)
+            ret = CheckStatus(SLM_Ctrl_WriteTI(slmNumber_, 1), "SLM_Ctrl_WriteTI", ERR_SLM_SEQUENCE_FAILED);
+        if (ret != DEVICE_OK)
+            return ret;
+        sequenceRunning_ = true;
+    }
+    else if (eAct == MM::StopSequence)
+    {
+        sequenceRunning_ = false;
+        return CheckStatus(SLM_Ctrl_WriteTI(slmNumber_, 0), "SLM_Ctrl_WriteTI", ERR_SLM_SEQUENCE_FAILED);
+    }
+    return DEVICE_OK;
+}
@@ -1,14 +1,41 @@
-#include "MySLM.h"
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          MySLM.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Santec SLM-200 through the SLMFunc SDK (USB, memory mode)
+//
+
+#pragma once
 #include "DeviceBase.h"  // Micro-Manager Device API
 #include "ModuleInterface.h"  // Interface to create the device
 #include "SLMFunc.h"  // The header provided by the SLM SDK
+#include <string>
+#include <vector>
 
 #define ERR_SLM_NOT_FOUND 10001
 #define ERR_SLM_INIT_FAILED 10002
 #define ERR_SLM_SET_WAVELENGTH_FAILED 10003
-// Additional error codes as needed...
+#define ERR_SLM_UPLOAD_FAILED 10004
+#define ERR_SLM_DISPLAY_FAILED 10005
+#define ERR_SLM_SEQUENCE_FAILED 10006
+
+#define SLM_MEMORY_SLOTS 128 //Onboard frame memories, numbered from 1
+#define SLM_TABLE_SIZE 128   //Memory table entries the trigger input steps through
+#define SLM_PHASE_2PI 200    //Phase range for SLM_Ctrl_WriteWL, in 0.01 pi
 
+static const char* g_SLMDeviceName = "Santec SLM200";
+static const char* g_PropName_SLM_Number = "SLM number";
+static const char* g_PropName_Wavelength = "Wavelength [nm]";
+static const char* g_PropName_Pattern_Files = "Pattern files (; separated, BMP or CSV)";
+static const char* g_PropName_Pattern = "Pattern";
+static const char* g_PropName_Pattern_Count = "Patterns in memory";
 
+
+//The SLM runs in memory mode: the pattern bank is uploaded into its frame memories once,
+//after which "Pattern" only selects a memory. As a property sequence the patterns go into
+//the SLM's memory table and its trigger input (e.g. wired to the MultiHarp frame clock)
+//steps through them.
 class SLMMicroscope : public CGenericBase<SLMMicroscope>
 {
 public:
@@ -23,12 +50,24 @@ public:
     bool Busy();
 
     // Property handlers
+    int OnSLMNumber(MM::PropertyBase* pProp, MM::ActionType eAct);
     int OnWavelength(MM::PropertyBase* pProp, MM::ActionType eAct);
+    int OnPatternFiles(MM::PropertyBase* pProp, MM::ActionType eAct);
+    int OnPatternCount(MM::PropertyBase* pProp, MM::ActionType eAct);
     int OnImage(MM::PropertyBase* pProp, MM::ActionType eAct);
 
 private:
     bool initialized_;
     DWORD slmNumber_;
-    DWORD displayNumber_;
-    // Additional variables...
+    long wavelength_;
+    bool wavelengthKnown_; //wavelength_ was read back from or written to the SLM, not just the default
+    std::string patternFiles_;
+    long patternCount_; //Patterns in frame memories 1..patternCount_
+    long pattern_;      //Shown pattern, 0 based
+    bool sequenceRunning_;
+
+    int UploadPatterns();
+    int SelectPattern(long pattern);
+    int LoadSequence(const std::vector<std::string>& sequence);
+    int CheckStatus(SLM_STATUS status, const char* call, int error);
 };